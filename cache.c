@@ -0,0 +1,265 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man2/mlock.2.html
+// https://man7.org/linux/man-pages/man2/madvise.2.html (MADV_DONTDUMP)
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "security.h"
+#include "cache.h"
+
+// Get the locked memory used by content of a given length, in whole pages.
+static size_t locked_size(size_t len) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (len + page - 1) / page * page;
+}
+
+// Unlink an entry from the recency list.
+static void unlink_entry(struct note_cache *cache, struct cache_entry *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+// Link an entry in as the most recently used.
+static void push_entry(struct note_cache *cache, struct cache_entry *entry) {
+  entry->next = cache->head;
+  if (cache->head) {
+    cache->head->prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+}
+
+// Drop an entry, wiping its content.
+static void drop_entry(struct note_cache *cache, struct cache_entry *entry) {
+  unlink_entry(cache, entry);
+  cache->used -= locked_size(entry->len);
+  secure_free(entry->content, entry->len);
+  free(entry);
+}
+
+// Find a note's entry.
+// Returns the entry or `NULL`.
+static struct cache_entry* find_entry(struct note_cache *cache, unsigned long id) {
+  for (struct cache_entry *entry = cache->head; entry; entry = entry->next) {
+    if (entry->id == id) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+// Check if a note file is the same as when it was cached.
+// Edits change the size or modification time, and replacing the file changes the inode.
+static int entry_matches(const struct cache_entry *entry, const struct stat *st) {
+  return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size
+      && entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec
+      && entry->ctime.tv_sec == st->st_ctim.tv_sec && entry->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+// Wipe every entry. The cache must be locked.
+static void clear_entries(struct note_cache *cache) {
+  while (cache->head) {
+    drop_entry(cache, cache->head);
+  }
+}
+
+// Thread entry point for wiping the cache once it has been idle long enough.
+//
+// `arg`: the cache
+static void* cache_reaper(void *arg) {
+  struct note_cache *cache = arg;
+  pthread_mutex_lock(&cache->lock);
+  while (!cache->stopping) {
+    if (cache->head == NULL) {
+      // Nothing to wipe until something is cached.
+      pthread_cond_wait(&cache->wake, &cache->lock);
+      continue;
+    }
+
+    struct timespec deadline = cache->last_used;
+    deadline.tv_sec += cache->idle_seconds;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+      clear_entries(cache);
+    } else {
+      pthread_cond_timedwait(&cache->wake, &cache->lock, &deadline);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return NULL;
+}
+
+// Set up a cache.
+// The capacity is lowered to fit within the limit on locked memory.
+// Returns `0` on success or `-1` on error.
+//
+// `cache`: the cache to set up
+// `capacity`: the most decrypted content to keep in bytes, or `0` to keep none
+// `idle_seconds`: seconds without use before the cache is wiped, or `0` to never wipe it
+int cache_init(struct note_cache *cache, size_t capacity, unsigned int idle_seconds) {
+  memset(cache, 0, sizeof(struct note_cache));
+
+  // Leave room under the limit for the rest of the program's locked memory.
+  struct rlimit limit;
+  if (!getrlimit(RLIMIT_MEMLOCK, &limit) && limit.rlim_cur != RLIM_INFINITY && capacity > limit.rlim_cur / 2) {
+    capacity = limit.rlim_cur / 2;
+  }
+  cache->capacity = capacity;
+  cache->idle_seconds = idle_seconds;
+  clock_gettime(CLOCK_MONOTONIC, &cache->last_used);
+
+  // Idle time is measured on the monotonic clock, so changing the time of day doesn't matter.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  if (pthread_mutex_init(&cache->lock, NULL) || pthread_cond_init(&cache->wake, &attr)) {
+    pthread_condattr_destroy(&attr);
+    return -1;
+  }
+  pthread_condattr_destroy(&attr);
+
+  if (capacity && idle_seconds) {
+    int error = pthread_create(&cache->reaper, NULL, cache_reaper, cache);
+    if (error) {
+      errno = error;
+      return -1;
+    }
+    cache->reaper_running = 1;
+  }
+  return 0;
+}
+
+// Pass a cached note's content to a sink, if it is cached and the note is unchanged.
+// Returns `1` if the note was cached, `0` if not, or `-1` if the sink failed.
+//
+// `cache`: the cache
+// `id`: the note ID
+// `st`: the note file's current status
+// `sink`: where to send the content, or `NULL` to only check
+// `arg`: passed to the sink
+int cache_read(struct note_cache *cache, unsigned long id, const struct stat *st, note_sink sink, void *arg) {
+  pthread_mutex_lock(&cache->lock);
+  struct cache_entry *entry = find_entry(cache, id);
+  int result = 0;
+  if (entry && !entry_matches(entry, st)) {
+    // Changed by an edit since it was cached.
+    drop_entry(cache, entry);
+  } else if (entry) {
+    unlink_entry(cache, entry);
+    push_entry(cache, entry);
+    // The content never leaves locked memory except through the sink.
+    result = sink == NULL || !sink(arg, entry->content, entry->len) ? 1 : -1;
+  }
+  if (sink) {
+    clock_gettime(CLOCK_MONOTONIC, &cache->last_used);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return result;
+}
+
+// Get memory to decrypt a note into, for adding to a cache with `cache_insert`.
+// Returns the memory, or `NULL` if the note is too large to cache or memory can't be locked.
+// Note: Memory not passed to `cache_insert` must be released with `secure_free`!
+//
+// `cache`: the cache
+// `len`: the note's content length
+unsigned char* cache_buffer(struct note_cache *cache, size_t len) {
+  if (locked_size(len) > cache->capacity) {
+    return NULL;
+  }
+  return secure_alloc(len);
+}
+
+// Add a decrypted note to a cache, dropping the least recently used notes to fit it.
+// The cache takes ownership of the content.
+//
+// `cache`: the cache
+// `id`: the note ID
+// `st`: the note file's status when it was decrypted
+// `content`: the content, from `cache_buffer`
+// `len`: the content's length
+void cache_insert(struct note_cache *cache, unsigned long id, const struct stat *st, unsigned char *content, size_t len) {
+  struct cache_entry *entry = calloc(1, sizeof(struct cache_entry));
+  if (entry == NULL) {
+    secure_free(content, len);
+    return;
+  }
+  entry->id = id;
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = st->st_mtim;
+  entry->ctime = st->st_ctim;
+  entry->content = content;
+  entry->len = len;
+
+  pthread_mutex_lock(&cache->lock);
+  struct cache_entry *old = find_entry(cache, id);
+  if (old) {
+    drop_entry(cache, old);
+  }
+  while (cache->tail && cache->used + locked_size(len) > cache->capacity) {
+    drop_entry(cache, cache->tail);
+  }
+  push_entry(cache, entry);
+  cache->used += locked_size(len);
+  // The reaper sleeps while the cache is empty.
+  pthread_cond_signal(&cache->wake);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Drop a note from a cache, i.e. when it is deleted.
+//
+// `cache`: the cache
+// `id`: the note ID
+void cache_remove(struct note_cache *cache, unsigned long id) {
+  pthread_mutex_lock(&cache->lock);
+  struct cache_entry *entry = find_entry(cache, id);
+  if (entry) {
+    drop_entry(cache, entry);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Wipe every note from a cache.
+//
+// `cache`: the cache
+void cache_clear(struct note_cache *cache) {
+  pthread_mutex_lock(&cache->lock);
+  clear_entries(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Wipe a cache and release its resources.
+//
+// `cache`: the cache
+void cache_destroy(struct note_cache *cache) {
+  pthread_mutex_lock(&cache->lock);
+  cache->stopping = 1;
+  pthread_cond_signal(&cache->wake);
+  pthread_mutex_unlock(&cache->lock);
+  if (cache->reaper_running) {
+    pthread_join(cache->reaper, NULL);
+    cache->reaper_running = 0;
+  }
+
+  clear_entries(cache);
+  pthread_cond_destroy(&cache->wake);
+  pthread_mutex_destroy(&cache->lock);
+}
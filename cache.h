@@ -0,0 +1,105 @@
+#ifndef CACHE_H
+#define CACHE_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "notefile.h"
+
+// Default limit on decrypted content held at once.
+#define CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+
+// Default seconds without use before the cache is wiped.
+#define CACHE_DEFAULT_IDLE 300
+
+// A decrypted note in the cache.
+struct cache_entry {
+  unsigned long id;
+  // The note file when it was decrypted. If it has changed since, the entry is stale.
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  struct timespec ctime;
+  // Content in memory from `secure_alloc`.
+  unsigned char *content;
+  size_t len;
+  struct cache_entry *prev;
+  struct cache_entry *next;
+};
+
+// Decrypted notes kept for the rest of a session, least recently used dropped first.
+// Content is kept in locked memory that is excluded from core dumps, and is wiped when
+// the cache has not been used for a while.
+struct note_cache {
+  pthread_mutex_t lock;
+  // Wakes the thread that wipes the cache when idle.
+  pthread_cond_t wake;
+  pthread_t reaper;
+  int reaper_running;
+  int stopping;
+  // Limit and current use, in bytes of locked memory.
+  size_t capacity;
+  size_t used;
+  unsigned int idle_seconds;
+  struct timespec last_used;
+  // Most recently used first.
+  struct cache_entry *head;
+  struct cache_entry *tail;
+};
+
+// Set up a cache.
+// The capacity is lowered to fit within the limit on locked memory.
+// Returns `0` on success or `-1` on error.
+//
+// `cache`: the cache to set up
+// `capacity`: the most decrypted content to keep in bytes, or `0` to keep none
+// `idle_seconds`: seconds without use before the cache is wiped, or `0` to never wipe it
+int cache_init(struct note_cache *cache, size_t capacity, unsigned int idle_seconds);
+
+// Pass a cached note's content to a sink, if it is cached and the note is unchanged.
+// Returns `1` if the note was cached, `0` if not, or `-1` if the sink failed.
+//
+// `cache`: the cache
+// `id`: the note ID
+// `st`: the note file's current status
+// `sink`: where to send the content, or `NULL` to only check
+// `arg`: passed to the sink
+int cache_read(struct note_cache *cache, unsigned long id, const struct stat *st, note_sink sink, void *arg);
+
+// Get memory to decrypt a note into, for adding to a cache with `cache_insert`.
+// Returns the memory, or `NULL` if the note is too large to cache or memory can't be locked.
+// Note: Memory not passed to `cache_insert` must be released with `secure_free`!
+//
+// `cache`: the cache
+// `len`: the note's content length
+unsigned char* cache_buffer(struct note_cache *cache, size_t len);
+
+// Add a decrypted note to a cache, dropping the least recently used notes to fit it.
+// The cache takes ownership of the content.
+//
+// `cache`: the cache
+// `id`: the note ID
+// `st`: the note file's status when it was decrypted
+// `content`: the content, from `cache_buffer`
+// `len`: the content's length
+void cache_insert(struct note_cache *cache, unsigned long id, const struct stat *st, unsigned char *content, size_t len);
+
+// Drop a note from a cache, i.e. when it is deleted.
+//
+// `cache`: the cache
+// `id`: the note ID
+void cache_remove(struct note_cache *cache, unsigned long id);
+
+// Wipe every note from a cache.
+//
+// `cache`: the cache
+void cache_clear(struct note_cache *cache);
+
+// Wipe a cache and release its resources.
+//
+// `cache`: the cache
+void cache_destroy(struct note_cache *cache);
+
+#endif
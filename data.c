@@ -2,19 +2,66 @@
 // Resources used:
 // Adam's labs from CS-355
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include "security.h"
 #include "data.h"
+#include "notefile.h"
+#include "dedup.h"
+#include "history.h"
+#include "trace.h"
+
+// Whether problems are printed on this thread. The libnotes API turns this off and
+// returns errors instead.
+static __thread int print_problems = 1;
+
+// Turn printing of problems on or off for the calling thread.
+// Returns the previous setting.
+//
+// `enabled`: `1` to print problems, `0` to only return them
+int print_errors(int enabled) {
+  int previous = print_problems;
+  print_problems = enabled;
+  return previous;
+}
+
+// Print a system error like `perror`, unless printing is turned off.
+//
+// `what`: what failed
+static void report_errno(const char *what) {
+  if (print_problems) {
+    perror(what);
+  }
+}
+
+// Print a problem to stderr, unless printing is turned off.
+//
+// `format`: a `printf` format string, followed by its arguments
+static void report_error(const char *format, ...) {
+  if (print_problems) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+  }
+}
 
 // Check if a file name is a note name.
 //
@@ -42,381 +89,3016 @@ int is_note(char *file_name) {
   return 1;
 }
 
-// List notes in a folder.
+// Parse a note ID from a file name.
+// Returns the ID or `0` if the file name is not a note name or is too large.
 //
-// `folder_name`: path of directory containing note files
-// Author: Adam, Alex (merged two different versions)
-int list_notes(const char *folder_name) {
-  DIR *dir = opendir(folder_name);
-  if (dir <= 0) {
-    // If the directory exists, print errors. Otherwise ignore.
-    if (errno != ENOENT) {
-      perror(folder_name);
-    }
+// `file_name`: the name to parse
+unsigned long parse_note_id(const char *file_name) {
+  // Same rules as is_note: a . followed by a non-zero digit and any number of digits.
+  if (file_name[0] != '.' || file_name[1] < '1' || '9' < file_name[1]) {
     return 0;
   }
 
-  // Get window width to determine max entries displayable in a row.
-  struct winsize wsize;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &wsize);
-
-  int width = wsize.ws_col;
-  // Initial column + remainder / characters per column
-  int cols = 1 + (width - 6) / 8;
-
-  int count = 0;
-  struct dirent *entry;
-  while ((entry = readdir(dir))) {
-    if (is_note(entry->d_name)) {
-      // Assume that the average file name will not exceed 6 characters.
-      // Our own limit is 3 because MAX_NOTES is 99.
-      printf("%-6s", entry->d_name + sizeof(char));
-      ++count;
-      if (count % cols == 0) {
-        // End of row, next row.
-        printf("\n");
-      } else {
-        // Space out next entry so it is clearly separate.
-        printf("  ");
-      }
+  unsigned long id = 0;
+  for (const char *c = file_name + 1; *c; ++c) {
+    if (*c < '0' || '9' < *c) {
+      return 0;
+    }
+    // Names that don't fit are not notes we can address.
+    if (__builtin_mul_overflow(id, 10, &id) || __builtin_add_overflow(id, *c - '0', &id)) {
+      return 0;
     }
   }
 
-  // If we aren't at a clean line ending, add a newline anyway.
-  if (count % cols != 0) {
-    printf("\n");
-  }
-
-  // Clean up and finish.
-  closedir(dir);
-
-  return count;
+  return id;
 }
 
-// Get a file name from user input.
-// Note: Allocates memory to store result.
-// Returns `NULL` on error, printing issues.
+// Parse a note ID from a name of known length, by the same rules as `parse_note_id`.
+// Digits are checked and converted 8 at a time as the bytes of one word, which is most
+// of the work of scanning a large folder.
+// Returns the ID or `0` if the name is not a note name or is too large.
 //
-// `len_ptr`: A pointer that will be filled with the accepted input length
-// Author: Adam
-char* intake_file_name(unsigned long *len_ptr) {
-  char *line = NULL;
-  int read = getline(&line, len_ptr, stdin);
-
-  // Handle errors getting input.
-  if (read <= 0) {
-    perror("filename");
-    return NULL;
+// `name`: the name to parse
+// `len`: the name's length
+unsigned long parse_entry_id(const char *name, size_t len) {
+  if (len < 2 || name[0] != '.' || name[1] < '1' || '9' < name[1]) {
+    return 0;
   }
 
-  // Truncate input to the first invalid character.
-  for (int i = 0; i < read; ++i) {
-    if (!isdigit(line[i])) {
-      line[i] = '\0';
-      *len_ptr = i + 1;
-      break;
+  const char *digits = name + 1;
+  size_t remaining = len - 1;
+  unsigned long id = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; remaining >= 8; digits += 8, remaining -= 8) {
+    uint64_t word;
+    memcpy(&word, digits, 8);
+    // A byte is a digit if its high half is 3, and still is after adding 6.
+    if (((word & 0xF0F0F0F0F0F0F0F0ULL) | (((word + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+        != 0x3333333333333333ULL) {
+      return 0;
+    }
+    // Combine neighbouring digits into 2-digit numbers, then 4, then 8. The first digit
+    // is the lowest byte.
+    word = ((word & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    word = ((word & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    word = ((word & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+    // Names that don't fit are not notes we can address.
+    if (__builtin_mul_overflow(id, 100000000UL, &id) || __builtin_add_overflow(id, word, &id)) {
+      return 0;
     }
   }
-
-  // If the input does not start with a number, complain.
-  if (*len_ptr <= 1) {
-    printf("Invalid file name! File names are numeric.\n");
-    free(line);
-    return NULL;
+#endif
+  for (; remaining; ++digits, --remaining) {
+    if (*digits < '0' || '9' < *digits) {
+      return 0;
+    }
+    if (__builtin_mul_overflow(id, 10, &id) || __builtin_add_overflow(id, *digits - '0', &id)) {
+      return 0;
+    }
   }
 
-  // Otherwise, allocate memory to store just what we need of it.
-  char *note_name = malloc(*len_ptr + 1);
+  return id;
+}
 
-  if (note_name == NULL) {
-    perror("note name");
-    free(line);
-    return NULL;
+// Add an ID to a set of note IDs, growing it if necessary.
+// Returns `0` on success or `-1` if memory could not be allocated.
+//
+// `set`: the set to add to
+// `id`: the ID to add
+int add_note_id(struct note_ids *set, unsigned long id) {
+  if (set->count == set->capacity) {
+    size_t capacity = set->capacity ? set->capacity * 2 : 256;
+    unsigned long *ids = realloc(set->ids, capacity * sizeof(unsigned long));
+    if (ids == NULL) {
+      return -1;
+    }
+    set->ids = ids;
+    set->capacity = capacity;
   }
 
-  // .<input>
-  note_name[0] = '.';
-  strncpy(note_name + sizeof(char), line, *len_ptr);
+  set->ids[set->count++] = id;
+  return 0;
+}
 
-  // Free original input allocation.
-  free(line);
+// Free memory used by a set of note IDs.
+//
+// `set`: the set to free
+void free_note_ids(struct note_ids *set) {
+  free(set->ids);
+  set->ids = NULL;
+  set->count = 0;
+  set->capacity = 0;
+}
 
-  return note_name;
+// Check if a file name is a shard directory name: 2 lowercase hex digits.
+//
+// `file_name`: the name to check
+int is_shard_name(const char *file_name) {
+  for (int i = 0; i < 2; ++i) {
+    if (!isdigit(file_name[i]) && (file_name[i] < 'a' || 'f' < file_name[i])) {
+      return 0;
+    }
+  }
+  return file_name[2] == '\0';
 }
 
-// Compare note names.
-// Note that this only returns valid results for names that succeed `is_note(char *file_name)`!
-int compare_names(const void *val1, const void *val2) {
-  int len1 = strlen(val1);
-  int len2 = strlen(val2);
+// A directory entry as the kernel returns it from `getdents64`.
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
 
-  // If one of the strings is longer, it is a number with more digits.
-  // Because we don't allow preceding 0s, the number with the most digits is the highest.
-  if (len1 < len2) {
-    return -1;
-  }
-  if (len1 > len2) {
-    return 1;
+// A directory being read by a scan.
+struct scan_dir {
+  int fd;
+  // Path of the directory, for messages.
+  const char *path;
+  // Path relative to the notes directory, i.e. `ab/cd`, or empty for the notes directory.
+  const char *relative;
+  // The number of shard directory levels below the directory.
+  int depth;
+};
+
+// Called for each entry read from a directory.
+// Returns `0` to keep reading or `-1` to stop, having printed issues.
+typedef int (*entry_visitor)(void *arg, const struct scan_dir *dir, const char *name, size_t len);
+
+// Buffers for reading directory entries, one per shard level, so a shard directory can
+// be read while its parent's entries are still being visited.
+struct entry_buffers {
+  char *levels[MAX_SHARD_DEPTH + 1];
+};
+
+// Get the buffer for reading directories at a shard level, allocating it if necessary.
+// Returns the buffer or `NULL` if memory could not be allocated.
+//
+// `buffers`: the buffers
+// `depth`: the number of shard directory levels below the directory to be read
+static char* entry_buffer(struct entry_buffers *buffers, int depth) {
+  if (buffers->levels[depth] == NULL) {
+    buffers->levels[depth] = malloc(SCAN_BUFFER_SIZE);
   }
+  return buffers->levels[depth];
+}
 
-  // Otherwise, the strings have the same length. Compare character codepoints.
-  return strncmp(val1, val2, len1);
+// Free buffers for reading directory entries.
+//
+// `buffers`: the buffers
+static void free_entry_buffers(struct entry_buffers *buffers) {
+  for (int depth = 0; depth <= MAX_SHARD_DEPTH; ++depth) {
+    free(buffers->levels[depth]);
+    buffers->levels[depth] = NULL;
+  }
 }
 
-// Find the next unused file name number.
-// File names are always numeric to prevent information leakage via titles.
-// Returns the next file number or `0` if files `1` through `MAX_NOTES` exist.
+// Read every entry of a directory and pass each to a visitor, skipping `.` and `..`.
+// Entries are read `SCAN_BUFFER_SIZE` bytes at a time with `getdents64`, so even large
+// folders take few system calls, and names are passed with their lengths.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
 //
-// `folder_name`: path of directory containing note files
-// Author: Adam
-int next_file_name(const char *folder_name) {
-  DIR *dir = opendir(folder_name);
-  if (dir <= 0) {
-    perror(folder_name);
+// `dir`: the directory to read
+// `buffers`: the buffers to read entries into
+// `visit`: called for each entry
+// `arg`: passed to the visitor
+static int read_entries(const struct scan_dir *dir, struct entry_buffers *buffers, entry_visitor visit, void *arg) {
+  char *buffer = entry_buffer(buffers, dir->depth);
+  if (buffer == NULL) {
+    report_errno(dir->path);
     return -1;
   }
 
-  // Read up to MAX_NOTES of note names from note directory.
-  char file_names[MAX_NOTES][MAXNAMLEN];
-  int index = 0;
-  struct dirent *entry;
-  while ((entry = readdir(dir)) > 0 && index < MAX_NOTES) {
-    if (!is_note(entry->d_name)) {
-      continue;
+  for (;;) {
+    long read = syscall(SYS_getdents64, dir->fd, buffer, SCAN_BUFFER_SIZE);
+    if (read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      report_errno(dir->path);
+      return -1;
+    }
+    if (read == 0) {
+      return 0;
     }
-    strncpy(file_names[index], entry->d_name, MAXNAMLEN);
-    ++index;
-  }
 
-  // Warn about issues closing directory, if any.
-  if (closedir(dir)) {
-    perror(folder_name);
+    for (long offset = 0; offset < read;) {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *) (buffer + offset);
+      offset += entry->d_reclen;
+      // Names are null-terminated and padded within the record.
+      size_t len = strnlen(entry->d_name, entry->d_reclen - offsetof(struct linux_dirent64, d_name));
+      if (entry->d_name[0] == '.' && (len == 1 || (len == 2 && entry->d_name[1] == '.'))) {
+        continue;
+      }
+      if (visit(arg, dir, entry->d_name, len)) {
+        return -1;
+      }
+    }
   }
+}
 
-  // If there are no files, this is the first.
-  if (index == 0) {
-    return 1;
-  }
+// A directory read by a scan for note IDs, to tell later whether it has changed.
+struct scanned_dir {
+  // Path relative to the notes directory, i.e. `ab/cd`.
+  char relative[3 * MAX_SHARD_DEPTH];
+  dev_t dev;
+  ino_t ino;
+  // Adding or removing an entry changes this, and unlike the modification time it can't
+  // be set back.
+  struct timespec ctime;
+};
 
-  // Quicksort file names with our note name comparator.
-  qsort(file_names, index, MAXNAMLEN, compare_names);
+// A scan for note IDs in progress.
+struct id_scan {
+  struct note_ids *result;
+  struct entry_buffers buffers;
+  // Directories read so far.
+  struct scanned_dir *dirs;
+  size_t dir_count;
+  size_t dir_capacity;
+};
 
-  // Iterate over numbers 1 - index and check for mismatches.
-  // The first mismatch is an available file number.
-  char buf[MAXNAMLEN];
-  buf[0] = '.';
-  for (int i = 1; i <= index; ++i) {
-    sprintf(buf + sizeof(char), "%d", i);
-    if (strncmp(buf, file_names[i - 1], MAXNAMLEN)) {
-      return i;
+// Remember a directory read by a scan.
+// Returns `0` on success or `-1` if memory could not be allocated.
+//
+// `scan`: the scan
+// `relative`: path of the directory relative to the notes directory
+// `st`: the directory's status, from before it was read
+static int add_scanned_dir(struct id_scan *scan, const char *relative, const struct stat *st) {
+  if (scan->dir_count == scan->dir_capacity) {
+    size_t capacity = scan->dir_capacity ? scan->dir_capacity * 2 : 16;
+    struct scanned_dir *grown = realloc(scan->dirs, capacity * sizeof(*grown));
+    if (grown == NULL) {
+      return -1;
     }
+    scan->dirs = grown;
+    scan->dir_capacity = capacity;
   }
-
-  // If there were no mismatches, the file number is the next free file number.
-  if (index < MAX_NOTES) {
-    return index + 1;
-  }
-
-  // If there are no free file numbers, indicate that.
+  struct scanned_dir *dir = &scan->dirs[scan->dir_count++];
+  strcpy(dir->relative, relative);
+  dir->dev = st->st_dev;
+  dir->ino = st->st_ino;
+  dir->ctime = st->st_ctim;
   return 0;
 }
 
-// Combine a directory and a file name into a file path.
-// Note: This introduces vulnerabilities! Check directory and file name lengths before using!
+// Collect note IDs from one directory entry, descending into shard directories.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+static int scan_entry(void *arg, const struct scan_dir *dir, const char *name, size_t len);
+
+// Collect the IDs of notes in an open directory and the shard directories below it.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
 //
-// `dir`: the path of the base directory
-// `entry_name`: the name of the file in the directory
-// `result`: A pointer to where the result is to be placed
-// Author: Adam
-void combined_path(const char *dir, const char *entry_name, char *result) {
-  // Vulnerability: strcpy
-  strcpy(result, dir);
-  if (dir[strlen(dir) - 1] != '/') {
-    strcat(result, "/");
+// `scan`: the scan to add IDs and directories to
+// `dir`: the directory to read
+static int scan_directory(struct id_scan *scan, const struct scan_dir *dir) {
+  struct stat st;
+  if (fstat(dir->fd, &st) || add_scanned_dir(scan, dir->relative, &st)) {
+    report_errno(dir->path);
+    return -1;
   }
-  // Vulnerability: strcat
-  strcat(result, entry_name);
+  return read_entries(dir, &scan->buffers, scan_entry, scan);
 }
 
-int is_symlink(const char *path) {
-    struct stat path_stat;
-
-    if (lstat(path, &path_stat) != 0) {
-        perror("lstat");
-        return 0; // error
+static int scan_entry(void *arg, const struct scan_dir *dir, const char *name, size_t len) {
+  struct id_scan *scan = arg;
+  unsigned long id = parse_entry_id(name, len);
+  if (id) {
+    if (add_note_id(scan->result, id)) {
+      report_errno("note IDs");
+      return -1;
     }
+    return 0;
+  }
 
-    // Check it's a directory
-    if (!S_ISDIR(path_stat.st_mode)) {
-        return 0; // not a directory
+  // Notes may be in shard directories, whatever layout is configured.
+  if (dir->depth == 0 || len != 2 || !is_shard_name(name)) {
+    return 0;
+  }
+  char shard_path[PATH_MAX];
+  if (checked_path(dir->path, name, shard_path)) {
+    return 0;
+  }
+  char relative[3 * MAX_SHARD_DEPTH];
+  snprintf(relative, sizeof(relative), "%s%s%s", dir->relative, *dir->relative ? "/" : "", name);
+  struct scan_dir shard = {openat(dir->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC), shard_path, relative,
+    dir->depth - 1};
+  if (shard.fd < 0) {
+    // A file with a shard's name holds no notes, and a shard removed since has none left.
+    if (errno == ENOTDIR || errno == ENOENT) {
+      return 0;
     }
+    report_errno(shard_path);
+    return -1;
+  }
 
-    // Check it's NOT a symlink
-    if (S_ISLNK(path_stat.st_mode)) {
-        return 0; // is a symlink
+  int result = scan_directory(scan, &shard);
+  close(shard.fd);
+  return result;
+}
+
+// Collect the IDs of all notes in a folder into a scan, along with the directories read.
+// Returns the number of IDs collected or `-1` on error. A missing folder has no notes.
+//
+// `folder_name`: path of directory containing note files
+// `scan`: the scan to add IDs and directories to
+static long scan_folder(const char *folder_name, struct id_scan *scan) {
+  int fd = open(folder_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    // If the directory exists, print errors. Otherwise there are no notes.
+    if (errno != ENOENT) {
+      report_errno(folder_name);
+      return -1;
     }
+    return 0;
+  }
 
-    return 1; // it's a real directory!
+  size_t before = scan->result->count;
+  struct scan_dir dir = {fd, folder_name, "", MAX_SHARD_DEPTH};
+  int error = scan_directory(scan, &dir);
+  close(fd);
+  free_entry_buffers(&scan->buffers);
+
+  return error ? -1 : (long) (scan->result->count - before);
 }
 
-// Encrypt and save a new note.
+// Collect the IDs of all notes in a folder. IDs are not sorted.
+// Notes are collected from shard directories regardless of configured layout, so
+// the result is complete while a notebook is being migrated.
+// Returns the number of IDs collected or `-1` on error. A missing folder has no notes.
 //
-// `key`: the key to use for encryption
 // `folder_name`: path of directory containing note files
-// `input`: the plaintext note content
-// Author: Alex
-void add_note(const unsigned char *key, const char *folder_name, const char *input) {
-
-  // Ensure that folder exists.
-  struct stat st;
-  if (stat(folder_name, &st) <= 0) {
-    // Create folder with read-write-execute permissions for the user
-    mkdir(folder_name, S_IRUSR | S_IWUSR | S_IXUSR);
-  }
+// `result`: the set to append IDs to
+long scan_note_ids(const char *folder_name, struct note_ids *result) {
+  struct id_scan scan = {result};
+  long count = scan_folder(folder_name, &scan);
+  free(scan.dirs);
+  return count;
+}
 
-  // Get the next file number.
-  int next_file_num = next_file_name(folder_name);
+// Compare note IDs for qsort.
+static int compare_ids(const void *val1, const void *val2) {
+  unsigned long id1 = *(const unsigned long *)val1;
+  unsigned long id2 = *(const unsigned long *)val2;
+  return (id1 > id2) - (id1 < id2);
+}
 
-  // If no file number is available, finish.
-  if (!next_file_num) {
-    printf("Too many notes present to create another!\n");
-    printf("Only up to %d notes are supported.\n", MAX_NOTES);
+// Sort note IDs numerically.
+// This is an LSD radix sort over bytes, skipping bytes above the largest ID.
+//
+// `ids`: the IDs to sort
+// `count`: the number of IDs
+void sort_note_ids(unsigned long *ids, size_t count) {
+  if (count < 2) {
     return;
   }
 
-  // Set up note name.
-  char note_name[MAXNAMLEN];
-  sprintf(note_name, ".%d", next_file_num);
-
-  // Resolve combined_path vulnerabilities by checking lengths before calls.
-  int len1 = strlen(folder_name);
-  int len2 = strlen(note_name);
-  int total = 0;
-  if (__builtin_add_overflow(len1, len2, &total)
-      || __builtin_add_overflow(total, 1, &total)
-      || total > PATH_MAX) {
-    fprintf(stderr, "Path too long: %s/%s", folder_name, note_name);
+  // Small sets aren't worth the extra buffer.
+  unsigned long *buffer = count < 64 ? NULL : malloc(count * sizeof(unsigned long));
+  if (buffer == NULL) {
+    qsort(ids, count, sizeof(unsigned long), compare_ids);
     return;
   }
-  char file_path[PATH_MAX];
-  combined_path(folder_name, note_name, file_path);
 
-  // Make file accessible only by user.
-  __mode_t existing_mask = umask(S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-  FILE *noteBook = fopen(file_path, "w");
-  // Reset umask after file creation.
-  umask(existing_mask);
-
-  // If file cannot be opened, print.
-  if (!noteBook) {
-    perror(file_path);
-    return;
+  unsigned long max = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (ids[i] > max) {
+      max = ids[i];
+    }
   }
 
-  // Generate a new IV for this file.
-  unsigned char iv[IV_SIZE];
-  generate_iv(iv);
+  unsigned long *src = ids;
+  unsigned long *dst = buffer;
+  for (unsigned int shift = 0; shift < sizeof(unsigned long) * 8 && (max >> shift); shift += 8) {
+    // Count occurrences of each byte value.
+    size_t offsets[256] = {0};
+    for (size_t i = 0; i < count; ++i) {
+      ++offsets[(src[i] >> shift) & 0xFF];
+    }
 
-  // Write the IV to the top of the file, stopping on error.
-  if (fwrite(iv, sizeof(unsigned char), IV_SIZE, noteBook) != IV_SIZE) {
-    perror(file_path);
-    fclose(noteBook);
-    return;
-  }
+    // Convert counts to starting offsets.
+    size_t total = 0;
+    for (int i = 0; i < 256; ++i) {
+      size_t bucket = offsets[i];
+      offsets[i] = total;
+      total += bucket;
+    }
 
-  // Encrypt the input.
-  if (!cipher((unsigned char *)input, strlen(input), noteBook, key, iv, 1)) {
-    printf("Encryption as note %s failed.\n", note_name + sizeof(char));
-    fclose(noteBook);
-    return;
+    // Scatter into the other buffer, preserving order within buckets.
+    for (size_t i = 0; i < count; ++i) {
+      dst[offsets[(src[i] >> shift) & 0xFF]++] = src[i];
+    }
+
+    unsigned long *swap = src;
+    src = dst;
+    dst = swap;
   }
 
-  // Close file and warn if closing fails.
-  if (fclose(noteBook)) {
-    perror(note_name);
+  // If the last pass landed in the buffer, copy back.
+  if (src != ids) {
+    memcpy(ids, src, count * sizeof(unsigned long));
   }
 
-  printf("Encrypted as note %s!", note_name + sizeof(char));
+  free(buffer);
 }
 
-// Decrypt and print a new note.
+// Remove duplicate IDs from sorted note IDs.
+// Returns the number of unique IDs.
 //
-// `key`: the key to use for decryption
-// `folder_name`: path of directory containing note files
-// `input`: the name of the note file
-// Author: Adam
-void read_note(const unsigned char *key, const char *folder_name, const char *note_name) {
-  // Resolve combined_path vulnerabilities by checking lengths before calls.
-  int len1 = strlen(folder_name);
-  int len2 = strlen(note_name);
-  int total = 0;
-  if (__builtin_add_overflow(len1, len2, &total)
-      || __builtin_add_overflow(total, 1, &total)
-      || total > PATH_MAX) {
-    fprintf(stderr, "Path too long: %s/%s", folder_name, note_name);
-    return;
+// `ids`: the sorted IDs
+// `count`: the number of IDs
+size_t unique_note_ids(unsigned long *ids, size_t count) {
+  size_t unique = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (!unique || ids[unique - 1] != ids[i]) {
+      ids[unique++] = ids[i];
+    }
   }
-  char file_path[PATH_MAX];
-  combined_path(folder_name, note_name, file_path);
+  return unique;
+}
 
-  // Get lstat of file.
-  struct stat lstat_val;
-  if (lstat(file_path, &lstat_val)) {
-    perror(file_path);
-    return;
-  }
+// The last scan of a notes directory, shared by everything that needs its note IDs:
+// listing, claiming new IDs, and the library's iterators.
+struct shared_scan {
+  pthread_mutex_t lock;
+  char folder[PATH_MAX];
+  // Sorted IDs without duplicates.
+  struct note_ids notes;
+  // The directories read, or none if there is no scan to share.
+  struct scanned_dir *dirs;
+  size_t dir_count;
+};
 
-  // Open file.
-  int fd = open(file_path, O_RDONLY);
+static struct shared_scan shared_scan = {PTHREAD_MUTEX_INITIALIZER};
 
-  // Handle failure to open file.
-  if (fd <= 0) {
-    perror(file_path);
-    return;
+// Check if none of the directories read by a scan have changed since.
+//
+// `folder_name`: path of directory containing note files
+// `dirs`: the directories read
+// `count`: the number of directories
+static int scan_is_current(const char *folder_name, const struct scanned_dir *dirs, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    char path[PATH_MAX];
+    struct stat st;
+    if ((*dirs[i].relative && checked_path(folder_name, dirs[i].relative, path))
+        || stat(*dirs[i].relative ? path : folder_name, &st)
+        || st.st_dev != dirs[i].dev || st.st_ino != dirs[i].ino
+        || st.st_ctim.tv_sec != dirs[i].ctime.tv_sec || st.st_ctim.tv_nsec != dirs[i].ctime.tv_nsec) {
+      return 0;
+    }
   }
+  return 1;
+}
 
-  // Get fstat of file.
-  struct stat fstat_val;
-  if (fstat(fd, &fstat_val)) {
-    perror(file_path);
-    return;
+// Check if every directory read by a scan last changed before it started.
+// Directory change times are only as fine as the clock tick, so a directory changed in
+// the tick a scan started could change again without its time changing.
+//
+// `dirs`: the directories read
+// `count`: the number of directories
+// `start`: the coarse time the scan started
+static int scan_is_settled(const struct scanned_dir *dirs, size_t count, const struct timespec *start) {
+  for (size_t i = 0; i < count; ++i) {
+    if (dirs[i].ctime.tv_sec > start->tv_sec
+        || (dirs[i].ctime.tv_sec == start->tv_sec && dirs[i].ctime.tv_nsec >= start->tv_nsec)) {
+      return 0;
+    }
   }
+  return 1;
+}
 
-  // Ensure that file is the intended target file.
-  if (lstat_val.st_ino != fstat_val.st_ino) {
-    fprintf(stderr, "File %s was moved while opening!", file_path);
-    return;
+// Get the sorted IDs of all notes in a folder, without duplicates.
+// The folder is scanned once and the result shared. Later calls only check that the
+// folder and its shard directories haven't changed, rather than reading them again.
+// Returns the number of IDs or `-1` on error. A missing folder has no notes.
+// Note: The IDs must be freed!
+//
+// `folder_name`: path of directory containing note files
+// `result`: the empty set to place IDs in
+long load_note_ids(const char *folder_name, struct note_ids *result) {
+  pthread_mutex_lock(&shared_scan.lock);
+  if (shared_scan.dir_count && !strcmp(shared_scan.folder, folder_name)
+      && scan_is_current(folder_name, shared_scan.dirs, shared_scan.dir_count)) {
+    size_t count = shared_scan.notes.count;
+    result->ids = malloc((count ? count : 1) * sizeof(unsigned long));
+    if (result->ids == NULL) {
+      pthread_mutex_unlock(&shared_scan.lock);
+      report_errno("note IDs");
+      return -1;
+    }
+    memcpy(result->ids, shared_scan.notes.ids, count * sizeof(unsigned long));
+    result->count = count;
+    result->capacity = count ? count : 1;
+    pthread_mutex_unlock(&shared_scan.lock);
+    return count;
   }
+  pthread_mutex_unlock(&shared_scan.lock);
 
-  // Get file size from stat data.
-  unsigned long file_len = fstat_val.st_size;
-  if (file_len < IV_SIZE * 2) {
-    fprintf(stderr, "Note %s corrupted. Please delete %s\n", note_name + sizeof(char), file_path);
-    return;
+  // Scan without the lock, so threads needing a fresh scan don't wait on each other.
+  struct timespec start;
+  clock_gettime(CLOCK_REALTIME_COARSE, &start);
+  struct id_scan scan = {result};
+  long count = scan_folder(folder_name, &scan);
+  if (count < 0) {
+    free(scan.dirs);
+    return -1;
   }
+  sort_note_ids(result->ids, result->count);
+  result->count = unique_note_ids(result->ids, result->count);
 
-  // Read IV.
-  unsigned char iv[IV_SIZE];
-  int bytes_read = read(fd, iv, IV_SIZE);
-  if (bytes_read < IV_SIZE) {
-    fprintf(stderr, "Only read %d of IV\n", bytes_read);
-    return;
+  // Only share scans that will be seen to be out of date. A copy failing only loses sharing.
+  unsigned long *shared = NULL;
+  if (scan.dir_count && strlen(folder_name) < PATH_MAX && scan_is_settled(scan.dirs, scan.dir_count, &start)) {
+    shared = malloc((result->count ? result->count : 1) * sizeof(unsigned long));
+  }
+  if (shared != NULL) {
+    memcpy(shared, result->ids, result->count * sizeof(unsigned long));
+    pthread_mutex_lock(&shared_scan.lock);
+    free(shared_scan.notes.ids);
+    free(shared_scan.dirs);
+    strcpy(shared_scan.folder, folder_name);
+    shared_scan.notes.ids = shared;
+    shared_scan.notes.count = result->count;
+    shared_scan.notes.capacity = result->count;
+    shared_scan.dirs = scan.dirs;
+    shared_scan.dir_count = scan.dir_count;
+    pthread_mutex_unlock(&shared_scan.lock);
+  } else {
+    free(scan.dirs);
+  }
+
+  return result->count;
+}
+
+// Buffered output for note listings.
+// Writes go straight to the file descriptor to avoid per-entry stdio overhead.
+struct list_buffer {
+  int fd;
+  size_t len;
+  char data[LIST_BUFFER_SIZE];
+};
+
+// Flush buffered listing output.
+// Returns `0` on success or `-1` on error.
+static int list_buffer_flush(struct list_buffer *buffer) {
+  size_t written = 0;
+  while (written < buffer->len) {
+    ssize_t result = write(buffer->fd, buffer->data + written, buffer->len - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      buffer->len = 0;
+      return -1;
+    }
+    written += result;
   }
+  buffer->len = 0;
+  return 0;
+}
 
-  // Remove IV from remaining content.
-  file_len -= IV_SIZE;
+// Append content to buffered listing output.
+// Returns `0` on success or `-1` on error.
+static int list_buffer_append(struct list_buffer *buffer, const char *content, size_t len) {
+  if (buffer->len + len > LIST_BUFFER_SIZE && list_buffer_flush(buffer)) {
+    return -1;
+  }
+  memcpy(buffer->data + buffer->len, content, len);
+  buffer->len += len;
+  return 0;
+}
 
-  // Read encrypted content.
-  unsigned char* contents = malloc(file_len);
-  bytes_read = read(fd, contents, file_len);
+// Append a note ID padded to `width` characters to buffered listing output.
+// Returns `0` on success or `-1` on error.
+static int list_buffer_append_id(struct list_buffer *buffer, unsigned long id, int width) {
+  // Enough for any unsigned long in base 10 plus padding.
+  char digits[24];
+  int len = 0;
+  do {
+    digits[sizeof(digits) - 1 - len++] = '0' + id % 10;
+    id /= 10;
+  } while (id);
 
-  // If unable to read fully, warn about possible data loss.
-  if (bytes_read != file_len) {
-    printf("Unable to read note fully! File may be corrupted.\n");
-    printf("Consider creating a new note with any recovered contents and deleting %s.\n", note_name + sizeof(char));
+  if (list_buffer_append(buffer, digits + sizeof(digits) - len, len)) {
+    return -1;
+  }
+  while (len++ < width) {
+    if (list_buffer_append(buffer, " ", 1)) {
+      return -1;
+    }
   }
+  return 0;
+}
 
-  // Decrypt contents and print.
-  cipher(contents, bytes_read, stdout, key, iv, 0);
+// Count the decimal digits in a number.
+static int count_digits(unsigned long value) {
+  int digits = 1;
+  while (value >= 10) {
+    value /= 10;
+    ++digits;
+  }
+  return digits;
+}
 
+// List notes in a folder in numeric order.
+// If stdout is a terminal, notes are printed in columns and paged. Otherwise, one per line.
+// Returns the number of notes listed or `-1` on error.
+//
+// `folder_name`: path of directory containing note files
+// `options`: range and paging options
+long list_notes_paged(const char *folder_name, const struct list_options *options) {
+  struct note_ids notes = {0};
+  if (load_note_ids(folder_name, &notes) < 0) {
+    free_note_ids(&notes);
+    return -1;
+  }
+
+  // Find the requested range in the sorted IDs.
+  size_t first = 0;
+  while (first < notes.count && notes.ids[first] < options->from) {
+    ++first;
+  }
+  size_t last = notes.count;
+  if (options->limit && last - first > options->limit) {
+    last = first + options->limit;
+  }
+
+  if (first == last) {
+    free_note_ids(&notes);
+    return 0;
+  }
+
+  // Only lay out columns if we can tell how wide the terminal is.
+  // If stdout is not a terminal, print one note per line so output is easy to consume.
+  // Columns are as wide as the largest listed name, separated by 2 spaces.
+  int width = count_digits(notes.ids[last - 1]);
+  int cols = 1;
+  int rows = 0;
+  struct winsize wsize;
+  if (isatty(STDOUT_FILENO) && !ioctl(STDOUT_FILENO, TIOCGWINSZ, &wsize) && wsize.ws_col > width) {
+    // Initial column + remainder / characters per column
+    cols = 1 + (wsize.ws_col - width) / (width + 2);
+    // Leave a line free for the paging prompt.
+    rows = wsize.ws_row > 1 ? wsize.ws_row - 1 : 0;
+  }
+  size_t page_size = options->more && rows ? (size_t) rows * cols : 0;
+
+  // Anything already printed through stdio must come first.
+  fflush(stdout);
+
+  struct list_buffer *buffer = malloc(sizeof(struct list_buffer));
+  if (buffer == NULL) {
+    report_errno("list buffer");
+    free_note_ids(&notes);
+    return -1;
+  }
+  buffer->fd = STDOUT_FILENO;
+  buffer->len = 0;
+
+  long count = 0;
+  int failed = 0;
+  for (size_t i = first; i < last && !failed; ++i) {
+    // End rows when full or out of notes. Otherwise, pad and space out the next entry.
+    int row_end = count % cols == cols - 1 || i == last - 1;
+    failed = list_buffer_append_id(buffer, notes.ids[i], row_end ? 0 : width)
+        || list_buffer_append(buffer, row_end ? "\n" : "  ", row_end ? 1 : 2);
+    ++count;
+
+    // At the end of a full page, let the user decide whether to continue.
+    if (!failed && page_size && count % page_size == 0 && i + 1 < last) {
+      failed = list_buffer_flush(buffer);
+      if (!failed && !options->more(last - i - 1)) {
+        break;
+      }
+    }
+  }
+
+  if (!failed) {
+    failed = list_buffer_flush(buffer);
+  }
+  if (failed) {
+    report_errno("list");
+  } else if (options->listed) {
+    options->listed(notes.ids + first, count);
+  }
+
+  free(buffer);
+  free_note_ids(&notes);
+
+  return failed ? -1 : count;
+}
+
+// List notes in a folder.
+// Returns the number of notes listed.
+//
+// `folder_name`: path of directory containing note files
+// Author: Adam, Alex (merged two different versions)
+int list_notes(const char *folder_name) {
+  struct list_options options = {0};
+  long count = list_notes_paged(folder_name, &options);
+  return count < 0 ? 0 : count;
+}
+
+// Get a file name from user input.
+// Note: Allocates memory to store result.
+// Returns `NULL` on error, printing issues.
+//
+// `len_ptr`: A pointer that will be filled with the accepted input length
+// Author: Adam
+char* intake_file_name(unsigned long *len_ptr) {
+  // Show the prompt before waiting, even when output is not a terminal.
+  fflush(stdout);
+  char *line = NULL;
+  int read = getline(&line, len_ptr, stdin);
+
+  // Handle errors getting input.
+  if (read <= 0) {
+    report_errno("filename");
+    return NULL;
+  }
+
+  // Truncate input to the first invalid character.
+  for (int i = 0; i < read; ++i) {
+    if (!isdigit(line[i])) {
+      line[i] = '\0';
+      *len_ptr = i + 1;
+      break;
+    }
+  }
+
+  // If the input does not start with a number, complain.
+  if (*len_ptr <= 1) {
+    printf("Invalid file name! File names are numeric.\n");
+    free(line);
+    return NULL;
+  }
+
+  // Otherwise, allocate memory to store just what we need of it.
+  char *note_name = malloc(*len_ptr + 1);
+
+  if (note_name == NULL) {
+    report_errno("note name");
+    free(line);
+    return NULL;
+  }
+
+  // .<input>
+  note_name[0] = '.';
+  strncpy(note_name + sizeof(char), line, *len_ptr);
+
+  // Free original input allocation.
+  free(line);
+
+  return note_name;
+}
+
+// Find the next unused file name number.
+// File names are always numeric to prevent information leakage via titles.
+// Returns the next file number or `0` if files `1` through `MAX_NOTES` exist.
+//
+// `folder_name`: path of directory containing note files
+// Author: Adam
+int next_file_name(const char *folder_name) {
+  unsigned long long span = trace_begin();
+  struct note_ids notes = {0};
+  if (load_note_ids(folder_name, &notes) < 0) {
+    free_note_ids(&notes);
+    trace_end("next_file_name", span);
+    return -1;
+  }
+
+  // Iterate over sorted IDs and check for mismatches.
+  // The first mismatch is an available file number.
+  unsigned long next = 1;
+  for (size_t i = 0; i < notes.count && notes.ids[i] == next; ++i) {
+    ++next;
+  }
+
+  free_note_ids(&notes);
+  trace_end("next_file_name", span);
+
+  // If there are no free file numbers, indicate that.
+  if (next > MAX_NOTES) {
+    return 0;
+  }
+
+  return next;
+}
+
+// Combine a directory and a file name into a file path.
+// Note: This introduces vulnerabilities! Check directory and file name lengths before using!
+//
+// `dir`: the path of the base directory
+// `entry_name`: the name of the file in the directory
+// `result`: A pointer to where the result is to be placed
+// Author: Adam
+void combined_path(const char *dir, const char *entry_name, char *result) {
+  // Vulnerability: strcpy
+  strcpy(result, dir);
+  if (dir[strlen(dir) - 1] != '/') {
+    strcat(result, "/");
+  }
+  // Vulnerability: strcat
+  strcat(result, entry_name);
+}
+
+// Combine a directory and a file name into a file path, checking lengths first.
+// Returns `0` on success, printing issues and returning `-1` if the path is too long.
+//
+// `dir`: the path of the base directory
+// `entry_name`: the name of the file in the directory
+// `result`: A pointer to where the result is to be placed, at least `PATH_MAX` long
+int checked_path(const char *dir, const char *entry_name, char *result) {
+  // Resolve combined_path vulnerabilities by checking lengths before calls.
+  // Space is needed for a separator and the terminating null byte.
+  size_t total = 0;
+  if (__builtin_add_overflow(strlen(dir), strlen(entry_name), &total)
+      || __builtin_add_overflow(total, 2, &total)
+      || total > PATH_MAX) {
+    report_error("Path too long: %s/%s\n", dir, entry_name);
+    return -1;
+  }
+  combined_path(dir, entry_name, result);
+  return 0;
+}
+
+// Read the notebook configuration. Missing files and settings use defaults.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `config`: A pointer to where the configuration is to be placed
+int read_config(const char *folder_name, struct notebook_config *config) {
+  config->shard_depth = 0;
+  config->dedup = 0;
+
+  char path[PATH_MAX];
+  if (checked_path(folder_name, CONFIG_FILE, path)) {
+    return -1;
+  }
+
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    // No configuration means a new or flat notebook.
+    if (errno == ENOENT) {
+      return 0;
+    }
+    report_errno(path);
+    return -1;
+  }
+
+  // Settings are stored as key=value lines. Unknown keys are ignored.
+  char line[256];
+  int result = 0;
+  while (fgets(line, sizeof(line), file)) {
+    char *value = strchr(line, '=');
+    if (value == NULL) {
+      continue;
+    }
+    *value++ = '\0';
+    if (!strcmp(line, "shard_depth")) {
+      int depth = atoi(value);
+      if (depth < 0 || depth > MAX_SHARD_DEPTH) {
+        report_error("Invalid shard depth %d in %s\n", depth, path);
+        result = -1;
+        continue;
+      }
+      config->shard_depth = depth;
+    } else if (!strcmp(line, "dedup")) {
+      config->dedup = atoi(value) != 0;
+    }
+  }
+
+  fclose(file);
+  return result;
+}
+
+// Write the notebook configuration, replacing any existing configuration atomically.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `config`: the configuration to write
+int write_config(const char *folder_name, const struct notebook_config *config) {
+  char path[PATH_MAX];
+  char temp_path[PATH_MAX];
+  if (checked_path(folder_name, CONFIG_FILE, path)
+      || checked_path(folder_name, CONFIG_FILE ".tmp", temp_path)) {
+    return -1;
+  }
+
+  int fd = open(temp_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    report_errno(temp_path);
+    return -1;
+  }
+
+  char content[64];
+  int len = snprintf(content, sizeof(content), "shard_depth=%d\ndedup=%d\n", config->shard_depth, config->dedup);
+  if (write(fd, content, len) != len || fsync(fd)) {
+    report_errno(temp_path);
+    close(fd);
+    unlink(temp_path);
+    return -1;
+  }
+  close(fd);
+
+  // Readers see either the old or the new configuration, never a partial one.
+  if (rename(temp_path, path)) {
+    report_errno(path);
+    unlink(temp_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Get the shard of a note ID.
+// IDs are mixed so that sequential notes spread evenly across shards.
+//
+// `id`: the note ID
+static unsigned int shard_of(unsigned long id) {
+  return (unsigned int) (((unsigned long long) id * 0x9E3779B97F4A7C15ULL) >> (64 - 8 * MAX_SHARD_DEPTH));
+}
+
+// Get the path of a note file in a given layout.
+// Returns `0` on success, printing issues and returning `-1` if the path is too long.
+//
+// `folder_name`: path of directory containing note files
+// `depth`: the number of shard directory levels
+// `id`: the note ID
+// `result`: A pointer to where the result is to be placed, at least `PATH_MAX` long
+int note_path(const char *folder_name, int depth, unsigned long id, char *result) {
+  // Each level is 2 hex digits and a slash, then the note name.
+  char relative[3 * MAX_SHARD_DEPTH + 24];
+  unsigned int shard = shard_of(id);
+  int len = 0;
+  for (int level = 0; level < depth; ++level) {
+    len += sprintf(relative + len, "%02x/", (shard >> (8 * (MAX_SHARD_DEPTH - 1 - level))) & 0xFF);
+  }
+  sprintf(relative + len, ".%lu", id);
+
+  return checked_path(folder_name, relative, result);
+}
+
+// Get the path of a note file that may already exist.
+// The configured layout is checked first. If the note isn't there, other layouts are
+// checked in case the notebook is being migrated. If the note is not found at all,
+// the path in the configured layout is used.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `config`: the notebook configuration
+// `id`: the note ID
+// `result`: A pointer to where the result is to be placed, at least `PATH_MAX` long
+int find_note_path(const char *folder_name, const struct notebook_config *config, unsigned long id, char *result) {
+  if (note_path(folder_name, config->shard_depth, id, result)) {
+    return -1;
+  }
+
+  struct stat st;
+  if (!lstat(result, &st) || errno != ENOENT) {
+    return 0;
+  }
+
+  char other[PATH_MAX];
+  for (int depth = 0; depth <= MAX_SHARD_DEPTH; ++depth) {
+    if (depth != config->shard_depth && !note_path(folder_name, depth, id, other) && !lstat(other, &st)) {
+      strcpy(result, other);
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+// Get the path of an existing note file from its name.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `result`: A pointer to where the result is to be placed, at least `PATH_MAX` long
+int note_file_path(const char *folder_name, const char *note_name, char *result) {
+  unsigned long id = parse_note_id(note_name);
+  if (!id) {
+    report_error("Invalid note name: %s\n", note_name);
+    return -1;
+  }
+
+  struct notebook_config config;
+  if (read_config(folder_name, &config)) {
+    return -1;
+  }
+
+  return find_note_path(folder_name, &config, id, result);
+}
+
+// Create the shard directories for a note, if they don't exist.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `depth`: the number of shard directory levels
+// `id`: the note ID
+int make_shard_dirs(const char *folder_name, int depth, unsigned long id) {
+  char path[PATH_MAX];
+  if (note_path(folder_name, depth, id, path)) {
+    return -1;
+  }
+
+  // Walk the shard components of the path, creating each in turn.
+  char *note = strrchr(path, '/');
+  char *end = note;
+  for (int level = 0; level < depth; ++level) {
+    end -= 3;
+  }
+  while (end < note) {
+    end += 3;
+    *end = '\0';
+    if (mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR) && errno != EEXIST) {
+      report_errno(path);
+      return -1;
+    }
+    *end = '/';
+  }
+
+  return 0;
+}
+
+// Remove empty shard directories.
+//
+// `path`: path of the directory to clean
+// `depth`: the number of shard directory levels below the directory
+static void remove_empty_shards(const char *path, int depth) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent *entry;
+  char shard_path[PATH_MAX];
+  while ((entry = readdir(dir))) {
+    if (is_shard_name(entry->d_name) && !checked_path(path, entry->d_name, shard_path)) {
+      if (depth > 1) {
+        remove_empty_shards(shard_path, depth - 1);
+      }
+      // Fails harmlessly if the shard still contains notes.
+      rmdir(shard_path);
+    }
+  }
+
+  closedir(dir);
+}
+
+// Check if a note exists in a layout other than the configured one.
+//
+// `folder_name`: path of directory containing note files
+// `config`: the notebook configuration
+// `id`: the note ID
+static int exists_in_other_layout(const char *folder_name, const struct notebook_config *config, unsigned long id) {
+  char path[PATH_MAX];
+  struct stat st;
+  for (int depth = 0; depth <= MAX_SHARD_DEPTH; ++depth) {
+    if (depth != config->shard_depth && !note_path(folder_name, depth, id, path) && !lstat(path, &st)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Where this process's next claim starts: past the highest ID it has seen taken, so
+// adds don't each read the notes directory again.
+struct claim_hint {
+  pthread_mutex_t lock;
+  char folder[PATH_MAX];
+  // The next ID to try, or `0` if there is none.
+  unsigned long next;
+};
+
+static struct claim_hint claim_hint = {PTHREAD_MUTEX_INITIALIZER};
+
+// Take the next ID to try from the hint, so threads of this process never try the same one.
+// Returns the ID, or `0` if there is no hint for the folder or it is past `MAX_NOTES`.
+//
+// `folder_name`: path of directory containing note files
+static unsigned long take_claim_hint(const char *folder_name) {
+  unsigned long candidate = 0;
+  pthread_mutex_lock(&claim_hint.lock);
+  if (claim_hint.next && claim_hint.next <= MAX_NOTES && !strcmp(claim_hint.folder, folder_name)) {
+    candidate = claim_hint.next++;
+  }
+  pthread_mutex_unlock(&claim_hint.lock);
+  return candidate;
+}
+
+// Move the hint past an ID known to be taken.
+//
+// `folder_name`: path of directory containing note files
+// `taken`: the ID
+static void raise_claim_hint(const char *folder_name, unsigned long taken) {
+  if (strlen(folder_name) >= PATH_MAX) {
+    return;
+  }
+  pthread_mutex_lock(&claim_hint.lock);
+  if (strcmp(claim_hint.folder, folder_name)) {
+    strcpy(claim_hint.folder, folder_name);
+    claim_hint.next = 0;
+  }
+  if (claim_hint.next <= taken) {
+    claim_hint.next = taken + 1;
+  }
+  pthread_mutex_unlock(&claim_hint.lock);
+}
+
+// Try to claim a note ID by exclusively creating its file.
+// Returns a file descriptor open for writing the new, empty note, `-2` if the ID is
+// taken, or `-1` on error, printing issues.
+//
+// `folder_name`: path of directory containing note files
+// `config`: the notebook configuration
+// `candidate`: the ID to claim
+// `file_path`: A pointer to where the note's path is to be placed, at least `PATH_MAX` long
+static int try_claim(const char *folder_name, const struct notebook_config *config, unsigned long candidate,
+    char *file_path) {
+  if (make_shard_dirs(folder_name, config->shard_depth, candidate)
+      || note_path(folder_name, config->shard_depth, candidate, file_path)) {
+    return -1;
+  }
+
+  // Make file accessible only by user. Fails if the file exists.
+  int fd = open(file_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    if (errno == EEXIST) {
+      // Another writer got here first.
+      return -2;
+    }
+    report_errno(file_path);
+    return -1;
+  }
+
+  // A writer using a stale layout may have created the same note elsewhere.
+  if (exists_in_other_layout(folder_name, config, candidate)) {
+    close(fd);
+    unlink(file_path);
+    return -2;
+  }
+  return fd;
+}
+
+// Claim an unused note ID by exclusively creating its file.
+// Concurrent writers never receive the same ID. Each process claims upward from the
+// highest ID it has seen taken, and only reads the directory for its first claim, once
+// IDs run out above that, or once other writers keep taking the IDs it tries. A read
+// claims the lowest free ID, trying the next free one from the same read if another
+// writer creates it first, so no lock is needed.
+// Returns a file descriptor open for writing the new, empty note, or `-1` on error.
+// If no IDs up to `MAX_NOTES` are free, `errno` is set to `ENOSPC`. Other issues are printed.
+//
+// `folder_name`: path of directory containing note files
+// `config`: the notebook configuration
+// `id`: A pointer to where the claimed ID is to be placed
+// `file_path`: A pointer to where the note's path is to be placed, at least `PATH_MAX` long
+int claim_note(const char *folder_name, const struct notebook_config *config, unsigned long *id, char *file_path) {
+  int fd = -2;
+  unsigned long candidate = 0;
+  unsigned long step = 1;
+  for (int attempt = 0; fd == -2 && attempt < CLAIM_HINT_ATTEMPTS; ++attempt) {
+    candidate = take_claim_hint(folder_name);
+    if (!candidate) {
+      break;
+    }
+    fd = try_claim(folder_name, config, candidate, file_path);
+    // Other writers are claiming ahead of this one. Skip further each time to get past them,
+    // leaving any IDs skipped for a later read of the directory.
+    if (fd == -2) {
+      raise_claim_hint(folder_name, candidate + step - 1);
+      if (step < MAX_NOTES) {
+        step *= 2;
+      }
+    }
+  }
+  if (fd != -2) {
+    *id = candidate;
+    return fd;
+  }
+
+  struct note_ids notes = {0};
+  if (load_note_ids(folder_name, &notes) < 0) {
+    free_note_ids(&notes);
+    return -1;
+  }
+  // Later claims start past every note seen, and any claimed since.
+  if (notes.count) {
+    raise_claim_hint(folder_name, notes.ids[notes.count - 1]);
+  }
+
+  candidate = 0;
+  size_t index = 0;
+  while (fd == -2) {
+    // Advance to the next ID that wasn't in use when scanned.
+    ++candidate;
+    while (index < notes.count && notes.ids[index] <= candidate) {
+      if (notes.ids[index] == candidate) {
+        ++candidate;
+      }
+      ++index;
+    }
+
+    if (candidate > MAX_NOTES) {
+      free_note_ids(&notes);
+      errno = ENOSPC;
+      return -1;
+    }
+    fd = try_claim(folder_name, config, candidate, file_path);
+  }
+
+  free_note_ids(&notes);
+  if (fd >= 0) {
+    raise_claim_hint(folder_name, candidate);
+  }
+
+  *id = candidate;
+  return fd;
+}
+
+// Move all notes in a notebook to a new layout.
+// The new layout is configured first, so new notes are created in it while existing
+// notes are moved. Notes remain readable throughout.
+// Returns the number of notes moved or `-1` on error, printing issues.
+//
+// `folder_name`: path of directory containing note files
+// `depth`: the number of shard directory levels to use
+long migrate_layout(const char *folder_name, int depth) {
+  if (depth < 0 || depth > MAX_SHARD_DEPTH) {
+    report_error("Shard depth must be between 0 and %d.\n", MAX_SHARD_DEPTH);
+    return -1;
+  }
+
+  // Ensure that folder exists.
+  if (mkdir(folder_name, S_IRUSR | S_IWUSR | S_IXUSR) && errno != EEXIST) {
+    report_errno(folder_name);
+    return -1;
+  }
+
+  struct notebook_config config;
+  if (read_config(folder_name, &config)) {
+    return -1;
+  }
+  config.shard_depth = depth;
+  if (write_config(folder_name, &config)) {
+    return -1;
+  }
+
+  struct note_ids notes = {0};
+  if (scan_note_ids(folder_name, &notes) < 0) {
+    free_note_ids(&notes);
+    return -1;
+  }
+
+  long moved = 0;
+  char target[PATH_MAX];
+  char source[PATH_MAX];
+  struct stat st;
+  for (size_t i = 0; i < notes.count; ++i) {
+    unsigned long id = notes.ids[i];
+    if (note_path(folder_name, depth, id, target)) {
+      continue;
+    }
+
+    for (int old_depth = 0; old_depth <= MAX_SHARD_DEPTH; ++old_depth) {
+      if (old_depth == depth || note_path(folder_name, old_depth, id, source) || lstat(source, &st)) {
+        continue;
+      }
+      if (make_shard_dirs(folder_name, depth, id)) {
+        break;
+      }
+      // Link then unlink rather than rename so that an existing note is never replaced.
+      if (link(source, target)) {
+        report_errno(target);
+        break;
+      }
+      if (unlink(source)) {
+        report_errno(source);
+      }
+      ++moved;
+      break;
+    }
+  }
+
+  free_note_ids(&notes);
+
+  // Shards left behind by a previous layout are no longer needed.
+  remove_empty_shards(folder_name, MAX_SHARD_DEPTH);
+
+  return moved;
+}
+
+int is_symlink(const char *path) {
+    struct stat path_stat;
+
+    if (lstat(path, &path_stat) != 0) {
+        report_errno("lstat");
+        return 0; // error
+    }
+
+    // Check it's a directory
+    if (!S_ISDIR(path_stat.st_mode)) {
+        return 0; // not a directory
+    }
+
+    // Check it's NOT a symlink
+    if (S_ISLNK(path_stat.st_mode)) {
+        return 0; // is a symlink
+    }
+
+    return 1; // it's a real directory!
+}
+
+// Lock a whole open file, waiting while another process or thread holds a conflicting lock.
+// The lock belongs to this open file, so threads of one process exclude each other too,
+// and closing another descriptor for the same file doesn't release it.
+// Returns `0` on success or `-1` on error.
+//
+// `fd`: the open file
+// `writable`: `1` for an exclusive lock, `0` for a shared one
+int lock_file(int fd, int writable) {
+  struct flock lock = {0};
+  lock.l_type = writable ? F_WRLCK : F_RDLCK;
+  lock.l_whence = SEEK_SET;
+  while (fcntl(fd, F_OFD_SETLKW, &lock)) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Lock a whole open file like `lock_file`, without waiting.
+// Returns `0` on success, `1` if another process or thread holds a conflicting lock, or
+// `-1` on error.
+//
+// `fd`: the open file
+// `writable`: `1` for an exclusive lock, `0` for a shared one
+int try_lock_file(int fd, int writable) {
+  struct flock lock = {0};
+  lock.l_type = writable ? F_WRLCK : F_RDLCK;
+  lock.l_whence = SEEK_SET;
+  if (fcntl(fd, F_OFD_SETLK, &lock)) {
+    return errno == EAGAIN || errno == EACCES ? 1 : -1;
+  }
+  return 0;
+}
+
+// Get the options for reading a notebook's notes, naming its chunk store.
+// Returns `0` on success, printing issues and returning `-1` if the path is too long.
+//
+// `folder_name`: path of directory containing note files
+// `store`: A pointer to where the chunk store's path is to be placed, at least `PATH_MAX` long
+// `options`: A pointer to where the options are to be placed
+static int note_options(const char *folder_name, char *store, struct chunk_options *options) {
+  options->threads = 0;
+  options->throttle = NULL;
+  options->chunk_store = store;
+  return checked_path(folder_name, CHUNK_STORE, store);
+}
+
+// Encrypt content into an empty note file, deduplicated if the notebook is set up for it.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the empty note file, open for writing
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `config`: the notebook configuration
+// `content`: the plaintext
+// `len`: the plaintext length
+static int write_note_file(int fd, const unsigned char *key, const char *folder_name,
+    const struct notebook_config *config, const unsigned char *content, size_t len) {
+  if (!config->dedup) {
+    return write_chunked_note(fd, key, content, len, NULL);
+  }
+  char store[PATH_MAX];
+  struct chunk_options options;
+  if (note_options(folder_name, store, &options)) {
+    return NOTE_ERR_IO;
+  }
+  return write_dedup_note(fd, key, content, len, &options);
+}
+
+// Read the manifest of a note about to be deleted or replaced, if it is deduplicated.
+// Notebooks without a chunk store have no deduplicated notes, so nothing is read.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+// Note: The manifest must be freed!
+//
+// `fd`: the note file, locked for writing
+// `key`: the key to use for decryption
+// `store`: path of the chunk store
+// `manifest`: A pointer to where the manifest is to be placed, `NULL` if there is none
+// `manifest_len`: A pointer to where the manifest's length is to be placed
+static int held_chunks(int fd, const unsigned char *key, const char *store, unsigned char **manifest,
+    size_t *manifest_len) {
+  *manifest = NULL;
+  *manifest_len = 0;
+  if (access(store, F_OK)) {
+    return 0;
+  }
+  return read_dedup_manifest(fd, key, manifest, manifest_len);
+}
+
+static int sync_parent(const char *file_path);
+
+// Release the chunks a note held once it is gone, and free its manifest.
+// Chunks that can't be released only cost space, so they are reported and left.
+//
+// `store`: path of the chunk store
+// `manifest`: the manifest, or `NULL` if the note was not deduplicated
+// `manifest_len`: the manifest's length
+static void release_chunks(const char *store, unsigned char *manifest, size_t manifest_len) {
+  if (manifest != NULL && dedup_release(store, manifest, manifest_len)) {
+    report_errno(store);
+  }
+  free(manifest);
+}
+
+// Claim the next free ID for a new note and lock its file, so readers wait for the
+// note to be written rather than see part of it.
+// Returns a file descriptor for the empty note, printing issues and returning `-1`
+// otherwise, i.e. with `errno` set to `ENOSPC` if every ID is taken.
+//
+// `folder_name`: path of directory containing note files
+// `id`: A pointer to where the new note's ID is to be placed
+// `file_path`: A pointer to where the note's path is to be placed, at least `PATH_MAX` long
+int reserve_note(const char *folder_name, unsigned long *id, char *file_path) {
+  // Ensure that folder exists.
+  struct stat st;
+  if (stat(folder_name, &st) <= 0) {
+    // Create folder with read-write-execute permissions for the user
+    mkdir(folder_name, S_IRUSR | S_IWUSR | S_IXUSR);
+  }
+
+  // Get the notebook layout.
+  struct notebook_config config;
+  if (read_config(folder_name, &config)) {
+    return -1;
+  }
+
+  // Claim the next file number. This creates the file, so no other writer can take it.
+  unsigned long long span = trace_begin();
+  int fd = claim_note(folder_name, &config, id, file_path);
+  trace_end("claim_note", span);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // Readers wait for the note to be written rather than see part of it.
+  if (lock_file(fd, 1)) {
+    int saved_errno = errno;
+    report_errno(file_path);
+    close(fd);
+    unlink(file_path);
+    errno = saved_errno;
+    return -1;
+  }
+
+  // A history left by a deleted note with this ID isn't this note's.
+  char note_name[MAXNAMLEN];
+  char history_path[PATH_MAX];
+  sprintf(note_name, ".%lu", *id);
+  if (!history_file_path(folder_name, note_name, history_path) && unlink(history_path) && errno != ENOENT) {
+    report_errno(history_path);
+  }
+  return fd;
+}
+
+// Encrypt content into a note claimed by `reserve_note`, then close it.
+// A note that can't be written is removed, so no one reads an empty note.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `fd`: the reserved note, locked for writing
+// `file_path`: path of the note file
+// `content`: the plaintext note content
+// `len`: the content's length
+int write_reserved_note(const unsigned char *key, const char *folder_name, int fd, const char *file_path,
+    const unsigned char *content, size_t len) {
+  // Encrypt the input in chunks, in parallel for large notes.
+  struct notebook_config config;
+  int error = read_config(folder_name, &config) ? NOTE_ERR_IO
+      : write_note_file(fd, key, folder_name, &config, content, len);
+  if (error) {
+    int saved_errno = errno;
+    close(fd);
+    unlink(file_path);
+    errno = saved_errno;
+    return error;
+  }
+
+  // Close file and warn if closing fails.
+  unsigned long long span = trace_begin();
+  if (close(fd)) {
+    report_errno(file_path);
+  }
+  trace_end("close", span);
+  return 0;
+}
+
+// Encrypt and save a new note at the next free ID.
+// Returns `0` on success, printing issues and returning a `NOTE_ERR_*` value otherwise.
+// For `NOTE_ERR_IO`, `errno` is `ENOSPC` if every ID is taken.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `content`: the plaintext note content
+// `len`: the content's length
+// `id`: A pointer to where the new note's ID is to be placed
+int create_note(const unsigned char *key, const char *folder_name, const unsigned char *content, size_t len,
+    unsigned long *id) {
+  char file_path[PATH_MAX];
+  int fd = reserve_note(folder_name, id, file_path);
+  if (fd < 0) {
+    return NOTE_ERR_IO;
+  }
+  return write_reserved_note(key, folder_name, fd, file_path, content, len);
+}
+
+// Encrypt and save a new note.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `input`: the plaintext note content
+// Author: Alex
+void add_note(const unsigned char *key, const char *folder_name, const char *input) {
+  unsigned long next_file_num = 0;
+  unsigned long long span = trace_begin();
+  int error = create_note(key, folder_name, (const unsigned char *) input, strlen(input), &next_file_num);
+  trace_end("create_note", span);
+
+  if (error == NOTE_ERR_IO && errno == ENOSPC) {
+    // If no file number is available, finish. Otherwise, claiming handles error logging.
+    printf("Too many notes present to create another!\n");
+    printf("Only up to %d notes are supported.\n", MAX_NOTES);
+  } else if (error && next_file_num) {
+    printf("Encryption as note %lu failed: %s\n", next_file_num, note_error_string(error));
+  } else if (!error) {
+    printf("Encrypted as note %lu!", next_file_num);
+  }
+}
+
+// Delete a note, along with its history and any journal left by an interrupted edit.
+// Chunks a deduplicated note held that no other note uses are removed too.
+// Returns `0` on success, printing issues and returning `-1` otherwise, i.e. with
+// `errno` set to `ENOENT` if there is no such note.
+//
+// `key`: the key to use for decryption, or `NULL` to leave stored chunks as they are
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+int delete_note(const unsigned char *key, const char *folder_name, const char *note_name) {
+  char file_path[PATH_MAX];
+  char store[PATH_MAX];
+  if (note_file_path(folder_name, note_name, file_path) || checked_path(folder_name, CHUNK_STORE, store)) {
+    return -1;
+  }
+
+  // The manifest is read under the lock, so no reader is left with chunks that are gone.
+  unsigned char *manifest = NULL;
+  size_t manifest_len = 0;
+  int fd = key == NULL ? -1 : open(file_path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+  if (fd >= 0 && !lock_file(fd, 1) && held_chunks(fd, key, store, &manifest, &manifest_len)) {
+    report_error("Note %s could not be read, so its chunks are left in %s\n", note_name + sizeof(char), store);
+  }
+
+  // Vulnerability mitigation: unlink rather than delete.
+  // Filesystem will delete when links reach 0.
+  if (unlink(file_path)) {
+    int saved_errno = errno;
+    report_errno(file_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(manifest);
+    errno = saved_errno;
+    return -1;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  // Chunks are only released once the unlink is on disk, so a crash can't leave the note
+  // pointing at chunks that are gone.
+  if (manifest != NULL && sync_parent(file_path)) {
+    report_errno(file_path);
+    free(manifest);
+    manifest = NULL;
+  }
+  release_chunks(store, manifest, manifest_len);
+
+  // Remove the journal and history too, so a later note with the same ID is clean.
+  char journal_path[PATH_MAX];
+  if (!journal_file_path(folder_name, note_name, journal_path) && unlink(journal_path) && errno != ENOENT) {
+    report_errno(journal_path);
+  }
+  char history_path[PATH_MAX];
+  if (!history_file_path(folder_name, note_name, history_path) && unlink(history_path) && errno != ENOENT) {
+    report_errno(history_path);
+  }
+  return 0;
+}
+
+// Compare ID ranges by their first ID for qsort.
+static int compare_id_ranges(const void *a, const void *b) {
+  unsigned long x = ((const struct id_range *) a)->first;
+  unsigned long y = ((const struct id_range *) b)->first;
+  return (x > y) - (x < y);
+}
+
+// Parse a list of note IDs and ranges of them, such as `1-5000,7000`.
+// Ranges are sorted and those that overlap or touch are merged.
+// Note: Allocates memory to store result.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `spec`: comma separated IDs and inclusive ranges of IDs
+// `ranges`: A pointer to where the ranges are to be placed
+// `count`: A pointer to where the number of ranges is to be placed
+int parse_id_ranges(const char *spec, struct id_range **ranges, size_t *count) {
+  struct id_range *result = NULL;
+  size_t used = 0, capacity = 0;
+  const char *c = spec;
+
+  while (*c) {
+    while (*c == ' ') {
+      ++c;
+    }
+    if (!isdigit(*c)) {
+      goto invalid;
+    }
+    char *end;
+    errno = 0;
+    unsigned long first = strtoul(c, &end, 10), last = first;
+    if (*end == '-') {
+      c = end + 1;
+      if (!isdigit(*c)) {
+        goto invalid;
+      }
+      last = strtoul(c, &end, 10);
+    }
+    if (errno || first == 0 || last < first) {
+      goto invalid;
+    }
+
+    if (used == capacity) {
+      capacity = capacity ? capacity * 2 : 8;
+      struct id_range *grown = realloc(result, capacity * sizeof(*result));
+      if (grown == NULL) {
+        report_errno("note IDs");
+        free(result);
+        return -1;
+      }
+      result = grown;
+    }
+    result[used].first = first;
+    result[used].last = last;
+    ++used;
+
+    c = end;
+    while (*c == ' ') {
+      ++c;
+    }
+    if (*c == ',') {
+      ++c;
+    } else if (*c) {
+      goto invalid;
+    }
+  }
+  if (used == 0) {
+    goto invalid;
+  }
+
+  // Merge ranges so each ID is looked up once.
+  qsort(result, used, sizeof(*result), compare_id_ranges);
+  size_t merged = 0;
+  for (size_t i = 1; i < used; ++i) {
+    if (result[merged].last == ULONG_MAX || result[i].first > result[merged].last + 1) {
+      result[++merged] = result[i];
+    } else if (result[i].last > result[merged].last) {
+      result[merged].last = result[i].last;
+    }
+  }
+
+  *ranges = result;
+  *count = merged + 1;
+  return 0;
+
+invalid:
+  report_error("Invalid note IDs: %s\nUse IDs and ranges of them, i.e. 1-5000,7000\n", spec);
+  free(result);
+  return -1;
+}
+
+// Check if an ID is in a sorted list of ranges.
+//
+// `ranges`: sorted ranges that don't overlap
+// `count`: the number of ranges
+// `id`: the ID to find
+static int in_id_ranges(const struct id_range *ranges, size_t count, unsigned long id) {
+  size_t low = 0, high = count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (id < ranges[mid].first) {
+      high = mid;
+    } else if (id > ranges[mid].last) {
+      low = mid + 1;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A file to unlink when deleting notes in bulk.
+struct delete_target {
+  // The open directory the file is in.
+  int dir_fd;
+  // Whether the file is a note rather than its journal or history.
+  int note;
+  // Note, journal and history names are well under this.
+  char name[32];
+};
+
+// Files found by a bulk delete, and its progress unlinking them.
+struct delete_job {
+  struct delete_target *targets;
+  size_t count;
+  size_t capacity;
+  // Directories are held open until every file in them is unlinked.
+  int *dirs;
+  size_t dir_count;
+  size_t dir_capacity;
+  // The next target to unlink, claimed a batch at a time.
+  size_t next;
+  // Key and chunk store for releasing the chunks of deduplicated notes, or `NULL`.
+  const unsigned char *key;
+  const char *store;
+  unsigned long deleted;
+  unsigned long failed;
+};
+
+// Get the ID of a journal or history file name, such as `.12.journal`.
+// Returns the ID or `0` if the name is not a journal or history.
+//
+// `file_name`: the name to check
+static unsigned long note_file_id(const char *file_name) {
+  const char *suffix = strchr(file_name + 1, '.');
+  if (file_name[0] != '.' || suffix == NULL
+      || (strcmp(suffix, JOURNAL_SUFFIX) && strcmp(suffix, HISTORY_SUFFIX))) {
+    return 0;
+  }
+  char note_name[32];
+  size_t len = suffix - file_name;
+  if (len >= sizeof(note_name)) {
+    return 0;
+  }
+  memcpy(note_name, file_name, len);
+  note_name[len] = '\0';
+  return parse_note_id(note_name);
+}
+
+// Hold a directory open for a bulk delete.
+// Returns `0` on success or `-1` with `errno` set.
+//
+// `job`: the bulk delete
+// `dir_fd`: the open directory
+static int hold_directory(struct delete_job *job, int dir_fd) {
+  if (job->dir_count == job->dir_capacity) {
+    size_t capacity = job->dir_capacity ? job->dir_capacity * 2 : 16;
+    int *grown = realloc(job->dirs, capacity * sizeof(*grown));
+    if (grown == NULL) {
+      return -1;
+    }
+    job->dirs = grown;
+    job->dir_capacity = capacity;
+  }
+  job->dirs[job->dir_count++] = dir_fd;
+  return 0;
+}
+
+// A bulk delete's search for files to unlink.
+struct deletion_scan {
+  struct delete_job *job;
+  // Sorted IDs of notes to delete.
+  const struct id_range *ranges;
+  size_t range_count;
+  struct entry_buffers buffers;
+};
+
+// Find the files to unlink for a bulk delete in a directory and the shard directories below it.
+// Each directory is read once, and the files are unlinked later relative to it.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `scan`: the search
+// `dir`: the directory to read, held open by the job
+static int collect_deletions(struct deletion_scan *scan, const struct scan_dir *dir);
+
+// Add one directory entry to a bulk delete if it belongs to a note being deleted,
+// descending into shard directories.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+static int collect_deletion(void *arg, const struct scan_dir *dir, const char *name, size_t len) {
+  struct deletion_scan *scan = arg;
+  struct delete_job *job = scan->job;
+  unsigned long id = parse_entry_id(name, len);
+  int note = id != 0;
+
+  // Journals and histories are kept at the top of the folder.
+  if (!note && dir->depth == MAX_SHARD_DEPTH) {
+    id = note_file_id(name);
+  }
+
+  if (id) {
+    if (!in_id_ranges(scan->ranges, scan->range_count, id) || len >= sizeof(job->targets->name)) {
+      return 0;
+    }
+    if (job->count == job->capacity) {
+      size_t capacity = job->capacity ? job->capacity * 2 : 256;
+      struct delete_target *grown = realloc(job->targets, capacity * sizeof(*grown));
+      if (grown == NULL) {
+        report_errno("note IDs");
+        return -1;
+      }
+      job->targets = grown;
+      job->capacity = capacity;
+    }
+    struct delete_target *target = &job->targets[job->count++];
+    target->dir_fd = dir->fd;
+    target->note = note;
+    memcpy(target->name, name, len + 1);
+    return 0;
+  }
+
+  // Notes may be in shard directories, whatever layout is configured.
+  if (dir->depth == 0 || len != 2 || !is_shard_name(name)) {
+    return 0;
+  }
+  char shard_path[PATH_MAX];
+  if (checked_path(dir->path, name, shard_path)) {
+    return 0;
+  }
+  int shard_fd = openat(dir->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (shard_fd < 0 || hold_directory(job, shard_fd)) {
+    report_errno(shard_path);
+    if (shard_fd >= 0) {
+      close(shard_fd);
+    }
+    return -1;
+  }
+  char relative[3 * MAX_SHARD_DEPTH];
+  snprintf(relative, sizeof(relative), "%s%s%s", dir->relative, *dir->relative ? "/" : "", name);
+  struct scan_dir shard = {shard_fd, shard_path, relative, dir->depth - 1};
+  return collect_deletions(scan, &shard);
+}
+
+static int collect_deletions(struct deletion_scan *scan, const struct scan_dir *dir) {
+  return read_entries(dir, &scan->buffers, collect_deletion, scan);
+}
+
+// Unlink a bulk delete's files a batch at a time until none are left.
+//
+// `arg`: the bulk delete
+static void* delete_worker(void *arg) {
+  struct delete_job *job = arg;
+  for (;;) {
+    size_t start = __atomic_fetch_add(&job->next, DELETE_BATCH_SIZE, __ATOMIC_RELAXED);
+    if (start >= job->count) {
+      return NULL;
+    }
+    size_t end = start + DELETE_BATCH_SIZE < job->count ? start + DELETE_BATCH_SIZE : job->count;
+    // Manifests of unlinked notes, released once the batch's unlinks are on disk.
+    struct delete_release {
+      int dir_fd;
+      unsigned char *manifest;
+      size_t manifest_len;
+      int flushed;
+    } releases[DELETE_BATCH_SIZE];
+    size_t release_count = 0;
+    for (size_t i = start; i < end; ++i) {
+      struct delete_target *target = &job->targets[i];
+      unsigned char *manifest = NULL;
+      size_t manifest_len = 0;
+      int fd = -1;
+      if (target->note && job->store != NULL) {
+        fd = openat(target->dir_fd, target->name, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0 && !lock_file(fd, 1)) {
+          read_dedup_manifest(fd, job->key, &manifest, &manifest_len);
+        }
+      }
+
+      // Vulnerability mitigation: unlink rather than delete.
+      int unlinked = !unlinkat(target->dir_fd, target->name, 0);
+      int saved_errno = errno;
+      if (fd >= 0) {
+        close(fd);
+      }
+      if (unlinked && manifest != NULL) {
+        releases[release_count++] = (struct delete_release) {target->dir_fd, manifest, manifest_len, 0};
+      } else {
+        free(manifest);
+      }
+      errno = saved_errno;
+
+      if (unlinked) {
+        if (target->note) {
+          __atomic_fetch_add(&job->deleted, 1, __ATOMIC_RELAXED);
+        }
+      } else if (errno != ENOENT) {
+        report_error("%s: %s\n", target->name, strerror(errno));
+        __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    // Each directory is flushed once, and chunks are kept if it can't be.
+    for (size_t i = 0; i < release_count; ++i) {
+      size_t first = 0;
+      while (releases[first].dir_fd != releases[i].dir_fd) {
+        ++first;
+      }
+      if (first == i) {
+        releases[i].flushed = !fsync(releases[i].dir_fd);
+        if (!releases[i].flushed) {
+          report_error("Deleted notes could not be flushed, so their chunks are left: %s\n", strerror(errno));
+        }
+      } else {
+        releases[i].flushed = releases[first].flushed;
+      }
+      if (releases[i].flushed) {
+        release_chunks(job->store, releases[i].manifest, releases[i].manifest_len);
+      } else {
+        free(releases[i].manifest);
+      }
+    }
+  }
+}
+
+// Compare delete targets for qsort, putting notes before their journals and histories.
+static int compare_delete_targets(const void *a, const void *b) {
+  return ((const struct delete_target *) b)->note - ((const struct delete_target *) a)->note;
+}
+
+// Delete every note with an ID in a set of ranges, along with their journals and histories.
+// The folder and its shard directories are each read once and held open, and files are
+// unlinked relative to them, so a bulk delete costs one directory pass rather than a path
+// lookup per ID. IDs without a note are skipped.
+// Chunks deduplicated notes held that no other note uses are removed too.
+// Returns the number of notes deleted, printing issues and returning `-1` if any file
+// could not be deleted.
+//
+// `key`: the key to use for decryption, or `NULL` to leave stored chunks as they are
+// `folder_name`: path of directory containing note files
+// `ranges`: sorted IDs of notes to delete, as from `parse_id_ranges`
+// `count`: the number of ranges
+// `jobs`: the number of threads unlinking files, or `0` for one
+long delete_notes(const unsigned char *key, const char *folder_name, const struct id_range *ranges, size_t count,
+    unsigned int jobs) {
+  struct delete_job job = {0};
+  // Notes are only opened to find their chunks in notebooks that have any.
+  char store[PATH_MAX];
+  if (checked_path(folder_name, CHUNK_STORE, store)) {
+    return -1;
+  }
+  if (key != NULL && !access(store, F_OK)) {
+    job.key = key;
+    job.store = store;
+  }
+  int folder_fd = open(folder_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (folder_fd < 0) {
+    // Without a folder, there are no notes.
+    if (errno == ENOENT) {
+      return 0;
+    }
+    report_errno(folder_name);
+    return -1;
+  }
+
+  long result = -1;
+  if (hold_directory(&job, folder_fd)) {
+    report_errno(folder_name);
+    close(folder_fd);
+    return -1;
+  }
+  struct deletion_scan scan = {&job, ranges, count};
+  struct scan_dir folder = {folder_fd, folder_name, "", MAX_SHARD_DEPTH};
+  int error = collect_deletions(&scan, &folder);
+  free_entry_buffers(&scan.buffers);
+  if (error) {
+    goto done;
+  }
+
+  // Notes go first, so an interrupted delete leaves whole notes rather than notes without history.
+  qsort(job.targets, job.count, sizeof(*job.targets), compare_delete_targets);
+
+  // There's no use in more threads than batches.
+  size_t batches = (job.count + DELETE_BATCH_SIZE - 1) / DELETE_BATCH_SIZE;
+  if (jobs > batches) {
+    jobs = batches;
+  }
+  pthread_t threads[MAX_DELETE_JOBS];
+  if (jobs > MAX_DELETE_JOBS) {
+    jobs = MAX_DELETE_JOBS;
+  }
+  unsigned int started = 0;
+  for (; jobs > 1 && started < jobs - 1; ++started) {
+    if (pthread_create(&threads[started], NULL, delete_worker, &job)) {
+      break;
+    }
+  }
+  delete_worker(&job);
+  for (unsigned int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  result = job.failed ? -1 : (long) job.deleted;
+
+done:
+  for (size_t i = 0; i < job.dir_count; ++i) {
+    close(job.dirs[i]);
+  }
+  free(job.dirs);
+  free(job.targets);
+  return result;
+}
+
+// Open an existing note file and lock it.
+// Readers share the lock, and a writer holds it alone, so no one reads a note while an
+// edit is being applied to it.
+// Returns a file descriptor or `-1` on error, printing issues.
+//
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `file_path`: A pointer to where the note's path is to be placed, at least `PATH_MAX` long
+// `writable`: `1` to open the note for editing, `0` for reading
+int open_note_file(const char *folder_name, const char *note_name, char *file_path, int writable) {
+  unsigned long long span = trace_begin();
+  int error = note_file_path(folder_name, note_name, file_path);
+  trace_end("note_file_path", span);
+  if (error) {
+    return -1;
+  }
+
+  // A note converted to the chunked format while waiting for the lock is a new file,
+  // so try again with that one.
+  for (int attempt = 0; attempt < 10; ++attempt) {
+    // Get lstat of file.
+    struct stat lstat_val;
+    if (lstat(file_path, &lstat_val)) {
+      report_errno(file_path);
+      return -1;
+    }
+
+    // Open file.
+    span = trace_begin();
+    int fd = open(file_path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    trace_end("open", span);
+
+    // Handle failure to open file.
+    if (fd < 0) {
+      report_errno(file_path);
+      return -1;
+    }
+
+    // Get fstat of file.
+    struct stat fstat_val;
+    if (fstat(fd, &fstat_val)) {
+      report_errno(file_path);
+      close(fd);
+      return -1;
+    }
+
+    // Ensure that file is the intended target file.
+    if (lstat_val.st_ino != fstat_val.st_ino) {
+      report_error("File %s was moved while opening!", file_path);
+      close(fd);
+      return -1;
+    }
+
+    // Waiting here means another process or thread is using the note.
+    span = trace_begin();
+    int locked = lock_file(fd, writable);
+    trace_end("lock", span);
+    if (locked) {
+      report_errno(file_path);
+      close(fd);
+      return -1;
+    }
+
+    // Ensure that file is still the intended target file now that it is locked.
+    if (!lstat(file_path, &lstat_val) && lstat_val.st_ino == fstat_val.st_ino) {
+      // A note is only empty between being claimed and its writer taking the lock.
+      // It isn't there yet, rather than damaged.
+      if (!fstat(fd, &fstat_val) && fstat_val.st_size == 0) {
+        errno = ENOENT;
+        report_errno(file_path);
+        close(fd);
+        return -1;
+      }
+      return fd;
+    }
+    close(fd);
+  }
+
+  report_error("File %s keeps changing while opening!\n", file_path);
+  return -1;
+}
+
+// Get the path of the journal used to edit a note.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `result`: A pointer to where the journal's path is to be placed, at least `PATH_MAX` long
+int journal_file_path(const char *folder_name, const char *note_name, char *result) {
+  char journal_name[MAXNAMLEN + 1];
+  if (strlen(note_name) + strlen(JOURNAL_SUFFIX) > MAXNAMLEN) {
+    report_error("Note name %s is too long!\n", note_name);
+    return -1;
+  }
+  strcpy(journal_name, note_name);
+  strcat(journal_name, JOURNAL_SUFFIX);
+  return checked_path(folder_name, journal_name, result);
+}
+
+// Get the path of the revision history of a note.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `result`: A pointer to where the history's path is to be placed, at least `PATH_MAX` long
+int history_file_path(const char *folder_name, const char *note_name, char *result) {
+  char history_name[MAXNAMLEN + 1];
+  if (strlen(note_name) + strlen(HISTORY_SUFFIX) > MAXNAMLEN) {
+    report_error("Note name %s is too long!\n", note_name);
+    return -1;
+  }
+  strcpy(history_name, note_name);
+  strcat(history_name, HISTORY_SUFFIX);
+  return checked_path(folder_name, history_name, result);
+}
+
+// Flush the directory containing a file, so that new or renamed entries survive a crash.
+// Returns `0` on success or `-1` on error.
+//
+// `file_path`: path of the file
+static int sync_parent(const char *file_path) {
+  char dir_path[PATH_MAX];
+  const char *slash = strrchr(file_path, '/');
+  if (slash == NULL) {
+    strcpy(dir_path, ".");
+  } else {
+    memcpy(dir_path, file_path, slash - file_path);
+    dir_path[slash - file_path] = '\0';
+  }
+
+  int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    return -1;
+  }
+  int result = fsync(dir_fd);
+  close(dir_fd);
+  return result;
+}
+
+// Finish or roll back an interrupted edit to a note, then remove its journal.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for decryption
+// `fd`: the note file, locked for writing
+// `note_name`: the name of the note file
+// `journal_path`: path of the note's journal
+static int replay_journal(const unsigned char *key, int fd, const char *note_name, const char *journal_path) {
+  int journal_fd = open(journal_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (journal_fd < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    report_errno(journal_path);
+    return -1;
+  }
+
+  int result = replay_note_journal(fd, journal_fd, key);
+  close(journal_fd);
+  if (result < 0) {
+    report_error("Unfinished edit to note %s could not be recovered: %s\n", note_name + sizeof(char),
+        note_error_string(result));
+    return -1;
+  }
+
+  if (unlink(journal_path)) {
+    report_errno(journal_path);
+    return -1;
+  }
+  return 0;
+}
+
+// Finish or roll back an edit to a note that was interrupted by a crash, if any.
+// This is a single check when there is nothing to recover.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+int recover_note(const unsigned char *key, const char *folder_name, const char *note_name) {
+  char journal_path[PATH_MAX];
+  if (journal_file_path(folder_name, note_name, journal_path)) {
+    return -1;
+  }
+  if (access(journal_path, F_OK)) {
+    return 0;
+  }
+
+  // An editor holding the lock finishes its own edit, leaving nothing to replay.
+  char file_path[PATH_MAX];
+  int fd = open_note_file(folder_name, note_name, file_path, 1);
+  if (fd < 0) {
+    return -1;
+  }
+  int result = replay_journal(key, fd, note_name, journal_path);
+  close(fd);
+  return result;
+}
+
+// Write decrypted note content to stdout.
+// Returns `0` on success or `-1` on error.
+//
+// `arg`: unused
+// `content`: the content to write
+// `len`: the content's length
+int write_stdout(void *arg, const unsigned char *content, size_t len) {
+  return fwrite(content, 1, len, stdout) == len ? 0 : -1;
+}
+
+// Decrypted content passed on to another sink while it is kept for a cache.
+struct cache_tee {
+  note_sink sink;
+  void *arg;
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+};
+
+// Keep decrypted content for a cache, then pass it on.
+// Returns `0` on success or `-1` on error.
+static int tee_content(void *arg, const unsigned char *content, size_t len) {
+  struct cache_tee *tee = arg;
+  if (tee->len + len > tee->capacity) {
+    // The note grew after its length was read. It can't have, while locked.
+    return -1;
+  }
+  memcpy(tee->data + tee->len, content, len);
+  tee->len += len;
+  return tee->sink == NULL ? 0 : tee->sink(tee->arg, content, len);
+}
+
+// Decrypt a note, passing its content to a sink, and keep it in a cache.
+// A note that is cached and unchanged since is not read or decrypted again.
+// Returns `0` on success, `NOTE_ERR_IO` with `errno` set if the note can't be opened,
+// or another `NOTE_ERR_*` value.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `cache`: the cache of decrypted notes, or `NULL` to not use one
+// `sink`: where to send decrypted content, or `NULL` to only fill the cache
+// `arg`: passed to the sink
+int load_note(const unsigned char *key, const char *folder_name, const char *note_name, struct note_cache *cache,
+    note_sink sink, void *arg) {
+  char file_path[PATH_MAX];
+  if (recover_note(key, folder_name, note_name)) {
+    return NOTE_ERR_IO;
+  }
+  unsigned long id = parse_note_id(note_name);
+
+  // A hit only costs a stat. Edits change the file, so a stale entry is never used.
+  struct stat stat_val;
+  if (cache && !note_file_path(folder_name, note_name, file_path) && !stat(file_path, &stat_val)) {
+    int cached = cache_read(cache, id, &stat_val, sink, arg);
+    if (cached) {
+      return cached > 0 ? 0 : NOTE_ERR_SINK;
+    }
+  }
+
+  char store[PATH_MAX];
+  struct chunk_options options;
+  if (note_options(folder_name, store, &options)) {
+    return NOTE_ERR_IO;
+  }
+  int fd = open_current_note(key, folder_name, note_name, file_path);
+  if (fd < 0) {
+    return NOTE_ERR_IO;
+  }
+
+  // Keep a copy of the content as it goes by, if it fits.
+  struct cache_tee tee = {sink, arg, NULL, 0, 0};
+  unsigned long long length;
+  if (cache && !fstat(fd, &stat_val) && !read_note_length(fd, key, &length) && length == (size_t) length) {
+    tee.data = cache_buffer(cache, length);
+    tee.capacity = length;
+  }
+  note_sink read_sink = tee.data ? tee_content : sink;
+  void *read_arg = tee.data ? (void *) &tee : arg;
+  if (read_sink == NULL) {
+    // Only filling the cache, and the note doesn't fit.
+    close(fd);
+    return 0;
+  }
+
+  int error = read_note_content(fd, key, 0, 0, read_sink, read_arg, &options);
+
+  if (tee.data && !error && tee.len == tee.capacity) {
+    cache_insert(cache, id, &stat_val, tee.data, tee.len);
+  } else if (tee.data) {
+    secure_free(tee.data, tee.capacity);
+  }
+
+  close(fd);
+  return error;
+}
+
+// Decrypt and print a new note.
+// Notes viewed before in the session are printed from the cache.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `input`: the name of the note file
+// `cache`: the cache of decrypted notes, or `NULL` to not use one
+// Author: Adam
+void read_note(const unsigned char *key, const char *folder_name, const char *note_name, struct note_cache *cache) {
+  // Problems opening the note are printed as they happen.
+  unsigned long long span = trace_begin();
+  int error = load_note(key, folder_name, note_name, cache, write_stdout, NULL);
+  trace_end("load_note", span);
+  if (error && error != NOTE_ERR_IO) {
+    fflush(stdout);
+    report_error("\nNote %s could not be read: %s\n", note_name + sizeof(char), note_error_string(error));
+  }
+}
+
+// Decrypt and print part of a note.
+// Only the part of the note covering the range is read and decrypted.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `offset`: the first byte to print, or if negative, how far from the end to start printing
+// `length`: the number of bytes to print, or `0` to print to the end
+int read_note_range(const unsigned char *key, const char *folder_name, const char *note_name, long long offset,
+    unsigned long long length) {
+  char file_path[PATH_MAX];
+  char store[PATH_MAX];
+  struct chunk_options options;
+  if (note_options(folder_name, store, &options) || recover_note(key, folder_name, note_name)) {
+    return -1;
+  }
+  int fd = open_current_note(key, folder_name, note_name, file_path);
+  if (fd < 0) {
+    return -1;
+  }
+
+  int error = read_note_content(fd, key, offset, length, write_stdout, NULL, &options);
+
+  if (error) {
+    fflush(stdout);
+    report_error("Note %s could not be read: %s\n", note_name + sizeof(char), note_error_string(error));
+  }
+
+  close(fd);
+  return error ? -1 : 0;
+}
+
+// Decrypted content gathered from a sink.
+struct content_buffer {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+};
+
+// Add decrypted content to a buffer.
+// Returns `0` on success or `-1` on error.
+static int collect_content(void *arg, const unsigned char *content, size_t len) {
+  struct content_buffer *buffer = arg;
+  if (buffer->len + len > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->len + len) {
+      capacity *= 2;
+    }
+    unsigned char *data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+      return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->len, content, len);
+  buffer->len += len;
+  return 0;
+}
+
+// Replace a note's content with a new chunked note.
+// The new note replaces the old one in a single rename, and is locked before it does.
+// New content is deduplicated if the notebook is set up for it, and chunks the old
+// note held are released once it is replaced.
+// Returns a file descriptor for the new note or `-1` on error, printing issues.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `fd`: the old note file, locked for writing
+// `file_path`: path of the note file
+// `content`: the new content
+// `len`: the new content's length
+// `revision`: the new note's revision
+static int replace_note_file(const unsigned char *key, const char *folder_name, const char *note_name, int fd,
+    const char *file_path, const unsigned char *content, size_t len, unsigned long long revision) {
+  char temp_path[PATH_MAX];
+  char store[PATH_MAX];
+  struct notebook_config config;
+  if (snprintf(temp_path, PATH_MAX, "%s%s", file_path, CONVERT_SUFFIX) >= PATH_MAX) {
+    report_error("File path too long!\n");
+    return -1;
+  }
+  if (checked_path(folder_name, CHUNK_STORE, store) || read_config(folder_name, &config)) {
+    return -1;
+  }
+  unsigned char *manifest;
+  size_t manifest_len;
+  int error = held_chunks(fd, key, store, &manifest, &manifest_len);
+  if (error) {
+    report_error("Note %s could not be read: %s\n", note_name + sizeof(char), note_error_string(error));
+    return -1;
+  }
+
+  int new_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (new_fd < 0) {
+    report_errno(temp_path);
+    free(manifest);
+    return -1;
+  }
+
+  error = write_note_file(new_fd, key, folder_name, &config, content, len);
+  if (!error && revision) {
+    error = set_note_revision(new_fd, key, revision);
+  }
+  if (error) {
+    report_error("Note %s could not be rewritten: %s\n", note_name + sizeof(char), note_error_string(error));
+  } else if (lock_file(new_fd, 1) || fdatasync(new_fd) || rename(temp_path, file_path)) {
+    report_errno(file_path);
+    error = NOTE_ERR_IO;
+    // The new note never replaced the old one, so it gives back the chunks it took.
+    unsigned char *taken;
+    size_t taken_len;
+    if (!held_chunks(new_fd, key, store, &taken, &taken_len)) {
+      release_chunks(store, taken, taken_len);
+    }
+  } else if (sync_parent(file_path)) {
+    // The old note may come back after a crash, so it keeps its chunks.
+    report_errno(file_path);
+    error = NOTE_ERR_IO;
+  } else {
+    // The old note is gone for good, and its hold on its chunks with it.
+    release_chunks(store, manifest, manifest_len);
+    manifest = NULL;
+  }
+  free(manifest);
+
+  if (error) {
+    close(new_fd);
+    unlink(temp_path);
+    return -1;
+  }
+  return new_fd;
+}
+
+// Rewrite a note written in an older format in the current one, keeping its revision.
+// Returns a file descriptor for the new note or `-1` on error, printing issues.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `fd`: the old note file, locked for writing
+// `note_name`: the name of the note file
+// `file_path`: path of the note file
+static int convert_note(const unsigned char *key, const char *folder_name, int fd, const char *note_name,
+    const char *file_path) {
+  char store[PATH_MAX];
+  struct chunk_options options;
+  if (note_options(folder_name, store, &options)) {
+    return -1;
+  }
+  // Notes from before chunked notes have no revision.
+  struct note_header header = {0};
+  int error = note_format(fd) == NOTE_FORMAT_LEGACY ? 0 : read_note_header(fd, key, &header);
+  struct content_buffer content = {0};
+  if (!error) {
+    error = read_note_content(fd, key, 0, 0, collect_content, &content, &options);
+  }
+  if (error) {
+    report_error("Note %s could not be read: %s\n", note_name + sizeof(char), note_error_string(error));
+    if (content.data != NULL) {
+      OPENSSL_cleanse(content.data, content.len);
+    }
+    free(content.data);
+    return -1;
+  }
+
+  int new_fd = replace_note_file(key, folder_name, note_name, fd, file_path, content.data, content.len,
+      header.revision);
+  OPENSSL_cleanse(content.data, content.len);
+  free(content.data);
+  return new_fd;
+}
+
+// Check if a note format is one this version reads but no longer writes.
+//
+// `format`: the format, from `note_format`
+static int is_older_format(int format) {
+  return format == NOTE_FORMAT_LEGACY || format == NOTE_FORMAT_UNBOUND;
+}
+
+// Bring a note written in an older format up to the current one.
+// The note is locked for writing while it is rewritten, and its content and revision
+// are kept. A note in the current format is only checked.
+// Returns `1` if the note was upgraded, `0` if it was current already, printing issues
+// and returning `-1` otherwise.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+int upgrade_note(const unsigned char *key, const char *folder_name, const char *note_name) {
+  char file_path[PATH_MAX];
+  char journal_path[PATH_MAX];
+  if (journal_file_path(folder_name, note_name, journal_path)) {
+    return -1;
+  }
+  int fd = open_note_file(folder_name, note_name, file_path, 1);
+  if (fd < 0) {
+    return -1;
+  }
+  if (replay_journal(key, fd, note_name, journal_path)) {
+    close(fd);
+    return -1;
+  }
+
+  // Checked again under the lock, in case another process upgraded it first.
+  int result = 0;
+  if (is_older_format(note_format(fd))) {
+    int new_fd = convert_note(key, folder_name, fd, note_name, file_path);
+    result = new_fd < 0 ? -1 : 1;
+    if (new_fd >= 0) {
+      close(new_fd);
+    }
+  }
+  close(fd);
+  return result;
+}
+
+// Open a note for reading, first upgrading it if it is in an older format.
+// Old notes are upgraded the first time they are read, so a notebook moves to the
+// current format as it is used. If a note can't be upgraded, i.e. in a read-only
+// notebook, it is opened as it is.
+// Returns a file descriptor or `-1` on error, printing issues.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `file_path`: A pointer to where the note's path is to be placed, at least `PATH_MAX` long
+int open_current_note(const unsigned char *key, const char *folder_name, const char *note_name, char *file_path) {
+  int fd = open_note_file(folder_name, note_name, file_path, 0);
+  if (fd < 0 || !is_older_format(note_format(fd))) {
+    return fd;
+  }
+
+  // The shared lock has to go before the note can be rewritten.
+  close(fd);
+  int printing = print_errors(0);
+  upgrade_note(key, folder_name, note_name);
+  print_errors(printing);
+  return open_note_file(folder_name, note_name, file_path, 0);
+}
+
+// Read and authenticate the header of a chunked note, with the length of its content.
+// A deduplicated note stores a manifest, so its content length is read from that.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `header`: A pointer to where the header is to be placed
+static int read_content_header(int fd, const unsigned char *key, struct note_header *header) {
+  int error = read_note_header(fd, key, header);
+  if (!error && (header->flags & NOTE_FLAG_DEDUP)) {
+    error = read_note_length(fd, key, &header->length);
+  }
+  return error;
+}
+
+// Add the revision a change is about to make to a note's history.
+// Returns `0` on success or a `NOTE_ERR_*` value, printing issues opening the history.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `fd`: the note file, locked for writing
+// `header`: the note's header, with the length of its content
+// `start`: where the change writes, ignored when replacing
+// `content`: the content the change writes
+// `len`: the content's length
+// `replace`: `1` if the content replaces the note's content, `0` otherwise
+static int save_revision(const unsigned char *key, const char *folder_name, const char *note_name, int fd,
+    const struct note_header *header, unsigned long long start, const unsigned char *content, size_t len,
+    int replace) {
+  char history_path[PATH_MAX];
+  char store[PATH_MAX];
+  struct chunk_options options;
+  if (history_file_path(folder_name, note_name, history_path) || note_options(folder_name, store, &options)) {
+    return NOTE_ERR_IO;
+  }
+  int history_fd = open(history_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (history_fd < 0) {
+    report_errno(history_path);
+    return NOTE_ERR_IO;
+  }
+
+  int error;
+  if (replace) {
+    error = history_add_replace(history_fd, fd, key, header, content, len, &options);
+  } else {
+    error = history_add_edit(history_fd, fd, key, header, start, content, len, &options);
+  }
+  close(history_fd);
+  return error;
+}
+
+// Apply an edit to a deduplicated note by replacing it with the edited content.
+// Only chunks the edit changes are stored again, as the rest are stored already.
+// Returns `0` on success, printing issues and returning a `NOTE_ERR_*` value otherwise.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `fd`: the note file, locked for writing
+// `file_path`: path of the note file
+// `header`: the note's header, with the length of its content
+// `start`: where the edit writes, no further than the end of the content
+// `content`: the content the edit writes
+// `len`: the content's length
+static int replace_dedup_note(const unsigned char *key, const char *folder_name, const char *note_name, int fd,
+    const char *file_path, const struct note_header *header, unsigned long long start, const unsigned char *content,
+    size_t len) {
+  char store[PATH_MAX];
+  struct chunk_options options;
+  if (note_options(folder_name, store, &options)) {
+    return NOTE_ERR_IO;
+  }
+  struct content_buffer edited = {0};
+  int error = start > header->length ? NOTE_ERR_RANGE : read_chunked_note(fd, key, collect_content, &edited, &options);
+
+  // Add what the edit writes past the end, then copy the rest over the old content.
+  size_t overlap = edited.len - start;
+  if (!error && len > overlap && collect_content(&edited, content + overlap, len - overlap)) {
+    error = NOTE_ERR_MEMORY;
+  }
+  if (!error && len) {
+    memcpy(edited.data + start, content, len > overlap ? overlap : len);
+  }
+  if (!error) {
+    error = save_revision(key, folder_name, note_name, fd, header, start, content, len, 0);
+  }
+  if (error) {
+    report_error("Note %s could not be changed: %s\n", note_name + sizeof(char), note_error_string(error));
+  } else {
+    int new_fd = replace_note_file(key, folder_name, note_name, fd, file_path, edited.data, edited.len,
+        header->revision + 1);
+    if (new_fd < 0) {
+      error = NOTE_ERR_IO;
+    } else {
+      close(new_fd);
+    }
+  }
+
+  if (edited.data) {
+    OPENSSL_cleanse(edited.data, edited.capacity);
+    free(edited.data);
+  }
+  return error;
+}
+
+// Change part of a note or add to its end.
+// Only the chunks covering the change are rewritten, and the change is committed
+// atomically, so a crash leaves either the old or the new content. Notes from before
+// chunked notes are converted first.
+// Returns `0` on success, printing issues and returning a `NOTE_ERR_*` value otherwise.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `append`: `1` to add the content to the end of the note, ignoring the offset
+// `offset`: where the content goes, or if negative, how far from the end it goes
+// `content`: the new content
+// `len`: the new content's length
+int edit_note(const unsigned char *key, const char *folder_name, const char *note_name, int append, long long offset,
+    const unsigned char *content, size_t len) {
+  char file_path[PATH_MAX];
+  char journal_path[PATH_MAX];
+  if (journal_file_path(folder_name, note_name, journal_path)) {
+    return -1;
+  }
+  int fd = open_note_file(folder_name, note_name, file_path, 1);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // Finish any edit interrupted by a crash before starting another.
+  if (replay_journal(key, fd, note_name, journal_path)) {
+    close(fd);
+    return -1;
+  }
+
+  if (!is_chunked_note(fd)) {
+    int new_fd = convert_note(key, folder_name, fd, note_name, file_path);
+    close(fd);
+    if (new_fd < 0) {
+      return -1;
+    }
+    fd = new_fd;
+  }
+
+  // Save the revision this edit makes before making it. A revision the note never
+  // reaches is dropped from the history the next time it is read.
+  struct note_header header;
+  int error = read_content_header(fd, key, &header);
+  unsigned long long start = append ? header.length : (unsigned long long) offset;
+  if (!error && !append && offset < 0) {
+    unsigned long long from_end = -(unsigned long long) offset;
+    error = from_end > header.length ? NOTE_ERR_RANGE : 0;
+    start = header.length - from_end;
+  }
+  if (!error) {
+    unsigned long long span = trace_begin();
+    error = save_revision(key, folder_name, note_name, fd, &header, start, content, len, 0);
+    trace_end("save_revision", span);
+  }
+  if (error) {
+    report_error("Note %s could not be changed: %s\n", note_name + sizeof(char), note_error_string(error));
+    close(fd);
+    return error;
+  }
+
+  // Chunks of a deduplicated note are shared, so it is replaced rather than changed in place.
+  if (header.flags & NOTE_FLAG_DEDUP) {
+    error = replace_dedup_note(key, folder_name, note_name, fd, file_path, &header, start, content, len);
+    close(fd);
+    return error;
+  }
+
+  // The journal must be findable after a crash, so its directory entry is flushed too.
+  int journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (journal_fd < 0 || sync_parent(journal_path)) {
+    report_errno(journal_path);
+    if (journal_fd >= 0) {
+      close(journal_fd);
+      unlink(journal_path);
+    }
+    close(fd);
+    return -1;
+  }
+
+  if (append) {
+    error = append_chunked_note(fd, journal_fd, key, content, len);
+  } else {
+    error = write_chunked_range(fd, journal_fd, key, offset, content, len);
+  }
+  close(journal_fd);
+
+  if (error) {
+    report_error("Note %s could not be changed: %s\n", note_name + sizeof(char), note_error_string(error));
+    // Leave the note as it was, or as it was meant to be if the change was committed.
+    replay_journal(key, fd, note_name, journal_path);
+  } else if (unlink(journal_path)) {
+    report_errno(journal_path);
+  }
+
+  unsigned long long span = trace_begin();
+  close(fd);
+  trace_end("close", span);
+  return error;
+}
+
+// Open a note's history for reading.
+// Returns a file descriptor, or `-1` on error, printing issues other than there being no history.
+//
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+static int open_history(const char *folder_name, const char *note_name) {
+  char history_path[PATH_MAX];
+  if (history_file_path(folder_name, note_name, history_path)) {
+    return -1;
+  }
+  int history_fd = open(history_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (history_fd < 0 && errno != ENOENT) {
+    report_errno(history_path);
+  }
+  return history_fd;
+}
+
+// Open a chunked note for reading and read its header.
+// Returns a file descriptor or `-1` on error, printing issues.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `header`: A pointer to where the note's header is to be placed
+static int open_versioned_note(const unsigned char *key, const char *folder_name, const char *note_name,
+    struct note_header *header) {
+  char file_path[PATH_MAX];
+  if (recover_note(key, folder_name, note_name)) {
+    return -1;
+  }
+  int fd = open_note_file(folder_name, note_name, file_path, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int error;
+  if (is_chunked_note(fd)) {
+    error = read_content_header(fd, key, header);
+  } else {
+    // Notes from before chunked notes have never been edited.
+    memset(header, 0, sizeof(struct note_header));
+    error = read_note_length(fd, key, &header->length);
+  }
+  if (error) {
+    report_error("Note %s could not be read: %s\n", note_name + sizeof(char), note_error_string(error));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Print the revisions of a note, oldest first.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+int list_history(const unsigned char *key, const char *folder_name, const char *note_name) {
+  struct note_header header;
+  int fd = open_versioned_note(key, folder_name, note_name, &header);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct note_revision *revisions = NULL;
+  size_t count = 0;
+  int error = 0;
+  int history_fd = open_history(folder_name, note_name);
+  if (history_fd >= 0) {
+    error = read_history(history_fd, key, header.revision, &revisions, &count);
+    close(history_fd);
+  } else if (errno != ENOENT) {
+    error = NOTE_ERR_IO;
+  }
+  close(fd);
+  if (error) {
+    if (error != NOTE_ERR_IO) {
+      report_error("History of note %s could not be read: %s\n", note_name + sizeof(char), note_error_string(error));
+    }
+    return -1;
+  }
+
+  printf("%10s  %-19s  %12s  %s\n", "Revision", "Saved", "Length", "Change");
+  for (size_t i = 0; i < count; ++i) {
+    char saved[32];
+    time_t when = revisions[i].time;
+    struct tm local;
+    if (localtime_r(&when, &local) == NULL || !strftime(saved, sizeof(saved), "%Y-%m-%d %H:%M:%S", &local)) {
+      strcpy(saved, "?");
+    }
+    printf("%10llu  %-19s  %12llu  ", revisions[i].revision, saved, revisions[i].length);
+    if (revisions[i].snapshot) {
+      printf("whole note");
+    } else {
+      printf("%llu bytes at %llu", revisions[i].changed, revisions[i].offset);
+    }
+    printf("%s\n", revisions[i].revision == header.revision ? " (current)" : "");
+  }
+  if (count == 0 || revisions[count - 1].revision != header.revision) {
+    printf("%10llu  %-19s  %12llu  (current)\n", header.revision, "", header.length);
+  }
+  free(revisions);
+  return 0;
+}
+
+// Decrypt and print a note as it was at an earlier revision.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `revision`: the revision to print
+int read_revision(const unsigned char *key, const char *folder_name, const char *note_name,
+    unsigned long long revision) {
+  struct note_header header;
+  int fd = open_versioned_note(key, folder_name, note_name, &header);
+  if (fd < 0) {
+    return -1;
+  }
+
+  char store[PATH_MAX];
+  struct chunk_options options;
+  int error = note_options(folder_name, store, &options) ? NOTE_ERR_IO : NOTE_ERR_REVISION;
+  if (error == NOTE_ERR_REVISION && revision == header.revision) {
+    // The current revision is the note itself.
+    if (is_chunked_note(fd)) {
+      error = read_chunked_note(fd, key, write_stdout, NULL, &options);
+    } else {
+      error = read_legacy_range(fd, key, 0, 0, write_stdout, NULL);
+    }
+  } else if (error == NOTE_ERR_REVISION && revision < header.revision) {
+    int history_fd = open_history(folder_name, note_name);
+    unsigned char *content = NULL;
+    size_t len = 0;
+    if (history_fd >= 0) {
+      error = history_content(history_fd, key, header.revision, revision, &content, &len);
+      close(history_fd);
+    }
+    if (!error && fwrite(content, 1, len, stdout) != len) {
+      error = NOTE_ERR_SINK;
+    }
+    if (content) {
+      OPENSSL_cleanse(content, len);
+      free(content);
+    }
+  }
+  close(fd);
+
+  if (error) {
+    fflush(stdout);
+    report_error("Revision %llu of note %s could not be read: %s\n", revision, note_name + sizeof(char),
+        note_error_string(error));
+    return -1;
+  }
+  return 0;
+}
+
+// Bring back a note's content from an earlier revision.
+// The restored content becomes a new revision, so the restore can be undone too.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `revision`: the revision to restore
+int restore_note(const unsigned char *key, const char *folder_name, const char *note_name,
+    unsigned long long revision) {
+  char file_path[PATH_MAX];
+  char journal_path[PATH_MAX];
+  if (journal_file_path(folder_name, note_name, journal_path)) {
+    return -1;
+  }
+  int fd = open_note_file(folder_name, note_name, file_path, 1);
+  if (fd < 0) {
+    return -1;
+  }
+  if (replay_journal(key, fd, note_name, journal_path)) {
+    close(fd);
+    return -1;
+  }
+
+  // Only chunked notes have been edited, so only they have earlier revisions.
+  struct note_header header;
+  int error = is_chunked_note(fd) ? read_content_header(fd, key, &header) : NOTE_ERR_REVISION;
+  if (!error && revision >= header.revision) {
+    error = NOTE_ERR_REVISION;
+  }
+
+  unsigned char *content = NULL;
+  size_t len = 0;
+  if (!error) {
+    int history_fd = open_history(folder_name, note_name);
+    if (history_fd < 0) {
+      error = errno == ENOENT ? NOTE_ERR_REVISION : NOTE_ERR_IO;
+    } else {
+      error = history_content(history_fd, key, header.revision, revision, &content, &len);
+      close(history_fd);
+    }
+  }
+  if (!error) {
+    error = save_revision(key, folder_name, note_name, fd, &header, 0, content, len, 1);
+  }
+  if (error) {
+    report_error("Note %s could not be restored: %s\n", note_name + sizeof(char), note_error_string(error));
+  } else {
+    int new_fd = replace_note_file(key, folder_name, note_name, fd, file_path, content, len, header.revision + 1);
+    if (new_fd < 0) {
+      error = NOTE_ERR_IO;
+    } else {
+      close(new_fd);
+    }
+  }
+
+  if (content) {
+    OPENSSL_cleanse(content, len);
+    free(content);
+  }
+  close(fd);
+  return error ? -1 : 0;
 }
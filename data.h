@@ -1,15 +1,160 @@
 #ifndef DATA_H
 #define DATA_H 1
 
+#include <stddef.h>
+#include "cache.h"
+
 // Define max notes.
 // This only comes into play when adding notes; extra notes on disk are supported.
-#define MAX_NOTES 99
+#define MAX_NOTES 100000000
+
+// Default locations of the notes directory and the login file, relative to the
+// directory notes is run in.
+#define NOTEBOOK_FOLDER ".notebook"
+#define LOGIN_FILE ".login"
+
+// Name of the notebook configuration file in the notes directory.
+#define CONFIG_FILE ".config"
+
+// Suffix of the journal used to commit an edit to a note, i.e. `.12.journal` in the
+// notes directory. A journal only outlives its edit if the edit was interrupted.
+#define JOURNAL_SUFFIX ".journal"
+
+// Suffix of the revision history of a note, i.e. `.12.history` in the notes directory.
+#define HISTORY_SUFFIX ".history"
+
+// Suffix of the file a note is rewritten to when its whole content is replaced, i.e. when
+// converted to the chunked format or restored to an earlier revision.
+#define CONVERT_SUFFIX ".convert"
+
+// Maximum levels of shard directories. Each level fans out to 256 directories,
+// so 2 levels keep directories small up to tens of millions of notes.
+#define MAX_SHARD_DEPTH 2
+
+// Notebook settings stored in the configuration file.
+struct notebook_config {
+  // Levels of shard directories notes are stored in, or `0` for a flat notebook.
+  int shard_depth;
+  // `1` to store new note content deduplicated in the chunk store.
+  int dedup;
+};
+
+// IDs a writer tries past the highest it has seen taken before reading the notes
+// directory again, i.e. while other writers keep taking them first.
+#define CLAIM_HINT_ATTEMPTS 64
+
+// Size of the buffers directory entries are read into when scanning for notes.
+#define SCAN_BUFFER_SIZE 262144
+
+// Size of the buffer used to write note listings.
+#define LIST_BUFFER_SIZE 65536
+
+// Most files a thread unlinks at a time when deleting notes in bulk.
+#define DELETE_BATCH_SIZE 256
+
+// Most threads unlinking files when deleting notes in bulk.
+#define MAX_DELETE_JOBS 64
+
+// An inclusive range of note IDs.
+struct id_range {
+  unsigned long first;
+  unsigned long last;
+};
+
+// A compact set of numeric note IDs.
+struct note_ids {
+  unsigned long *ids;
+  size_t count;
+  size_t capacity;
+};
+
+// Options for listing notes.
+struct list_options {
+  // The lowest note ID to list.
+  unsigned long from;
+  // The maximum number of notes to list, or `0` for no limit.
+  unsigned long limit;
+  // Called between pages of terminal output. Return `0` to stop listing.
+  // If `NULL`, output is not paged.
+  int (*more)(unsigned long remaining);
+  // Called with the IDs listed, in order, once listing is done, or `NULL`.
+  void (*listed)(const unsigned long *ids, size_t count);
+};
 
 // List notes in a folder.
+// Returns the number of notes listed.
 //
 // `folder_name`: path of directory containing note files
 int list_notes(const char *folder_name);
 
+// List notes in a folder in numeric order.
+// If stdout is a terminal, notes are printed in columns and paged. Otherwise, one per line.
+// Returns the number of notes listed or `-1` on error.
+//
+// `folder_name`: path of directory containing note files
+// `options`: range and paging options
+long list_notes_paged(const char *folder_name, const struct list_options *options);
+
+// Parse a note ID from a file name.
+// Returns the ID or `0` if the file name is not a note name or is too large.
+//
+// `file_name`: the name to parse
+unsigned long parse_note_id(const char *file_name);
+
+// Parse a note ID from a name of known length, by the same rules as `parse_note_id`.
+// Returns the ID or `0` if the name is not a note name or is too large.
+//
+// `name`: the name to parse
+// `len`: the name's length
+unsigned long parse_entry_id(const char *name, size_t len);
+
+// Check if a file name is a shard directory name: 2 lowercase hex digits.
+//
+// `file_name`: the name to check
+int is_shard_name(const char *file_name);
+
+// Collect the IDs of all notes in a folder. IDs are not sorted.
+// Returns the number of IDs collected or `-1` on error. A missing folder has no notes.
+//
+// `folder_name`: path of directory containing note files
+// `result`: the set to append IDs to
+long scan_note_ids(const char *folder_name, struct note_ids *result);
+
+// Get the sorted IDs of all notes in a folder, without duplicates.
+// The folder is scanned once and the result shared. Later calls only check that the
+// folder and its shard directories haven't changed, rather than reading them again.
+// Returns the number of IDs or `-1` on error. A missing folder has no notes.
+// Note: The IDs must be freed!
+//
+// `folder_name`: path of directory containing note files
+// `result`: the empty set to place IDs in
+long load_note_ids(const char *folder_name, struct note_ids *result);
+
+// Add an ID to a set of note IDs, growing it if necessary.
+// Returns `0` on success or `-1` if memory could not be allocated.
+//
+// `set`: the set to add to
+// `id`: the ID to add
+int add_note_id(struct note_ids *set, unsigned long id);
+
+// Remove duplicate IDs from sorted note IDs.
+// Returns the number of unique IDs.
+//
+// `ids`: the sorted IDs
+// `count`: the number of IDs
+size_t unique_note_ids(unsigned long *ids, size_t count);
+
+// Sort note IDs numerically.
+//
+// `ids`: the IDs to sort
+// `count`: the number of IDs
+void sort_note_ids(unsigned long *ids, size_t count);
+
+// Free memory used by a set of note IDs.
+//
+// `set`: the set to free
+void free_note_ids(struct note_ids *set);
+
 // Check if a file name is a note name.
 //
 // `file_name`: the name to check
@@ -37,6 +182,142 @@ int next_file_name(const char *folder_name);
 // `result`: A pointer to where the result is to be placed
 void combined_path(const char *dir, const char *entry_name, char *result);
 
+// Combine a directory and a file name into a file path, checking lengths first.
+// Returns `0` on success, printing issues and returning `-1` if the path is too long.
+//
+// `dir`: the path of the base directory
+// `entry_name`: the name of the file in the directory
+// `result`: A pointer to where the result is to be placed, at least `PATH_MAX` long
+int checked_path(const char *dir, const char *entry_name, char *result);
+
+// Read the notebook configuration. Missing files and settings use defaults.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `config`: A pointer to where the configuration is to be placed
+int read_config(const char *folder_name, struct notebook_config *config);
+
+// Write the notebook configuration, replacing any existing configuration atomically.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `config`: the configuration to write
+int write_config(const char *folder_name, const struct notebook_config *config);
+
+// Get the path of a note file in a given layout.
+// Notes in a sharded layout are stored as `<folder>/ab/cd/.<id>`, with shards derived from the ID.
+// Returns `0` on success, printing issues and returning `-1` if the path is too long.
+//
+// `folder_name`: path of directory containing note files
+// `depth`: the number of shard directory levels
+// `id`: the note ID
+// `result`: A pointer to where the result is to be placed, at least `PATH_MAX` long
+int note_path(const char *folder_name, int depth, unsigned long id, char *result);
+
+// Get the path of a note file that may already exist.
+// Other layouts are checked if the note is not in the configured layout.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `config`: the notebook configuration
+// `id`: the note ID
+// `result`: A pointer to where the result is to be placed, at least `PATH_MAX` long
+int find_note_path(const char *folder_name, const struct notebook_config *config, unsigned long id, char *result);
+
+// Get the path of an existing note file from its name.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `result`: A pointer to where the result is to be placed, at least `PATH_MAX` long
+int note_file_path(const char *folder_name, const char *note_name, char *result);
+
+// Create the shard directories for a note, if they don't exist.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `depth`: the number of shard directory levels
+// `id`: the note ID
+int make_shard_dirs(const char *folder_name, int depth, unsigned long id);
+
+// Claim an unused note ID by exclusively creating its file.
+// Safe for concurrent writers: each ID is only ever claimed by one of them. Each process
+// claims upward from the highest ID it has seen taken, so IDs freed by deletes are only
+// reused once the notes directory is read again.
+// Returns a file descriptor open for writing the new, empty note, or `-1` on error.
+// If no IDs up to `MAX_NOTES` are free, `errno` is set to `ENOSPC`. Other issues are printed.
+//
+// `folder_name`: path of directory containing note files
+// `config`: the notebook configuration
+// `id`: A pointer to where the claimed ID is to be placed
+// `file_path`: A pointer to where the note's path is to be placed, at least `PATH_MAX` long
+int claim_note(const char *folder_name, const struct notebook_config *config, unsigned long *id, char *file_path);
+
+// Move all notes in a notebook to a new layout while it remains in use.
+// Returns the number of notes moved or `-1` on error, printing issues.
+//
+// `folder_name`: path of directory containing note files
+// `depth`: the number of shard directory levels to use
+long migrate_layout(const char *folder_name, int depth);
+
+// Turn printing of problems on or off for the calling thread.
+// Returns the previous setting.
+//
+// `enabled`: `1` to print problems, `0` to only return them
+int print_errors(int enabled);
+
+// Lock a whole open file, waiting while another process or thread holds a conflicting lock.
+// The lock belongs to this open file, so threads of one process exclude each other too,
+// and closing another descriptor for the same file doesn't release it.
+// Returns `0` on success or `-1` on error.
+//
+// `fd`: the open file
+// `writable`: `1` for an exclusive lock, `0` for a shared one
+int lock_file(int fd, int writable);
+
+// Lock a whole open file like `lock_file`, without waiting.
+// Returns `0` on success, `1` if another process or thread holds a conflicting lock, or
+// `-1` on error.
+//
+// `fd`: the open file
+// `writable`: `1` for an exclusive lock, `0` for a shared one
+int try_lock_file(int fd, int writable);
+
+// Claim the next free ID for a new note and lock its file, so readers wait for the
+// note to be written rather than see part of it.
+// Returns a file descriptor for the empty note, printing issues and returning `-1`
+// otherwise, i.e. with `errno` set to `ENOSPC` if every ID is taken.
+//
+// `folder_name`: path of directory containing note files
+// `id`: A pointer to where the new note's ID is to be placed
+// `file_path`: A pointer to where the note's path is to be placed, at least `PATH_MAX` long
+int reserve_note(const char *folder_name, unsigned long *id, char *file_path);
+
+// Encrypt content into a note claimed by `reserve_note`, then close it.
+// A note that can't be written is removed, so no one reads an empty note.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `fd`: the reserved note, locked for writing
+// `file_path`: path of the note file
+// `content`: the plaintext note content
+// `len`: the content's length
+int write_reserved_note(const unsigned char *key, const char *folder_name, int fd, const char *file_path,
+    const unsigned char *content, size_t len);
+
+// Encrypt and save a new note at the next free ID.
+// Returns `0` on success, printing issues and returning a `NOTE_ERR_*` value otherwise.
+// For `NOTE_ERR_IO`, `errno` is `ENOSPC` if every ID is taken.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `content`: the plaintext note content
+// `len`: the content's length
+// `id`: A pointer to where the new note's ID is to be placed
+int create_note(const unsigned char *key, const char *folder_name, const unsigned char *content, size_t len,
+    unsigned long *id);
+
 // Encrypt and save a new note.
 //
 // `key`: the key to use for encryption
@@ -44,11 +325,189 @@ void combined_path(const char *dir, const char *entry_name, char *result);
 // `input`: the plaintext note content
 void add_note(const unsigned char *key, const char *folder_name, const char *input);
 
+// Delete a note, along with its history and any journal left by an interrupted edit.
+// Chunks a deduplicated note held that no other note uses are removed too.
+// Returns `0` on success, printing issues and returning `-1` otherwise, i.e. with
+// `errno` set to `ENOENT` if there is no such note.
+//
+// `key`: the key to use for decryption, or `NULL` to leave stored chunks as they are
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+int delete_note(const unsigned char *key, const char *folder_name, const char *note_name);
+
+// Parse a list of note IDs and ranges of them, such as `1-5000,7000`.
+// Ranges are sorted and those that overlap or touch are merged.
+// Note: Allocates memory to store result.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `spec`: comma separated IDs and inclusive ranges of IDs
+// `ranges`: A pointer to where the ranges are to be placed
+// `count`: A pointer to where the number of ranges is to be placed
+int parse_id_ranges(const char *spec, struct id_range **ranges, size_t *count);
+
+// Delete every note with an ID in a set of ranges, along with their journals and histories.
+// The folder and its shard directories are each read once and held open, and files are
+// unlinked relative to them, so a bulk delete costs one directory pass rather than a path
+// lookup per ID. IDs without a note are skipped.
+// Chunks deduplicated notes held that no other note uses are removed too.
+// Returns the number of notes deleted, printing issues and returning `-1` if any file
+// could not be deleted.
+//
+// `key`: the key to use for decryption, or `NULL` to leave stored chunks as they are
+// `folder_name`: path of directory containing note files
+// `ranges`: sorted IDs of notes to delete, as from `parse_id_ranges`
+// `count`: the number of ranges
+// `jobs`: the number of threads unlinking files, or `0` for one
+long delete_notes(const unsigned char *key, const char *folder_name, const struct id_range *ranges, size_t count,
+    unsigned int jobs);
+
+// Decrypt a note, passing its content to a sink, and keep it in a cache.
+// A note that is cached and unchanged since is not read or decrypted again.
+// Returns `0` on success, `NOTE_ERR_IO` with `errno` set if the note can't be opened,
+// or another `NOTE_ERR_*` value.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `cache`: the cache of decrypted notes, or `NULL` to not use one
+// `sink`: where to send decrypted content, or `NULL` to only fill the cache
+// `arg`: passed to the sink
+int load_note(const unsigned char *key, const char *folder_name, const char *note_name, struct note_cache *cache,
+    note_sink sink, void *arg);
+
+// Write decrypted note content to stdout.
+// Returns `0` on success or `-1` on error.
+//
+// `arg`: unused
+// `content`: the content to write
+// `len`: the content's length
+int write_stdout(void *arg, const unsigned char *content, size_t len);
+
 // Decrypt and print a new note.
+// Notes viewed before in the session are printed from the cache.
 //
 // `key`: the key to use for decryption
 // `folder_name`: path of directory containing note files
 // `input`: the name of the note file
-void read_note(const unsigned char *key, const char *folder_name, const char *input);
+// `cache`: the cache of decrypted notes, or `NULL` to not use one
+void read_note(const unsigned char *key, const char *folder_name, const char *input, struct note_cache *cache);
+
+// Open an existing note file and lock it.
+// Readers share the lock, and a writer holds it alone, so no one reads a note while an
+// edit is being applied to it.
+// Returns a file descriptor or `-1` on error, printing issues.
+//
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `file_path`: A pointer to where the note's path is to be placed, at least `PATH_MAX` long
+// `writable`: `1` to open the note for editing, `0` for reading
+int open_note_file(const char *folder_name, const char *note_name, char *file_path, int writable);
+
+// Get the path of the journal used to edit a note.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `result`: A pointer to where the journal's path is to be placed, at least `PATH_MAX` long
+int journal_file_path(const char *folder_name, const char *note_name, char *result);
+
+// Get the path of the revision history of a note.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `result`: A pointer to where the history's path is to be placed, at least `PATH_MAX` long
+int history_file_path(const char *folder_name, const char *note_name, char *result);
+
+// Bring a note written in an older format up to the current one.
+// The note is locked for writing while it is rewritten, and its content and revision
+// are kept. A note in the current format is only checked.
+// Returns `1` if the note was upgraded, `0` if it was current already, printing issues
+// and returning `-1` otherwise.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+int upgrade_note(const unsigned char *key, const char *folder_name, const char *note_name);
+
+// Open a note for reading, first upgrading it if it is in an older format.
+// Old notes are upgraded the first time they are read, so a notebook moves to the
+// current format as it is used. If a note can't be upgraded, i.e. in a read-only
+// notebook, it is opened as it is.
+// Returns a file descriptor or `-1` on error, printing issues.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `file_path`: A pointer to where the note's path is to be placed, at least `PATH_MAX` long
+int open_current_note(const unsigned char *key, const char *folder_name, const char *note_name, char *file_path);
+
+// Finish or roll back an edit to a note that was interrupted by a crash, if any.
+// This is a single check when there is nothing to recover.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+int recover_note(const unsigned char *key, const char *folder_name, const char *note_name);
+
+// Decrypt and print part of a note.
+// Only the part of the note covering the range is read and decrypted, so reading the
+// end of a large note is as fast as reading the end of a small one.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `offset`: the first byte to print, or if negative, how far from the end to start printing
+// `length`: the number of bytes to print, or `0` to print to the end
+int read_note_range(const unsigned char *key, const char *folder_name, const char *note_name, long long offset,
+    unsigned long long length);
+
+// Change part of a note or add to its end.
+// Only the chunks covering the change are rewritten, and the change is committed
+// atomically, so a crash leaves either the old or the new content. Notes from before
+// chunked notes are converted first.
+// The note's revision before the change is kept in its history.
+// Returns `0` on success, printing issues and returning a `NOTE_ERR_*` value otherwise.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `append`: `1` to add the content to the end of the note, ignoring the offset
+// `offset`: where the content goes, or if negative, how far from the end it goes
+// `content`: the new content
+// `len`: the new content's length
+int edit_note(const unsigned char *key, const char *folder_name, const char *note_name, int append, long long offset,
+    const unsigned char *content, size_t len);
+
+// Print the revisions of a note, oldest first.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+int list_history(const unsigned char *key, const char *folder_name, const char *note_name);
+
+// Decrypt and print a note as it was at an earlier revision.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `revision`: the revision to print
+int read_revision(const unsigned char *key, const char *folder_name, const char *note_name,
+    unsigned long long revision);
+
+// Bring back a note's content from an earlier revision.
+// The restored content becomes a new revision, so the restore can be undone too.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `key`: the key to use for encryption
+// `folder_name`: path of directory containing note files
+// `note_name`: the name of the note file
+// `revision`: the revision to restore
+int restore_note(const unsigned char *key, const char *folder_name, const char *note_name,
+    unsigned long long revision);
 
 #endif
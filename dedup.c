@@ -0,0 +1,476 @@
+// Resources used:
+// https://www.usenix.org/conference/atc16/technical-sessions/presentation/xia (FastCDC)
+// https://man7.org/linux/man-pages/man2/fcntl.2.html (Open file description locks)
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include "security.h"
+#include "notefile.h"
+#include "dedup.h"
+
+// Label the chunk ID key is derived under, so it is never the notebook key itself.
+#define DEDUP_KEY_LABEL "notes chunk id"
+
+// Boundaries are taken from the high bits of the rolling hash, which depend on the most bytes.
+#define DEDUP_MASK ((((unsigned long long) 1 << DEDUP_AVERAGE_BITS) - 1) << (64 - DEDUP_AVERAGE_BITS))
+
+// Keys for splitting and naming chunks, derived from the notebook key.
+struct dedup_keys {
+  unsigned char id_key[SHA256_DIGEST_LENGTH];
+  // Byte values of the rolling hash. Keyed too, so chunk sizes don't hint at content.
+  unsigned long long gear[256];
+};
+
+// Derive the keys for splitting and naming chunks.
+// Returns `0` on success or `NOTE_ERR_MEMORY`.
+static int derive_keys(const unsigned char *key, struct dedup_keys *keys) {
+  unsigned int len = 0;
+  if (HMAC(sha256_digest(), key, KEY_SIZE, (const unsigned char *) DEDUP_KEY_LABEL, strlen(DEDUP_KEY_LABEL),
+      keys->id_key, &len) == NULL) {
+    return NOTE_ERR_MEMORY;
+  }
+
+  // SplitMix64, seeded from the ID key.
+  unsigned long long state = get_le(keys->id_key, 8);
+  for (int i = 0; i < 256; ++i) {
+    unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    keys->gear[i] = z ^ (z >> 31);
+  }
+  return 0;
+}
+
+// Find the end of the next chunk with a gear rolling hash.
+// Returns the length of the chunk.
+static size_t next_boundary(const struct dedup_keys *keys, const unsigned char *content, size_t len) {
+  if (len <= DEDUP_MIN_CHUNK) {
+    return len;
+  }
+  size_t limit = len < DEDUP_MAX_CHUNK ? len : DEDUP_MAX_CHUNK;
+  unsigned long long hash = 0;
+  for (size_t i = DEDUP_MIN_CHUNK; i < limit; ++i) {
+    hash = (hash << 1) + keys->gear[content[i]];
+    if (!(hash & DEDUP_MASK)) {
+      return i + 1;
+    }
+  }
+  return limit;
+}
+
+// Get the path of a stored chunk, i.e. `.chunks/ab/ab12...`.
+// Returns `0` on success or `-1` if the path is too long.
+//
+// `store`: path of the chunk store
+// `id`: the chunk ID
+// `result`: A pointer to where the path is to be placed, at least `PATH_MAX` long
+// `dir_only`: `1` for the path of the directory holding the chunk
+static int chunk_path(const char *store, const unsigned char id[CHUNK_ID_SIZE], char *result, int dir_only) {
+  char hex[CHUNK_ID_SIZE * 2 + 1];
+  for (int i = 0; i < CHUNK_ID_SIZE; ++i) {
+    sprintf(hex + 2 * i, "%02x", id[i]);
+  }
+  int len = dir_only ? snprintf(result, PATH_MAX, "%s/%.2s", store, hex)
+      : snprintf(result, PATH_MAX, "%s/%.2s/%s", store, hex, hex);
+  return len >= PATH_MAX ? -1 : 0;
+}
+
+// Check if a file name is the name of a stored chunk: its ID in lowercase hex.
+//
+// `file_name`: the name to check
+int is_chunk_name(const char *file_name) {
+  for (int i = 0; i < CHUNK_ID_SIZE * 2; ++i) {
+    if (!isdigit(file_name[i]) && (file_name[i] < 'a' || 'f' < file_name[i])) {
+      return 0;
+    }
+  }
+  return file_name[CHUNK_ID_SIZE * 2] == '\0';
+}
+
+// Lock a stored chunk for changing its reference count.
+// Locks belong to the open file rather than the process, so threads exclude each other too.
+// Returns `0` on success or `-1` on error.
+static int lock_chunk(int fd) {
+  struct flock lock = {0};
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  while (fcntl(fd, F_OFD_SETLKW, &lock)) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Flush a directory's entries to disk.
+// Returns `0` on success or `-1` on error.
+//
+// `path`: path of the directory
+// `parent`: `1` to flush the directory holding it instead
+static int sync_dir(const char *path, int parent) {
+  char dir_path[PATH_MAX];
+  strcpy(dir_path, path);
+  char *slash = strrchr(dir_path, '/');
+  if (parent) {
+    if (slash == NULL) {
+      strcpy(dir_path, ".");
+    } else {
+      *slash = '\0';
+    }
+  }
+  int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  int result = fsync(fd);
+  close(fd);
+  return result;
+}
+
+// Add a reference to a stored chunk.
+// The new count is on disk before this returns, so a note written after it can't be left
+// counting on a reference a crash took away.
+// Returns `0` on success, `1` if the chunk is not stored, or a `NOTE_ERR_*` value.
+static int reference_chunk(const char *path) {
+  int fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return errno == ENOENT ? 1 : NOTE_ERR_IO;
+  }
+
+  // A chunk released while waiting for the lock is gone, even though it is open here.
+  struct stat st;
+  unsigned char count[8];
+  int error = lock_chunk(fd) || fstat(fd, &st) ? NOTE_ERR_IO : 0;
+  if (!error && st.st_nlink == 0) {
+    close(fd);
+    return 1;
+  }
+  if (!error) {
+    error = read_at(fd, count, sizeof(count), 8);
+  }
+  if (!error) {
+    put_le(count, get_le(count, 8) + 1, 8);
+    error = write_at(fd, count, sizeof(count), 8);
+  }
+  if (!error && fdatasync(fd)) {
+    error = NOTE_ERR_IO;
+  }
+  close(fd);
+  return error;
+}
+
+// Encrypt a chunk and store it with one reference, unless another writer stores it first.
+// The chunk is written beside its final path and linked into place, so it is complete
+// once it can be seen. Its content and its link are on disk before this returns.
+// Returns `0` on success, `1` if the chunk was stored already, or a `NOTE_ERR_*` value.
+static int create_chunk(const char *store, const char *path, const unsigned char *key,
+    const unsigned char id[CHUNK_ID_SIZE], const unsigned char *content, size_t len) {
+  char dir[PATH_MAX];
+  char temp_path[PATH_MAX];
+  if (chunk_path(store, id, dir, 1)
+      || snprintf(temp_path, PATH_MAX, "%s.%d.%d.tmp", path, (int) getpid(), (int) gettid()) >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return NOTE_ERR_IO;
+  }
+  // New directories must be on disk too, or the chunk could be lost with them.
+  int made_store = !mkdir(store, S_IRUSR | S_IWUSR | S_IXUSR);
+  if ((!made_store && errno != EEXIST) || (made_store && sync_dir(store, 1))) {
+    return NOTE_ERR_IO;
+  }
+  int made_dir = !mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+  if ((!made_dir && errno != EEXIST) || (made_dir && sync_dir(store, 0))) {
+    return NOTE_ERR_IO;
+  }
+
+  size_t size = CHUNK_HEADER_SIZE + NONCE_SIZE + len + TAG_SIZE;
+  unsigned char *buf = malloc(size);
+  EVP_CIPHER_CTX *context = aead_context(key, 1);
+  int error = buf == NULL || context == NULL ? NOTE_ERR_MEMORY : 0;
+  if (!error) {
+    memcpy(buf, CHUNK_MAGIC, 8);
+    put_le(buf + 8, 1, 8);
+    generate_nonce(buf + CHUNK_HEADER_SIZE);
+    unsigned char *ciphertext = buf + CHUNK_HEADER_SIZE + NONCE_SIZE;
+    if (!aead_seal(context, buf + CHUNK_HEADER_SIZE, id, CHUNK_ID_SIZE, content, len, ciphertext, ciphertext + len)) {
+      error = NOTE_ERR_CHUNK;
+    }
+  }
+  EVP_CIPHER_CTX_free(context);
+
+  if (!error) {
+    int fd = open(temp_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    error = fd < 0 ? NOTE_ERR_IO : write_at(fd, buf, size, 0);
+    if (!error && fdatasync(fd)) {
+      error = NOTE_ERR_IO;
+    }
+    if (fd >= 0 && close(fd) && !error) {
+      error = NOTE_ERR_IO;
+    }
+    // Linking never replaces a chunk another writer stored first.
+    if (!error && link(temp_path, path)) {
+      error = errno == EEXIST ? 1 : NOTE_ERR_IO;
+    }
+    int saved_errno = errno;
+    unlink(temp_path);
+    // A chunk another writer linked first is flushed too, as this writer is about to use it.
+    if (error >= 0 && sync_dir(dir, 0)) {
+      saved_errno = errno;
+      error = NOTE_ERR_IO;
+    }
+    errno = saved_errno;
+  }
+  free(buf);
+  return error;
+}
+
+// Split content into chunks and store each one not stored already, adding a reference
+// to each chunk used. Chunks are named by a keyed hash, so only the key's holder can tell
+// which content they hold, and encrypted like notes.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+// Note: The manifest must be freed!
+//
+// `store`: path of the chunk store
+// `key`: the notebook key
+// `content`: the content to store
+// `len`: the content's length
+// `manifest`: A pointer to where the manifest is to be placed
+// `manifest_len`: A pointer to where the manifest's length is to be placed
+int dedup_store(const char *store, const unsigned char *key, const unsigned char *content, size_t len,
+    unsigned char **manifest, size_t *manifest_len) {
+  *manifest = NULL;
+  *manifest_len = 0;
+  struct dedup_keys keys;
+  if (derive_keys(key, &keys)) {
+    return NOTE_ERR_MEMORY;
+  }
+
+  // Every chunk but the last is at least the minimum size.
+  size_t capacity = DEDUP_MANIFEST_HEADER + (len / DEDUP_MIN_CHUNK + 1) * DEDUP_ENTRY_SIZE;
+  unsigned char *entries = malloc(capacity);
+  if (entries == NULL) {
+    OPENSSL_cleanse(&keys, sizeof(keys));
+    return NOTE_ERR_MEMORY;
+  }
+  put_le(entries, len, 8);
+  size_t used = DEDUP_MANIFEST_HEADER;
+
+  int error = 0;
+  size_t done = 0;
+  while (!error && done < len) {
+    size_t chunk_len = next_boundary(&keys, content + done, len - done);
+    unsigned char *entry = entries + used;
+    unsigned int id_len = 0;
+    if (HMAC(sha256_digest(), keys.id_key, sizeof(keys.id_key), content + done, chunk_len, entry, &id_len) == NULL) {
+      error = NOTE_ERR_MEMORY;
+      break;
+    }
+    put_le(entry + CHUNK_ID_SIZE, chunk_len, 4);
+
+    // Add a reference to a stored chunk, or store it. Either may race with another
+    // writer storing or releasing the same chunk, so try again until one succeeds.
+    char path[PATH_MAX];
+    if (chunk_path(store, entry, path, 0)) {
+      errno = ENAMETOOLONG;
+      error = NOTE_ERR_IO;
+      break;
+    }
+    int result = 1;
+    for (int attempt = 0; result == 1 && attempt < 10; ++attempt) {
+      result = reference_chunk(path);
+      if (result == 1) {
+        result = create_chunk(store, path, key, entry, content + done, chunk_len);
+      }
+    }
+    if (result) {
+      error = result == 1 ? NOTE_ERR_IO : result;
+      if (result == 1) {
+        errno = EBUSY;
+      }
+      break;
+    }
+    used += DEDUP_ENTRY_SIZE;
+    done += chunk_len;
+  }
+  OPENSSL_cleanse(&keys, sizeof(keys));
+
+  if (error) {
+    // Chunks referenced so far would otherwise be kept forever.
+    dedup_release(store, entries, used);
+    free(entries);
+    return error;
+  }
+  *manifest = entries;
+  *manifest_len = used;
+  return 0;
+}
+
+// Get the content length a manifest describes.
+// Returns `0` on success or `NOTE_ERR_HEADER` if the manifest is damaged.
+//
+// `manifest`: the manifest
+// `manifest_len`: the manifest's length
+// `length`: A pointer to where the content length is to be placed
+int dedup_length(const unsigned char *manifest, size_t manifest_len, unsigned long long *length) {
+  if (manifest_len < DEDUP_MANIFEST_HEADER || (manifest_len - DEDUP_MANIFEST_HEADER) % DEDUP_ENTRY_SIZE) {
+    return NOTE_ERR_HEADER;
+  }
+  *length = get_le(manifest, 8);
+  return 0;
+}
+
+// Read and decrypt a stored chunk.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+static int read_chunk(const char *store, const unsigned char *entry,
+    unsigned char *ciphertext, unsigned char *content, EVP_CIPHER_CTX *context) {
+  size_t len = get_le(entry + CHUNK_ID_SIZE, 4);
+  char path[PATH_MAX];
+  if (chunk_path(store, entry, path, 0)) {
+    return NOTE_ERR_CHUNK;
+  }
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    // A missing chunk is damage to the note, not a missing note.
+    return errno == ENOENT ? NOTE_ERR_CHUNK : NOTE_ERR_IO;
+  }
+  size_t size = CHUNK_HEADER_SIZE + NONCE_SIZE + len + TAG_SIZE;
+  int error = read_at(fd, ciphertext, size, 0);
+  close(fd);
+  if (error) {
+    return error == NOTE_ERR_TRUNCATED ? NOTE_ERR_CHUNK : error;
+  }
+  if (memcmp(ciphertext, CHUNK_MAGIC, 8)) {
+    return NOTE_ERR_CHUNK;
+  }
+  const unsigned char *sealed = ciphertext + CHUNK_HEADER_SIZE + NONCE_SIZE;
+  if (!aead_open(context, ciphertext + CHUNK_HEADER_SIZE, entry, CHUNK_ID_SIZE, sealed, len, content, sealed + len)) {
+    return NOTE_ERR_CHUNK;
+  }
+  return 0;
+}
+
+// Decrypt part of the content a manifest describes, passing it to a sink in order.
+// Only the chunks covering the range are read.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_CHUNK` if a chunk is
+// damaged or missing.
+//
+// `store`: path of the chunk store
+// `key`: the notebook key
+// `manifest`: the manifest
+// `manifest_len`: the manifest's length
+// `offset`: the first byte to read, or if negative, how far from the end to start reading
+// `length`: the number of bytes to read, or `0` to read to the end
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+int dedup_read(const char *store, const unsigned char *key, const unsigned char *manifest, size_t manifest_len,
+    long long offset, unsigned long long length, note_sink sink, void *arg) {
+  unsigned long long total;
+  int error = dedup_length(manifest, manifest_len, &total);
+  if (error) {
+    return error;
+  }
+
+  // Resolve the range, clipping it to the content.
+  unsigned long long start = offset;
+  if (offset < 0) {
+    unsigned long long from_end = -(unsigned long long) offset;
+    start = from_end < total ? total - from_end : 0;
+  }
+  if (start >= total) {
+    return 0;
+  }
+  unsigned long long stop = length && length < total - start ? start + length : total;
+
+  unsigned char *ciphertext = malloc(CHUNK_HEADER_SIZE + NONCE_SIZE + DEDUP_MAX_CHUNK + TAG_SIZE);
+  unsigned char *content = malloc(DEDUP_MAX_CHUNK);
+  EVP_CIPHER_CTX *context = aead_context(key, 0);
+  if (ciphertext == NULL || content == NULL || context == NULL) {
+    error = NOTE_ERR_MEMORY;
+  }
+
+  unsigned long long position = 0;
+  for (size_t at = DEDUP_MANIFEST_HEADER; !error && at < manifest_len && position < stop; at += DEDUP_ENTRY_SIZE) {
+    const unsigned char *entry = manifest + at;
+    size_t len = get_le(entry + CHUNK_ID_SIZE, 4);
+    if (len == 0 || len > DEDUP_MAX_CHUNK) {
+      error = NOTE_ERR_HEADER;
+      break;
+    }
+    if (position + len <= start) {
+      position += len;
+      continue;
+    }
+
+    error = read_chunk(store, entry, ciphertext, content, context);
+    if (!error) {
+      size_t skip = start > position ? start - position : 0;
+      size_t pass = (position + len > stop ? stop - position : len) - skip;
+      if (sink(arg, content + skip, pass)) {
+        error = NOTE_ERR_SINK;
+      }
+    }
+    position += len;
+  }
+  if (!error && position < stop) {
+    error = NOTE_ERR_TRUNCATED;
+  }
+
+  if (content != NULL) {
+    OPENSSL_cleanse(content, DEDUP_MAX_CHUNK);
+  }
+  free(content);
+  free(ciphertext);
+  EVP_CIPHER_CTX_free(context);
+  return error;
+}
+
+// Drop the references a manifest holds, removing chunks no note refers to anymore.
+// Returns `0` on success or a `NOTE_ERR_*` value. Chunks that can't be released are left,
+// which only costs space.
+//
+// `store`: path of the chunk store
+// `manifest`: the manifest
+// `manifest_len`: the manifest's length
+int dedup_release(const char *store, const unsigned char *manifest, size_t manifest_len) {
+  int error = 0;
+  for (size_t at = DEDUP_MANIFEST_HEADER; at + DEDUP_ENTRY_SIZE <= manifest_len; at += DEDUP_ENTRY_SIZE) {
+    char path[PATH_MAX];
+    if (chunk_path(store, manifest + at, path, 0)) {
+      continue;
+    }
+    int fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+      // Already gone, i.e. released by a delete that was interrupted.
+      if (errno != ENOENT) {
+        error = NOTE_ERR_IO;
+      }
+      continue;
+    }
+
+    // The last reference removes the chunk while it is locked, so no one adds a
+    // reference to a chunk that is about to be gone.
+    unsigned char count[8];
+    int result = lock_chunk(fd) ? NOTE_ERR_IO : read_at(fd, count, sizeof(count), 8);
+    if (!result && get_le(count, 8) <= 1) {
+      result = unlink(path) ? NOTE_ERR_IO : 0;
+    } else if (!result) {
+      put_le(count, get_le(count, 8) - 1, 8);
+      result = write_at(fd, count, sizeof(count), 8);
+    }
+    close(fd);
+    if (result) {
+      error = result;
+    }
+  }
+  return error;
+}
@@ -0,0 +1,94 @@
+#ifndef DEDUP_H
+#define DEDUP_H 1
+
+#include <stddef.h>
+#include "notefile.h"
+
+// Directory in the notes directory holding the chunks of deduplicated notes.
+#define CHUNK_STORE ".chunks"
+
+// Stored chunks start with this magic number.
+#define CHUNK_MAGIC "\x89NCHK\r\n\x1a"
+
+// Size of a chunk ID: an HMAC-SHA-256 of the chunk's content.
+#define CHUNK_ID_SIZE 32
+
+// Size of the header of a stored chunk, before its nonce.
+#define CHUNK_HEADER_SIZE 16
+
+// Smallest and largest chunks content is split into. Boundaries fall where the content
+// says, about every 8 KiB, so an insert only changes the chunks around it.
+#define DEDUP_MIN_CHUNK 2048
+#define DEDUP_MAX_CHUNK 65536
+#define DEDUP_AVERAGE_BITS 13
+
+// Size of the length at the start of a manifest, and of each entry after it.
+#define DEDUP_MANIFEST_HEADER 8
+#define DEDUP_ENTRY_SIZE (CHUNK_ID_SIZE + 4)
+
+// A stored chunk, on disk. All numbers are little-endian:
+// 0   magic (8)
+// 8   number of notes referring to it (8), changed in place under a lock
+// 16  nonce (12)
+// 28  ciphertext (content length)
+// end tag (16), authenticating the ciphertext and the chunk ID
+//
+// A deduplicated note is a chunked note with `NOTE_FLAG_DEDUP` whose content is a
+// manifest rather than the note's content:
+// 0   content length (8)
+// 8   entries: chunk ID (32) || chunk length (4), in order
+
+// Check if a file name is the name of a stored chunk: its ID in lowercase hex.
+//
+// `file_name`: the name to check
+int is_chunk_name(const char *file_name);
+
+// Split content into chunks and store each one not stored already, adding a reference
+// to each chunk used. Chunks are named by a keyed hash, so only the key's holder can tell
+// which content they hold, and encrypted like notes.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+// Note: The manifest must be freed!
+//
+// `store`: path of the chunk store
+// `key`: the notebook key
+// `content`: the content to store
+// `len`: the content's length
+// `manifest`: A pointer to where the manifest is to be placed
+// `manifest_len`: A pointer to where the manifest's length is to be placed
+int dedup_store(const char *store, const unsigned char *key, const unsigned char *content, size_t len,
+    unsigned char **manifest, size_t *manifest_len);
+
+// Get the content length a manifest describes.
+// Returns `0` on success or `NOTE_ERR_HEADER` if the manifest is damaged.
+//
+// `manifest`: the manifest
+// `manifest_len`: the manifest's length
+// `length`: A pointer to where the content length is to be placed
+int dedup_length(const unsigned char *manifest, size_t manifest_len, unsigned long long *length);
+
+// Decrypt part of the content a manifest describes, passing it to a sink in order.
+// Only the chunks covering the range are read.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_CHUNK` if a chunk is
+// damaged or missing.
+//
+// `store`: path of the chunk store
+// `key`: the notebook key
+// `manifest`: the manifest
+// `manifest_len`: the manifest's length
+// `offset`: the first byte to read, or if negative, how far from the end to start reading
+// `length`: the number of bytes to read, or `0` to read to the end
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+int dedup_read(const char *store, const unsigned char *key, const unsigned char *manifest, size_t manifest_len,
+    long long offset, unsigned long long length, note_sink sink, void *arg);
+
+// Drop the references a manifest holds, removing chunks no note refers to anymore.
+// Returns `0` on success or a `NOTE_ERR_*` value. Chunks that can't be released are left,
+// which only costs space.
+//
+// `store`: path of the chunk store
+// `manifest`: the manifest
+// `manifest_len`: the manifest's length
+int dedup_release(const char *store, const unsigned char *manifest, size_t manifest_len);
+
+#endif
@@ -0,0 +1,293 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man3/mkdtemp.3.html
+// https://man7.org/linux/man-pages/man3/ftw.3.html
+
+// Checks that stored chunks count exactly the notes using them as notes are added,
+// deleted and replaced in a deduplicating notebook. After each step, every stored chunk's
+// count must equal the references found in the notes' manifests, every referenced chunk
+// must be stored, and once the last note is gone no chunks may be left.
+
+#define _XOPEN_SOURCE 700
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "data.h"
+#include "dedup.h"
+#include "notefile.h"
+#include "scrub.h"
+#include "security.h"
+
+// Password for the scratch notebook.
+#define TEST_PASSWORD "dedup refcount test password"
+// Size of each note, spread over many chunks.
+#define TEST_NOTE_SIZE 200000
+// Where an edit goes and its size, replacing the chunks around it.
+#define TEST_EDIT_OFFSET 50000
+#define TEST_EDIT_SIZE 5000
+
+// References found in notes' manifests, one chunk ID per reference.
+struct references {
+  unsigned char *ids;
+  size_t count;
+};
+
+// Fill a buffer with content that doesn't repeat, so each note has many distinct chunks.
+//
+// `buf`: the buffer
+// `len`: the buffer's length
+// `seed`: the seed
+void fill_content(unsigned char *buf, size_t len, unsigned long seed) {
+  for (size_t i = 0; i < len; ++i) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    buf[i] = seed >> 56;
+  }
+}
+
+// Compare chunk IDs for qsort.
+int compare_ids(const void *val1, const void *val2) {
+  return memcmp(val1, val2, CHUNK_ID_SIZE);
+}
+
+// Gather the references a note's manifest holds.
+// Returns `0` on success or `-1` on error, printing issues.
+//
+// `key`: the notebook key
+// `folder`: the notes directory
+// `id`: the note ID
+// `refs`: the references to add to
+int add_references(const unsigned char *key, const char *folder, unsigned long id, struct references *refs) {
+  char path[PATH_MAX];
+  char note_name[NAME_MAX + 1];
+  sprintf(note_name, ".%lu", id);
+  int fd = note_file_path(folder, note_name, path) ? -1 : open(path, O_RDONLY);
+  unsigned char *manifest = NULL;
+  size_t manifest_len = 0;
+  int error = fd < 0 ? NOTE_ERR_IO : read_dedup_manifest(fd, key, &manifest, &manifest_len);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (error || manifest == NULL) {
+    fprintf(stderr, "note %lu: no manifest\n", id);
+    free(manifest);
+    return -1;
+  }
+
+  size_t entries = (manifest_len - DEDUP_MANIFEST_HEADER) / DEDUP_ENTRY_SIZE;
+  unsigned char *ids = realloc(refs->ids, (refs->count + entries) * CHUNK_ID_SIZE);
+  if (ids == NULL) {
+    free(manifest);
+    return -1;
+  }
+  refs->ids = ids;
+  for (size_t i = 0; i < entries; ++i) {
+    memcpy(refs->ids + (refs->count++) * CHUNK_ID_SIZE, manifest + DEDUP_MANIFEST_HEADER + i * DEDUP_ENTRY_SIZE,
+        CHUNK_ID_SIZE);
+  }
+  free(manifest);
+  return 0;
+}
+
+// Compare every stored chunk's count with the references the notes hold.
+// Returns the number of problems found, printing them.
+//
+// `key`: the notebook key
+// `folder`: the notes directory
+// `ids`: the notes that should exist
+// `count`: the number of notes
+// `chunks`: A pointer to where the number of stored chunks is to be placed
+unsigned long check_counts(const unsigned char *key, const char *folder, const unsigned long *ids, int count,
+    unsigned long *chunks) {
+  struct references refs = {0};
+  unsigned long problems = 0;
+  for (int i = 0; i < count; ++i) {
+    problems += add_references(key, folder, ids[i], &refs) != 0;
+  }
+  qsort(refs.ids, refs.count, CHUNK_ID_SIZE, compare_ids);
+
+  // Each stored chunk accounts for the run of references to it.
+  char store[PATH_MAX];
+  snprintf(store, sizeof(store), "%s/%s", folder, CHUNK_STORE);
+  unsigned long found = 0;
+  *chunks = 0;
+  DIR *dir = opendir(store);
+  struct dirent *shard;
+  while (dir != NULL && (shard = readdir(dir))) {
+    char shard_path[PATH_MAX];
+    if (shard->d_name[0] == '.' || snprintf(shard_path, sizeof(shard_path), "%s/%s", store, shard->d_name) >= PATH_MAX) {
+      continue;
+    }
+    DIR *shard_dir = opendir(shard_path);
+    struct dirent *entry;
+    while (shard_dir != NULL && (entry = readdir(shard_dir))) {
+      char path[PATH_MAX];
+      unsigned char id[CHUNK_ID_SIZE];
+      unsigned char header[CHUNK_HEADER_SIZE];
+      if (!is_chunk_name(entry->d_name) || snprintf(path, sizeof(path), "%s/%s", shard_path, entry->d_name) >= PATH_MAX) {
+        continue;
+      }
+      ++*chunks;
+      for (int i = 0; i < CHUNK_ID_SIZE; ++i) {
+        sscanf(entry->d_name + 2 * i, "%2hhx", &id[i]);
+      }
+      unsigned long long references = 0;
+      for (size_t i = 0; i < refs.count; ++i) {
+        references += !memcmp(refs.ids + i * CHUNK_ID_SIZE, id, CHUNK_ID_SIZE);
+      }
+      found += references;
+
+      int fd = open(path, O_RDONLY);
+      int error = fd < 0 || read_at(fd, header, sizeof(header), 0);
+      if (fd >= 0) {
+        close(fd);
+      }
+      if (error || get_le(header + 8, 8) != references) {
+        fprintf(stderr, "chunk %.16s: counts %llu notes, used by %llu\n", entry->d_name,
+            error ? 0 : get_le(header + 8, 8), references);
+        ++problems;
+      }
+    }
+    if (shard_dir != NULL) {
+      closedir(shard_dir);
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+
+  // References to chunks that aren't stored were never matched.
+  if (found != refs.count) {
+    fprintf(stderr, "%zu references to chunks that are not stored\n", refs.count - found);
+    ++problems;
+  }
+  free(refs.ids);
+  return problems;
+}
+
+// Check the counts after a step and print the outcome.
+// Returns `0` if the counts are right, `-1` otherwise.
+//
+// `name`: the step, for messages
+// `key`: the notebook key
+// `folder`: the notes directory
+// `ids`: the notes that should exist
+// `count`: the number of notes
+int check_step(const char *name, const unsigned char *key, const char *folder, const unsigned long *ids, int count) {
+  unsigned long chunks = 0;
+  unsigned long problems = check_counts(key, folder, ids, count, &chunks);
+  // With no notes left, nothing may be stored.
+  if (!count && chunks) {
+    fprintf(stderr, "%lu chunks left with no notes\n", chunks);
+    ++problems;
+  }
+  printf("%s: %lu chunks, %s\n", name, chunks, problems ? "counts wrong" : "counts ok");
+  return problems ? -1 : 0;
+}
+
+// Remove a file or directory, for nftw.
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main() {
+  char dir[] = "/tmp/notes-dedup-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  // Set up a notebook that stores new notes deduplicated.
+  char path[PATH_MAX];
+  char folder[PATH_MAX];
+  struct login_details details;
+  generate_salt(details.salt);
+  unsigned char *hash = calculate_hash(TEST_PASSWORD, details.salt);
+  snprintf(path, sizeof(path), "%s/%s", dir, LOGIN_FILE);
+  snprintf(folder, sizeof(folder), "%s/%s", dir, NOTEBOOK_FOLDER);
+  if (hash == NULL || mkdir(folder, S_IRWXU)) {
+    perror(folder);
+    return 1;
+  }
+  memcpy(details.hash, hash, sizeof(details.hash));
+  free(hash);
+  struct notebook_config config = {0, 1};
+  if (write_login_file(path, &details) || write_config(folder, &config)) {
+    perror(path);
+    return 1;
+  }
+  unsigned char *key = log_in(TEST_PASSWORD, details.salt, details.hash);
+
+  unsigned char *content = malloc(TEST_NOTE_SIZE);
+  unsigned char *edit = malloc(TEST_EDIT_SIZE);
+  int status = key == NULL || content == NULL || edit == NULL;
+  unsigned long ids[2] = {0};
+  char names[2][NAME_MAX + 1];
+  int failed = 0;
+
+  // Two notes with the same content share every chunk.
+  if (!status) {
+    fill_content(content, TEST_NOTE_SIZE, 1);
+    status = create_note(key, folder, content, TEST_NOTE_SIZE, &ids[0])
+        || create_note(key, folder, content, TEST_NOTE_SIZE, &ids[1]);
+    sprintf(names[0], ".%lu", ids[0]);
+    sprintf(names[1], ".%lu", ids[1]);
+  }
+  if (!status) {
+    failed += check_step("two notes added", key, folder, ids, 2) != 0;
+
+    // Scrub counts the same way, and must find nothing wrong either.
+    struct scrub_options options = {1, 0, tmpfile()};
+    long problems = options.report == NULL ? -1 : scrub_notes(key, folder, &options);
+    if (options.report != NULL) {
+      fclose(options.report);
+    }
+    printf("scrub: %ld problems\n", problems);
+    failed += problems != 0;
+  }
+
+  // Deleting one leaves the other's references.
+  if (!status) {
+    status = delete_note(key, folder, names[0]) != 0;
+  }
+  if (!status) {
+    failed += check_step("one note deleted", key, folder, ids + 1, 1) != 0;
+  }
+
+  // Editing a deduplicated note replaces it, taking references to the new chunks before
+  // the old ones are released.
+  if (!status) {
+    fill_content(edit, TEST_EDIT_SIZE, 2);
+    status = edit_note(key, folder, names[1], 0, TEST_EDIT_OFFSET, edit, TEST_EDIT_SIZE) != 0;
+  }
+  if (!status) {
+    failed += check_step("note edited", key, folder, ids + 1, 1) != 0;
+  }
+
+  // Restoring replaces it again with the content it had.
+  if (!status) {
+    status = restore_note(key, folder, names[1], 0) != 0;
+  }
+  if (!status) {
+    failed += check_step("note restored", key, folder, ids + 1, 1) != 0;
+  }
+
+  if (!status) {
+    status = delete_note(key, folder, names[1]) != 0;
+  }
+  if (!status) {
+    failed += check_step("both notes deleted", key, folder, ids, 0) != 0;
+  }
+
+  status = status || failed;
+  free(key);
+  free(content);
+  free(edit);
+  nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  printf(status ? "FAIL\n" : "PASS\n");
+  return status;
+}
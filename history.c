@@ -0,0 +1,512 @@
+// Resources used:
+// https://www.openssl.org/docs/man3.0/man3/EVP_EncryptInit.html (AEAD Interface)
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include "security.h"
+#include "history.h"
+
+// Bytes in a record's additional data: the history ID and where the record is.
+#define RECORD_AAD_SIZE (HISTORY_ID_SIZE + 8)
+// Size of a record's sealed revision info.
+#define INFO_SLOT_SIZE (NONCE_SIZE + HISTORY_INFO_SIZE + TAG_SIZE)
+// Revision info flag: the whole content is stored.
+#define REVISION_SNAPSHOT 1
+
+// A revision and where its content is stored.
+struct history_record {
+  struct note_revision info;
+  off_t content_offset;
+};
+
+// The committed records in a history file.
+struct history_index {
+  unsigned char id[HISTORY_ID_SIZE];
+  struct history_record *records;
+  size_t count;
+  size_t capacity;
+  // Where the next record goes, or `0` if the file has no header yet.
+  off_t end;
+};
+
+// Decrypted content gathered from a sink.
+struct history_buffer {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+};
+
+// Add decrypted content to a buffer.
+// Returns `0` on success or `-1` on error.
+static int gather_content(void *arg, const unsigned char *content, size_t len) {
+  struct history_buffer *buffer = arg;
+  if (buffer->len + len > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 65536;
+    while (capacity < buffer->len + len) {
+      capacity *= 2;
+    }
+    unsigned char *grown = malloc(capacity);
+    if (grown == NULL) {
+      return -1;
+    }
+    // Don't leave copies of plaintext behind in freed memory.
+    if (buffer->data) {
+      memcpy(grown, buffer->data, buffer->len);
+      OPENSSL_cleanse(buffer->data, buffer->len);
+      free(buffer->data);
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->len, content, len);
+  buffer->len += len;
+  return 0;
+}
+
+// Wipe and free a buffer of plaintext.
+static void free_buffer(struct history_buffer *buffer) {
+  if (buffer->data) {
+    OPENSSL_cleanse(buffer->data, buffer->len);
+    free(buffer->data);
+  }
+  memset(buffer, 0, sizeof(struct history_buffer));
+}
+
+// Build the additional data tying sealed bytes to their place in a history file.
+static void record_aad(const struct history_index *index, off_t offset, unsigned char aad[RECORD_AAD_SIZE]) {
+  memcpy(aad, index->id, HISTORY_ID_SIZE);
+  put_le(aad + HISTORY_ID_SIZE, offset, 8);
+}
+
+// Encrypt bytes and write them to a history file.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the history file
+// `key`: the key to encrypt with
+// `index`: the history's index
+// `offset`: where to write
+// `plain`: the bytes to encrypt
+// `len`: the number of bytes
+static int write_sealed(int fd, const unsigned char *key, const struct history_index *index, off_t offset,
+    const unsigned char *plain, size_t len) {
+  if (len > INT_MAX - NONCE_SIZE - TAG_SIZE) {
+    return NOTE_ERR_MEMORY;
+  }
+  unsigned char *slot = malloc(NONCE_SIZE + len + TAG_SIZE);
+  EVP_CIPHER_CTX *context = aead_context(key, 1);
+  int error = slot == NULL ? NOTE_ERR_MEMORY : context == NULL ? NOTE_ERR_CHUNK : 0;
+
+  unsigned char aad[RECORD_AAD_SIZE];
+  record_aad(index, offset, aad);
+  if (!error) {
+    generate_nonce(slot);
+    if (!aead_seal(context, slot, aad, RECORD_AAD_SIZE, plain, len, slot + NONCE_SIZE, slot + NONCE_SIZE + len)) {
+      error = NOTE_ERR_CHUNK;
+    }
+  }
+  if (!error) {
+    error = write_at(fd, slot, NONCE_SIZE + len + TAG_SIZE, offset);
+  }
+
+  EVP_CIPHER_CTX_free(context);
+  free(slot);
+  return error;
+}
+
+// Read bytes from a history file and decrypt them.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_CHUNK` if they are damaged.
+//
+// `fd`: the history file
+// `key`: the key the history was written with
+// `index`: the history's index
+// `offset`: where to read
+// `plain`: A pointer to where the bytes are to be placed
+// `len`: the number of bytes
+static int read_sealed(int fd, const unsigned char *key, const struct history_index *index, off_t offset,
+    unsigned char *plain, size_t len) {
+  if (len > INT_MAX - NONCE_SIZE - TAG_SIZE) {
+    return NOTE_ERR_MEMORY;
+  }
+  unsigned char *slot = malloc(NONCE_SIZE + len + TAG_SIZE);
+  EVP_CIPHER_CTX *context = aead_context(key, 0);
+  int error = slot == NULL ? NOTE_ERR_MEMORY : context == NULL ? NOTE_ERR_CHUNK : 0;
+
+  if (!error) {
+    error = read_at(fd, slot, NONCE_SIZE + len + TAG_SIZE, offset);
+  }
+  unsigned char aad[RECORD_AAD_SIZE];
+  record_aad(index, offset, aad);
+  if (!error && !aead_open(context, slot, aad, RECORD_AAD_SIZE, slot + NONCE_SIZE, len, plain, slot + NONCE_SIZE + len)) {
+    error = NOTE_ERR_CHUNK;
+  }
+
+  EVP_CIPHER_CTX_free(context);
+  free(slot);
+  return error;
+}
+
+// Add a record to an index.
+// Returns `0` on success or `NOTE_ERR_MEMORY`.
+static int index_add(struct history_index *index, const struct history_record *record) {
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 64;
+    struct history_record *grown = realloc(index->records, capacity * sizeof(struct history_record));
+    if (grown == NULL) {
+      return NOTE_ERR_MEMORY;
+    }
+    index->records = grown;
+    index->capacity = capacity;
+  }
+  index->records[index->count++] = *record;
+  return 0;
+}
+
+// Read the committed records of a history file.
+// Records stop at the first one that is torn, damaged, out of order or was never committed.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_HEADER` if the history
+// is not readable at all.
+// Note: The index's records must be freed, even on error!
+//
+// `fd`: the history file
+// `key`: the key the history was written with
+// `current`: the note's revision
+// `index`: A pointer to where the index is to be placed
+static int load_index(int fd, const unsigned char *key, unsigned long long current, struct history_index *index) {
+  memset(index, 0, sizeof(struct history_index));
+  struct stat st;
+  if (fstat(fd, &st)) {
+    return NOTE_ERR_IO;
+  }
+  if (st.st_size == 0) {
+    return 0;
+  }
+
+  unsigned char header[HISTORY_HEADER_SIZE];
+  int error = read_at(fd, header, HISTORY_HEADER_SIZE, 0);
+  if (error) {
+    return error == NOTE_ERR_TRUNCATED ? NOTE_ERR_HEADER : error;
+  }
+  if (memcmp(header, NOTE_HISTORY_MAGIC, NOTE_MAGIC_SIZE) || header[8] != HISTORY_FORMAT_VERSION) {
+    return NOTE_ERR_HEADER;
+  }
+  memcpy(index->id, header + 16, HISTORY_ID_SIZE);
+  index->end = HISTORY_HEADER_SIZE;
+
+  while (index->end + INFO_SLOT_SIZE <= st.st_size) {
+    unsigned char info[HISTORY_INFO_SIZE];
+    if (read_sealed(fd, key, index, index->end, info, HISTORY_INFO_SIZE)) {
+      // A crash while appending leaves a torn record. The history ends before it.
+      break;
+    }
+
+    struct history_record record;
+    record.info.revision = get_le(info, 8);
+    record.info.time = get_le(info + 8, 8);
+    record.info.length = get_le(info + 16, 8);
+    record.info.offset = get_le(info + 24, 8);
+    record.info.changed = get_le(info + 32, 8);
+    record.info.snapshot = (get_le(info + 40, 8) & REVISION_SNAPSHOT) != 0;
+    record.content_offset = index->end + INFO_SLOT_SIZE;
+    off_t content_size = record.info.changed ? NONCE_SIZE + record.info.changed + TAG_SIZE : 0;
+
+    // Records after the note's revision belong to an edit that was never committed.
+    if (record.info.revision > current
+        || (index->count && record.info.revision <= index->records[index->count - 1].info.revision)
+        || record.info.changed > record.info.length || record.info.offset > record.info.length - record.info.changed
+        || (record.info.snapshot && record.info.changed != record.info.length)
+        || record.content_offset + content_size > st.st_size) {
+      break;
+    }
+
+    error = index_add(index, &record);
+    if (error) {
+      return error;
+    }
+    index->end = record.content_offset + content_size;
+  }
+  return 0;
+}
+
+// Append a record to a history file and flush it to disk.
+// Anything after the last committed record is cut off first.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the history file
+// `key`: the key to encrypt with
+// `index`: the history's index, which the record is added to
+// `info`: the revision
+// `content`: the content to store, `info->changed` long
+static int append_record(int fd, const unsigned char *key, struct history_index *index, const struct note_revision *info,
+    const unsigned char *content) {
+  if (index->end == 0) {
+    // Start a new history, with an ID of its own.
+    unsigned char header[HISTORY_HEADER_SIZE] = {0};
+    memcpy(header, NOTE_HISTORY_MAGIC, NOTE_MAGIC_SIZE);
+    header[8] = HISTORY_FORMAT_VERSION;
+    generate_iv(header + 16);
+    if (ftruncate(fd, 0) || write_at(fd, header, HISTORY_HEADER_SIZE, 0)) {
+      return NOTE_ERR_IO;
+    }
+    memcpy(index->id, header + 16, HISTORY_ID_SIZE);
+    index->end = HISTORY_HEADER_SIZE;
+  }
+
+  unsigned char buf[HISTORY_INFO_SIZE];
+  put_le(buf, info->revision, 8);
+  put_le(buf + 8, info->time, 8);
+  put_le(buf + 16, info->length, 8);
+  put_le(buf + 24, info->offset, 8);
+  put_le(buf + 32, info->changed, 8);
+  put_le(buf + 40, info->snapshot ? REVISION_SNAPSHOT : 0, 8);
+
+  struct history_record record;
+  record.info = *info;
+  record.content_offset = index->end + INFO_SLOT_SIZE;
+  off_t end = record.content_offset + (info->changed ? NONCE_SIZE + info->changed + TAG_SIZE : 0);
+
+  int error = write_sealed(fd, key, index, index->end, buf, HISTORY_INFO_SIZE);
+  if (!error && info->changed) {
+    error = write_sealed(fd, key, index, record.content_offset, content, info->changed);
+  }
+  if (!error && (ftruncate(fd, end) || fdatasync(fd))) {
+    error = NOTE_ERR_IO;
+  }
+  if (!error) {
+    error = index_add(index, &record);
+    index->end = end;
+  }
+  return error;
+}
+
+// Add the revision an edit or replacement is about to make to a note's history.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `history_fd`: the history file, open for reading and writing
+// `note_fd`: the note file, locked for writing
+// `key`: the key the note was written with
+// `header`: the note's header
+// `start`: where the edit writes
+// `content`: the content the edit writes, or the new content
+// `len`: the content's length
+// `replace`: `1` if the content replaces the note's content, `0` for an edit
+// `options`: options for reading the note
+static int add_revision(int history_fd, int note_fd, const unsigned char *key, const struct note_header *header,
+    unsigned long long start, const unsigned char *content, size_t len, int replace,
+    const struct chunk_options *options) {
+  struct history_index index;
+  int error = load_index(history_fd, key, header->revision, &index);
+  if (error == NOTE_ERR_HEADER) {
+    // A history that can't be read can't be added to, so a new one is started.
+    free(index.records);
+    memset(&index, 0, sizeof(struct history_index));
+    error = 0;
+  }
+
+  // Count the content stored since the last snapshot, if the history reaches the note's
+  // current revision without gaps.
+  int in_sync = !error && index.count && index.records[index.count - 1].info.revision == header->revision;
+  unsigned long long since = 0;
+  for (size_t i = index.count; in_sync && i-- > 0;) {
+    if (index.records[i].info.snapshot) {
+      break;
+    }
+    since += index.records[i].info.changed;
+    in_sync = i > 0 && index.records[i - 1].info.revision + 1 == index.records[i].info.revision;
+  }
+
+  struct note_revision info = {0};
+  info.time = time(NULL);
+  struct history_buffer current = {0};
+
+  // Without the current revision to build on, store it whole first.
+  if (!error && !in_sync) {
+    error = read_chunked_note(note_fd, key, gather_content, &current, options);
+    if (!error) {
+      info.revision = header->revision;
+      info.length = current.len;
+      info.changed = current.len;
+      info.snapshot = 1;
+      error = append_record(history_fd, key, &index, &info, current.data);
+      since = 0;
+    }
+  }
+
+  unsigned long long length = replace ? len : start + len > header->length ? start + len : header->length;
+  info.revision = header->revision + 1;
+  info.length = length;
+  if (!error && replace) {
+    info.offset = 0;
+    info.changed = len;
+    info.snapshot = 1;
+    error = append_record(history_fd, key, &index, &info, content);
+  } else if (!error && since + len >= length) {
+    // Rebuilding would read more edits than the note holds, so store it whole.
+    if (in_sync) {
+      error = read_chunked_note(note_fd, key, gather_content, &current, options);
+    }
+    // Add what the edit writes past the end, then copy the rest over the old content.
+    size_t overlap = current.len - start;
+    if (!error && len > overlap && gather_content(&current, content + overlap, len - overlap)) {
+      error = NOTE_ERR_MEMORY;
+    }
+    if (!error && len) {
+      memcpy(current.data + start, content, len > overlap ? overlap : len);
+    }
+    if (!error) {
+      info.offset = 0;
+      info.changed = current.len;
+      info.snapshot = 1;
+      error = append_record(history_fd, key, &index, &info, current.data);
+    }
+  } else if (!error) {
+    info.offset = start;
+    info.changed = len;
+    info.snapshot = 0;
+    error = append_record(history_fd, key, &index, &info, content);
+  }
+
+  free_buffer(&current);
+  free(index.records);
+  return error;
+}
+
+// Read the revisions in a note's history, oldest first.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_HEADER` if the history
+// is damaged or written with another key.
+// Note: The revisions must be freed!
+//
+// `history_fd`: the open history file
+// `key`: the key the note was written with
+// `current`: the note's revision
+// `revisions`: A pointer to where the revisions are to be placed
+// `count`: A pointer to where the number of revisions is to be placed
+int read_history(int history_fd, const unsigned char *key, unsigned long long current,
+    struct note_revision **revisions, size_t *count) {
+  *revisions = NULL;
+  *count = 0;
+  struct history_index index;
+  int error = load_index(history_fd, key, current, &index);
+  if (!error && index.count) {
+    *revisions = malloc(index.count * sizeof(struct note_revision));
+    if (*revisions == NULL) {
+      error = NOTE_ERR_MEMORY;
+    }
+  }
+  for (size_t i = 0; !error && i < index.count; ++i) {
+    (*revisions)[i] = index.records[i].info;
+  }
+  if (!error) {
+    *count = index.count;
+  }
+  free(index.records);
+  return error;
+}
+
+// Rebuild a note's content at a revision from its history.
+// Returns `0` on success, `NOTE_ERR_REVISION` if the revision can't be rebuilt, or
+// another `NOTE_ERR_*` value.
+// Note: The content must be freed!
+//
+// `history_fd`: the open history file
+// `key`: the key the note was written with
+// `current`: the note's revision
+// `revision`: the revision to rebuild
+// `content`: A pointer to where the content is to be placed
+// `len`: A pointer to where the content's length is to be placed
+int history_content(int history_fd, const unsigned char *key, unsigned long long current,
+    unsigned long long revision, unsigned char **content, size_t *len) {
+  *content = NULL;
+  *len = 0;
+  struct history_index index;
+  int error = load_index(history_fd, key, current, &index);
+
+  // Find the revision, then the snapshot it is built on.
+  size_t last = 0;
+  while (!error && last < index.count && index.records[last].info.revision != revision) {
+    ++last;
+  }
+  if (!error && last == index.count) {
+    error = NOTE_ERR_REVISION;
+  }
+  size_t first = last;
+  while (!error && !index.records[first].info.snapshot) {
+    if (first == 0 || index.records[first - 1].info.revision + 1 != index.records[first].info.revision) {
+      error = NOTE_ERR_REVISION;
+      break;
+    }
+    --first;
+  }
+
+  // Start from the snapshot and apply each edit after it.
+  size_t capacity = 0;
+  for (size_t i = first; !error && i <= last; ++i) {
+    if (index.records[i].info.length > capacity) {
+      capacity = index.records[i].info.length;
+    }
+  }
+  unsigned char *buf = error ? NULL : malloc(capacity ? capacity : 1);
+  if (!error && buf == NULL) {
+    error = NOTE_ERR_MEMORY;
+  }
+  for (size_t i = first; !error && i <= last; ++i) {
+    const struct history_record *record = &index.records[i];
+    if (record->info.changed) {
+      error = read_sealed(history_fd, key, &index, record->content_offset, buf + record->info.offset,
+          record->info.changed);
+    }
+  }
+
+  if (error) {
+    if (buf) {
+      OPENSSL_cleanse(buf, capacity);
+      free(buf);
+    }
+  } else {
+    *content = buf;
+    *len = index.records[last].info.length;
+  }
+  free(index.records);
+  return error;
+}
+
+// Add the revision an edit is about to make to a note's history.
+// A history that doesn't have the note's current revision first gets a snapshot of it.
+// The record is on disk before this returns, so the edit can be committed after it.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `history_fd`: the history file, open for reading and writing
+// `note_fd`: the note file, locked for writing
+// `key`: the key the note was written with
+// `header`: the note's header, with the length of its content
+// `start`: where the edit writes, no further than the end of the content
+// `content`: the content the edit writes
+// `len`: the content's length
+// `options`: options for reading the note, i.e. its chunk store
+int history_add_edit(int history_fd, int note_fd, const unsigned char *key, const struct note_header *header,
+    unsigned long long start, const unsigned char *content, size_t len, const struct chunk_options *options) {
+  if (start > header->length) {
+    return NOTE_ERR_RANGE;
+  }
+  return add_revision(history_fd, note_fd, key, header, start, content, len, 0, options);
+}
+
+// Add a revision that replaces a note's whole content to its history.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `history_fd`: the history file, open for reading and writing
+// `note_fd`: the note file, locked for writing
+// `key`: the key the note was written with
+// `header`: the note's header, with the length of its content
+// `content`: the new content
+// `len`: the new content's length
+// `options`: options for reading the note, i.e. its chunk store
+int history_add_replace(int history_fd, int note_fd, const unsigned char *key, const struct note_header *header,
+    const unsigned char *content, size_t len, const struct chunk_options *options) {
+  return add_revision(history_fd, note_fd, key, header, 0, content, len, 1, options);
+}
@@ -0,0 +1,109 @@
+#ifndef HISTORY_H
+#define HISTORY_H 1
+
+#include <stddef.h>
+#include "notefile.h"
+
+// Revision histories start with this magic number.
+#define NOTE_HISTORY_MAGIC "\x89NHST\r\n\x1a"
+
+// Current history format version.
+#define HISTORY_FORMAT_VERSION 1
+
+// Size of the history header in bytes.
+#define HISTORY_HEADER_SIZE 32
+
+// Size of the random ID tying records to their history file.
+#define HISTORY_ID_SIZE 16
+
+// Size of the revision info in each record, before encryption.
+#define HISTORY_INFO_SIZE 48
+
+// Revision history of a chunked note, kept next to it.
+// Each edit is stored as the bytes it wrote, so history grows with the size of edits
+// rather than the size of the note. Once the edits since the last snapshot add up to the
+// size of the note, the whole content is stored instead, so rebuilding any revision
+// reads at most about twice the note.
+// Records are only appended. Each is encrypted and authenticated on its own, tied to its
+// place in the file, and numbered by the note revision it produced. Records numbered
+// past the note's revision were never committed and are dropped.
+//
+// On disk, all numbers are little-endian:
+// 0   magic (8)
+// 8   format version (1)
+// 9   reserved, zero (7)
+// 16  history ID (16)
+// 32  records: nonce (12) || sealed revision info (48) || tag (16)
+//     || if content was stored: nonce (12) || sealed content || tag (16)
+// Revision info: revision (8) || time (8) || length (8) || offset (8) || content length (8) || flags (8)
+struct note_revision {
+  unsigned long long revision;
+  // Seconds since the epoch when the revision was made.
+  long long time;
+  // The note's content length at this revision.
+  unsigned long long length;
+  // Where the stored content goes.
+  unsigned long long offset;
+  // The length of the stored content.
+  unsigned long long changed;
+  // `1` if the whole content was stored, `0` if only an edit was.
+  int snapshot;
+};
+
+// Read the revisions in a note's history, oldest first.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_HEADER` if the history
+// is damaged or written with another key.
+// Note: The revisions must be freed!
+//
+// `history_fd`: the open history file
+// `key`: the key the note was written with
+// `current`: the note's revision
+// `revisions`: A pointer to where the revisions are to be placed
+// `count`: A pointer to where the number of revisions is to be placed
+int read_history(int history_fd, const unsigned char *key, unsigned long long current,
+    struct note_revision **revisions, size_t *count);
+
+// Rebuild a note's content at a revision from its history.
+// Returns `0` on success, `NOTE_ERR_REVISION` if the revision can't be rebuilt, or
+// another `NOTE_ERR_*` value.
+// Note: The content must be freed!
+//
+// `history_fd`: the open history file
+// `key`: the key the note was written with
+// `current`: the note's revision
+// `revision`: the revision to rebuild
+// `content`: A pointer to where the content is to be placed
+// `len`: A pointer to where the content's length is to be placed
+int history_content(int history_fd, const unsigned char *key, unsigned long long current,
+    unsigned long long revision, unsigned char **content, size_t *len);
+
+// Add the revision an edit is about to make to a note's history.
+// A history that doesn't have the note's current revision first gets a snapshot of it.
+// The record is on disk before this returns, so the edit can be committed after it.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `history_fd`: the history file, open for reading and writing
+// `note_fd`: the note file, locked for writing
+// `key`: the key the note was written with
+// `header`: the note's header, with the length of its content
+// `start`: where the edit writes, no further than the end of the content
+// `content`: the content the edit writes
+// `len`: the content's length
+// `options`: options for reading the note, i.e. its chunk store
+int history_add_edit(int history_fd, int note_fd, const unsigned char *key, const struct note_header *header,
+    unsigned long long start, const unsigned char *content, size_t len, const struct chunk_options *options);
+
+// Add a revision that replaces a note's whole content to its history.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `history_fd`: the history file, open for reading and writing
+// `note_fd`: the note file, locked for writing
+// `key`: the key the note was written with
+// `header`: the note's header, with the length of its content
+// `content`: the new content
+// `len`: the new content's length
+// `options`: options for reading the note, i.e. its chunk store
+int history_add_replace(int history_fd, int note_fd, const unsigned char *key, const struct note_header *header,
+    const unsigned char *content, size_t len, const struct chunk_options *options);
+
+#endif
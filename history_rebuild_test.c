@@ -0,0 +1,197 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man3/mkdtemp.3.html
+// https://man7.org/linux/man-pages/man3/ftw.3.html
+
+// Checks that every revision of a note can be rebuilt from its history.
+// A note is edited many times, with edits and appends of varying size, so its history
+// holds several snapshots with edits between them, and is then restored to an early
+// revision. Each revision rebuilt from the history must match the content the note had.
+
+#define _XOPEN_SOURCE 700
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "data.h"
+#include "history.h"
+#include "notefile.h"
+#include "security.h"
+
+// Password for the scratch notebook.
+#define TEST_PASSWORD "history rebuild test password"
+// Size of the note when it is added.
+#define TEST_NOTE_SIZE 20000
+// Edits made, and the most each writes. Edits add up to the note's size every few, so
+// snapshots are taken between them.
+#define TEST_EDITS 60
+#define TEST_EDIT_SIZE 4000
+// Fewest snapshots the history must hold for the test to cover rebuilding across them.
+#define TEST_SNAPSHOTS 4
+
+// Get the next number from a simple generator, so every run makes the same edits.
+//
+// `seed`: the generator's state
+unsigned long next_random(unsigned long *seed) {
+  *seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+  return *seed >> 33;
+}
+
+// Fill a buffer with content that depends on a seed.
+//
+// `buf`: the buffer
+// `len`: the buffer's length
+// `seed`: the seed
+void fill_content(unsigned char *buf, size_t len, unsigned long seed) {
+  for (size_t i = 0; i < len; ++i) {
+    buf[i] = 'a' + (i * 7 + seed) % 26;
+  }
+}
+
+// Rebuild every revision before the note's current one and compare it with what it was.
+// Returns the number of revisions that could not be rebuilt or were wrong, printing them.
+//
+// `key`: the notebook key
+// `folder`: the notes directory
+// `note_name`: the name of the note file
+// `expected`: the content of each revision
+// `expected_len`: the length of each revision's content
+// `snapshots`: A pointer to where the number of snapshots in the history is to be placed
+unsigned long check_revisions(const unsigned char *key, const char *folder, const char *note_name,
+    unsigned char **expected, const size_t *expected_len, unsigned long *snapshots) {
+  char path[PATH_MAX];
+  char history_path[PATH_MAX];
+  struct note_header header;
+  *snapshots = 0;
+  int fd = note_file_path(folder, note_name, path) ? -1 : open(path, O_RDONLY);
+  int history_fd = history_file_path(folder, note_name, history_path) ? -1 : open(history_path, O_RDONLY);
+  if (fd < 0 || history_fd < 0 || read_note_header(fd, key, &header)) {
+    fprintf(stderr, "note or history could not be opened\n");
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (history_fd >= 0) {
+      close(history_fd);
+    }
+    return 1;
+  }
+  close(fd);
+
+  struct note_revision *revisions;
+  size_t count;
+  if (!read_history(history_fd, key, header.revision, &revisions, &count)) {
+    for (size_t i = 0; i < count; ++i) {
+      *snapshots += revisions[i].snapshot;
+    }
+    free(revisions);
+  }
+
+  unsigned long failed = 0;
+  for (unsigned long long revision = 0; revision < header.revision; ++revision) {
+    unsigned char *content = NULL;
+    size_t len = 0;
+    int error = history_content(history_fd, key, header.revision, revision, &content, &len);
+    if (error) {
+      fprintf(stderr, "revision %llu: %s\n", revision, note_error_string(error));
+      ++failed;
+    } else if (len != expected_len[revision] || memcmp(content, expected[revision], len)) {
+      fprintf(stderr, "revision %llu: wrong content\n", revision);
+      ++failed;
+    }
+    free(content);
+  }
+  close(history_fd);
+  return failed;
+}
+
+// Remove a file or directory, for nftw.
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main() {
+  char dir[] = "/tmp/notes-history-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  // Set up a notebook.
+  char path[PATH_MAX];
+  char folder[PATH_MAX];
+  struct login_details details;
+  generate_salt(details.salt);
+  unsigned char *hash = calculate_hash(TEST_PASSWORD, details.salt);
+  snprintf(path, sizeof(path), "%s/%s", dir, LOGIN_FILE);
+  snprintf(folder, sizeof(folder), "%s/%s", dir, NOTEBOOK_FOLDER);
+  if (hash == NULL || mkdir(folder, S_IRWXU)) {
+    perror(folder);
+    return 1;
+  }
+  memcpy(details.hash, hash, sizeof(details.hash));
+  free(hash);
+  if (write_login_file(path, &details)) {
+    perror(path);
+    return 1;
+  }
+  unsigned char *key = log_in(TEST_PASSWORD, details.salt, details.hash);
+
+  // The content of every revision: the note as added, then after each edit.
+  unsigned char *expected[TEST_EDITS + 1] = {0};
+  size_t expected_len[TEST_EDITS + 1] = {0};
+  size_t capacity = TEST_NOTE_SIZE + TEST_EDITS * TEST_EDIT_SIZE;
+  int status = key == NULL;
+  for (int i = 0; i <= TEST_EDITS && !status; ++i) {
+    expected[i] = malloc(capacity);
+    status = expected[i] == NULL;
+  }
+
+  unsigned long id = 0;
+  char note_name[NAME_MAX + 1];
+  if (!status) {
+    fill_content(expected[0], TEST_NOTE_SIZE, 0);
+    expected_len[0] = TEST_NOTE_SIZE;
+    status = create_note(key, folder, expected[0], TEST_NOTE_SIZE, &id) != 0;
+    sprintf(note_name, ".%lu", id);
+  }
+
+  unsigned long seed = 1;
+  unsigned char *edit = malloc(TEST_EDIT_SIZE);
+  status = status || edit == NULL;
+  for (int revision = 1; revision <= TEST_EDITS && !status; ++revision) {
+    size_t previous_len = expected_len[revision - 1];
+    size_t len = 1 + next_random(&seed) % TEST_EDIT_SIZE;
+    int append = next_random(&seed) % 4 == 0;
+    size_t offset = append ? previous_len : next_random(&seed) % previous_len;
+    fill_content(edit, len, revision);
+
+    memcpy(expected[revision], expected[revision - 1], previous_len);
+    memcpy(expected[revision] + offset, edit, len);
+    expected_len[revision] = offset + len > previous_len ? offset + len : previous_len;
+    status = edit_note(key, folder, note_name, append, offset, edit, len) != 0;
+  }
+  free(edit);
+
+  // Restoring stores the old content whole as a new revision, after the ones checked.
+  if (!status) {
+    status = restore_note(key, folder, note_name, 2) != 0;
+  }
+
+  if (!status) {
+    unsigned long snapshots = 0;
+    unsigned long failed = check_revisions(key, folder, note_name, expected, expected_len, &snapshots);
+    printf("%lu of %d revisions rebuilt wrong, across %lu snapshots\n", failed, TEST_EDITS + 1, snapshots);
+    status = failed || snapshots < TEST_SNAPSHOTS;
+  }
+
+  free(key);
+  for (int i = 0; i <= TEST_EDITS; ++i) {
+    free(expected[i]);
+  }
+  nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  printf(status ? "FAIL\n" : "PASS\n");
+  return status;
+}
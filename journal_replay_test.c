@@ -0,0 +1,328 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man3/mkdtemp.3.html
+// https://man7.org/linux/man-pages/man3/ftw.3.html
+
+// Checks that an edit interrupted by a crash is recovered from its journal.
+// Each edit is made, then the note and journal are put back as a crash at some point
+// during the edit would have left them. Reading the note must give the edited content
+// once the journal is complete, and the old content if the journal was cut short.
+
+#define _XOPEN_SOURCE 700
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "data.h"
+#include "notefile.h"
+#include "security.h"
+
+// Password for the scratch notebook.
+#define TEST_PASSWORD "journal replay test password"
+// Size of the note, so edits cover some of its chunks and not others.
+#define TEST_NOTE_SIZE 200000
+// Where the edit goes and its size, spanning the first two chunks.
+#define TEST_EDIT_OFFSET 1000
+#define TEST_EDIT_SIZE 70000
+// Size of an append, adding chunks past the old end.
+#define TEST_APPEND_SIZE 100000
+
+// A file's content.
+struct file_bytes {
+  unsigned char *data;
+  size_t len;
+};
+
+// Note content gathered from a sink.
+struct test_buffer {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+};
+
+// Add decrypted content to a buffer.
+int gather(void *arg, const unsigned char *content, size_t len) {
+  struct test_buffer *buf = arg;
+  if (buf->len + len > buf->capacity) {
+    size_t capacity = (buf->len + len) * 2;
+    unsigned char *data = realloc(buf->data, capacity);
+    if (data == NULL) {
+      return -1;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+  }
+  memcpy(buf->data + buf->len, content, len);
+  buf->len += len;
+  return 0;
+}
+
+// Fill a buffer with content that depends on a seed.
+//
+// `buf`: the buffer
+// `len`: the buffer's length
+// `seed`: the seed
+void fill_content(unsigned char *buf, size_t len, unsigned long seed) {
+  for (size_t i = 0; i < len; ++i) {
+    buf[i] = 'a' + (i * 7 + seed) % 26;
+  }
+}
+
+// Read a whole file.
+// Returns `0` on success or `-1` on error, printing issues.
+//
+// `path`: path of the file
+// `bytes`: A pointer to where the content is to be placed
+int read_file(const char *path, struct file_bytes *bytes) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  bytes->len = st.st_size;
+  bytes->data = malloc(bytes->len ? bytes->len : 1);
+  int error = bytes->data == NULL || read_at(fd, bytes->data, bytes->len, 0);
+  close(fd);
+  if (error) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Replace a file's content.
+// Returns `0` on success or `-1` on error, printing issues.
+//
+// `path`: path of the file
+// `data`: the new content
+// `len`: the new content's length
+int write_file(const char *path, const unsigned char *data, size_t len) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  int error = fd < 0 || write_at(fd, data, len, 0);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (error) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Leave a note and its journal as a crash partway through an edit would, then recover it.
+// Returns `0` if the note reads as expected and the journal is gone, `-1` otherwise,
+// printing the problem.
+//
+// `name`: the case, for messages
+// `key`: the notebook key
+// `folder`: the notes directory
+// `note_name`: the name of the note file
+// `note`: the note file as the crash left it
+// `journal`: the journal as the crash left it
+// `expected`: the content the note must have afterwards
+// `expected_len`: the expected content's length
+int check_recovery(const char *name, const unsigned char *key, const char *folder, const char *note_name,
+    const struct file_bytes *note, const struct file_bytes *journal, const unsigned char *expected,
+    size_t expected_len) {
+  char path[PATH_MAX];
+  char journal_path[PATH_MAX];
+  if (note_file_path(folder, note_name, path) || journal_file_path(folder, note_name, journal_path)
+      || write_file(path, note->data, note->len) || write_file(journal_path, journal->data, journal->len)) {
+    return -1;
+  }
+  if (recover_note(key, folder, note_name)) {
+    fprintf(stderr, "%s: not recovered\n", name);
+    return -1;
+  }
+  if (!access(journal_path, F_OK)) {
+    fprintf(stderr, "%s: journal left behind\n", name);
+    return -1;
+  }
+
+  struct test_buffer content = {0};
+  int fd = open(path, O_RDONLY);
+  int error = fd < 0 ? NOTE_ERR_IO : read_note_content(fd, key, 0, 0, gather, &content, NULL);
+  if (fd >= 0) {
+    close(fd);
+  }
+  int result = 0;
+  if (error) {
+    fprintf(stderr, "%s: %s\n", name, note_error_string(error));
+    result = -1;
+  } else if (content.len != expected_len || memcmp(content.data, expected, expected_len)) {
+    fprintf(stderr, "%s: wrong content\n", name);
+    result = -1;
+  }
+  free(content.data);
+  printf("%s: %s\n", name, result ? "failed" : "ok");
+  return result;
+}
+
+// Make an edit, keeping the note as it was before and after and the journal it wrote.
+// Returns `0` on success or `-1` on error, printing issues.
+//
+// `key`: the notebook key
+// `folder`: the notes directory
+// `note_name`: the name of the note file
+// `append`: `1` to add the content to the end of the note
+// `content`: the content the edit writes
+// `len`: the content's length
+// `before`: A pointer to where the note from before the edit is to be placed
+// `after`: A pointer to where the note from after the edit is to be placed
+// `journal`: A pointer to where the journal is to be placed
+int make_edit(const unsigned char *key, const char *folder, const char *note_name, int append,
+    const unsigned char *content, size_t len, struct file_bytes *before, struct file_bytes *after,
+    struct file_bytes *journal) {
+  char path[PATH_MAX];
+  char journal_path[PATH_MAX];
+  if (note_file_path(folder, note_name, path) || journal_file_path(folder, note_name, journal_path)
+      || read_file(path, before)) {
+    return -1;
+  }
+
+  // The edit is made the way `edit_note` makes it, but its journal is kept.
+  int fd = open(path, O_RDWR);
+  int journal_fd = open(journal_path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  int error = fd < 0 || journal_fd < 0 ? NOTE_ERR_IO
+      : append ? append_chunked_note(fd, journal_fd, key, content, len)
+      : write_chunked_range(fd, journal_fd, key, TEST_EDIT_OFFSET, content, len);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (journal_fd >= 0) {
+    close(journal_fd);
+  }
+  if (error) {
+    fprintf(stderr, "edit failed: %s\n", note_error_string(error));
+    return -1;
+  }
+  if (read_file(path, after) || read_file(journal_path, journal)) {
+    return -1;
+  }
+  unlink(journal_path);
+  return 0;
+}
+
+// Remove a file or directory, for nftw.
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main() {
+  char dir[] = "/tmp/notes-journal-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  // Set up a notebook.
+  char path[PATH_MAX];
+  char folder[PATH_MAX];
+  struct login_details details;
+  generate_salt(details.salt);
+  unsigned char *hash = calculate_hash(TEST_PASSWORD, details.salt);
+  snprintf(path, sizeof(path), "%s/%s", dir, LOGIN_FILE);
+  snprintf(folder, sizeof(folder), "%s/%s", dir, NOTEBOOK_FOLDER);
+  if (hash == NULL || mkdir(folder, S_IRWXU)) {
+    perror(folder);
+    return 1;
+  }
+  memcpy(details.hash, hash, sizeof(details.hash));
+  free(hash);
+  if (write_login_file(path, &details)) {
+    perror(path);
+    return 1;
+  }
+  unsigned char *key = log_in(TEST_PASSWORD, details.salt, details.hash);
+
+  // The old and new content, for both kinds of edit.
+  unsigned char *old_content = malloc(TEST_NOTE_SIZE);
+  unsigned char *edited = malloc(TEST_NOTE_SIZE);
+  unsigned char *appended = malloc(TEST_NOTE_SIZE + TEST_APPEND_SIZE);
+  int status = key == NULL || old_content == NULL || edited == NULL || appended == NULL;
+  unsigned long id = 0;
+  char note_name[NAME_MAX + 1];
+  if (!status) {
+    fill_content(old_content, TEST_NOTE_SIZE, 1);
+    memcpy(edited, old_content, TEST_NOTE_SIZE);
+    fill_content(edited + TEST_EDIT_OFFSET, TEST_EDIT_SIZE, 2);
+    memcpy(appended, old_content, TEST_NOTE_SIZE);
+    fill_content(appended + TEST_NOTE_SIZE, TEST_APPEND_SIZE, 3);
+    status = create_note(key, folder, old_content, TEST_NOTE_SIZE, &id) != 0;
+    sprintf(note_name, ".%lu", id);
+  }
+
+  struct file_bytes before = {0};
+  struct file_bytes after = {0};
+  struct file_bytes journal = {0};
+  unsigned long failed = 0;
+  if (!status) {
+    status = make_edit(key, folder, note_name, 0, edited + TEST_EDIT_OFFSET, TEST_EDIT_SIZE, &before, &after, &journal);
+  }
+  if (!status) {
+    // Nothing applied yet: the journal finishes the edit.
+    failed += check_recovery("edit, journal written", key, folder, note_name, &before, &journal, edited,
+        TEST_NOTE_SIZE) != 0;
+
+    // The first chunk applied, but not the second or the header.
+    struct file_bytes partial = {malloc(before.len), before.len};
+    size_t slot = NONCE_SIZE + NOTE_CHUNK_SIZE + TAG_SIZE;
+    if (partial.data != NULL) {
+      memcpy(partial.data, before.data, before.len);
+      memcpy(partial.data + NOTE_HEADER_SIZE, after.data + NOTE_HEADER_SIZE, slot);
+    }
+    failed += partial.data == NULL || check_recovery("edit, partly applied", key, folder, note_name, &partial,
+        &journal, edited, TEST_NOTE_SIZE) != 0;
+    free(partial.data);
+
+    // The journal never made it to disk whole: the edit never happened.
+    struct file_bytes torn = {journal.data, journal.len / 2};
+    failed += check_recovery("edit, journal torn", key, folder, note_name, &before, &torn, old_content,
+        TEST_NOTE_SIZE) != 0;
+  }
+  free(before.data);
+  free(after.data);
+  free(journal.data);
+  memset(&before, 0, sizeof(before));
+  memset(&after, 0, sizeof(after));
+  memset(&journal, 0, sizeof(journal));
+
+  if (!status) {
+    status = make_edit(key, folder, note_name, 1, appended + TEST_NOTE_SIZE, TEST_APPEND_SIZE, &before, &after,
+        &journal);
+  }
+  if (!status) {
+    // New chunks are written past the old end before the journal, so a crash leaves them there.
+    struct file_bytes extended = {malloc(after.len), after.len};
+    if (extended.data != NULL) {
+      memcpy(extended.data, after.data, after.len);
+      memcpy(extended.data, before.data, before.len);
+    }
+    failed += extended.data == NULL || check_recovery("append, journal written", key, folder, note_name, &extended,
+        &journal, appended, TEST_NOTE_SIZE + TEST_APPEND_SIZE) != 0;
+
+    struct file_bytes torn = {journal.data, journal.len - 1};
+    failed += extended.data == NULL || check_recovery("append, journal torn", key, folder, note_name, &extended,
+        &torn, old_content, TEST_NOTE_SIZE) != 0;
+    free(extended.data);
+  }
+  free(before.data);
+  free(after.data);
+  free(journal.data);
+
+  status = status || failed;
+  free(key);
+  free(old_content);
+  free(edited);
+  free(appended);
+  nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  printf(status ? "FAIL\n" : "PASS\n");
+  return status;
+}
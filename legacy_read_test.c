@@ -0,0 +1,200 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man3/mkdtemp.3.html
+// https://man7.org/linux/man-pages/man3/ftw.3.html
+
+// Checks that notes written before chunked notes survive being read by many threads at once.
+// The first read of such a note rewrites it in the current format, so threads reading the
+// same notes race to upgrade them. Every read must return the original content, and the
+// notes must still read correctly afterwards.
+
+#define _XOPEN_SOURCE 700
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "data.h"
+#include "notes.h"
+#include "security.h"
+
+// Password for the scratch notebook.
+#define TEST_PASSWORD "legacy read test password"
+// Notes written in the old format, and their size, large enough that upgrading takes a while.
+#define TEST_NOTES 4
+#define TEST_NOTE_SIZE 200000
+// Threads reading at once, and reads each makes.
+#define TEST_THREADS 40
+#define TEST_READS 20
+
+// State shared by reading threads.
+struct read_test {
+  struct notes *handle;
+  unsigned char *content[TEST_NOTES];
+  // Reads that failed or returned the wrong content.
+  unsigned long failed;
+};
+
+// A reading thread and the shared state.
+struct reader {
+  struct read_test *test;
+  int index;
+};
+
+// Fill a buffer with content that differs for each note.
+//
+// `buf`: the buffer
+// `id`: the note ID
+void fill_content(unsigned char *buf, unsigned long id) {
+  for (size_t i = 0; i < TEST_NOTE_SIZE; ++i) {
+    buf[i] = 'a' + (i * 7 + id) % 26;
+  }
+}
+
+// Write a note as an IV followed by AES-256-CBC ciphertext, as notes were before chunks.
+// Returns `0` on success or `-1` on error, printing issues.
+//
+// `folder`: the notes directory
+// `key`: the notebook key
+// `id`: the note ID
+// `content`: the note content
+int write_legacy_note(const char *folder, const unsigned char *key, unsigned long id, const unsigned char *content) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/.%lu", folder, id);
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+  unsigned char iv[IV_SIZE];
+  generate_iv(iv);
+  int ok = fwrite(iv, 1, IV_SIZE, file) == IV_SIZE && cipher(content, TEST_NOTE_SIZE, file, key, iv, 1);
+  if (fclose(file) || !ok) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Read a note and check its content.
+// Returns `0` if the note read correctly, `-1` otherwise, printing the problem.
+//
+// `test`: the shared state
+// `id`: the note ID
+// `buf`: a buffer at least `TEST_NOTE_SIZE` long
+int check_note(struct read_test *test, unsigned long id, unsigned char *buf) {
+  size_t len = 0;
+  int error = notes_read_into(test->handle, id, buf, TEST_NOTE_SIZE, &len);
+  if (error) {
+    fprintf(stderr, "note %lu: %s\n", id, notes_strerror(error));
+    return -1;
+  }
+  if (len != TEST_NOTE_SIZE || memcmp(buf, test->content[id - 1], len)) {
+    fprintf(stderr, "note %lu: wrong content\n", id);
+    return -1;
+  }
+  return 0;
+}
+
+// Thread entry point for reading every note several times.
+//
+// `arg`: the reader
+void* read_worker(void *arg) {
+  struct reader *reader = arg;
+  unsigned char *buf = malloc(TEST_NOTE_SIZE);
+  for (int i = 0; i < TEST_READS && buf != NULL; ++i) {
+    unsigned long id = 1 + (reader->index + i) % TEST_NOTES;
+    if (check_note(reader->test, id, buf)) {
+      __atomic_add_fetch(&reader->test->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+// Remove a file or directory, for nftw.
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main() {
+  char dir[] = "/tmp/notes-legacy-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  // Set up a notebook and write notes in the old format with its key.
+  char path[PATH_MAX];
+  char folder[PATH_MAX];
+  struct login_details details;
+  generate_salt(details.salt);
+  unsigned char *hash = calculate_hash(TEST_PASSWORD, details.salt);
+  snprintf(path, sizeof(path), "%s/%s", dir, LOGIN_FILE);
+  snprintf(folder, sizeof(folder), "%s/%s", dir, NOTEBOOK_FOLDER);
+  if (hash == NULL || mkdir(folder, S_IRWXU)) {
+    perror(folder);
+    return 1;
+  }
+  memcpy(details.hash, hash, sizeof(details.hash));
+  free(hash);
+  if (write_login_file(path, &details)) {
+    perror(path);
+    return 1;
+  }
+  unsigned char *key = log_in(TEST_PASSWORD, details.salt, details.hash);
+
+  struct read_test test = {0};
+  int status = key == NULL;
+  for (unsigned long id = 1; id <= TEST_NOTES && !status; ++id) {
+    test.content[id - 1] = malloc(TEST_NOTE_SIZE);
+    status = test.content[id - 1] == NULL;
+    if (!status) {
+      fill_content(test.content[id - 1], id);
+      status = write_legacy_note(folder, key, id, test.content[id - 1]);
+    }
+  }
+  free(key);
+
+  if (!status && notes_open(dir, TEST_PASSWORD, &test.handle)) {
+    fprintf(stderr, "notebook could not be opened\n");
+    status = 1;
+  }
+
+  if (!status) {
+    pthread_t threads[TEST_THREADS];
+    struct reader readers[TEST_THREADS];
+    int started = 0;
+    for (; started < TEST_THREADS; ++started) {
+      readers[started].test = &test;
+      readers[started].index = started;
+      if (pthread_create(&threads[started], NULL, read_worker, &readers[started])) {
+        break;
+      }
+    }
+    for (int i = 0; i < started; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+    printf("%lu of %d concurrent reads failed\n", test.failed, started * TEST_READS);
+
+    // Notes must still be whole once every upgrade is over.
+    unsigned char *buf = malloc(TEST_NOTE_SIZE);
+    unsigned long damaged = 0;
+    for (unsigned long id = 1; id <= TEST_NOTES && buf != NULL; ++id) {
+      damaged += check_note(&test, id, buf) != 0;
+    }
+    printf("%lu of %d notes damaged afterwards\n", damaged, TEST_NOTES);
+    free(buf);
+    status = test.failed || damaged || buf == NULL;
+    notes_close(test.handle);
+  }
+
+  for (int i = 0; i < TEST_NOTES; ++i) {
+    free(test.content[i]);
+  }
+  nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  printf(status ? "FAIL\n" : "PASS\n");
+  return status;
+}
@@ -5,6 +5,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,47 +16,220 @@
 #include <openssl/sha.h>
 #include "security.h"
 #include "data.h"
+#include "scrub.h"
+#include "mirror.h"
+#include "migrate.h"
+#include "prefetch.h"
+#include "startup.h"
+#include "trace.h"
+#include "writeback.h"
 
 // Define minimum password length.
 #define MIN_PASSWORD_LEN 12
 
 // Constants for file locations.
-const char *folder = ".notebook";
-const char *login_storage = ".login";
+const char *folder = NOTEBOOK_FOLDER;
+const char *login_storage = LOGIN_FILE;
 
-// Struct for storing salted and hashed password and salt.
-struct login_details {
-  unsigned char hash[SHA256_DIGEST_LENGTH];
-  unsigned char salt[SALT_SIZE];
-};
+// Notes decrypted in this session, so viewing them again doesn't decrypt them again.
+static struct note_cache cache;
+// Whether the cache was set up. It is only used by the main menu.
+static int have_cache = 0;
+
+// Decrypts notes likely to be viewed next into the cache while the menu waits for input.
+static struct prefetcher prefetcher;
+static int have_prefetcher = 0;
+
+// Encrypts and writes notes added from the menu, so adding one doesn't wait for the disk.
+static struct write_queue writer;
+static int have_writer = 0;
 
 // Commonly-used terminal settings.
 static struct termios originalt;
 static struct termios instant_no_echo;
+// Whether the terminal settings have been read. Only interactive input needs them.
+static int have_termios = 0;
+
+// Read the terminal settings, if not done already.
+// Also flushes output, as this is called just before waiting for input, and prompts
+// must be shown even when output is not a terminal.
+// Returns 1 if input is a terminal, 0 otherwise.
+int init_termios() {
+  fflush(stdout);
+  if (!have_termios) {
+    // Store the original terminal settings for later restoration.
+    have_termios = tcgetattr(STDIN_FILENO, &originalt) ? -1 : 1;
+    // Create a copy for modification.
+    instant_no_echo = originalt;
+    // Turn off echo and awaiting newline for inputs.
+    instant_no_echo.c_lflag &= ~(ICANON | ECHO);
+  }
+  return have_termios > 0;
+}
 
 // Turn echo off and don't wait for newlines.
 // Author: Adam
 void echo_icanon_off() {
-  tcsetattr( STDIN_FILENO, TCSANOW, &instant_no_echo);
+  if (init_termios()) {
+    tcsetattr( STDIN_FILENO, TCSANOW, &instant_no_echo);
+  }
 }
 
 // Reset terminal to its original state.
 // Turns echo back on and waits for newlines to process input.
 // Author: Adam
 void reset_termios() {
-  tcsetattr(STDIN_FILENO, TCSANOW, &originalt);
+  if (have_termios > 0) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &originalt);
+  }
 }
 
 // Await a keystroke from the user to avoid pushing content out of view.
 // Author: Adam
 void pause_for_input() {
-  echo_icanon_off();
   printf("\nPress any key to return to the main menu...");
+  echo_icanon_off();
   getchar();
   reset_termios();
   printf("\n\n\n");
 }
 
+// Ask the user whether to display another page of notes.
+// Returns 1 to continue or 0 to stop.
+//
+// `remaining`: the number of notes not yet displayed
+int more_notes(unsigned long remaining) {
+  printf("-- %lu more, press q to stop or any other key to continue --", remaining);
+  echo_icanon_off();
+  int selection = getchar();
+  reset_termios();
+  printf("\n");
+  return selection != 'q' && selection != EOF;
+}
+
+// Tell the user about added notes the write queue could not save, as they were told
+// the notes were being saved.
+//
+// `failed`: the number of notes that could not be saved
+static void report_unsaved(unsigned long failed) {
+  if (failed) {
+    printf("%lu new note%s could not be saved, and %s removed.\n", failed, failed == 1 ? "" : "s",
+        failed == 1 ? "was" : "were");
+  }
+}
+
+// Prefetch notes, skipping any still waiting to be written, as they are shown from the
+// write queue and reading their files would only wait for them to be written.
+//
+// `ids`: the note IDs, which may be reordered
+// `count`: the number of IDs
+static void hint_notes(unsigned long *ids, size_t count) {
+  size_t hints = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (!have_writer || !writeback_waiting(&writer, ids[i])) {
+      ids[hints++] = ids[i];
+    }
+  }
+  prefetch_hint(&prefetcher, ids, hints);
+}
+
+// Prefetch the notes shown last in a listing, as the newest notes are the likeliest to be viewed.
+//
+// `ids`: the IDs listed, in order
+// `count`: the number of IDs
+void prefetch_listed(const unsigned long *ids, size_t count) {
+  unsigned long newest[PREFETCH_QUEUE_SIZE];
+  size_t hints = 0;
+  while (hints < PREFETCH_QUEUE_SIZE && hints < count) {
+    newest[hints] = ids[count - hints - 1];
+    ++hints;
+  }
+  hint_notes(newest, hints);
+}
+
+// Print all notes in the notes directory, a page at a time.
+// Returns the number of notes printed.
+//
+// `prefetch`: `1` to prefetch the listed notes, i.e. when one will be viewed
+long print_notes(int prefetch) {
+  struct list_options options = {0};
+  options.more = more_notes;
+  if (prefetch && have_prefetcher) {
+    options.listed = prefetch_listed;
+  }
+  return list_notes_paged(folder, &options);
+}
+
+// Parse a non-negative number from a command line argument.
+// Returns 0 on success, printing issues and returning 1 otherwise.
+//
+// `name`: the name of the option, for error messages
+// `arg`: the argument to parse
+// `result`: A pointer to where the result is to be placed
+int parse_number(const char *name, const char *arg, unsigned long *result) {
+  char *end = NULL;
+  errno = 0;
+  *result = strtoul(arg, &end, 10);
+  if (errno || end == arg || *end != '\0' || arg[0] == '-') {
+    fprintf(stderr, "Invalid value for --%s: %s\n", name, arg);
+    return 1;
+  }
+  return 0;
+}
+
+// Parse a note ID from a command line argument into a note name.
+// Returns 0 on success, printing issues and returning 1 otherwise.
+//
+// `name`: the name of the option, for error messages
+// `arg`: the argument to parse
+// `note_name`: A pointer to where the note name is to be placed, at least `MAXNAMLEN` long
+int parse_note_name(const char *name, const char *arg, char *note_name) {
+  unsigned long id = 0;
+  if (parse_number(name, arg, &id)) {
+    return 1;
+  }
+  if (!id) {
+    fprintf(stderr, "Invalid note for --%s: %s\n", name, arg);
+    return 1;
+  }
+  sprintf(note_name, ".%lu", id);
+  return 0;
+}
+
+// Change part of a note or add to its end, using all of standard input as the content.
+// Returns 0 on success, printing issues and returning 1 otherwise.
+//
+// `secret`: the key to use for encryption
+// `note_name`: the name of the note file
+// `append`: `1` to add the content to the end of the note, ignoring the offset
+// `offset`: where the content goes, or if negative, how far from the end it goes
+int edit_from_input(const unsigned char *secret, const char *note_name, int append, long long offset) {
+  size_t len = 0;
+  size_t capacity = 4096;
+  unsigned char *content = malloc(capacity);
+  size_t bytes_read;
+  while (content != NULL && (bytes_read = fread(content + len, 1, capacity - len, stdin)) > 0) {
+    len += bytes_read;
+    if (len == capacity) {
+      capacity *= 2;
+      unsigned char *grown = realloc(content, capacity);
+      if (grown == NULL) {
+        free(content);
+      }
+      content = grown;
+    }
+  }
+  if (content == NULL || ferror(stdin)) {
+    perror("note content");
+    free(content);
+    return 1;
+  }
+
+  int result = edit_note(secret, folder, note_name, append, offset, content, len);
+  free(content);
+  return result != 0;
+}
+
 // Display the main menu.
 //
 // `secret`: the key to use for encryption and decryption
@@ -72,7 +246,9 @@ void view_menu(unsigned char *secret);
 void add_menu(unsigned char *secret);
 
 // Display the "Delete Note" menu.
-void delete_menu();
+//
+// `secret`: the key to use for decryption, to release chunks deleted notes held
+void delete_menu(unsigned char *secret);
 
 // Accept a line of text as a password from the user.
 // Side effects: Allocates memory to store password.
@@ -86,9 +262,11 @@ int intake_password(char **pwd) {
   printf("Please enter your password: ");
 
   // Turn off echo. No password peeksies!
-  struct termios no_echo = originalt;
-  no_echo.c_lflag &= ~ECHO;
-  tcsetattr(STDIN_FILENO, TCSANOW, &no_echo);
+  if (init_termios()) {
+    struct termios no_echo = originalt;
+    no_echo.c_lflag &= ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &no_echo);
+  }
 
   // Read line of input from user. Note that this allocates memory!
   *pwd = NULL;
@@ -118,55 +296,312 @@ int intake_password(char **pwd) {
 // `argv`: The arguments used when running the executable
 // Author: Adam
 int main(int argc, char *argv[]) {
-  // Store the original terminal settings for later restoration.
-  tcgetattr(STDIN_FILENO, &originalt);
-  // Create a copy for modification.
-  instant_no_echo = originalt;
-  // Turn off echo and awaiting newline for inputs.
-  instant_no_echo.c_lflag &= ~(ICANON | ECHO);
-
-  // Check for cli password parameter.
+  unsigned long long started = trace_begin();
+
+  // Long-only options.
+  enum {
+    OPT_FROM = 256,
+    OPT_LIMIT,
+    OPT_MIGRATE_LAYOUT,
+    OPT_SCRUB,
+    OPT_JOBS,
+    OPT_RATE,
+    OPT_READ,
+    OPT_OFFSET,
+    OPT_LENGTH,
+    OPT_APPEND,
+    OPT_WRITE,
+    OPT_CACHE,
+    OPT_CACHE_IDLE,
+    OPT_NO_PREFETCH,
+    OPT_HISTORY,
+    OPT_RESTORE,
+    OPT_REVISION,
+    OPT_MIRROR,
+    OPT_DELETE,
+    OPT_MIGRATE_FORMAT,
+    OPT_DEDUP,
+  };
+  static const struct option long_options[] = {
+    {"password", required_argument, NULL, 'p'},
+    {"list", no_argument, NULL, 'l'},
+    {"from", required_argument, NULL, OPT_FROM},
+    {"limit", required_argument, NULL, OPT_LIMIT},
+    {"migrate-layout", required_argument, NULL, OPT_MIGRATE_LAYOUT},
+    {"scrub", no_argument, NULL, OPT_SCRUB},
+    {"jobs", required_argument, NULL, OPT_JOBS},
+    {"rate", required_argument, NULL, OPT_RATE},
+    {"read", required_argument, NULL, OPT_READ},
+    {"offset", required_argument, NULL, OPT_OFFSET},
+    {"length", required_argument, NULL, OPT_LENGTH},
+    {"append", required_argument, NULL, OPT_APPEND},
+    {"write", required_argument, NULL, OPT_WRITE},
+    {"cache", required_argument, NULL, OPT_CACHE},
+    {"cache-idle", required_argument, NULL, OPT_CACHE_IDLE},
+    {"no-prefetch", no_argument, NULL, OPT_NO_PREFETCH},
+    {"history", required_argument, NULL, OPT_HISTORY},
+    {"restore", required_argument, NULL, OPT_RESTORE},
+    {"revision", required_argument, NULL, OPT_REVISION},
+    {"mirror", required_argument, NULL, OPT_MIRROR},
+    {"delete", required_argument, NULL, OPT_DELETE},
+    {"migrate-format", no_argument, NULL, OPT_MIGRATE_FORMAT},
+    {"dedup", required_argument, NULL, OPT_DEDUP},
+    {NULL, 0, NULL, 0},
+  };
+
+  // Check for cli parameters.
   char *pwd = 0;
-  char opt = 0;
-  while ((opt = getopt(argc, argv, "p:")) != -1) {
+  int list = 0;
+  unsigned long shard_depth = 0;
+  int migrate = 0;
+  int dedup = -1;
+  const char *mirror = NULL;
+  struct list_options list_options = {0};
+  unsigned long number = 0;
+
+  // Commands that need the secret run in place of the main menu.
+  enum {
+    COMMAND_MENU,
+    COMMAND_SCRUB,
+    COMMAND_READ,
+    COMMAND_APPEND,
+    COMMAND_WRITE,
+    COMMAND_HISTORY,
+    COMMAND_RESTORE,
+    COMMAND_DELETE,
+    COMMAND_MIGRATE_FORMAT,
+  } command = COMMAND_MENU;
+  struct scrub_options scrub_options = {0};
+  scrub_options.report = stdout;
+  char note_name[MAXNAMLEN] = "";
+  long long offset = 0;
+  unsigned long long length = 0;
+  unsigned long revision = 0;
+  int have_revision = 0;
+  const char *delete_spec = NULL;
+  unsigned int jobs = 0;
+  size_t cache_size = CACHE_DEFAULT_SIZE;
+  unsigned int cache_idle = CACHE_DEFAULT_IDLE;
+  int prefetch = 1;
+
+  int opt = 0;
+  while ((opt = getopt_long(argc, argv, "p:l", long_options, NULL)) != -1) {
     switch (opt) {
       case 'p':
         pwd = optarg;
         break;
+      case 'l':
+        list = 1;
+        break;
+      case OPT_FROM:
+        if (parse_number("from", optarg, &list_options.from)) {
+          return 1;
+        }
+        break;
+      case OPT_LIMIT:
+        if (parse_number("limit", optarg, &list_options.limit)) {
+          return 1;
+        }
+        break;
+      case OPT_MIGRATE_LAYOUT:
+        if (parse_number("migrate-layout", optarg, &shard_depth)) {
+          return 1;
+        }
+        migrate = 1;
+        break;
+      case OPT_MIRROR:
+        mirror = optarg;
+        break;
+      case OPT_DEDUP:
+        if (strcmp(optarg, "on") && strcmp(optarg, "off")) {
+          fprintf(stderr, "Invalid value for --dedup: %s\n", optarg);
+          return 1;
+        }
+        dedup = !strcmp(optarg, "on");
+        break;
+      case OPT_SCRUB:
+        command = COMMAND_SCRUB;
+        break;
+      case OPT_JOBS:
+        if (parse_number("jobs", optarg, &number)) {
+          return 1;
+        }
+        scrub_options.jobs = number;
+        jobs = number;
+        break;
+      case OPT_RATE:
+        // Rates are given in KiB per second.
+        if (parse_number("rate", optarg, &number)) {
+          return 1;
+        }
+        scrub_options.rate = number * 1024;
+        break;
+      case OPT_READ:
+        if (parse_note_name("read", optarg, note_name)) {
+          return 1;
+        }
+        command = COMMAND_READ;
+        break;
+      case OPT_APPEND:
+        if (parse_note_name("append", optarg, note_name)) {
+          return 1;
+        }
+        command = COMMAND_APPEND;
+        break;
+      case OPT_WRITE:
+        if (parse_note_name("write", optarg, note_name)) {
+          return 1;
+        }
+        command = COMMAND_WRITE;
+        break;
+      case OPT_HISTORY:
+        if (parse_note_name("history", optarg, note_name)) {
+          return 1;
+        }
+        command = COMMAND_HISTORY;
+        break;
+      case OPT_RESTORE:
+        if (parse_note_name("restore", optarg, note_name)) {
+          return 1;
+        }
+        command = COMMAND_RESTORE;
+        break;
+      case OPT_MIGRATE_FORMAT:
+        command = COMMAND_MIGRATE_FORMAT;
+        break;
+      case OPT_DELETE:
+        delete_spec = optarg;
+        command = COMMAND_DELETE;
+        break;
+      case OPT_REVISION:
+        if (parse_number("revision", optarg, &revision)) {
+          return 1;
+        }
+        have_revision = 1;
+        break;
+      case OPT_OFFSET:
+        // Negative offsets count back from the end of the note.
+        if (parse_number("offset", optarg[0] == '-' ? optarg + 1 : optarg, &number)) {
+          return 1;
+        }
+        offset = optarg[0] == '-' ? -(long long) number : (long long) number;
+        break;
+      case OPT_LENGTH:
+        if (parse_number("length", optarg, &number)) {
+          return 1;
+        }
+        length = number;
+        break;
+      case OPT_CACHE:
+        // Cache sizes are given in KiB, and 0 turns the cache off.
+        if (parse_number("cache", optarg, &number)) {
+          return 1;
+        }
+        cache_size = number * 1024;
+        break;
+      case OPT_CACHE_IDLE:
+        if (parse_number("cache-idle", optarg, &number)) {
+          return 1;
+        }
+        cache_idle = number;
+        break;
+      case OPT_NO_PREFETCH:
+        prefetch = 0;
+        break;
       default:
         continue;
     }
   }
 
-  printf("\nWelcome to Secret Notes!\n");
+  if (command == COMMAND_RESTORE && !have_revision) {
+    fprintf(stderr, "Missing --revision for --restore.\n");
+    return 1;
+  }
 
-  int pwd_allocated = 0;
-  struct login_details details;
-  int details_len = sizeof(details);
+  // Check IDs before asking for a password.
+  struct id_range *delete_ranges = NULL;
+  size_t delete_range_count = 0;
+  if (command == COMMAND_DELETE && parse_id_ranges(delete_spec, &delete_ranges, &delete_range_count)) {
+    return 1;
+  }
 
-  // Try to read salt and hash from disk.
-  int fd = open(login_storage, O_RDONLY);
-  if (fd > 0) {
-    // If the file was opened, we can read from it.
-    int bytesRead = read(fd, &details, details_len);
-    if (bytesRead != details_len) {
-      if (bytesRead < 0) {
-        perror(login_storage);
-      } else {
-        fprintf(stderr, "Login details file (%s) is corrupted! Please delete it.\n", login_storage);
-      }
+  // Moving notes between shards doesn't touch content, so no password is required.
+  if (migrate) {
+    long moved = migrate_layout(folder, shard_depth > MAX_SHARD_DEPTH ? -1 : (int) shard_depth);
+    if (moved < 0) {
       return 1;
     }
-    if (close(fd)) {
-      perror(login_storage);
+    printf("Moved %ld notes to a layout with %lu shard levels.\n", moved, shard_depth);
+    return 0;
+  }
+
+  // Deduplication only changes how notes are stored from now on, so no password is required.
+  if (dedup >= 0) {
+    struct notebook_config config;
+    if (mkdir(folder, S_IRUSR | S_IWUSR | S_IXUSR) && errno != EEXIST) {
+      perror(folder);
+      return 1;
+    }
+    if (read_config(folder, &config)) {
+      return 1;
+    }
+    config.dedup = dedup;
+    if (write_config(folder, &config)) {
+      return 1;
+    }
+    printf("New notes are %s.\n", dedup ? "deduplicated" : "stored whole");
+    return 0;
+  }
+
+  // Mirrors hold notes still encrypted, so no password is required.
+  if (mirror) {
+    struct mirror_stats stats;
+    int result = mirror_notebook(folder, mirror, &stats);
+    printf("Mirrored to %s: %lu copied (%llu bytes), %lu removed, %lu unchanged.\n", mirror, stats.copied,
+        stats.bytes, stats.removed, stats.unchanged);
+    return result != 0;
+  }
+
+  // Listing only needs note names, not content, so no password is required.
+  // Page output for people, but not for pipes.
+  if (list) {
+    if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+      list_options.more = more_notes;
     }
+    return list_notes_paged(folder, &list_options) < 0;
+  }
+
+  // Keep command output clean for other programs.
+  if (command == COMMAND_MENU) {
+    printf("\nWelcome to Secret Notes!\n");
+  }
+
+  // Get the menu ready while the password is typed, or while the key is derived if another
+  // processor is free. Commands don't need the notes scanned.
+  struct startup startup;
+  int have_startup = command == COMMAND_MENU && (pwd == 0 || sysconf(_SC_NPROCESSORS_ONLN) > 1)
+      && !startup_begin(&startup, folder);
+
+  trace_end("startup", started);
+
+  int pwd_allocated = 0;
+  struct login_details details;
+  int legacy_login = 0;
 
+  // Try to read salt and hash from disk.
+  if (!read_login_file(login_storage, &details, &legacy_login)) {
     // If password is not specified, read it.
     if (pwd == 0) {
       // Flag for later memory deallocation.
       pwd_allocated = 1;
       intake_password(&pwd);
     }
+  } else if (errno == EBADMSG) {
+    fprintf(stderr, "Login details file (%s) is corrupted! Please delete it.\n", login_storage);
+    return 1;
+  } else if (errno == ENOTSUP) {
+    fprintf(stderr, "Login details file (%s) was written by a newer version of notes.\n", login_storage);
+    return 1;
   } else if (errno == ENOENT) {
     // If the file doesn't exist, do first-time setup.
     printf("------------------------------------------------------------------------------------------\n");
@@ -212,22 +647,14 @@ int main(int argc, char *argv[]) {
     // Free up memory consumed by the hash.
     free(hash);
 
-    // Open the login file.
-    fd = open(login_storage, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
-
-    if (fd <= 0) {
+    // Save to disk.
+    if (write_login_file(login_storage, &details)) {
       perror(login_storage);
       if (pwd_allocated && &pwd > 0) {
         free(pwd);
       }
       return 1;
     }
-
-    // Save to disk.
-    if (write(fd, &details, details_len) != details_len) {
-      perror(login_storage);
-      return 1;
-    }
   } else {
     // For other errors (Access permission, file limit, etc.) log and exit.
     perror(login_storage);
@@ -236,27 +663,108 @@ int main(int argc, char *argv[]) {
 
   // Convert password to secret.
   unsigned char *secret = log_in(pwd, details.salt, details.hash);
+  size_t newest = have_startup ? startup_finish(&startup) : 0;
 
   // Clean up password if possible.
   if (pwd_allocated && &pwd > 0) {
     free(pwd);
   }
 
+  // Bring an old login file up to the current format once it is known to be right.
+  if (secret != NULL && legacy_login && write_login_file(login_storage, &details)) {
+    perror(login_storage);
+  }
+
+  int status = 0;
   if (secret != NULL) {
-    while (main_menu(secret)) {
-      // While exit is not selected, always re-enter main menu after completion.
-    }
+    switch (command) {
+      case COMMAND_SCRUB:
+        // Any problem found is a failure, so scripts can tell.
+        status = scrub_notes(secret, folder, &scrub_options) != 0;
+        break;
+      case COMMAND_READ:
+        if (have_revision) {
+          status = read_revision(secret, folder, note_name, revision) != 0;
+        } else {
+          status = read_note_range(secret, folder, note_name, offset, length) != 0;
+        }
+        break;
+      case COMMAND_HISTORY:
+        status = list_history(secret, folder, note_name) != 0;
+        break;
+      case COMMAND_RESTORE:
+        status = restore_note(secret, folder, note_name, revision) != 0;
+        if (!status) {
+          printf("Restored note %s to revision %lu.\n", note_name + sizeof(char), revision);
+        }
+        break;
+      case COMMAND_MIGRATE_FORMAT: {
+        struct migrate_stats stats;
+        status = migrate_notes(secret, folder, scrub_options.rate, &stats) != 0;
+        printf("Upgraded %lu notes (%llu bytes) to format version %d, %lu current", stats.upgraded, stats.bytes,
+            NOTE_FORMAT_VERSION, stats.current);
+        if (stats.newer) {
+          printf(", %lu newer than this version", stats.newer);
+        }
+        printf(".\n");
+        break;
+      }
+      case COMMAND_DELETE: {
+        long deleted = delete_notes(secret, folder, delete_ranges, delete_range_count, jobs);
+        status = deleted < 0;
+        if (!status) {
+          printf("Deleted %ld notes.\n", deleted);
+        }
+        break;
+      }
+      case COMMAND_APPEND:
+      case COMMAND_WRITE:
+        status = edit_from_input(secret, note_name, command == COMMAND_APPEND, offset);
+        break;
+      case COMMAND_MENU:
+      default:
+        // Without a cache, notes are decrypted every time they are viewed.
+        have_cache = cache_size && !cache_init(&cache, cache_size, cache_idle);
+        have_prefetcher = have_cache && prefetch && !prefetch_start(&prefetcher, secret, folder, &cache);
+        // Without a write queue, notes are written before the menu returns.
+        have_writer = !writeback_start(&writer, secret, folder);
+        if (have_prefetcher) {
+          // The newest notes were read from disk at startup. Decrypt them before they're asked for.
+          prefetch_hint(&prefetcher, startup.newest, newest);
+        }
 
-    printf("\nGoodbye!\n");
+        while (main_menu(secret)) {
+          // While exit is not selected, always re-enter main menu after completion.
+        }
+
+        // Save added notes, then wipe decrypted notes before leaving.
+        if (have_writer) {
+          report_unsaved(writeback_stop(&writer));
+          have_writer = 0;
+        }
+        if (have_prefetcher) {
+          prefetch_stop(&prefetcher);
+          have_prefetcher = 0;
+        }
+        if (have_cache) {
+          cache_destroy(&cache);
+          have_cache = 0;
+        }
+        printf("\nGoodbye!\n");
+        break;
+    }
 
     // Free memory allocated for secret.
     free(secret);
   } else {
     printf("Access denied. Make sure you have entered your password correctly.\n");
     sleep(1);
+    status = command != COMMAND_MENU;
   }
+  free(delete_ranges);
 
-  return 0;
+  trace_end("main", started);
+  return status;
 }
 
 // Display the main menu. Intakes a user selection from prompt and opens relevant submenu.
@@ -273,9 +781,14 @@ int main_menu(unsigned char *secret) {
 
   echo_icanon_off();
 
-  char selection;
+  int selection;
   while ((selection = getchar()) < '1' || selection > '4') {
     // printf("Invalid selection %c\n", selection);
+    // Out of input, i.e. a script ended without choosing to exit.
+    if (selection == EOF) {
+      reset_termios();
+      return 0;
+    }
   }
 
   reset_termios();
@@ -306,7 +819,7 @@ int main_menu(unsigned char *secret) {
 void view_menu(unsigned char *secret) {
   // Print notes in notes directory.
   printf("Current notes:\n");
-  int count = list_notes(folder);
+  long count = print_notes(1);
 
   if (count <= 0) {
     printf("No notes! Maybe you should write some.\n");
@@ -326,9 +839,22 @@ void view_menu(unsigned char *secret) {
     return;
   }
 
-  // Decrypt note.
+  // Decrypt note, unless it was prefetched while the name was being typed.
+  unsigned long id = parse_note_id(note_name);
+  if (have_prefetcher) {
+    prefetch_claim(&prefetcher, id);
+  }
   printf("Decrypting note %s!\n", note_name + sizeof(char));
-  read_note(secret, folder, note_name);
+  // A note still being saved is shown from memory. Its file is not ready to be read.
+  if (!have_writer || !writeback_read(&writer, id, write_stdout, NULL)) {
+    read_note(secret, folder, note_name, have_cache ? &cache : NULL);
+  }
+
+  // Notes are often read in order, so get the neighbours ready while this one is read.
+  if (have_prefetcher) {
+    unsigned long neighbours[] = {id + 1, id - 1};
+    hint_notes(neighbours, id > 1 ? 2 : 1);
+  }
 
   // Free memory used by note name.
   free(note_name);
@@ -345,6 +871,7 @@ void add_menu(unsigned char *secret) {
   printf("Please enter the note's content:\n");
 
   // Read line of input from user. Note that this allocates memory!
+  fflush(stdout);
   char *input = NULL;
   unsigned long pwd_len = 0;
   int read = getline(&input, &pwd_len, stdin);
@@ -356,8 +883,21 @@ void add_menu(unsigned char *secret) {
 
   input[strcspn(input, "\n")] = 0;
 
-  // Encrypt to file.
-  add_note(secret, folder, input);
+  // Encrypt to file, in the background if possible.
+  if (have_writer) {
+    unsigned long id = 0;
+    int error = writeback_add(&writer, (const unsigned char *) input, strlen(input), &id);
+    if (error == NOTE_ERR_IO && errno == ENOSPC) {
+      printf("Too many notes present to create another!\n");
+      printf("Only up to %d notes are supported.\n", MAX_NOTES);
+    } else if (error && id) {
+      printf("Encryption as note %lu failed: %s\n", id, note_error_string(error));
+    } else if (!error) {
+      printf("Saving as note %lu!", id);
+    }
+  } else {
+    add_note(secret, folder, input);
+  }
 
   // Free memory used by input.
   free(input);
@@ -366,13 +906,19 @@ void add_menu(unsigned char *secret) {
   pause_for_input();
 }
 
-// Display the "Delete Note" menu. Displays existing notes, intakes a note name to delete,
-// and deletes the note.
+// Display the "Delete Note" menu. Displays existing notes, intakes the notes to delete,
+// and deletes them. Several notes may be given as IDs and ranges, i.e. `1-5000,7000`.
 //
+// `secret`: the key to use for decryption, to release chunks deleted notes held
 // Author: Adam
-void delete_menu() {
+void delete_menu(unsigned char *secret) {
+  // Notes still being saved can't be deleted until they are written.
+  if (have_writer) {
+    report_unsaved(writeback_flush(&writer));
+  }
+
   printf("Current notes:\n");
-  int count = list_notes(folder);
+  long count = print_notes(0);
 
   if (count <= 0) {
     printf("No notes! Maybe you should write some.\n");
@@ -382,37 +928,50 @@ void delete_menu() {
 
   printf("Which would you like to delete?\n");
 
-  unsigned long len = 0;
-  char *note_name = intake_file_name(&len);
-
-  if (note_name == NULL) {
-    // Method handles error logging.
+  // Show the prompt before waiting, even when output is not a terminal.
+  fflush(stdout);
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t read = getline(&line, &len, stdin);
+  if (read <= 0) {
+    perror("note IDs");
+    free(line);
     return;
   }
+  line[strcspn(line, "\n")] = '\0';
 
-  // Resolve combined_path vulnerabilities by checking lengths before calls.
-  int len1 = strlen(folder);
-  int len2 = strlen(note_name);
-  int total = 0;
-  if (__builtin_add_overflow(len1, len2, &total)
-      || __builtin_add_overflow(total, 1, &total)
-      || total > PATH_MAX) {
-    fprintf(stderr, "Path too long: %s/%s", folder, note_name);
+  struct id_range *ranges = NULL;
+  size_t range_count = 0;
+  if (parse_id_ranges(line, &ranges, &range_count)) {
+    // Parsing handles error logging.
+    free(line);
+    pause_for_input();
     return;
   }
-  char file_path[PATH_MAX];
-  combined_path(folder, note_name, file_path);
+  free(line);
 
-  printf("Deleting note %s.", note_name + sizeof(char));
+  if (range_count == 1 && ranges[0].first == ranges[0].last) {
+    char note_name[MAXNAMLEN];
+    snprintf(note_name, sizeof(note_name), ".%lu", ranges[0].first);
+    printf("Deleting note %s.", note_name + sizeof(char));
 
-  // Vulnerability mitigation: unlink rather than delete.
-  // Filesystem will delete when links reach 0.
-  if (unlink(file_path)) {
-    perror(file_path);
+    // Deleting handles error logging. A deleted note must not be shown again.
+    if (!delete_note(secret, folder, note_name) && have_cache) {
+      cache_remove(&cache, ranges[0].first);
+    }
+  } else {
+    long deleted = delete_notes(secret, folder, ranges, range_count, 0);
+    if (deleted >= 0) {
+      printf("Deleted %ld notes.", deleted);
+    }
+
+    // Even a failed delete may have removed some notes.
+    if (have_cache) {
+      cache_clear(&cache);
+    }
   }
 
-  // Free memory used by input.
-  free(note_name);
+  free(ranges);
 
   // Pause so user can read before re-displaying main menu.
   pause_for_input();
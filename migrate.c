@@ -0,0 +1,86 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "data.h"
+#include "notefile.h"
+#include "throttle.h"
+#include "migrate.h"
+
+// Upgrade every note written in an older format to the current one.
+// Notes are also upgraded the first time they are read, so this only hurries along
+// notes that haven't been. Each note is locked only while it is rewritten, so the
+// notebook stays in use throughout, and rewrites can be limited to a rate so they don't
+// crowd out other disk use.
+// Returns `0` on success, printing issues and returning `-1` if any note could not be upgraded.
+//
+// `key`: the key to use for encryption and decryption
+// `folder_name`: path of directory containing note files
+// `rate`: bytes of notes rewritten per second, or `0` for no limit
+// `stats`: A pointer to where the counts are to be placed
+int migrate_notes(const unsigned char *key, const char *folder_name, unsigned long rate, struct migrate_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  struct note_ids note_ids = {0};
+  // Go in order, so progress is easy to follow from outside.
+  if (load_note_ids(folder_name, &note_ids) < 0) {
+    free_note_ids(&note_ids);
+    return -1;
+  }
+
+  struct throttle throttle;
+  throttle_init(&throttle, rate);
+  for (size_t i = 0; i < note_ids.count; ++i) {
+    char note_name[32];
+    char file_path[PATH_MAX];
+    sprintf(note_name, ".%lu", note_ids.ids[i]);
+    if (note_file_path(folder_name, note_name, file_path)) {
+      ++stats->failed;
+      continue;
+    }
+
+    // Only the first bytes are needed to tell the format, without a lock.
+    int fd = open(file_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+      // Deleted since the scan.
+      if (errno != ENOENT) {
+        perror(file_path);
+        ++stats->failed;
+      }
+      continue;
+    }
+    struct stat st;
+    int format = fstat(fd, &st) ? -1 : note_format(fd);
+    close(fd);
+
+    if (format == NOTE_FORMAT_VERSION) {
+      ++stats->current;
+      continue;
+    }
+    if (format > NOTE_FORMAT_VERSION) {
+      ++stats->newer;
+      continue;
+    }
+    if (format < 0) {
+      // Empty notes were claimed but never written, and are left for scrub to report.
+      continue;
+    }
+
+    // Old notes are read and written again in full.
+    throttle_wait(&throttle, 2 * (size_t) st.st_size);
+    int result = upgrade_note(key, folder_name, note_name);
+    if (result < 0) {
+      ++stats->failed;
+    } else if (result > 0) {
+      ++stats->upgraded;
+      stats->bytes += st.st_size;
+    } else {
+      ++stats->current;
+    }
+  }
+  throttle_destroy(&throttle);
+  free_note_ids(&note_ids);
+  return stats->failed ? -1 : 0;
+}
@@ -0,0 +1,30 @@
+#ifndef MIGRATE_H
+#define MIGRATE_H 1
+
+// What a format migration did.
+struct migrate_stats {
+  // Notes rewritten in the current format.
+  unsigned long upgraded;
+  // Notes in the current format already.
+  unsigned long current;
+  // Notes written by a newer version, left as they are.
+  unsigned long newer;
+  unsigned long failed;
+  // Bytes of notes rewritten.
+  unsigned long long bytes;
+};
+
+// Upgrade every note written in an older format to the current one.
+// Notes are also upgraded the first time they are read, so this only hurries along
+// notes that haven't been. Each note is locked only while it is rewritten, so the
+// notebook stays in use throughout, and rewrites can be limited to a rate so they don't
+// crowd out other disk use.
+// Returns `0` on success, printing issues and returning `-1` if any note could not be upgraded.
+//
+// `key`: the key to use for encryption and decryption
+// `folder_name`: path of directory containing note files
+// `rate`: bytes of notes rewritten per second, or `0` for no limit
+// `stats`: A pointer to where the counts are to be placed
+int migrate_notes(const unsigned char *key, const char *folder_name, unsigned long rate, struct migrate_stats *stats);
+
+#endif
@@ -0,0 +1,682 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man2/copy_file_range.2.html
+// https://man7.org/linux/man-pages/man2/ioctl_ficlone.2.html
+// https://git-scm.com/docs/racy-git
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+#include "security.h"
+#include "data.h"
+#include "dedup.h"
+#include "mirror.h"
+
+// Suffix of a file being copied into the mirror, renamed into place once complete.
+#define COPY_SUFFIX ".copy"
+
+// Size of the buffer used to hash and copy files.
+#define MIRROR_BUFFER_SIZE 65536
+
+// A file in the notes directory or the manifest.
+struct mirror_entry {
+  // Path relative to the notes directory, i.e. `ab/.171`.
+  char *path;
+  off_t size;
+  struct timespec mtime;
+  // SHA-256 of the file's ciphertext when it was last copied or hashed.
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  // `1` for a note, which is locked while it is read.
+  int note;
+};
+
+// A growable list of files.
+struct mirror_list {
+  struct mirror_entry *entries;
+  size_t count;
+  size_t capacity;
+};
+
+// Add a file to a list, taking ownership of its path.
+// Returns `0` on success or `-1` on error.
+//
+// `list`: the list to add to
+// `entry`: the file
+static int add_mirror_entry(struct mirror_list *list, const struct mirror_entry *entry) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 256;
+    struct mirror_entry *grown = realloc(list->entries, capacity * sizeof(struct mirror_entry));
+    if (grown == NULL) {
+      return -1;
+    }
+    list->entries = grown;
+    list->capacity = capacity;
+  }
+  list->entries[list->count++] = *entry;
+  return 0;
+}
+
+// Free a list and the paths it owns.
+//
+// `list`: the list to free
+static void free_mirror_list(struct mirror_list *list) {
+  for (size_t i = 0; i < list->count; ++i) {
+    free(list->entries[i].path);
+  }
+  free(list->entries);
+}
+
+// Compare files by path for qsort.
+static int compare_mirror_entries(const void *val1, const void *val2) {
+  const struct mirror_entry *entry1 = val1;
+  const struct mirror_entry *entry2 = val2;
+  return strcmp(entry1->path, entry2->path);
+}
+
+// Check if a file in the notes directory belongs in a mirror.
+// Returns `1` for a note, `2` for another file that belongs, or `0` if it doesn't.
+// Temporary files are left out, as they are only complete once renamed.
+//
+// `name`: the file name
+// `level`: the number of shard directory levels above the file
+static int mirror_kind(const char *name, int level) {
+  if (parse_note_id(name)) {
+    return 1;
+  }
+  if (level) {
+    return 0;
+  }
+  if (!strcmp(name, CONFIG_FILE)) {
+    return 2;
+  }
+
+  // Journals and histories are named after their note.
+  static const char *suffixes[] = {JOURNAL_SUFFIX, HISTORY_SUFFIX};
+  size_t len = strlen(name);
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+    size_t suffix_len = strlen(suffixes[i]);
+    char note_name[MAXNAMLEN + 1];
+    if (len > suffix_len && !strcmp(name + len - suffix_len, suffixes[i])) {
+      memcpy(note_name, name, len - suffix_len);
+      note_name[len - suffix_len] = '\0';
+      return parse_note_id(note_name) ? 2 : 0;
+    }
+  }
+  return 0;
+}
+
+// Collect the stored chunks to mirror from the chunk store.
+// Chunks are kept in directories named after the start of their IDs, as `.chunks/ab/ab12...`.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `list`: the list to add files to
+static int collect_chunks(const char *folder_name, struct mirror_list *list) {
+  char store[PATH_MAX];
+  if (checked_path(folder_name, CHUNK_STORE, store)) {
+    return -1;
+  }
+  DIR *dir = opendir(store);
+  if (dir == NULL) {
+    perror(store);
+    return -1;
+  }
+
+  int result = 0;
+  struct dirent *prefix;
+  while (!result && (prefix = readdir(dir))) {
+    char prefix_path[PATH_MAX];
+    DIR *chunks;
+    if (!is_shard_name(prefix->d_name) || checked_path(store, prefix->d_name, prefix_path)
+        || (chunks = opendir(prefix_path)) == NULL) {
+      continue;
+    }
+
+    struct dirent *entry;
+    while (!result && (entry = readdir(chunks))) {
+      // Chunks being written have a temporary name until they are complete.
+      struct stat st;
+      if (!is_chunk_name(entry->d_name) || fstatat(dirfd(chunks), entry->d_name, &st, AT_SYMLINK_NOFOLLOW)
+          || !S_ISREG(st.st_mode)) {
+        continue;
+      }
+      struct mirror_entry file = {0};
+      char relative[PATH_MAX];
+      snprintf(relative, PATH_MAX, "%s/%s/%s", CHUNK_STORE, prefix->d_name, entry->d_name);
+      file.path = strdup(relative);
+      file.size = st.st_size;
+      file.mtime = st.st_mtim;
+      if (file.path == NULL || add_mirror_entry(list, &file)) {
+        free(file.path);
+        perror("mirror files");
+        result = -1;
+      }
+    }
+    closedir(chunks);
+  }
+
+  closedir(dir);
+  return result;
+}
+
+// Collect the files to mirror in a directory and the shard directories below it.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `relative`: path of the directory to collect from, relative to the notes directory
+// `level`: the number of shard directory levels above the directory
+// `list`: the list to add files to
+static int collect_files(const char *folder_name, const char *relative, int level, struct mirror_list *list) {
+  char path[PATH_MAX];
+  if (level == 0) {
+    strcpy(path, folder_name);
+  } else if (checked_path(folder_name, relative, path)) {
+    return -1;
+  }
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    // A missing notebook is an error rather than an empty one, so the mirror is kept.
+    perror(path);
+    return -1;
+  }
+
+  int result = 0;
+  struct dirent *entry;
+  while (!result && (entry = readdir(dir))) {
+    const char *name = entry->d_name;
+    char entry_relative[PATH_MAX];
+    if (snprintf(entry_relative, PATH_MAX, "%s%s%s", relative, level ? "/" : "", name) >= PATH_MAX) {
+      continue;
+    }
+
+    if (level < MAX_SHARD_DEPTH && is_shard_name(name)) {
+      result = collect_files(folder_name, entry_relative, level + 1, list);
+      continue;
+    }
+    if (level == 0 && !strcmp(name, CHUNK_STORE)) {
+      result = collect_chunks(folder_name, list);
+      continue;
+    }
+    int kind = mirror_kind(name, level);
+    struct stat st;
+    if (!kind || fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    struct mirror_entry file = {0};
+    file.path = strdup(entry_relative);
+    file.size = st.st_size;
+    file.mtime = st.st_mtim;
+    file.note = kind == 1;
+    if (file.path == NULL || add_mirror_entry(list, &file)) {
+      free(file.path);
+      perror("mirror files");
+      result = -1;
+    }
+  }
+
+  closedir(dir);
+  return result;
+}
+
+// Read the manifest of a mirror.
+// A missing or unreadable manifest is empty, so everything is copied again.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `target`: path of the mirror directory
+// `list`: the list to add files to
+// `started`: A pointer to where the time the last sync started is to be placed, in seconds
+static int read_manifest(const char *target, struct mirror_list *list, long long *started) {
+  *started = 0;
+  char path[PATH_MAX];
+  if (checked_path(target, MIRROR_MANIFEST, path)) {
+    return -1;
+  }
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    perror(path);
+    return -1;
+  }
+
+  char line[PATH_MAX + 256];
+  int version = 0;
+  long nsec = 0;
+  if (fgets(line, sizeof(line), file) == NULL || sscanf(line, "mirror %d %lld %ld", &version, started, &nsec) != 3
+      || version != MIRROR_FORMAT_VERSION) {
+    fclose(file);
+    *started = 0;
+    return 0;
+  }
+
+  int result = 0;
+  while (!result && fgets(line, sizeof(line), file)) {
+    struct mirror_entry entry = {0};
+    long long size = 0;
+    long long sec = 0;
+    char hash[2 * SHA256_DIGEST_LENGTH + 1];
+    int path_start = 0;
+    if (sscanf(line, "%lld %lld %ld %64s %n", &size, &sec, &entry.mtime.tv_nsec, hash, &path_start) != 4
+        || strlen(hash) != 2 * SHA256_DIGEST_LENGTH || line[path_start] == '\0') {
+      continue;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    entry.size = size;
+    entry.mtime.tv_sec = sec;
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+      unsigned int byte = 0;
+      sscanf(hash + 2 * i, "%2x", &byte);
+      entry.hash[i] = byte;
+    }
+    entry.path = strdup(line + path_start);
+    if (entry.path == NULL || add_mirror_entry(list, &entry)) {
+      free(entry.path);
+      perror("mirror manifest");
+      result = -1;
+    }
+  }
+
+  fclose(file);
+  return result;
+}
+
+// Write the manifest of a mirror, replacing the old one in a single rename.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `target`: path of the mirror directory
+// `list`: the files in the mirror, sorted by path
+// `started`: when this sync started
+static int write_manifest(const char *target, const struct mirror_list *list, const struct timespec *started) {
+  char path[PATH_MAX];
+  char temp_path[PATH_MAX];
+  if (checked_path(target, MIRROR_MANIFEST, path) || checked_path(target, MIRROR_MANIFEST COPY_SUFFIX, temp_path)) {
+    return -1;
+  }
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+  if (file == NULL) {
+    perror(temp_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  fprintf(file, "mirror %d %lld %ld\n", MIRROR_FORMAT_VERSION, (long long) started->tv_sec, started->tv_nsec);
+  for (size_t i = 0; i < list->count; ++i) {
+    const struct mirror_entry *entry = &list->entries[i];
+    fprintf(file, "%lld %lld %ld ", (long long) entry->size, (long long) entry->mtime.tv_sec, entry->mtime.tv_nsec);
+    for (int j = 0; j < SHA256_DIGEST_LENGTH; ++j) {
+      fprintf(file, "%02x", entry->hash[j]);
+    }
+    fprintf(file, " %s\n", entry->path);
+  }
+
+  if (fflush(file) || fsync(fd)) {
+    perror(temp_path);
+    fclose(file);
+    unlink(temp_path);
+    return -1;
+  }
+  fclose(file);
+  if (rename(temp_path, path)) {
+    perror(path);
+    unlink(temp_path);
+    return -1;
+  }
+  return 0;
+}
+
+// Hash the content of an open file.
+// Returns `0` on success or `-1` on error.
+//
+// `fd`: the open file
+// `size`: the number of bytes to hash
+// `hash`: A pointer to where the hash is to be placed
+static int hash_file(int fd, off_t size, unsigned char hash[SHA256_DIGEST_LENGTH]) {
+  EVP_MD_CTX *context = EVP_MD_CTX_new();
+  unsigned char *buf = malloc(MIRROR_BUFFER_SIZE);
+  int result = context == NULL || buf == NULL || !EVP_DigestInit_ex2(context, sha256_digest(), NULL) ? -1 : 0;
+  for (off_t offset = 0; !result && offset < size;) {
+    size_t want = size - offset < MIRROR_BUFFER_SIZE ? size - offset : MIRROR_BUFFER_SIZE;
+    ssize_t got = pread(fd, buf, want, offset);
+    if (got <= 0) {
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      result = -1;
+      break;
+    }
+    result = EVP_DigestUpdate(context, buf, got) ? 0 : -1;
+    offset += got;
+  }
+  if (!result && !EVP_DigestFinal_ex(context, hash, NULL)) {
+    result = -1;
+  }
+  free(buf);
+  EVP_MD_CTX_free(context);
+  return result;
+}
+
+// Copy the content of one open file to another, empty one.
+// The copy shares the source's blocks if the filesystem supports reflinks, and is made in
+// the kernel if it supports copying between the files, so content only passes through
+// this process as a last resort.
+// Returns `0` on success or `-1` on error.
+//
+// `in_fd`: the file to copy
+// `out_fd`: the empty file to copy to
+// `size`: the number of bytes to copy
+static int copy_data(int in_fd, int out_fd, off_t size) {
+  if (size == 0 || !ioctl(out_fd, FICLONE, in_fd)) {
+    return 0;
+  }
+
+  loff_t in_offset = 0;
+  loff_t out_offset = 0;
+  while (in_offset < size) {
+    ssize_t copied = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, size - in_offset, 0);
+    if (copied > 0) {
+      continue;
+    }
+    if (copied == 0) {
+      // The file was cut short while being copied.
+      errno = EIO;
+      return -1;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+      return -1;
+    }
+    break;
+  }
+
+  char buf[MIRROR_BUFFER_SIZE];
+  while (in_offset < size) {
+    size_t want = size - in_offset < MIRROR_BUFFER_SIZE ? size - in_offset : MIRROR_BUFFER_SIZE;
+    ssize_t got = pread(in_fd, buf, want, in_offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      errno = got ? errno : EIO;
+      return -1;
+    }
+    for (ssize_t done = 0; done < got;) {
+      ssize_t wrote = pwrite(out_fd, buf + done, got - done, out_offset + done);
+      if (wrote < 0 && errno != EINTR) {
+        return -1;
+      }
+      done += wrote > 0 ? wrote : 0;
+    }
+    in_offset += got;
+    out_offset += got;
+  }
+  return 0;
+}
+
+// Create the shard directories a file goes in, in the mirror.
+// Returns `0` on success or `-1` on error.
+//
+// `path`: path of the file in the mirror
+// `target_len`: length of the mirror directory's path, which already exists
+static int make_parent_dirs(const char *path, size_t target_len) {
+  char dir_path[PATH_MAX];
+  strcpy(dir_path, path);
+  for (char *slash = strchr(dir_path + target_len + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(dir_path, S_IRUSR | S_IWUSR | S_IXUSR) && errno != EEXIST) {
+      return -1;
+    }
+    *slash = '/';
+  }
+  return 0;
+}
+
+// Open a file in the notes directory to copy or hash it.
+// Notes are locked, so no edit is applied to them while they are read.
+// Returns a file descriptor, or `-1` with `errno` set, i.e. to `ENOENT` if it was deleted.
+//
+// `folder_name`: path of directory containing note files
+// `entry`: the file, whose size and modification time are updated
+static int open_source(const char *folder_name, struct mirror_entry *entry) {
+  char path[PATH_MAX];
+  if (checked_path(folder_name, entry->path, path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && ((entry->note && lock_file(fd, 0)) || fstat(fd, &st))) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  if (fd >= 0) {
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+  }
+  return fd;
+}
+
+// Copy a file into the mirror, replacing any older copy in a single rename.
+// Returns `0` on success, `1` if the file was deleted first, or `-1` on error, printing issues.
+//
+// `folder_name`: path of directory containing note files
+// `target`: path of the mirror directory
+// `entry`: the file, whose size, modification time and hash are updated
+static int copy_file(const char *folder_name, const char *target, struct mirror_entry *entry) {
+  char path[PATH_MAX];
+  char temp_path[PATH_MAX];
+  if (checked_path(target, entry->path, path) || snprintf(temp_path, PATH_MAX, "%s%s", path, COPY_SUFFIX) >= PATH_MAX) {
+    return -1;
+  }
+  int in_fd = open_source(folder_name, entry);
+  if (in_fd < 0) {
+    if (errno == ENOENT) {
+      return 1;
+    }
+    perror(entry->path);
+    return -1;
+  }
+
+  int out_fd = -1;
+  if (make_parent_dirs(path, strlen(target)) || (out_fd = open(temp_path,
+      O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0) {
+    perror(temp_path);
+    close(in_fd);
+    return -1;
+  }
+
+  // The copy is flushed with the rest of the mirror before the manifest is written.
+  int result = 0;
+  if (copy_data(in_fd, out_fd, entry->size) || hash_file(in_fd, entry->size, entry->hash)) {
+    perror(entry->path);
+    result = -1;
+  }
+  if (close(out_fd) && !result) {
+    perror(temp_path);
+    result = -1;
+  }
+  if (!result && rename(temp_path, path)) {
+    perror(path);
+    result = -1;
+  }
+  if (result) {
+    unlink(temp_path);
+  }
+  close(in_fd);
+  return result;
+}
+
+// Remove a file from the mirror.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `target`: path of the mirror directory
+// `entry`: the file
+static int remove_copy(const char *target, const struct mirror_entry *entry) {
+  char path[PATH_MAX];
+  if (checked_path(target, entry->path, path)) {
+    return -1;
+  }
+  if (unlink(path) && errno != ENOENT) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Bring one file in the mirror up to date.
+// Returns `0` if the mirror has the file, `1` if it was deleted first, or `-1` on error,
+// printing issues.
+//
+// `folder_name`: path of directory containing note files
+// `target`: path of the mirror directory
+// `entry`: the file, whose size, modification time and hash are updated
+// `old`: the file as it was last mirrored, or `NULL` if it is new
+// `started`: when the last sync started, in seconds
+// `stats`: counts to update
+static int sync_file(const char *folder_name, const char *target, struct mirror_entry *entry,
+    const struct mirror_entry *old, long long started, struct mirror_stats *stats) {
+  char path[PATH_MAX];
+  struct stat st;
+  int same = old && old->size == entry->size && old->mtime.tv_sec == entry->mtime.tv_sec
+      && old->mtime.tv_nsec == entry->mtime.tv_nsec
+      && !checked_path(target, entry->path, path) && !lstat(path, &st) && st.st_size == entry->size;
+
+  if (same && entry->mtime.tv_sec < started - MIRROR_RACY_SECONDS) {
+    memcpy(entry->hash, old->hash, SHA256_DIGEST_LENGTH);
+    ++stats->unchanged;
+    return 0;
+  }
+
+  // A file changed as the last sync started may have changed again without its
+  // modification time moving on, so only its content can tell.
+  if (same) {
+    int fd = open_source(folder_name, entry);
+    if (fd < 0 && errno == ENOENT) {
+      return 1;
+    }
+    int hashed = fd >= 0 && !hash_file(fd, entry->size, entry->hash);
+    if (fd >= 0) {
+      close(fd);
+    }
+    ++stats->hashed;
+    if (hashed && entry->size == old->size && !memcmp(entry->hash, old->hash, SHA256_DIGEST_LENGTH)) {
+      ++stats->unchanged;
+      return 0;
+    }
+  }
+
+  int result = copy_file(folder_name, target, entry);
+  if (result == 0) {
+    ++stats->copied;
+    stats->bytes += entry->size;
+  }
+  return result;
+}
+
+// Bring a copy of the notes directory up to date, copying only what changed.
+// Notes, their journals and histories, stored chunks and the notebook configuration are mirrored, still
+// encrypted, so no key is needed. Changes are found from the manifest written by the
+// last sync: files with the same size and modification time are skipped, so a sync of a
+// mostly unchanged notebook costs about a stat for each file. Files are cloned where the
+// filesystem supports it, and copied in the kernel otherwise.
+// Returns `0` on success, printing issues and returning `-1` otherwise. Files that could
+// not be mirrored are tried again on the next sync.
+//
+// `folder_name`: path of directory containing note files
+// `target`: path of the mirror directory, created if needed
+// `stats`: A pointer to where the counts are to be placed
+int mirror_notebook(const char *folder_name, const char *target, struct mirror_stats *stats) {
+  memset(stats, 0, sizeof(struct mirror_stats));
+  struct timespec started;
+  clock_gettime(CLOCK_REALTIME, &started);
+  if (mkdir(target, S_IRUSR | S_IWUSR | S_IXUSR) && errno != EEXIST) {
+    perror(target);
+    return -1;
+  }
+
+  struct mirror_list files = {0};
+  struct mirror_list manifest = {0};
+  long long last_started = 0;
+  if (collect_files(folder_name, "", 0, &files) || read_manifest(target, &manifest, &last_started)) {
+    free_mirror_list(&files);
+    free_mirror_list(&manifest);
+    return -1;
+  }
+  qsort(files.entries, files.count, sizeof(struct mirror_entry), compare_mirror_entries);
+  qsort(manifest.entries, manifest.count, sizeof(struct mirror_entry), compare_mirror_entries);
+
+  // Walk both lists in order. The new manifest borrows their paths. Files that fail keep
+  // their old entry, so they are found to differ and tried again next time.
+  struct mirror_list mirrored = {0};
+  int failed = 0;
+  size_t next_old = 0;
+  for (size_t i = 0; i <= files.count; ++i) {
+    struct mirror_entry *entry = i < files.count ? &files.entries[i] : NULL;
+    while (next_old < manifest.count && (entry == NULL || strcmp(manifest.entries[next_old].path, entry->path) < 0)) {
+      struct mirror_entry *gone = &manifest.entries[next_old++];
+      if (remove_copy(target, gone)) {
+        failed = 1;
+        add_mirror_entry(&mirrored, gone);
+      } else {
+        ++stats->removed;
+      }
+    }
+    if (entry == NULL) {
+      break;
+    }
+    struct mirror_entry *old = NULL;
+    if (next_old < manifest.count && !strcmp(manifest.entries[next_old].path, entry->path)) {
+      old = &manifest.entries[next_old++];
+    }
+
+    int result = sync_file(folder_name, target, entry, old, last_started, stats);
+    if (result > 0 && old && !remove_copy(target, old)) {
+      ++stats->removed;
+      continue;
+    }
+    if (result) {
+      failed = 1;
+    }
+    if ((result == 0 && add_mirror_entry(&mirrored, entry)) || (result != 0 && old && add_mirror_entry(&mirrored, old))) {
+      perror("mirror manifest");
+      failed = 1;
+    }
+  }
+
+  // Copies are renamed into place before the manifest names them.
+  int dir_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int synced = dir_fd >= 0 && !syncfs(dir_fd);
+  if (!synced) {
+    perror(target);
+  }
+  if (dir_fd >= 0) {
+    close(dir_fd);
+  }
+  if (!synced || write_manifest(target, &mirrored, &started)) {
+    failed = 1;
+  }
+
+  free(mirrored.entries);
+  free_mirror_list(&files);
+  free_mirror_list(&manifest);
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,42 @@
+#ifndef MIRROR_H
+#define MIRROR_H 1
+
+#include <stddef.h>
+
+// Name of the manifest kept in a mirror, describing the notebook as it was last mirrored.
+#define MIRROR_MANIFEST ".mirror"
+
+// Current manifest format version.
+#define MIRROR_FORMAT_VERSION 1
+
+// Seconds within which a file's modification time may not tell changes apart.
+// Files changed this close to a sync are hashed on the next one, even if they look unchanged.
+#define MIRROR_RACY_SECONDS 2
+
+// What a mirror sync did.
+struct mirror_stats {
+  // Files copied because they were new or changed.
+  unsigned long copied;
+  unsigned long long bytes;
+  // Files removed from the mirror because they were deleted from the notebook.
+  unsigned long removed;
+  unsigned long unchanged;
+  // Files hashed because their modification time couldn't be trusted.
+  unsigned long hashed;
+};
+
+// Bring a copy of the notes directory up to date, copying only what changed.
+// Notes, their journals and histories, stored chunks and the notebook configuration are mirrored, still
+// encrypted, so no key is needed. Changes are found from the manifest written by the
+// last sync: files with the same size and modification time are skipped, so a sync of a
+// mostly unchanged notebook costs about a stat for each file. Files are cloned where the
+// filesystem supports it, and copied in the kernel otherwise.
+// Returns `0` on success, printing issues and returning `-1` otherwise. Files that could
+// not be mirrored are tried again on the next sync.
+//
+// `folder_name`: path of directory containing note files
+// `target`: path of the mirror directory, created if needed
+// `stats`: A pointer to where the counts are to be placed
+int mirror_notebook(const char *folder_name, const char *target, struct mirror_stats *stats);
+
+#endif
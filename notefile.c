@@ -0,0 +1,1480 @@
+// Resources used:
+// https://www.openssl.org/docs/man3.0/man3/EVP_EncryptInit.html (AEAD Interface)
+// https://www.rfc-editor.org/rfc/rfc5116
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "security.h"
+#include "notefile.h"
+#include "dedup.h"
+#include "trace.h"
+
+// Size of the header fields authenticated by the header tag.
+#define HEADER_AAD_SIZE 52
+// Size of everything the header tag authenticates: its fields and the digest of the chunk tags.
+#define HEADER_BOUND_AAD_SIZE (HEADER_AAD_SIZE + SHA256_DIGEST_LENGTH)
+// Bytes in a chunk's additional data: the file ID and chunk index.
+#define CHUNK_AAD_SIZE (NOTE_FILE_ID_SIZE + 8)
+// Chunks each decrypting thread may work ahead of the sink.
+#define CHUNKS_AHEAD 4
+// Size of a journal's header and of the header of each write in it.
+#define JOURNAL_HEADER_SIZE 36
+#define JOURNAL_WRITE_SIZE 12
+
+// Describe an error from reading or writing a chunked note.
+// Returns a message for the error.
+//
+// `error`: the `NOTE_ERR_*` value
+const char* note_error_string(int error) {
+  switch (error) {
+    case 0:
+      return "success";
+    case NOTE_ERR_IO:
+      return strerror(errno);
+    case NOTE_ERR_HEADER:
+      return "header is damaged or was written with another key";
+    case NOTE_ERR_CHUNK:
+      return "content is damaged or was written with another key";
+    case NOTE_ERR_TRUNCATED:
+      return "content is missing from the end of the note";
+    case NOTE_ERR_SINK:
+      return "content could not be written out";
+    case NOTE_ERR_MEMORY:
+      return "out of memory";
+    case NOTE_ERR_RANGE:
+      return "offset is past the end of the note";
+    case NOTE_ERR_REVISION:
+      return "revision is not in the note's history";
+    case NOTE_ERR_FORMAT:
+      return "note was written in a newer format; update notes to read it";
+    default:
+      return "unknown error";
+  }
+}
+
+// Store a number in little-endian order.
+void put_le(unsigned char *buf, unsigned long long value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    buf[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+// Load a number stored in little-endian order.
+unsigned long long get_le(const unsigned char *buf, int bytes) {
+  unsigned long long value = 0;
+  for (int i = bytes - 1; i >= 0; --i) {
+    value = (value << 8) | buf[i];
+  }
+  return value;
+}
+
+// Read exactly `len` bytes at an offset, retrying short reads.
+// Returns `0` on success, `NOTE_ERR_TRUNCATED` if the file ends first or `NOTE_ERR_IO`.
+int read_at(int fd, void *buf, size_t len, off_t offset) {
+  unsigned long long span = trace_begin();
+  int error = 0;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t result = pread(fd, (char *) buf + done, len - done, offset + done);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = NOTE_ERR_IO;
+      break;
+    }
+    if (result == 0) {
+      error = NOTE_ERR_TRUNCATED;
+      break;
+    }
+    done += result;
+  }
+  trace_end("read", span);
+  return error;
+}
+
+// Write exactly `len` bytes at an offset, retrying short writes.
+// Returns `0` on success or `NOTE_ERR_IO`.
+int write_at(int fd, const void *buf, size_t len, off_t offset) {
+  unsigned long long span = trace_begin();
+  int error = 0;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t result = pwrite(fd, (const char *) buf + done, len - done, offset + done);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = NOTE_ERR_IO;
+      break;
+    }
+    done += result;
+  }
+  trace_end("write", span);
+  return error;
+}
+
+// Get the number of chunks in a note.
+static unsigned long long chunk_count(const struct note_header *header) {
+  return (header->length + header->chunk_size - 1) / header->chunk_size;
+}
+
+// Get the file offset of a chunk.
+static off_t chunk_offset(const struct note_header *header, unsigned long long index) {
+  return NOTE_HEADER_SIZE + index * (off_t) (NONCE_SIZE + header->chunk_size + TAG_SIZE);
+}
+
+// Get the plaintext length of a chunk. Only the last chunk may be shorter than the chunk size.
+static size_t chunk_length(const struct note_header *header, unsigned long long index) {
+  unsigned long long start = index * header->chunk_size;
+  unsigned long long remaining = header->length - start;
+  return remaining < header->chunk_size ? remaining : header->chunk_size;
+}
+
+// Build the additional data for a chunk, tying it to its note and position.
+static void chunk_aad(const struct note_header *header, unsigned long long index, unsigned char aad[CHUNK_AAD_SIZE]) {
+  memcpy(aad, header->file_id, NOTE_FILE_ID_SIZE);
+  put_le(aad + NOTE_FILE_ID_SIZE, index, 8);
+}
+
+// Encrypt a chunk into its on-disk form.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `context`: an encryption context from `aead_context`
+// `header`: the note header
+// `index`: the chunk index
+// `content`: the chunk's plaintext
+// `slot`: a buffer of at least `NONCE_SIZE + chunk size + TAG_SIZE` bytes
+static int seal_chunk(EVP_CIPHER_CTX *context, const struct note_header *header, unsigned long long index,
+    const unsigned char *content, unsigned char *slot) {
+  size_t len = chunk_length(header, index);
+  unsigned char aad[CHUNK_AAD_SIZE];
+  chunk_aad(header, index, aad);
+
+  // Every chunk gets a fresh nonce, stored in front of its ciphertext.
+  generate_nonce(slot);
+  if (!aead_seal(context, slot, aad, CHUNK_AAD_SIZE, content, len, slot + NONCE_SIZE, slot + NONCE_SIZE + len)) {
+    return NOTE_ERR_CHUNK;
+  }
+  return 0;
+}
+
+// Encrypt a chunk and write it to its place in the file.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file
+// `context`: an encryption context from `aead_context`
+// `header`: the note header
+// `index`: the chunk index
+// `content`: the chunk's plaintext
+// `slot`: a buffer of at least `NONCE_SIZE + chunk size + TAG_SIZE` bytes
+static int write_chunk(int fd, EVP_CIPHER_CTX *context, const struct note_header *header, unsigned long long index,
+    const unsigned char *content, unsigned char *slot) {
+  int error = seal_chunk(context, header, index, content, slot);
+  if (error) {
+    return error;
+  }
+  return write_at(fd, slot, NONCE_SIZE + chunk_length(header, index) + TAG_SIZE, chunk_offset(header, index));
+}
+
+// Read a chunk from its place in the file and decrypt it.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file
+// `context`: a decryption context from `aead_context`
+// `header`: the note header
+// `index`: the chunk index
+// `throttle`: rate limit for reads, or `NULL`
+// `slot`: a buffer of at least `NONCE_SIZE + chunk size + TAG_SIZE` bytes
+// `content`: A pointer to where the chunk's plaintext is to be placed, at least chunk size long
+static int read_chunk(int fd, EVP_CIPHER_CTX *context, const struct note_header *header, unsigned long long index,
+    struct throttle *throttle, unsigned char *slot, unsigned char *content) {
+  size_t len = chunk_length(header, index);
+  if (throttle) {
+    throttle_wait(throttle, NONCE_SIZE + len + TAG_SIZE);
+  }
+
+  int result = read_at(fd, slot, NONCE_SIZE + len + TAG_SIZE, chunk_offset(header, index));
+  if (result) {
+    return result;
+  }
+
+  unsigned char aad[CHUNK_AAD_SIZE];
+  chunk_aad(header, index, aad);
+  if (!aead_open(context, slot, aad, CHUNK_AAD_SIZE, slot + NONCE_SIZE, len, content, slot + NONCE_SIZE + len)) {
+    return NOTE_ERR_CHUNK;
+  }
+
+  return 0;
+}
+
+// Hash the tags of a note's chunks in order, so its header can commit to them.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file
+// `header`: the note header
+// `tags`: tags of chunks `first` up to `end` to use instead of those in the file, or `NULL`
+// `first`: the first chunk whose tag is in `tags`
+// `end`: the chunk after the last whose tag is in `tags`
+// `digest`: A pointer to where the digest is to be placed
+static int chunk_tags_digest(int fd, const struct note_header *header, const unsigned char *tags,
+    unsigned long long first, unsigned long long end, unsigned char digest[SHA256_DIGEST_LENGTH]) {
+  EVP_MD_CTX *context = EVP_MD_CTX_new();
+  int error = context == NULL || !EVP_DigestInit_ex(context, sha256_digest(), NULL) ? NOTE_ERR_MEMORY : 0;
+
+  unsigned long long chunks = chunk_count(header);
+  for (unsigned long long index = 0; !error && index < chunks; ++index) {
+    unsigned char tag[TAG_SIZE];
+    if (tags != NULL && index >= first && index < end) {
+      memcpy(tag, tags + (index - first) * TAG_SIZE, TAG_SIZE);
+    } else {
+      error = read_at(fd, tag, TAG_SIZE, chunk_offset(header, index) + NONCE_SIZE + chunk_length(header, index));
+    }
+    if (!error && !EVP_DigestUpdate(context, tag, TAG_SIZE)) {
+      error = NOTE_ERR_MEMORY;
+    }
+  }
+  if (!error && !EVP_DigestFinal_ex(context, digest, NULL)) {
+    error = NOTE_ERR_MEMORY;
+  }
+  EVP_MD_CTX_free(context);
+  return error;
+}
+
+// Check if an open file is a chunked note.
+// Returns 1 if the file starts with the note magic number, 0 otherwise.
+//
+// `fd`: the open note file
+int is_chunked_note(int fd) {
+  unsigned char magic[NOTE_MAGIC_SIZE];
+  return !read_at(fd, magic, NOTE_MAGIC_SIZE, 0) && !memcmp(magic, NOTE_MAGIC, NOTE_MAGIC_SIZE);
+}
+
+// Get the format of a note from its first bytes, without authenticating them.
+// Older notes start with a random IV, which matches the magic number by chance once in
+// 2^64 notes. Readers authenticate the header before trusting the version.
+// Returns `NOTE_FORMAT_LEGACY`, the version of a chunked note, or `-1` if it can't be read.
+//
+// `fd`: the open note file
+int note_format(int fd) {
+  unsigned char buf[NOTE_MAGIC_SIZE + 1];
+  if (read_at(fd, buf, sizeof(buf), 0)) {
+    // Too short to be a chunked note, or unreadable.
+    struct stat st;
+    return fstat(fd, &st) || st.st_size == 0 ? -1 : NOTE_FORMAT_LEGACY;
+  }
+  return memcmp(buf, NOTE_MAGIC, NOTE_MAGIC_SIZE) ? NOTE_FORMAT_LEGACY : buf[NOTE_MAGIC_SIZE];
+}
+
+// Build the on-disk form of a chunked note's header, in the current format.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `key`: the key to authenticate the header with
+// `header`: the header to build
+// `digest`: the digest of the chunk tags, from `chunk_tags_digest`
+// `buf`: A pointer to where the header is to be placed, `NOTE_HEADER_SIZE` long
+static int seal_note_header(const unsigned char *key, const struct note_header *header,
+    const unsigned char digest[SHA256_DIGEST_LENGTH], unsigned char buf[NOTE_HEADER_SIZE]) {
+  memset(buf, 0, NOTE_HEADER_SIZE);
+  memcpy(buf, NOTE_MAGIC, NOTE_MAGIC_SIZE);
+  buf[8] = NOTE_FORMAT_VERSION;
+  buf[9] = header->cipher;
+  put_le(buf + 10, header->flags, 2);
+  put_le(buf + 12, header->chunk_size, 4);
+  put_le(buf + 16, header->length, 8);
+  memcpy(buf + 24, header->file_id, NOTE_FILE_ID_SIZE);
+  put_le(buf + 40, header->revision, 8);
+
+  // The header has no content of its own; the tag authenticates its fields and chunks.
+  unsigned char aad[HEADER_BOUND_AAD_SIZE];
+  memcpy(aad, buf, HEADER_AAD_SIZE);
+  memcpy(aad + HEADER_AAD_SIZE, digest, SHA256_DIGEST_LENGTH);
+  EVP_CIPHER_CTX *context = aead_context(key, 1);
+  if (context == NULL) {
+    return NOTE_ERR_HEADER;
+  }
+  generate_nonce(buf + HEADER_AAD_SIZE);
+  int sealed = aead_seal(context, buf + HEADER_AAD_SIZE, aad, HEADER_BOUND_AAD_SIZE, NULL, 0, NULL,
+      buf + HEADER_AAD_SIZE + NONCE_SIZE);
+  EVP_CIPHER_CTX_free(context);
+  return sealed ? 0 : NOTE_ERR_HEADER;
+}
+
+// Write the header of a chunked note in the current format, committing to the chunks
+// in the file.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file
+// `key`: the key to authenticate the header with
+// `header`: the header to write
+static int write_note_header(int fd, const unsigned char *key, const struct note_header *header) {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  unsigned char buf[NOTE_HEADER_SIZE];
+  int error = chunk_tags_digest(fd, header, NULL, 0, 0, digest);
+  if (!error) {
+    error = seal_note_header(key, header, digest, buf);
+  }
+  if (error) {
+    return error;
+  }
+  return write_at(fd, buf, NOTE_HEADER_SIZE, 0);
+}
+
+// Read the fields of a chunked note's header without authenticating them.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file
+// `buf`: A pointer to where the header's bytes are to be placed, `NOTE_HEADER_SIZE` long
+// `header`: A pointer to where the header is to be placed
+static int parse_note_header(int fd, unsigned char buf[NOTE_HEADER_SIZE], struct note_header *header) {
+  int result = read_at(fd, buf, NOTE_HEADER_SIZE, 0);
+  if (result) {
+    return result;
+  }
+
+  if (memcmp(buf, NOTE_MAGIC, NOTE_MAGIC_SIZE)) {
+    return NOTE_ERR_HEADER;
+  }
+
+  header->version = buf[8];
+  header->cipher = buf[9];
+  header->flags = get_le(buf + 10, 2);
+  header->chunk_size = get_le(buf + 12, 4);
+  header->length = get_le(buf + 16, 8);
+  memcpy(header->file_id, buf + 24, NOTE_FILE_ID_SIZE);
+  // Notes from before revisions have zero here.
+  header->revision = get_le(buf + 40, 8);
+  if (header->chunk_size < NOTE_MIN_CHUNK_SIZE || header->chunk_size > NOTE_MAX_CHUNK_SIZE) {
+    return NOTE_ERR_HEADER;
+  }
+  return 0;
+}
+
+// Read and authenticate the header of a chunked note.
+// Returns `0` on success, `NOTE_ERR_HEADER` if the header is damaged or written with
+// another key, or another `NOTE_ERR_*` value.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `header`: A pointer to where the header is to be placed
+int read_note_header(int fd, const unsigned char *key, struct note_header *header) {
+  // The fields are needed to find the chunks the tag commits to, so they're parsed first and
+  // nothing is trusted until the tag checks out.
+  unsigned char buf[NOTE_HEADER_SIZE];
+  int result = parse_note_header(fd, buf, header);
+  if (result) {
+    return result;
+  }
+
+  unsigned char aad[HEADER_BOUND_AAD_SIZE];
+  size_t aad_len = HEADER_AAD_SIZE;
+  memcpy(aad, buf, HEADER_AAD_SIZE);
+  if (header->version != NOTE_FORMAT_UNBOUND) {
+    result = chunk_tags_digest(fd, header, NULL, 0, 0, aad + HEADER_AAD_SIZE);
+    if (result) {
+      return result;
+    }
+    aad_len = HEADER_BOUND_AAD_SIZE;
+  }
+
+  EVP_CIPHER_CTX *context = aead_context(key, 0);
+  if (context == NULL) {
+    return NOTE_ERR_HEADER;
+  }
+  int authentic = aead_open(context, buf + HEADER_AAD_SIZE, aad, aad_len, NULL, 0, NULL,
+      buf + HEADER_AAD_SIZE + NONCE_SIZE);
+  EVP_CIPHER_CTX_free(context);
+  if (!authentic) {
+    return NOTE_ERR_HEADER;
+  }
+
+  // Only accept what this version knows how to read. The header is authentic, so anything
+  // else was written by a newer version.
+  if ((header->version != NOTE_FORMAT_VERSION && header->version != NOTE_FORMAT_UNBOUND)
+      || header->cipher != NOTE_CIPHER_AES_256_GCM || (header->flags & ~NOTE_FLAG_DEDUP)) {
+    return NOTE_ERR_FORMAT;
+  }
+
+  return 0;
+}
+
+// Get the number of threads to use for a number of chunks.
+//
+// `options`: threading options, or `NULL` for defaults
+// `chunks`: the number of chunks to process
+static unsigned int thread_count(const struct chunk_options *options, unsigned long long chunks) {
+  long threads = options && options->threads ? (long) options->threads : sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) {
+    threads = 1;
+  }
+  if ((unsigned long long) threads > chunks) {
+    threads = chunks ? chunks : 1;
+  }
+  return threads;
+}
+
+// State shared by threads encrypting a note.
+struct encrypt_job {
+  int fd;
+  const unsigned char *key;
+  const struct note_header *header;
+  const unsigned char *content;
+  unsigned long long chunks;
+  // Each chunk's tag, for the header to commit to.
+  unsigned char *tags;
+  // Index of the next chunk to encrypt.
+  unsigned long long next;
+  // The first error, if any.
+  int error;
+};
+
+// Thread entry point for encrypting chunks.
+// Takes chunks until none are left or any thread fails.
+//
+// `arg`: the shared job state
+static void* encrypt_worker(void *arg) {
+  struct encrypt_job *job = arg;
+
+  EVP_CIPHER_CTX *context = aead_context(job->key, 1);
+  unsigned char *slot = malloc(NONCE_SIZE + job->header->chunk_size + TAG_SIZE);
+  int error = context == NULL ? NOTE_ERR_CHUNK : slot == NULL ? NOTE_ERR_MEMORY : 0;
+
+  unsigned long long index;
+  while (!error && !__atomic_load_n(&job->error, __ATOMIC_RELAXED)
+      && (index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->chunks) {
+    error = write_chunk(job->fd, context, job->header, index,
+        job->content + index * job->header->chunk_size, slot);
+    if (!error) {
+      memcpy(job->tags + index * TAG_SIZE, slot + NONCE_SIZE + chunk_length(job->header, index), TAG_SIZE);
+    }
+  }
+
+  if (error) {
+    int expected = 0;
+    __atomic_compare_exchange_n(&job->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+
+  free(slot);
+  EVP_CIPHER_CTX_free(context);
+  return NULL;
+}
+
+// Encrypt content and write it as a chunked note with the given header flags.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+static int write_note_chunks(int fd, const unsigned char *key, const unsigned char *content, size_t len,
+    unsigned short flags, const struct chunk_options *options) {
+  struct note_header header = {0};
+  header.version = NOTE_FORMAT_VERSION;
+  header.cipher = NOTE_CIPHER_AES_256_GCM;
+  header.flags = flags;
+  header.chunk_size = NOTE_CHUNK_SIZE;
+  header.length = len;
+  // Not secret, just unique. An IV is as good a source as any.
+  generate_iv(header.file_id);
+
+  struct encrypt_job job = {0};
+  job.fd = fd;
+  job.key = key;
+  job.header = &header;
+  job.content = content;
+  job.chunks = chunk_count(&header);
+  job.tags = malloc(job.chunks ? job.chunks * TAG_SIZE : 1);
+  if (job.tags == NULL) {
+    return NOTE_ERR_MEMORY;
+  }
+
+  // Encrypt on this thread and as many others as are useful.
+  unsigned int threads = thread_count(options, job.chunks);
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  unsigned int started = 0;
+  if (workers != NULL) {
+    while (started + 1 < threads && !pthread_create(&workers[started], NULL, encrypt_worker, &job)) {
+      ++started;
+    }
+  }
+  encrypt_worker(&job);
+  for (unsigned int i = 0; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+
+  // The file may be open only for writing, so the tags come from the workers rather than
+  // being read back.
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  unsigned char buf[NOTE_HEADER_SIZE];
+  int error = job.error ? job.error : chunk_tags_digest(fd, &header, job.tags, 0, job.chunks, digest);
+  free(job.tags);
+  if (!error) {
+    error = seal_note_header(key, &header, digest, buf);
+  }
+  if (error) {
+    return error;
+  }
+  return write_at(fd, buf, NOTE_HEADER_SIZE, 0);
+}
+
+// Encrypt content and write it as a chunked note.
+// Chunks are encrypted in parallel. The header is written last, so a note that was
+// not written completely is never mistaken for a valid one.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the empty note file, open for writing
+// `key`: the key to encrypt with
+// `content`: the plaintext
+// `len`: the plaintext length
+// `options`: threading options, or `NULL` for defaults
+int write_chunked_note(int fd, const unsigned char *key, const unsigned char *content, size_t len,
+    const struct chunk_options *options) {
+  return write_note_chunks(fd, key, content, len, 0, options);
+}
+
+// Store content in the chunk store and write its manifest as a deduplicated note.
+// The manifest is written like any other note's content, so it is encrypted and
+// authenticated, and the chunks a note uses are only known to the key's holder.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the empty note file, open for writing
+// `key`: the key to encrypt with
+// `content`: the plaintext
+// `len`: the plaintext length
+// `options`: options naming the chunk store
+int write_dedup_note(int fd, const unsigned char *key, const unsigned char *content, size_t len,
+    const struct chunk_options *options) {
+  if (options == NULL || options->chunk_store == NULL) {
+    return NOTE_ERR_FORMAT;
+  }
+  unsigned char *manifest;
+  size_t manifest_len;
+  int error = dedup_store(options->chunk_store, key, content, len, &manifest, &manifest_len);
+  if (error) {
+    return error;
+  }
+  error = write_note_chunks(fd, key, manifest, manifest_len, NOTE_FLAG_DEDUP, options);
+  if (error) {
+    // No note holds the references just taken.
+    dedup_release(options->chunk_store, manifest, manifest_len);
+  }
+  free(manifest);
+  return error;
+}
+
+// Part of a note's content to pass to a sink.
+// Whole chunks are decrypted, so content outside the range is trimmed off.
+struct range_sink {
+  note_sink sink;
+  void *arg;
+  // Bytes left to skip before the range starts.
+  unsigned long long skip;
+  // Bytes left to pass on.
+  unsigned long long remaining;
+};
+
+// Pass the part of decrypted content that is within a range to its sink.
+// Returns `0` to continue or `-1` to stop with an error.
+static int pass_range(void *arg, const unsigned char *content, size_t len) {
+  struct range_sink *range = arg;
+  if (range->skip >= len) {
+    range->skip -= len;
+    return 0;
+  }
+  content += range->skip;
+  len -= range->skip;
+  range->skip = 0;
+
+  if (len > range->remaining) {
+    len = range->remaining;
+  }
+  range->remaining -= len;
+  return len ? range->sink(range->arg, content, len) : 0;
+}
+
+// State shared by threads decrypting a note ahead of its sink.
+// Decrypted chunks are placed in a ring of slots. Threads may only work on chunks
+// within the ring's reach of the last chunk consumed, bounding memory use.
+struct decrypt_job {
+  int fd;
+  const unsigned char *key;
+  const struct note_header *header;
+  struct throttle *throttle;
+  // Index after the last chunk to decrypt.
+  unsigned long long end;
+
+  pthread_mutex_t lock;
+  // Signalled when a chunk is decrypted.
+  pthread_cond_t decrypted;
+  // Signalled when a chunk is consumed or the job stops.
+  pthread_cond_t consumed;
+
+  // Index of the next chunk to decrypt.
+  unsigned long long next;
+  // Index of the next chunk to pass to the sink.
+  unsigned long long done;
+  // The first error, if any.
+  int error;
+
+  // Decrypted content, `slots` chunks long.
+  unsigned char *ring;
+  size_t slots;
+  // Index of the chunk in each slot, or `ULLONG_MAX` if it is not ready.
+  unsigned long long *ready;
+};
+
+// Thread entry point for decrypting chunks.
+// Takes chunks in order until none are left or the job stops.
+//
+// `arg`: the shared job state
+static void* decrypt_worker(void *arg) {
+  struct decrypt_job *job = arg;
+
+  EVP_CIPHER_CTX *context = aead_context(job->key, 0);
+  unsigned char *slot = malloc(NONCE_SIZE + job->header->chunk_size + TAG_SIZE);
+
+  pthread_mutex_lock(&job->lock);
+  if (context == NULL || slot == NULL) {
+    job->error = context == NULL ? NOTE_ERR_CHUNK : NOTE_ERR_MEMORY;
+    pthread_cond_broadcast(&job->decrypted);
+  }
+
+  while (!job->error && job->next < job->end) {
+    // Wait for the sink to free the slot this chunk goes in.
+    if (job->next >= job->done + job->slots) {
+      pthread_cond_wait(&job->consumed, &job->lock);
+      continue;
+    }
+    unsigned long long index = job->next++;
+    pthread_mutex_unlock(&job->lock);
+
+    size_t ring_slot = index % job->slots;
+    int error = read_chunk(job->fd, context, job->header, index, job->throttle, slot,
+        job->ring + ring_slot * job->header->chunk_size);
+
+    pthread_mutex_lock(&job->lock);
+    if (error && !job->error) {
+      job->error = error;
+    }
+    job->ready[ring_slot] = index;
+    pthread_cond_broadcast(&job->decrypted);
+  }
+
+  pthread_mutex_unlock(&job->lock);
+
+  free(slot);
+  EVP_CIPHER_CTX_free(context);
+  return NULL;
+}
+
+// Decrypt chunks on this thread alone, passing their content to a sink in order.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+static int read_chunks_serial(int fd, const unsigned char *key, const struct note_header *header,
+    unsigned long long first, unsigned long long end, note_sink sink, void *arg, struct throttle *throttle) {
+  EVP_CIPHER_CTX *context = aead_context(key, 0);
+  unsigned char *slot = malloc(NONCE_SIZE + header->chunk_size + TAG_SIZE);
+  unsigned char *content = malloc(header->chunk_size);
+  int error = context == NULL ? NOTE_ERR_CHUNK : slot == NULL || content == NULL ? NOTE_ERR_MEMORY : 0;
+
+  for (unsigned long long index = first; !error && index < end; ++index) {
+    error = read_chunk(fd, context, header, index, throttle, slot, content);
+    if (!error && sink(arg, content, chunk_length(header, index))) {
+      error = NOTE_ERR_SINK;
+    }
+  }
+
+  if (content != NULL) {
+    OPENSSL_cleanse(content, header->chunk_size);
+  }
+  free(content);
+  free(slot);
+  EVP_CIPHER_CTX_free(context);
+  return error;
+}
+
+// Decrypt chunks, passing their content to a sink in order.
+// Chunks are decrypted in parallel ahead of the sink.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+static int read_chunks(int fd, const unsigned char *key, const struct note_header *header,
+    unsigned long long first, unsigned long long end, note_sink sink, void *arg, const struct chunk_options *options) {
+  struct throttle *throttle = options ? options->throttle : NULL;
+  unsigned int threads = thread_count(options, end - first);
+  if (threads == 1) {
+    return read_chunks_serial(fd, key, header, first, end, sink, arg, throttle);
+  }
+
+  struct decrypt_job job = {0};
+  job.fd = fd;
+  job.key = key;
+  job.header = header;
+  job.throttle = throttle;
+  job.end = end;
+  job.next = first;
+  job.done = first;
+  job.slots = threads * CHUNKS_AHEAD;
+  if (job.slots > end - first) {
+    job.slots = end - first;
+  }
+  job.ring = malloc(job.slots * header->chunk_size);
+  job.ready = malloc(job.slots * sizeof(unsigned long long));
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  if (job.ring == NULL || job.ready == NULL || workers == NULL) {
+    free(job.ring);
+    free(job.ready);
+    free(workers);
+    // Fall back to the slow way rather than failing.
+    return read_chunks_serial(fd, key, header, first, end, sink, arg, throttle);
+  }
+  memset(job.ready, 0xFF, job.slots * sizeof(unsigned long long));
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.decrypted, NULL);
+  pthread_cond_init(&job.consumed, NULL);
+
+  unsigned int started = 0;
+  while (started < threads && !pthread_create(&workers[started], NULL, decrypt_worker, &job)) {
+    ++started;
+  }
+  if (started == 0) {
+    job.error = NOTE_ERR_MEMORY;
+  }
+
+  // Pass chunks to the sink in order as they become ready.
+  pthread_mutex_lock(&job.lock);
+  while (!job.error && job.done < end) {
+    size_t ring_slot = job.done % job.slots;
+    if (job.ready[ring_slot] != job.done) {
+      pthread_cond_wait(&job.decrypted, &job.lock);
+      continue;
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    // The slot is safe to read: no thread may take the chunk that replaces it until it's consumed.
+    int sink_error = sink(arg, job.ring + ring_slot * header->chunk_size, chunk_length(header, job.done));
+
+    pthread_mutex_lock(&job.lock);
+    if (sink_error && !job.error) {
+      job.error = NOTE_ERR_SINK;
+    }
+    ++job.done;
+    pthread_cond_broadcast(&job.consumed);
+  }
+  int error = job.error;
+  // Wake any waiting threads so they see the job is over.
+  pthread_cond_broadcast(&job.consumed);
+  pthread_mutex_unlock(&job.lock);
+
+  for (unsigned int i = 0; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+
+  pthread_cond_destroy(&job.consumed);
+  pthread_cond_destroy(&job.decrypted);
+  pthread_mutex_destroy(&job.lock);
+  free(workers);
+  free(job.ready);
+  OPENSSL_cleanse(job.ring, job.slots * header->chunk_size);
+  free(job.ring);
+
+  return error;
+}
+
+// Decrypt part of what a chunked note stores, passing it to a sink in order.
+// For a deduplicated note, that is its manifest.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+static int read_stored_range(int fd, const unsigned char *key, const struct note_header *header, long long offset,
+    unsigned long long length, note_sink sink, void *arg, const struct chunk_options *options) {
+  // Resolve the range, clipping it to the content.
+  unsigned long long start = offset;
+  if (offset < 0) {
+    unsigned long long from_end = -(unsigned long long) offset;
+    start = from_end < header->length ? header->length - from_end : 0;
+  }
+  if (start >= header->length) {
+    return 0;
+  }
+  unsigned long long stop = length && length < header->length - start ? start + length : header->length;
+  unsigned long long first = start / header->chunk_size;
+  unsigned long long end = (stop + header->chunk_size - 1) / header->chunk_size;
+
+  // A note cut short by a crash or a bad copy is reported as such, rather than as
+  // damage to its last chunk. Only the chunks being read need to be there.
+  struct stat st;
+  if (fstat(fd, &st)) {
+    return NOTE_ERR_IO;
+  }
+  if (st.st_size < chunk_offset(header, end - 1) + NONCE_SIZE + (off_t) chunk_length(header, end - 1) + TAG_SIZE) {
+    return NOTE_ERR_TRUNCATED;
+  }
+
+  struct range_sink range = {sink, arg, start - first * header->chunk_size, stop - start};
+  return read_chunks(fd, key, header, first, end, pass_range, &range, options);
+}
+
+// A manifest being read from a deduplicated note.
+struct manifest_buffer {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+};
+
+// Add part of a manifest to its buffer.
+// Returns `0` on success or `-1` if it doesn't fit.
+static int gather_manifest(void *arg, const unsigned char *content, size_t len) {
+  struct manifest_buffer *buffer = arg;
+  if (len > buffer->capacity - buffer->len) {
+    return -1;
+  }
+  memcpy(buffer->data + buffer->len, content, len);
+  buffer->len += len;
+  return 0;
+}
+
+// Read the whole manifest of a deduplicated note.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+// Note: The manifest must be freed, even on error!
+static int read_note_manifest(int fd, const unsigned char *key, const struct note_header *header, unsigned char **manifest,
+    size_t *manifest_len) {
+  *manifest_len = 0;
+  *manifest = header->length == (size_t) header->length ? malloc(header->length ? header->length : 1) : NULL;
+  if (*manifest == NULL) {
+    return NOTE_ERR_MEMORY;
+  }
+  // Manifests are small, so one thread is plenty.
+  struct chunk_options serial = {1, NULL, NULL};
+  struct manifest_buffer buffer = {*manifest, 0, header->length};
+  int error = read_stored_range(fd, key, header, 0, 0, gather_manifest, &buffer, &serial);
+  *manifest_len = buffer.len;
+  return error;
+}
+
+// Decrypt part of a chunked note, passing its content to a sink in order.
+// Only the chunks covering the range are read and decrypted.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_CHUNK` if content is damaged.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `offset`: the first byte to read, or if negative, how far from the end to start reading
+// `length`: the number of bytes to read, or `0` to read to the end
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+// `options`: threading and rate options, or `NULL` for defaults
+int read_chunked_range(int fd, const unsigned char *key, long long offset, unsigned long long length,
+    note_sink sink, void *arg, const struct chunk_options *options) {
+  struct note_header header;
+  int error = read_note_header(fd, key, &header);
+  if (error) {
+    return error;
+  }
+  if (!(header.flags & NOTE_FLAG_DEDUP)) {
+    return read_stored_range(fd, key, &header, offset, length, sink, arg, options);
+  }
+
+  // The content is in the chunk store, found through the manifest.
+  if (options == NULL || options->chunk_store == NULL) {
+    return NOTE_ERR_FORMAT;
+  }
+  unsigned char *manifest;
+  size_t manifest_len;
+  error = read_note_manifest(fd, key, &header, &manifest, &manifest_len);
+  if (!error) {
+    error = dedup_read(options->chunk_store, key, manifest, manifest_len, offset, length, sink, arg);
+  }
+  free(manifest);
+  return error;
+}
+
+// Get the content length of a note written before chunked notes.
+// CBC ciphertext is the content plus 1 to 16 bytes of padding, so only the last block
+// needs to be decrypted to find the length.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `size`: the size of the note file
+// `length`: A pointer to where the content length is to be placed
+static int legacy_length(int fd, const unsigned char *key, off_t size, unsigned long long *length) {
+  if (size < IV_SIZE * 2 || (size - IV_SIZE) % CIPHER_BLOCK_SIZE) {
+    return NOTE_ERR_TRUNCATED;
+  }
+
+  // Decrypt the last block without removing padding, so the padding can be measured.
+  unsigned char tail[CIPHER_BLOCK_SIZE * 2];
+  unsigned char last[CIPHER_BLOCK_SIZE * 2];
+  int last_len = 0;
+  int final_len = 0;
+  int error = read_at(fd, tail, sizeof(tail), size - sizeof(tail));
+  if (error) {
+    return error;
+  }
+  EVP_CIPHER_CTX *context = cipher_start(key, tail, 0);
+  if (context == NULL) {
+    return NOTE_ERR_CHUNK;
+  }
+  EVP_CIPHER_CTX_set_padding(context, 0);
+  if (!cipher_update(context, tail + CIPHER_BLOCK_SIZE, CIPHER_BLOCK_SIZE, last, &last_len)) {
+    EVP_CIPHER_CTX_free(context);
+    return NOTE_ERR_CHUNK;
+  }
+  if (!cipher_finish(context, last + last_len, &final_len) || last_len != CIPHER_BLOCK_SIZE) {
+    return NOTE_ERR_CHUNK;
+  }
+
+  // PKCS#7 padding is 1 to 16 bytes, all holding the padding length.
+  int padding = last[CIPHER_BLOCK_SIZE - 1];
+  if (padding < 1 || padding > CIPHER_BLOCK_SIZE) {
+    return NOTE_ERR_CHUNK;
+  }
+  for (int i = CIPHER_BLOCK_SIZE - padding; i < CIPHER_BLOCK_SIZE; ++i) {
+    if (last[i] != padding) {
+      return NOTE_ERR_CHUNK;
+    }
+  }
+  *length = size - IV_SIZE - padding;
+  return 0;
+}
+
+// Decrypt part of a note written before chunked notes, passing its content to a sink.
+// Such notes are an IV followed by AES-256-CBC ciphertext. CBC only needs the previous
+// ciphertext block to decrypt a block, so only the blocks covering the range are read,
+// plus the last block to find the content length from its padding.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `offset`: the first byte to read, or if negative, how far from the end to start reading
+// `length`: the number of bytes to read, or `0` to read to the end
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+int read_legacy_range(int fd, const unsigned char *key, long long offset, unsigned long long length,
+    note_sink sink, void *arg) {
+  struct stat st;
+  if (fstat(fd, &st)) {
+    return NOTE_ERR_IO;
+  }
+  unsigned long long content_len = 0;
+  int error = legacy_length(fd, key, st.st_size, &content_len);
+  if (error) {
+    return error;
+  }
+
+  // Resolve the range, clipping it to the content.
+  unsigned long long start = offset;
+  if (offset < 0) {
+    unsigned long long from_end = -(unsigned long long) offset;
+    start = from_end < content_len ? content_len - from_end : 0;
+  }
+  if (start >= content_len) {
+    return 0;
+  }
+  unsigned long long stop = length && length < content_len - start ? start + length : content_len;
+  unsigned long long first = start / CIPHER_BLOCK_SIZE;
+  unsigned long long end = (stop + CIPHER_BLOCK_SIZE - 1) / CIPHER_BLOCK_SIZE;
+
+  // The block before the first is its IV. For the first block, that is the note's IV.
+  unsigned char iv[IV_SIZE];
+  error = read_at(fd, iv, IV_SIZE, first * CIPHER_BLOCK_SIZE);
+  if (error) {
+    return error;
+  }
+  EVP_CIPHER_CTX *context = cipher_start(key, iv, 0);
+  if (context == NULL) {
+    return NOTE_ERR_CHUNK;
+  }
+  EVP_CIPHER_CTX_set_padding(context, 0);
+
+  unsigned char *in = malloc(NOTE_CHUNK_SIZE);
+  unsigned char *out = malloc(NOTE_CHUNK_SIZE + CIPHER_BLOCK_SIZE);
+  if (in == NULL || out == NULL) {
+    error = NOTE_ERR_MEMORY;
+  }
+
+  struct range_sink range = {sink, arg, start - first * CIPHER_BLOCK_SIZE, stop - start};
+  off_t position = IV_SIZE + first * CIPHER_BLOCK_SIZE;
+  off_t stop_position = IV_SIZE + end * CIPHER_BLOCK_SIZE;
+  while (!error && position < stop_position) {
+    size_t len = stop_position - position < NOTE_CHUNK_SIZE ? stop_position - position : NOTE_CHUNK_SIZE;
+    int out_len = 0;
+    error = read_at(fd, in, len, position);
+    if (!error && !cipher_update(context, in, len, out, &out_len)) {
+      error = NOTE_ERR_CHUNK;
+    }
+    if (!error && pass_range(&range, out, out_len)) {
+      error = NOTE_ERR_SINK;
+    }
+    position += len;
+  }
+
+  // Nothing is left over without padding, but the context still has to be released.
+  unsigned char spare[CIPHER_BLOCK_SIZE];
+  int final_len = 0;
+  cipher_finish(context, spare, &final_len);
+  free(in);
+  if (out != NULL) {
+    OPENSSL_cleanse(out, NOTE_CHUNK_SIZE + CIPHER_BLOCK_SIZE);
+  }
+  free(out);
+  return error;
+}
+
+// Get the content length of a note, in either format.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `length`: A pointer to where the content length is to be placed
+int read_note_length(int fd, const unsigned char *key, unsigned long long *length) {
+  if (is_chunked_note(fd)) {
+    struct note_header header;
+    int error = read_note_header(fd, key, &header);
+    if (error) {
+      return error;
+    }
+    *length = header.length;
+    if (!(header.flags & NOTE_FLAG_DEDUP)) {
+      return 0;
+    }
+
+    // A manifest starts with the length of the content it describes.
+    unsigned char buf[DEDUP_MANIFEST_HEADER];
+    struct chunk_options serial = {1, NULL, NULL};
+    struct manifest_buffer buffer = {buf, 0, sizeof(buf)};
+    error = read_stored_range(fd, key, &header, 0, sizeof(buf), gather_manifest, &buffer, &serial);
+    if (!error) {
+      error = dedup_length(buf, buffer.len == sizeof(buf) ? buffer.len : 0, length);
+    }
+    return error;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    return NOTE_ERR_IO;
+  }
+  return legacy_length(fd, key, st.st_size, length);
+}
+
+// Decrypt part of a note in any format, passing its content to a sink in order.
+// The reader is chosen from the note's header.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_FORMAT` for a note
+// written in a newer format.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `offset`: the first byte to read, or if negative, how far from the end to start reading
+// `length`: the number of bytes to read, or `0` to read to the end
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+// `options`: threading and rate options for chunked notes, or `NULL` for defaults
+int read_note_content(int fd, const unsigned char *key, long long offset, unsigned long long length,
+    note_sink sink, void *arg, const struct chunk_options *options) {
+  int format = note_format(fd);
+  switch (format) {
+    case -1:
+      return NOTE_ERR_TRUNCATED;
+    case NOTE_FORMAT_LEGACY:
+      return read_legacy_range(fd, key, offset, length, sink, arg);
+    case NOTE_FORMAT_UNBOUND:
+    case NOTE_FORMAT_VERSION:
+      return read_chunked_range(fd, key, offset, length, sink, arg, options);
+    default:
+      // The version is only trusted once the header is authentic.
+      return read_note_header(fd, key, &(struct note_header) {0});
+  }
+}
+
+// Set the revision of a chunked note that is not in use yet, i.e. one just written to a
+// temporary file to replace another note.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file, open for reading and writing
+// `key`: the key the note was written with
+// `revision`: the revision number
+int set_note_revision(int fd, const unsigned char *key, unsigned long long revision) {
+  struct note_header header;
+  int error = read_note_header(fd, key, &header);
+  if (error) {
+    return error;
+  }
+  header.revision = revision;
+  return write_note_header(fd, key, &header);
+}
+
+// Decrypt a chunked note, passing its content to a sink in order.
+// Chunks are decrypted in parallel ahead of the sink.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_CHUNK` if content is damaged.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+// `options`: threading and rate options, or `NULL` for defaults
+int read_chunked_note(int fd, const unsigned char *key, note_sink sink, void *arg, const struct chunk_options *options) {
+  return read_chunked_range(fd, key, 0, 0, sink, arg, options);
+}
+
+// Read the manifest of a deduplicated note, i.e. to release its chunks once it is gone.
+// Returns `0` on success, with the manifest left `NULL` if the note is not deduplicated,
+// or a `NOTE_ERR_*` value.
+// Note: The manifest must be freed!
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `manifest`: A pointer to where the manifest is to be placed
+// `manifest_len`: A pointer to where the manifest's length is to be placed
+int read_dedup_manifest(int fd, const unsigned char *key, unsigned char **manifest, size_t *manifest_len) {
+  *manifest = NULL;
+  *manifest_len = 0;
+  if (!is_chunked_note(fd)) {
+    return 0;
+  }
+  struct note_header header;
+  int error = read_note_header(fd, key, &header);
+  if (error || !(header.flags & NOTE_FLAG_DEDUP)) {
+    return error;
+  }
+  error = read_note_manifest(fd, key, &header, manifest, manifest_len);
+  if (error) {
+    free(*manifest);
+    *manifest = NULL;
+    *manifest_len = 0;
+  }
+  return error;
+}
+
+// Changes to a note waiting to be committed through its journal.
+// The journal holds every write that would replace bytes already in the note, so the
+// note can always be rolled forward to the edited version or left as it was.
+//
+// On disk, all numbers are little-endian:
+// 0   magic (8)
+// 8   file ID of the note (16)
+// 24  note file size after the edit (8)
+// 32  number of writes (4)
+// 36  writes: file offset (8) || length (4) || bytes (length)
+// end SHA-256 of everything before it (32)
+struct note_journal {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+  unsigned int writes;
+};
+
+// Add a write to a journal.
+// Returns `0` on success or `NOTE_ERR_MEMORY`.
+//
+// `journal`: the journal
+// `offset`: where the bytes go in the note file
+// `buf`: the bytes to write
+// `len`: the number of bytes
+static int journal_add(struct note_journal *journal, off_t offset, const unsigned char *buf, size_t len) {
+  size_t needed = journal->len + JOURNAL_WRITE_SIZE + len + SHA256_DIGEST_LENGTH;
+  if (needed > journal->capacity) {
+    size_t capacity = journal->capacity;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    unsigned char *data = realloc(journal->data, capacity);
+    if (data == NULL) {
+      return NOTE_ERR_MEMORY;
+    }
+    journal->data = data;
+    journal->capacity = capacity;
+  }
+
+  put_le(journal->data + journal->len, offset, 8);
+  put_le(journal->data + journal->len + 8, len, 4);
+  memcpy(journal->data + journal->len + JOURNAL_WRITE_SIZE, buf, len);
+  journal->len += JOURNAL_WRITE_SIZE + len;
+  ++journal->writes;
+  return 0;
+}
+
+// Get the size of a note file holding content of a given length.
+static off_t note_file_size(const struct note_header *header) {
+  unsigned long long chunks = chunk_count(header);
+  if (!chunks) {
+    return NOTE_HEADER_SIZE;
+  }
+  return chunk_offset(header, chunks - 1) + NONCE_SIZE + chunk_length(header, chunks - 1) + TAG_SIZE;
+}
+
+// Check a journal and apply its writes to a note if it is complete.
+// Returns `1` if the journal was applied, `0` if it is incomplete or for another note,
+// or `NOTE_ERR_IO`.
+//
+// `fd`: the note file, open for writing
+// `header`: the note header
+// `data`: the journal's contents
+// `len`: the journal's length
+static int apply_journal(int fd, const struct note_header *header, const unsigned char *data, size_t len) {
+  if (len < JOURNAL_HEADER_SIZE + SHA256_DIGEST_LENGTH || memcmp(data, NOTE_JOURNAL_MAGIC, NOTE_MAGIC_SIZE)
+      || memcmp(data + NOTE_MAGIC_SIZE, header->file_id, NOTE_FILE_ID_SIZE)) {
+    return 0;
+  }
+
+  // A journal cut short by a crash fails its checksum, and nothing from it was applied.
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  len -= SHA256_DIGEST_LENGTH;
+  if (!EVP_Digest(data, len, digest, NULL, sha256_digest(), NULL) || memcmp(digest, data + len, SHA256_DIGEST_LENGTH)) {
+    return 0;
+  }
+
+  // Check that every write is whole before applying any of them.
+  off_t file_size = get_le(data + 24, 8);
+  unsigned int writes = get_le(data + 32, 4);
+  size_t position = JOURNAL_HEADER_SIZE;
+  for (unsigned int i = 0; i < writes; ++i) {
+    if (len - position < JOURNAL_WRITE_SIZE || len - position - JOURNAL_WRITE_SIZE < get_le(data + position + 8, 4)) {
+      return 0;
+    }
+    position += JOURNAL_WRITE_SIZE + get_le(data + position + 8, 4);
+  }
+  if (position != len) {
+    return 0;
+  }
+
+  // Applying a journal twice is harmless, so a crash from here on is recovered by replaying it.
+  position = JOURNAL_HEADER_SIZE;
+  for (unsigned int i = 0; i < writes; ++i) {
+    size_t write_len = get_le(data + position + 8, 4);
+    if (write_at(fd, data + position + JOURNAL_WRITE_SIZE, write_len, get_le(data + position, 8))) {
+      return NOTE_ERR_IO;
+    }
+    position += JOURNAL_WRITE_SIZE + write_len;
+  }
+  if (ftruncate(fd, file_size) || fdatasync(fd)) {
+    return NOTE_ERR_IO;
+  }
+  return 1;
+}
+
+// Overwrite part of a chunked note's content, extending it if needed.
+// Only the chunks covering the change are re-encrypted. Chunks past the old end of the
+// note are written directly, as the old header does not reach them. Everything else,
+// including the header, is committed through the journal.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file, open for reading and writing
+// `journal_fd`: an empty journal file, open for writing
+// `key`: the key the note was written with
+// `header`: the note header
+// `start`: where the new content goes, no further than the end of the old content
+// `content`: the new content
+// `len`: the new content's length
+static int update_chunks(int fd, int journal_fd, const unsigned char *key, const struct note_header *header,
+    unsigned long long start, const unsigned char *content, size_t len) {
+  if (start > header->length) {
+    return NOTE_ERR_RANGE;
+  }
+  if (!len) {
+    return 0;
+  }
+
+  struct note_header updated = *header;
+  updated.version = NOTE_FORMAT_VERSION;
+  ++updated.revision;
+  if (start + len > header->length) {
+    updated.length = start + len;
+  }
+  unsigned long long old_chunks = chunk_count(header);
+  unsigned long long first = start / header->chunk_size;
+  unsigned long long end = (start + len + header->chunk_size - 1) / header->chunk_size;
+
+  EVP_CIPHER_CTX *encrypt = aead_context(key, 1);
+  EVP_CIPHER_CTX *decrypt = aead_context(key, 0);
+  unsigned char *plain = malloc(header->chunk_size);
+  unsigned char *slot = malloc(NONCE_SIZE + header->chunk_size + TAG_SIZE);
+  // The new chunks' tags, which the new header commits to along with the untouched chunks'.
+  unsigned char *tags = malloc((end - first) * TAG_SIZE);
+
+  // The journal header is filled in once the writes are known.
+  struct note_journal journal = {0};
+  journal.capacity = JOURNAL_HEADER_SIZE + SHA256_DIGEST_LENGTH;
+  journal.data = malloc(journal.capacity);
+  journal.len = JOURNAL_HEADER_SIZE;
+
+  int error = encrypt == NULL || decrypt == NULL ? NOTE_ERR_CHUNK
+      : plain == NULL || slot == NULL || tags == NULL || journal.data == NULL ? NOTE_ERR_MEMORY : 0;
+
+  int direct = 0;
+  for (unsigned long long i = first; !error && i < end; ++i) {
+    // Keep whatever part of an existing chunk is not being replaced.
+    if (i < old_chunks) {
+      error = read_chunk(fd, decrypt, header, i, NULL, slot, plain);
+    }
+
+    unsigned long long chunk_start = i * header->chunk_size;
+    unsigned long long from = start > chunk_start ? start : chunk_start;
+    unsigned long long to = chunk_start + chunk_length(&updated, i);
+    if (to > start + len) {
+      to = start + len;
+    }
+    if (!error) {
+      memcpy(plain + (from - chunk_start), content + (from - start), to - from);
+      error = seal_chunk(encrypt, &updated, i, plain, slot);
+    }
+
+    size_t slot_len = NONCE_SIZE + chunk_length(&updated, i) + TAG_SIZE;
+    if (!error) {
+      memcpy(tags + (i - first) * TAG_SIZE, slot + NONCE_SIZE + chunk_length(&updated, i), TAG_SIZE);
+    }
+    if (!error && i < old_chunks) {
+      error = journal_add(&journal, chunk_offset(&updated, i), slot, slot_len);
+    } else if (!error) {
+      error = write_at(fd, slot, slot_len, chunk_offset(&updated, i));
+      direct = 1;
+    }
+  }
+
+  // The header is always rewritten, as the revision changes.
+  if (!error) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned char buf[NOTE_HEADER_SIZE];
+    error = chunk_tags_digest(fd, &updated, tags, first, end, digest);
+    if (!error) {
+      error = seal_note_header(key, &updated, digest, buf);
+    }
+    if (!error) {
+      error = journal_add(&journal, 0, buf, NOTE_HEADER_SIZE);
+    }
+  }
+
+  // New chunks must be on disk before a header that points at them.
+  if (!error && direct && fdatasync(fd)) {
+    error = NOTE_ERR_IO;
+  }
+
+  if (!error) {
+    memcpy(journal.data, NOTE_JOURNAL_MAGIC, NOTE_MAGIC_SIZE);
+    memcpy(journal.data + NOTE_MAGIC_SIZE, header->file_id, NOTE_FILE_ID_SIZE);
+    put_le(journal.data + 24, note_file_size(&updated), 8);
+    put_le(journal.data + 32, journal.writes, 4);
+    if (!EVP_Digest(journal.data, journal.len, journal.data + journal.len, NULL, sha256_digest(), NULL)) {
+      error = NOTE_ERR_IO;
+    }
+  }
+
+  // Once the journal is on disk, the edit is committed.
+  if (!error && (write_at(journal_fd, journal.data, journal.len + SHA256_DIGEST_LENGTH, 0) || fdatasync(journal_fd))) {
+    error = NOTE_ERR_IO;
+  }
+  if (!error && apply_journal(fd, header, journal.data, journal.len + SHA256_DIGEST_LENGTH) != 1) {
+    error = NOTE_ERR_IO;
+  }
+
+  free(journal.data);
+  free(tags);
+  free(slot);
+  if (plain != NULL) {
+    OPENSSL_cleanse(plain, header->chunk_size);
+  }
+  free(plain);
+  EVP_CIPHER_CTX_free(decrypt);
+  EVP_CIPHER_CTX_free(encrypt);
+  return error;
+}
+
+// Overwrite part of a chunked note's content, extending it if needed.
+// Only the chunks covering the change and the header are rewritten. The change is
+// committed through a journal, so a crash leaves either the old or the new content.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_RANGE` if the offset
+// is past the end of the note.
+//
+// `fd`: the note file, open for reading and writing
+// `journal_fd`: an empty journal file, open for writing
+// `key`: the key the note was written with
+// `offset`: where the new content goes, or if negative, how far from the end it goes
+// `content`: the new content
+// `len`: the new content's length
+int write_chunked_range(int fd, int journal_fd, const unsigned char *key, long long offset,
+    const unsigned char *content, size_t len) {
+  struct note_header header;
+  int error = read_note_header(fd, key, &header);
+  if (error) {
+    return error;
+  }
+  // Chunks of a deduplicated note are shared, so it is replaced rather than changed.
+  if (header.flags & NOTE_FLAG_DEDUP) {
+    return NOTE_ERR_FORMAT;
+  }
+
+  unsigned long long start = offset;
+  if (offset < 0) {
+    unsigned long long from_end = -(unsigned long long) offset;
+    if (from_end > header.length) {
+      return NOTE_ERR_RANGE;
+    }
+    start = header.length - from_end;
+  }
+  return update_chunks(fd, journal_fd, key, &header, start, content, len);
+}
+
+// Add content to the end of a chunked note.
+// Only the last chunk, any new chunks and the header are written, so the cost depends
+// on the length of the new content rather than the size of the note.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file, open for reading and writing
+// `journal_fd`: an empty journal file, open for writing
+// `key`: the key the note was written with
+// `content`: the content to add
+// `len`: the content's length
+int append_chunked_note(int fd, int journal_fd, const unsigned char *key, const unsigned char *content, size_t len) {
+  struct note_header header;
+  int error = read_note_header(fd, key, &header);
+  if (error) {
+    return error;
+  }
+  // Chunks of a deduplicated note are shared, so it is replaced rather than changed.
+  if (header.flags & NOTE_FLAG_DEDUP) {
+    return NOTE_ERR_FORMAT;
+  }
+  return update_chunks(fd, journal_fd, key, &header, header.length, content, len);
+}
+
+// Finish or roll back an edit to a chunked note that was interrupted.
+// A complete journal is applied. Otherwise the note still has its old content, and
+// any chunks written past its end are cut off.
+// Returns `1` if the journal was applied, `0` if it was not, or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file, open for reading and writing
+// `journal_fd`: the open journal file
+// `key`: the key the note was written with
+int replay_note_journal(int fd, int journal_fd, const unsigned char *key) {
+  // A crash partway through applying a journal leaves chunks the header doesn't commit
+  // to, so the header can't be authenticated until the journal is applied. Reading the
+  // note afterwards authenticates the result.
+  unsigned char buf[NOTE_HEADER_SIZE];
+  struct note_header header;
+  int error = parse_note_header(fd, buf, &header);
+  if (error) {
+    return error;
+  }
+
+  struct stat st;
+  if (fstat(journal_fd, &st)) {
+    return NOTE_ERR_IO;
+  }
+  unsigned char *data = malloc(st.st_size ? st.st_size : 1);
+  if (data == NULL) {
+    return NOTE_ERR_MEMORY;
+  }
+  int result = read_at(journal_fd, data, st.st_size, 0);
+  if (!result) {
+    result = apply_journal(fd, &header, data, st.st_size);
+  } else if (result == NOTE_ERR_TRUNCATED) {
+    result = 0;
+  }
+  free(data);
+
+  // Nothing from an incomplete journal was applied, so the note is as it was before the edit.
+  if (!result) {
+    result = read_note_header(fd, key, &header);
+  }
+  if (!result) {
+    if (fstat(fd, &st) || (st.st_size > note_file_size(&header) && ftruncate(fd, note_file_size(&header)))) {
+      return NOTE_ERR_IO;
+    }
+  }
+  return result;
+}
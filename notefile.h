@@ -0,0 +1,310 @@
+#ifndef NOTEFILE_H
+#define NOTEFILE_H 1
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "throttle.h"
+
+// Chunked note files start with this magic number, so they can be told apart from
+// older notes, which start with a random IV.
+#define NOTE_MAGIC "\x89NOTE\r\n\x1a"
+#define NOTE_MAGIC_SIZE 8
+
+// Journals of edits to chunked notes start with this magic number.
+#define NOTE_JOURNAL_MAGIC "\x89NJRL\r\n\x1a"
+
+// Current chunked note format version.
+#define NOTE_FORMAT_VERSION 2
+
+// Chunked notes whose header did not commit to their chunks, so a chunk could be put
+// back to an older version of itself unnoticed. Still read, and upgraded like legacy notes.
+#define NOTE_FORMAT_UNBOUND 1
+
+// Format of notes from before chunked notes: a random IV followed by AES-256-CBC
+// ciphertext, with nothing to identify it. Chunked notes use their version number.
+#define NOTE_FORMAT_LEGACY 0
+
+// Cipher used for chunks: AES-256 in GCM mode.
+#define NOTE_CIPHER_AES_256_GCM 1
+
+// Header flag for a deduplicated note, whose content is a manifest of chunks kept in
+// the notebook's chunk store.
+#define NOTE_FLAG_DEDUP 1
+
+// Size of the note header in bytes.
+#define NOTE_HEADER_SIZE 80
+
+// Bytes of plaintext in each chunk of new notes.
+#define NOTE_CHUNK_SIZE 65536
+
+// Smallest and largest chunk sizes accepted when reading.
+#define NOTE_MIN_CHUNK_SIZE 4096
+#define NOTE_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+// Size of the random ID tying chunks to their note file. Same as an IV.
+#define NOTE_FILE_ID_SIZE 16
+
+// Header of a chunked note.
+// Content is split into fixed-size chunks, each encrypted and authenticated on its own,
+// so chunks can be processed in parallel. The header itself is authenticated too, along
+// with a SHA-256 digest of every chunk's tag in order, so a chunk can't be swapped for
+// an older version of itself without the header failing to authenticate. The digest is
+// computed from the chunks rather than stored.
+//
+// On disk, all numbers are little-endian:
+// 0   magic (8)
+// 8   format version (1)
+// 9   cipher (1)
+// 10  flags (2)
+// 12  chunk size (4)
+// 16  content length (8)
+// 24  file ID (16)
+// 40  revision (8)
+// 48  reserved, zero (4)
+// 52  header nonce (12)
+// 64  header tag (16)
+// 80  chunks: nonce (12) || ciphertext (chunk size, last may be shorter) || tag (16)
+struct note_header {
+  unsigned char version;
+  unsigned char cipher;
+  unsigned short flags;
+  unsigned int chunk_size;
+  unsigned long long length;
+  unsigned char file_id[NOTE_FILE_ID_SIZE];
+  // Number of edits made to the note, so its history can be matched to it.
+  unsigned long long revision;
+};
+
+// Errors from reading and writing chunked notes.
+#define NOTE_ERR_IO -1
+#define NOTE_ERR_HEADER -2
+#define NOTE_ERR_CHUNK -3
+#define NOTE_ERR_TRUNCATED -4
+#define NOTE_ERR_SINK -5
+#define NOTE_ERR_MEMORY -6
+#define NOTE_ERR_RANGE -7
+#define NOTE_ERR_REVISION -8
+#define NOTE_ERR_FORMAT -9
+
+// Called with decrypted content, in order.
+// Returns `0` to continue or `-1` to stop with an error.
+typedef int (*note_sink)(void *arg, const unsigned char *content, size_t len);
+
+// Options for processing chunks.
+struct chunk_options {
+  // Number of threads to use, or `0` for one per processor.
+  unsigned int threads;
+  // Rate limit for reads, or `NULL` for no limit.
+  struct throttle *throttle;
+  // Path of the chunk store deduplicated notes are read from, or `NULL` for none.
+  const char *chunk_store;
+};
+
+// Store a number in little-endian order.
+//
+// `buf`: where to store the number
+// `value`: the number
+// `bytes`: the number of bytes to store
+void put_le(unsigned char *buf, unsigned long long value, int bytes);
+
+// Load a number stored in little-endian order.
+// Returns the number.
+//
+// `buf`: where the number is stored
+// `bytes`: the number of bytes stored
+unsigned long long get_le(const unsigned char *buf, int bytes);
+
+// Read exactly `len` bytes at an offset, retrying short reads.
+// Returns `0` on success, `NOTE_ERR_TRUNCATED` if the file ends first or `NOTE_ERR_IO`.
+//
+// `fd`: the open file
+// `buf`: A pointer to where the bytes are to be placed
+// `len`: the number of bytes to read
+// `offset`: where to read from
+int read_at(int fd, void *buf, size_t len, off_t offset);
+
+// Write exactly `len` bytes at an offset, retrying short writes.
+// Returns `0` on success or `NOTE_ERR_IO`.
+//
+// `fd`: the open file
+// `buf`: the bytes to write
+// `len`: the number of bytes to write
+// `offset`: where to write to
+int write_at(int fd, const void *buf, size_t len, off_t offset);
+
+// Check if an open file is a chunked note.
+// Returns 1 if the file starts with the note magic number, 0 otherwise.
+//
+// `fd`: the open note file
+int is_chunked_note(int fd);
+
+// Get the format of a note from its first bytes, without authenticating them.
+// Returns `NOTE_FORMAT_LEGACY`, the version of a chunked note, or `-1` if it can't be read.
+//
+// `fd`: the open note file
+int note_format(int fd);
+
+// Describe an error from reading or writing a chunked note.
+// Returns a message for the error.
+//
+// `error`: the `NOTE_ERR_*` value
+const char* note_error_string(int error);
+
+// Read and authenticate the header of a chunked note.
+// Returns `0` on success, `NOTE_ERR_HEADER` if the header is damaged or written with
+// another key, `NOTE_ERR_FORMAT` if it uses a version, cipher or flags this version
+// doesn't know, or another `NOTE_ERR_*` value.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `header`: A pointer to where the header is to be placed
+int read_note_header(int fd, const unsigned char *key, struct note_header *header);
+
+// Get the content length of a note, in either format.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `length`: A pointer to where the content length is to be placed
+int read_note_length(int fd, const unsigned char *key, unsigned long long *length);
+
+// Encrypt content and write it as a chunked note.
+// Chunks are encrypted in parallel. The header is written last, so a note that was
+// not written completely is never mistaken for a valid one.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the empty note file, open for writing
+// `key`: the key to encrypt with
+// `content`: the plaintext
+// `len`: the plaintext length
+// `options`: threading options, or `NULL` for defaults
+int write_chunked_note(int fd, const unsigned char *key, const unsigned char *content, size_t len,
+    const struct chunk_options *options);
+
+// Store content in the chunk store and write its manifest as a deduplicated note.
+// Only chunks not stored already are encrypted and written.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the empty note file, open for writing
+// `key`: the key to encrypt with
+// `content`: the plaintext
+// `len`: the plaintext length
+// `options`: options naming the chunk store
+int write_dedup_note(int fd, const unsigned char *key, const unsigned char *content, size_t len,
+    const struct chunk_options *options);
+
+// Read the manifest of a deduplicated note, i.e. to release its chunks once it is gone.
+// Returns `0` on success, with the manifest left `NULL` if the note is not deduplicated,
+// or a `NOTE_ERR_*` value.
+// Note: The manifest must be freed!
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `manifest`: A pointer to where the manifest is to be placed
+// `manifest_len`: A pointer to where the manifest's length is to be placed
+int read_dedup_manifest(int fd, const unsigned char *key, unsigned char **manifest, size_t *manifest_len);
+
+// Set the revision of a chunked note that is not in use yet, i.e. one just written to a
+// temporary file to replace another note.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file, open for reading and writing
+// `key`: the key the note was written with
+// `revision`: the revision number
+int set_note_revision(int fd, const unsigned char *key, unsigned long long revision);
+
+// Decrypt a chunked note, passing its content to a sink in order.
+// Chunks are decrypted in parallel ahead of the sink.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_CHUNK` if content is damaged.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+// `options`: threading and rate options, or `NULL` for defaults
+int read_chunked_note(int fd, const unsigned char *key, note_sink sink, void *arg, const struct chunk_options *options);
+
+// Decrypt part of a chunked note, passing its content to a sink in order.
+// Only the chunks covering the range are read and decrypted, so the cost depends on
+// the length of the range rather than the size of the note.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_CHUNK` if content is damaged.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `offset`: the first byte to read, or if negative, how far from the end to start reading
+// `length`: the number of bytes to read, or `0` to read to the end
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+// `options`: threading and rate options, or `NULL` for defaults
+int read_chunked_range(int fd, const unsigned char *key, long long offset, unsigned long long length,
+    note_sink sink, void *arg, const struct chunk_options *options);
+
+// Decrypt part of a note written before chunked notes, passing its content to a sink.
+// Only the cipher blocks covering the range are read and decrypted.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `offset`: the first byte to read, or if negative, how far from the end to start reading
+// `length`: the number of bytes to read, or `0` to read to the end
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+int read_legacy_range(int fd, const unsigned char *key, long long offset, unsigned long long length,
+    note_sink sink, void *arg);
+
+// Decrypt part of a note in any format, passing its content to a sink in order.
+// The reader is chosen from the note's header.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_FORMAT` for a note
+// written in a newer format.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `offset`: the first byte to read, or if negative, how far from the end to start reading
+// `length`: the number of bytes to read, or `0` to read to the end
+// `sink`: where to send decrypted content
+// `arg`: passed to the sink
+// `options`: threading and rate options for chunked notes, or `NULL` for defaults
+int read_note_content(int fd, const unsigned char *key, long long offset, unsigned long long length,
+    note_sink sink, void *arg, const struct chunk_options *options);
+
+// Overwrite part of a chunked note's content, extending it if needed.
+// Only the chunks covering the change and the header are rewritten. The change is
+// committed through a journal, so a crash leaves either the old or the new content.
+// Each change adds one to the note's revision.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_RANGE` if the offset
+// is past the end of the note, or `NOTE_ERR_FORMAT` for a deduplicated note, which is
+// replaced instead.
+//
+// `fd`: the note file, open for reading and writing
+// `journal_fd`: an empty journal file, open for writing
+// `key`: the key the note was written with
+// `offset`: where the new content goes, or if negative, how far from the end it goes
+// `content`: the new content
+// `len`: the new content's length
+int write_chunked_range(int fd, int journal_fd, const unsigned char *key, long long offset,
+    const unsigned char *content, size_t len);
+
+// Add content to the end of a chunked note.
+// Only the last chunk, any new chunks and the header are written, so the cost depends
+// on the length of the new content rather than the size of the note.
+// Returns `0` on success or a `NOTE_ERR_*` value, i.e. `NOTE_ERR_FORMAT` for a
+// deduplicated note.
+//
+// `fd`: the note file, open for reading and writing
+// `journal_fd`: an empty journal file, open for writing
+// `key`: the key the note was written with
+// `content`: the content to add
+// `len`: the content's length
+int append_chunked_note(int fd, int journal_fd, const unsigned char *key, const unsigned char *content, size_t len);
+
+// Finish or roll back an edit to a chunked note that was interrupted.
+// A complete journal is applied. Otherwise the note still has its old content, and
+// any chunks written past its end are cut off.
+// Returns `1` if the journal was applied, `0` if it was not, or a `NOTE_ERR_*` value.
+//
+// `fd`: the note file, open for reading and writing
+// `journal_fd`: the open journal file
+// `key`: the key the note was written with
+int replay_note_journal(int fd, int journal_fd, const unsigned char *key);
+
+#endif
@@ -0,0 +1,410 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man3/pthread_rwlock_rdlock.3p.html
+// https://gcc.gnu.org/wiki/Visibility
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include "security.h"
+#include "data.h"
+#include "notefile.h"
+#include "storage.h"
+#include "trace.h"
+#include "notes.h"
+
+// An open notebook.
+struct notes {
+  struct note_storage *storage;
+  unsigned char key[KEY_SIZE];
+  // Note file locks keep threads apart, but notes in memory share one open file each
+  // and take no file locks, so this lock does it for every backend.
+  // Reads and adds share this lock, and changes to existing notes hold it alone.
+  pthread_rwlock_t lock;
+};
+
+// Decrypted content being copied into a caller's buffer.
+struct copy_sink {
+  unsigned char *buf;
+  size_t len;
+  size_t capacity;
+};
+
+// Copy decrypted content into a buffer.
+// Returns `0` to continue or `-1` if the buffer is full.
+static int copy_content(void *arg, const unsigned char *content, size_t len) {
+  struct copy_sink *sink = arg;
+  if (len > sink->capacity - sink->len) {
+    return -1;
+  }
+  memcpy(sink->buf + sink->len, content, len);
+  sink->len += len;
+  return 0;
+}
+
+// Convert an error from the notebook code into a libnotes error.
+//
+// `error`: a `NOTE_ERR_*` value, where `NOTE_ERR_IO` means `errno` has the cause
+static int notes_error(int error) {
+  switch (error) {
+    case 0:
+      return NOTES_OK;
+    case NOTE_ERR_HEADER:
+    case NOTE_ERR_CHUNK:
+    case NOTE_ERR_TRUNCATED:
+      return NOTES_ERR_DAMAGED;
+    case NOTE_ERR_SINK:
+      return NOTES_ERR_TOO_SMALL;
+    case NOTE_ERR_MEMORY:
+      return NOTES_ERR_MEMORY;
+    case NOTE_ERR_RANGE:
+      return NOTES_ERR_INVALID;
+    case NOTE_ERR_FORMAT:
+      return NOTES_ERR_FORMAT;
+  }
+
+  switch (errno) {
+    case ENOENT:
+      return NOTES_ERR_NOT_FOUND;
+    case ENOSPC:
+      return NOTES_ERR_FULL;
+    case ENOMEM:
+      return NOTES_ERR_MEMORY;
+    case EINVAL:
+    case ENAMETOOLONG:
+      return NOTES_ERR_INVALID;
+    default:
+      return NOTES_ERR_IO;
+  }
+}
+
+// Log in to a notebook kept in a storage backend.
+// Returns `NOTES_OK`, `NOTES_ERR_AUTH` if the password is wrong, or another error.
+//
+// `storage`: the backend, which is released if opening fails
+// `password`: the notebook password
+// `salt`: the salt the password was hashed with
+// `hash`: the password's hash
+// `handle`: A pointer to where the open notebook is to be placed
+static int open_storage(struct note_storage *storage, const char *password, const unsigned char salt[SALT_SIZE],
+    const unsigned char hash[SHA256_DIGEST_LENGTH], struct notes **handle) {
+  struct notes *notes = calloc(1, sizeof(struct notes));
+  if (notes == NULL) {
+    storage->ops->destroy(storage);
+    return NOTES_ERR_MEMORY;
+  }
+
+  unsigned char *secret = log_in(password, salt, hash);
+  if (secret == NULL) {
+    storage->ops->destroy(storage);
+    free(notes);
+    return NOTES_ERR_AUTH;
+  }
+  memcpy(notes->key, secret, KEY_SIZE);
+  OPENSSL_cleanse(secret, KEY_SIZE);
+  free(secret);
+
+  notes->storage = storage;
+  pthread_rwlock_init(&notes->lock, NULL);
+  *handle = notes;
+  return NOTES_OK;
+}
+
+// Open a notebook and log in to it.
+// The directory is the one notes is run in, holding the login file and notes directory.
+// A login file written by an older version is upgraded to the current format.
+// Returns `NOTES_OK`, `NOTES_ERR_NOT_FOUND` if the notebook has not been set up,
+// `NOTES_ERR_AUTH` if the password is wrong, or another error.
+//
+// `dir`: path of the directory holding the notebook
+// `password`: the notebook password
+// `handle`: A pointer to where the open notebook is to be placed
+int notes_open(const char *dir, const char *password, struct notes **handle) {
+  *handle = NULL;
+  char login_path[PATH_MAX];
+  if (snprintf(login_path, PATH_MAX, "%s/%s", dir, LOGIN_FILE) >= PATH_MAX) {
+    return NOTES_ERR_INVALID;
+  }
+
+  // Read salt and hash from disk.
+  struct login_details details;
+  int legacy = 0;
+  if (read_login_file(login_path, &details, &legacy)) {
+    return errno == EBADMSG ? NOTES_ERR_DAMAGED : errno == ENOTSUP ? NOTES_ERR_FORMAT : notes_error(NOTE_ERR_IO);
+  }
+
+  char folder[PATH_MAX];
+  if (snprintf(folder, PATH_MAX, "%s/%s", dir, NOTEBOOK_FOLDER) >= PATH_MAX) {
+    return NOTES_ERR_INVALID;
+  }
+  struct note_storage *storage = file_storage(folder);
+  if (storage == NULL) {
+    return notes_error(NOTE_ERR_IO);
+  }
+  int error = open_storage(storage, password, details.salt, details.hash, handle);
+
+  // Bring an old login file up to the current format once the password is known to be right.
+  // The notebook is usable either way.
+  if (!error && legacy) {
+    write_login_file(login_path, &details);
+  }
+  return error;
+}
+
+// Open a notebook held only in memory, for measuring without disk I/O.
+// It starts empty, and its notes are lost when it is closed.
+// Returns `NOTES_OK` or an error.
+//
+// `password`: the password to derive the notebook's key from
+// `handle`: A pointer to where the open notebook is to be placed
+int notes_open_memory(const char *password, struct notes **handle) {
+  *handle = NULL;
+  // Keys are derived as for a notebook on disk, so opening costs the same.
+  unsigned char salt[SALT_SIZE];
+  generate_salt(salt);
+  unsigned char *hash = calculate_hash(password, salt);
+  if (hash == NULL) {
+    return NOTES_ERR_MEMORY;
+  }
+  struct note_storage *storage = memory_storage();
+  int error = storage == NULL ? NOTES_ERR_MEMORY : open_storage(storage, password, salt, hash, handle);
+  free(hash);
+  return error;
+}
+
+// Close a notebook, wiping its key from memory.
+//
+// `handle`: the open notebook, or `NULL`
+void notes_close(struct notes *handle) {
+  if (handle == NULL) {
+    return;
+  }
+  handle->storage->ops->destroy(handle->storage);
+  pthread_rwlock_destroy(&handle->lock);
+  OPENSSL_cleanse(handle->key, KEY_SIZE);
+  free(handle);
+}
+
+// Encrypt and save a new note at the next free ID.
+// Returns `NOTES_OK`, `NOTES_ERR_FULL` if every ID is taken, or another error.
+//
+// `handle`: the open notebook
+// `content`: the note content
+// `len`: the content's length
+// `id`: A pointer to where the new note's ID is to be placed
+int notes_add(struct notes *handle, const void *content, size_t len, unsigned long *id) {
+  int printing = print_errors(0);
+  unsigned long long span = trace_begin();
+
+  // Claiming an ID is exclusive, so adds never conflict.
+  pthread_rwlock_rdlock(&handle->lock);
+  *id = 0;
+  int error = notes_error(handle->storage->ops->create(handle->storage, handle->key, content, len, id));
+  pthread_rwlock_unlock(&handle->lock);
+
+  trace_end("notes_add", span);
+  print_errors(printing);
+  return error;
+}
+
+// Get the content length of a note.
+// Returns `NOTES_OK`, `NOTES_ERR_NOT_FOUND` or another error.
+//
+// `handle`: the open notebook
+// `id`: the note ID
+// `length`: A pointer to where the length is to be placed
+int notes_length(struct notes *handle, unsigned long id, size_t *length) {
+  if (!id) {
+    return NOTES_ERR_INVALID;
+  }
+  int printing = print_errors(0);
+  unsigned long long span = trace_begin();
+
+  pthread_rwlock_rdlock(&handle->lock);
+  unsigned long long note_length = 0;
+  int error = handle->storage->ops->read(handle->storage, handle->key, id, 0, &note_length, NULL, NULL);
+  *length = note_length;
+  error = notes_error(error);
+  pthread_rwlock_unlock(&handle->lock);
+
+  trace_end("notes_length", span);
+  print_errors(printing);
+  return error;
+}
+
+// Decrypt a note into a buffer.
+// Returns `NOTES_OK`, `NOTES_ERR_TOO_SMALL` if the note does not fit, `NOTES_ERR_DAMAGED`
+// if it fails authentication, or another error. The length is set either way, so a
+// buffer that is too small can be grown and the call repeated.
+//
+// `handle`: the open notebook
+// `id`: the note ID
+// `buf`: A pointer to where the content is to be placed
+// `capacity`: the buffer's size
+// `len`: A pointer to where the content length is to be placed
+int notes_read_into(struct notes *handle, unsigned long id, void *buf, size_t capacity, size_t *len) {
+  *len = 0;
+  if (!id) {
+    return NOTES_ERR_INVALID;
+  }
+  int printing = print_errors(0);
+  unsigned long long span = trace_begin();
+
+  // Nothing is decrypted into a buffer it won't fit in.
+  pthread_rwlock_rdlock(&handle->lock);
+  struct copy_sink sink = {buf, 0, capacity};
+  unsigned long long note_length = 0;
+  int error = handle->storage->ops->read(handle->storage, handle->key, id, capacity, &note_length, copy_content,
+      &sink);
+  *len = error ? note_length : sink.len;
+  error = notes_error(error);
+  pthread_rwlock_unlock(&handle->lock);
+
+  trace_end("notes_read_into", span);
+  print_errors(printing);
+  return error;
+}
+
+// Add content to the end of a note, rewriting only its last chunk.
+// Returns `NOTES_OK`, `NOTES_ERR_NOT_FOUND` or another error.
+//
+// `handle`: the open notebook
+// `id`: the note ID
+// `content`: the content to add
+// `len`: the content's length
+int notes_append(struct notes *handle, unsigned long id, const void *content, size_t len) {
+  if (!id) {
+    return NOTES_ERR_INVALID;
+  }
+  int printing = print_errors(0);
+  unsigned long long span = trace_begin();
+
+  pthread_rwlock_wrlock(&handle->lock);
+  int error = notes_error(handle->storage->ops->write(handle->storage, handle->key, id, 1, 0, content, len));
+  pthread_rwlock_unlock(&handle->lock);
+
+  trace_end("notes_append", span);
+  print_errors(printing);
+  return error;
+}
+
+// Delete a note.
+// Returns `NOTES_OK`, `NOTES_ERR_NOT_FOUND` or another error.
+//
+// `handle`: the open notebook
+// `id`: the note ID
+int notes_delete(struct notes *handle, unsigned long id) {
+  if (!id) {
+    return NOTES_ERR_INVALID;
+  }
+  int printing = print_errors(0);
+  unsigned long long span = trace_begin();
+
+  pthread_rwlock_wrlock(&handle->lock);
+  int error = notes_error(handle->storage->ops->remove(handle->storage, handle->key, id));
+  pthread_rwlock_unlock(&handle->lock);
+
+  trace_end("notes_delete", span);
+  print_errors(printing);
+  return error;
+}
+
+// Start listing the notes in a notebook.
+// The IDs are read at once, so notes added or deleted later are not reflected.
+// Returns `NOTES_OK` or an error.
+// Note: The iterator must be released with `notes_list_end`!
+//
+// `handle`: the open notebook
+// `iter`: the iterator to set up
+int notes_list(struct notes *handle, struct notes_iter *iter) {
+  memset(iter, 0, sizeof(struct notes_iter));
+  int printing = print_errors(0);
+  unsigned long long span = trace_begin();
+
+  struct note_ids ids = {0};
+  int error = NOTES_OK;
+  int scanned = handle->storage->ops->enumerate(handle->storage, &ids);
+  if (scanned) {
+    error = notes_error(scanned);
+    free_note_ids(&ids);
+  } else {
+    sort_note_ids(ids.ids, ids.count);
+    iter->ids = ids.ids;
+    iter->count = unique_note_ids(ids.ids, ids.count);
+  }
+
+  trace_end("notes_list", span);
+  print_errors(printing);
+  return error;
+}
+
+// Make every change to a notebook so far survive a crash.
+// Returns `NOTES_OK` or an error.
+//
+// `handle`: the open notebook
+int notes_sync(struct notes *handle) {
+  unsigned long long span = trace_begin();
+  pthread_rwlock_rdlock(&handle->lock);
+  int error = notes_error(handle->storage->ops->sync(handle->storage));
+  pthread_rwlock_unlock(&handle->lock);
+  trace_end("notes_sync", span);
+  return error;
+}
+
+// Get the next note ID from a listing.
+// Returns 1 with the ID set, or 0 once every note has been listed.
+//
+// `iter`: the iterator from `notes_list`
+// `id`: A pointer to where the note ID is to be placed
+int notes_next(struct notes_iter *iter, unsigned long *id) {
+  if (iter->next >= iter->count) {
+    return 0;
+  }
+  *id = iter->ids[iter->next++];
+  return 1;
+}
+
+// Release a listing.
+//
+// `iter`: the iterator from `notes_list`
+void notes_list_end(struct notes_iter *iter) {
+  free(iter->ids);
+  memset(iter, 0, sizeof(struct notes_iter));
+}
+
+// Describe a libnotes error.
+// Returns a message for the error.
+//
+// `error`: the `NOTES_ERR_*` value
+const char* notes_strerror(int error) {
+  switch (error) {
+    case NOTES_OK:
+      return "success";
+    case NOTES_ERR_IO:
+      return "input/output error";
+    case NOTES_ERR_AUTH:
+      return "wrong password";
+    case NOTES_ERR_NOT_FOUND:
+      return "no such note or notebook";
+    case NOTES_ERR_DAMAGED:
+      return "note is damaged or was written with another key";
+    case NOTES_ERR_TOO_SMALL:
+      return "buffer is too small for the note";
+    case NOTES_ERR_MEMORY:
+      return "out of memory";
+    case NOTES_ERR_FULL:
+      return "every note ID is taken";
+    case NOTES_ERR_INVALID:
+      return "invalid argument";
+    case NOTES_ERR_FORMAT:
+      return "written by a newer version of notes";
+    default:
+      return "unknown error";
+  }
+}
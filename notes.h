@@ -0,0 +1,138 @@
+#ifndef NOTES_H
+#define NOTES_H 1
+
+// libnotes: use a notebook from another program, without running notes.
+// Every function returns `NOTES_OK` or a `NOTES_ERR_*` value and never prints.
+// A handle may be shared by any number of threads.
+
+#include <stddef.h>
+
+// Marks functions exported from the shared library.
+#define NOTES_API __attribute__((visibility("default")))
+
+// Errors returned by libnotes.
+#define NOTES_OK 0
+#define NOTES_ERR_IO -1
+#define NOTES_ERR_AUTH -2
+#define NOTES_ERR_NOT_FOUND -3
+#define NOTES_ERR_DAMAGED -4
+#define NOTES_ERR_TOO_SMALL -5
+#define NOTES_ERR_MEMORY -6
+#define NOTES_ERR_FULL -7
+#define NOTES_ERR_INVALID -8
+#define NOTES_ERR_FORMAT -9
+
+// An open notebook.
+struct notes;
+
+// The notes in a notebook, in numeric order, from `notes_list`.
+struct notes_iter {
+  unsigned long *ids;
+  size_t count;
+  // Index of the next ID to return.
+  size_t next;
+};
+
+// Open a notebook and log in to it.
+// The directory is the one notes is run in, holding the login file and notes directory.
+// A login file written by an older version is upgraded to the current format.
+// Returns `NOTES_OK`, `NOTES_ERR_NOT_FOUND` if the notebook has not been set up,
+// `NOTES_ERR_AUTH` if the password is wrong, or another error.
+//
+// `dir`: path of the directory holding the notebook
+// `password`: the notebook password
+// `handle`: A pointer to where the open notebook is to be placed
+NOTES_API int notes_open(const char *dir, const char *password, struct notes **handle);
+
+// Open a notebook held only in memory, for measuring without disk I/O.
+// It starts empty, and its notes are lost when it is closed.
+// Returns `NOTES_OK` or an error.
+//
+// `password`: the password to derive the notebook's key from
+// `handle`: A pointer to where the open notebook is to be placed
+NOTES_API int notes_open_memory(const char *password, struct notes **handle);
+
+// Close a notebook, wiping its key from memory.
+//
+// `handle`: the open notebook, or `NULL`
+NOTES_API void notes_close(struct notes *handle);
+
+// Encrypt and save a new note at the next free ID.
+// Returns `NOTES_OK`, `NOTES_ERR_FULL` if every ID is taken, or another error.
+//
+// `handle`: the open notebook
+// `content`: the note content
+// `len`: the content's length
+// `id`: A pointer to where the new note's ID is to be placed
+NOTES_API int notes_add(struct notes *handle, const void *content, size_t len, unsigned long *id);
+
+// Get the content length of a note.
+// Returns `NOTES_OK`, `NOTES_ERR_NOT_FOUND` or another error.
+//
+// `handle`: the open notebook
+// `id`: the note ID
+// `length`: A pointer to where the length is to be placed
+NOTES_API int notes_length(struct notes *handle, unsigned long id, size_t *length);
+
+// Decrypt a note into a buffer.
+// Returns `NOTES_OK`, `NOTES_ERR_TOO_SMALL` if the note does not fit, `NOTES_ERR_DAMAGED`
+// if it fails authentication, or another error. The length is set either way, so a
+// buffer that is too small can be grown and the call repeated.
+//
+// `handle`: the open notebook
+// `id`: the note ID
+// `buf`: A pointer to where the content is to be placed
+// `capacity`: the buffer's size
+// `len`: A pointer to where the content length is to be placed
+NOTES_API int notes_read_into(struct notes *handle, unsigned long id, void *buf, size_t capacity, size_t *len);
+
+// Add content to the end of a note, rewriting only its last chunk.
+// Returns `NOTES_OK`, `NOTES_ERR_NOT_FOUND` or another error.
+//
+// `handle`: the open notebook
+// `id`: the note ID
+// `content`: the content to add
+// `len`: the content's length
+NOTES_API int notes_append(struct notes *handle, unsigned long id, const void *content, size_t len);
+
+// Delete a note.
+// Returns `NOTES_OK`, `NOTES_ERR_NOT_FOUND` or another error.
+//
+// `handle`: the open notebook
+// `id`: the note ID
+NOTES_API int notes_delete(struct notes *handle, unsigned long id);
+
+// Start listing the notes in a notebook.
+// The IDs are read at once, so notes added or deleted later are not reflected.
+// Returns `NOTES_OK` or an error.
+// Note: The iterator must be released with `notes_list_end`!
+//
+// `handle`: the open notebook
+// `iter`: the iterator to set up
+NOTES_API int notes_list(struct notes *handle, struct notes_iter *iter);
+
+// Make every change to a notebook so far survive a crash.
+// Returns `NOTES_OK` or an error.
+//
+// `handle`: the open notebook
+NOTES_API int notes_sync(struct notes *handle);
+
+// Get the next note ID from a listing.
+// Returns 1 with the ID set, or 0 once every note has been listed.
+//
+// `iter`: the iterator from `notes_list`
+// `id`: A pointer to where the note ID is to be placed
+NOTES_API int notes_next(struct notes_iter *iter, unsigned long *id);
+
+// Release a listing.
+//
+// `iter`: the iterator from `notes_list`
+NOTES_API void notes_list_end(struct notes_iter *iter);
+
+// Describe a libnotes error.
+// Returns a message for the error.
+//
+// `error`: the `NOTES_ERR_*` value
+NOTES_API const char* notes_strerror(int error);
+
+#endif
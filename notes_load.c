@@ -0,0 +1,945 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man2/mmap.2.html (MAP_SHARED | MAP_ANONYMOUS)
+// https://gcc.gnu.org/onlinedocs/gcc/_005f_005fatomic-Builtins.html
+
+// Drives a notebook with a mix of operations, to see how the whole program behaves at scale.
+// A notebook is generated with a given number of notes and sizes, then worker threads,
+// optionally in several processes, add, read, list, delete and append notes at random
+// with the given weights. Throughput and latency percentiles are reported every interval
+// and for the whole run. Every operation can be recorded to a trace and replayed later.
+//
+// With --memory, notes are kept in memory instead, so the cost of encryption and the
+// notebook code can be told apart from the cost of I/O.
+//
+// Trace lines: start time (us) || worker || operation || note ID || bytes || latency (us) || result
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "data.h"
+#include "security.h"
+#include "notefile.h"
+#include "notes.h"
+#include "trace.h"
+
+// Password for generated notebooks.
+#define LOAD_PASSWORD "load generator password"
+
+// Latency histogram buckets. Latencies under 32 us get their own bucket. Above that,
+// each power of 2 is split into 16 buckets, so percentiles are within about 6%.
+#define HIST_LINEAR 32
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (HIST_LINEAR + (64 - 5) * (1 << HIST_SUB_BITS))
+
+// Most workers at once, in all processes.
+#define MAX_WORKERS 1024
+
+// Operations in a workload.
+enum load_op {
+  OP_ADD,
+  OP_READ,
+  OP_LIST,
+  OP_DELETE,
+  OP_APPEND,
+  OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {"add", "read", "list", "delete", "append"};
+
+// Latencies of one operation, in microseconds.
+struct histogram {
+  unsigned long long counts[HIST_BUCKETS];
+  unsigned long long errors;
+  unsigned long long max;
+};
+
+// State shared by every worker process. It is mapped shared before forking, and only
+// changed with atomics.
+struct load_shared {
+  // Highest note ID known to exist, for picking notes to read and delete.
+  unsigned long max_id;
+  // Set when the run is over.
+  int stop;
+  // Latencies since the last report, and for the whole run.
+  struct histogram interval[OP_COUNT];
+  struct histogram total[OP_COUNT];
+};
+
+// Distribution of note sizes.
+struct size_dist {
+  enum {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_EXP,
+  } kind;
+  size_t min;
+  size_t max;
+};
+
+// One operation from a trace.
+struct trace_op {
+  enum load_op op;
+  unsigned long id;
+  size_t bytes;
+};
+
+// Operations for one worker to replay, in order.
+struct trace_worker {
+  struct trace_op *ops;
+  size_t count;
+  size_t capacity;
+};
+
+// Settings for a run.
+struct load_config {
+  const char *dir;
+  unsigned long notes;
+  struct size_dist size;
+  unsigned int threads;
+  unsigned int procs;
+  unsigned int weights[OP_COUNT];
+  unsigned long ops;
+  double duration;
+  double interval;
+  unsigned long seed;
+  int trace_fd;
+  struct trace_worker *replay;
+  unsigned int replay_workers;
+  // A notebook in memory shared by every worker, or `NULL` to open the one in `dir`.
+  struct notes *memory;
+};
+
+// Arguments for a worker thread.
+struct worker {
+  const struct load_config *config;
+  struct load_shared *shared;
+  struct notes *handle;
+  unsigned int index;
+  unsigned long long seed;
+  // For generating the notebook: the notes to add.
+  unsigned long generate;
+};
+
+// Time runs are measured from. Monotonic time is the same in every process.
+static double start_us;
+
+// Get the current time in microseconds.
+double now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+// Get the next pseudo-random number. Quality doesn't matter, but speed and a per-thread
+// state do, as every operation needs some.
+// Returns the number.
+//
+// `state`: the generator state, not `0`
+unsigned long long next_random(unsigned long long *state) {
+  unsigned long long x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+// Get the histogram bucket for a latency.
+unsigned int bucket_of(unsigned long long us) {
+  if (us < HIST_LINEAR) {
+    return us;
+  }
+  int exponent = 63 - __builtin_clzll(us);
+  unsigned int sub = (us >> (exponent - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+  return HIST_LINEAR + (exponent - 5) * (1 << HIST_SUB_BITS) + sub;
+}
+
+// Get the lowest latency in a histogram bucket.
+unsigned long long bucket_value(unsigned int bucket) {
+  if (bucket < HIST_LINEAR) {
+    return bucket;
+  }
+  unsigned int exponent = (bucket - HIST_LINEAR) / (1 << HIST_SUB_BITS) + 5;
+  unsigned int sub = (bucket - HIST_LINEAR) % (1 << HIST_SUB_BITS);
+  return (unsigned long long) ((1 << HIST_SUB_BITS) + sub) << (exponent - HIST_SUB_BITS);
+}
+
+// Add a latency to a histogram.
+void record_latency(struct histogram *hist, unsigned long long us, int failed) {
+  __atomic_fetch_add(&hist->counts[bucket_of(us)], 1, __ATOMIC_RELAXED);
+  if (failed) {
+    __atomic_fetch_add(&hist->errors, 1, __ATOMIC_RELAXED);
+  }
+  unsigned long long max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  while (us > max && !__atomic_compare_exchange_n(&hist->max, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    // Another worker raised the maximum; try again against its value.
+  }
+}
+
+// Add one histogram to another, taking its counts, and optionally clear it.
+void merge_histogram(struct histogram *into, struct histogram *from, int clear) {
+  for (int i = 0; i < HIST_BUCKETS; ++i) {
+    into->counts[i] += clear ? __atomic_exchange_n(&from->counts[i], 0, __ATOMIC_RELAXED)
+        : __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+  }
+  into->errors += clear ? __atomic_exchange_n(&from->errors, 0, __ATOMIC_RELAXED)
+      : __atomic_load_n(&from->errors, __ATOMIC_RELAXED);
+  unsigned long long max = clear ? __atomic_exchange_n(&from->max, 0, __ATOMIC_RELAXED)
+      : __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+  if (max > into->max) {
+    into->max = max;
+  }
+}
+
+// Count the latencies in a histogram.
+unsigned long long histogram_count(const struct histogram *hist) {
+  unsigned long long count = 0;
+  for (int i = 0; i < HIST_BUCKETS; ++i) {
+    count += hist->counts[i];
+  }
+  return count;
+}
+
+// Get a percentile of the latencies in a histogram.
+// Returns the latency in microseconds.
+//
+// `hist`: the histogram
+// `percentile`: the percentile, i.e. `99.9`
+unsigned long long histogram_percentile(const struct histogram *hist, double percentile) {
+  unsigned long long count = histogram_count(hist);
+  if (count == 0) {
+    return 0;
+  }
+  unsigned long long rank = (unsigned long long) ceil(count * percentile / 100);
+  unsigned long long seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; ++i) {
+    seen += hist->counts[i];
+    if (seen >= rank && hist->counts[i]) {
+      // The top bucket is reported as the true maximum.
+      unsigned long long value = bucket_value(i);
+      return value > hist->max ? hist->max : value;
+    }
+  }
+  return hist->max;
+}
+
+// Pick a note size.
+size_t pick_size(const struct size_dist *dist, unsigned long long *state) {
+  switch (dist->kind) {
+    case SIZE_UNIFORM:
+      return dist->min + next_random(state) % (dist->max - dist->min + 1);
+    case SIZE_EXP: {
+      // Most notes are small and a few are large, like real notes.
+      double uniform = (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+      size_t size = (size_t) (-log(1 - uniform) * dist->min);
+      return size > dist->max ? dist->max : size;
+    }
+    case SIZE_FIXED:
+    default:
+      return dist->min;
+  }
+}
+
+// Pick an operation by weight.
+enum load_op pick_op(const struct load_config *config, unsigned long long *state) {
+  unsigned int total = 0;
+  for (int op = 0; op < OP_COUNT; ++op) {
+    total += config->weights[op];
+  }
+  unsigned int pick = next_random(state) % total;
+  for (int op = 0; op < OP_COUNT; ++op) {
+    if (pick < config->weights[op]) {
+      return op;
+    }
+    pick -= config->weights[op];
+  }
+  return OP_READ;
+}
+
+// Raise the highest known note ID.
+void note_added(struct load_shared *shared, unsigned long id) {
+  unsigned long max = __atomic_load_n(&shared->max_id, __ATOMIC_RELAXED);
+  while (id > max && !__atomic_compare_exchange_n(&shared->max_id, &max, id, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    // Another worker raised it; try again against its value.
+  }
+}
+
+// Get a buffer of filler content, grown as needed. Content doesn't affect encryption speed.
+// Returns the buffer or `NULL` on error.
+//
+// `buf`: the worker's buffer
+// `capacity`: the buffer's size
+// `len`: the size needed
+unsigned char* filler(unsigned char **buf, size_t *capacity, size_t len) {
+  if (len > *capacity) {
+    unsigned char *grown = realloc(*buf, len);
+    if (grown == NULL) {
+      return NULL;
+    }
+    for (size_t i = *capacity; i < len; ++i) {
+      grown[i] = 'a' + i % 26;
+    }
+    *buf = grown;
+    *capacity = len;
+  }
+  return *buf;
+}
+
+// Run one operation and record it.
+//
+// `worker`: the worker running it
+// `op`: the operation
+// `id`: the note to use, or `0` to pick one, or to use the new note's ID when adding
+// `bytes`: content to add, or `0` for a read
+// `buf`: the worker's content buffer
+// `capacity`: the buffer's size
+void run_op(struct worker *worker, enum load_op op, unsigned long id, size_t bytes, unsigned char **buf,
+    size_t *capacity) {
+  struct load_shared *shared = worker->shared;
+  unsigned long max_id = __atomic_load_n(&shared->max_id, __ATOMIC_RELAXED);
+  if (!id && op != OP_ADD && op != OP_LIST && max_id) {
+    id = 1 + next_random(&worker->seed) % max_id;
+  }
+
+  double start = now_us();
+  int error = NOTES_OK;
+  size_t len = 0;
+  switch (op) {
+    case OP_ADD:
+    case OP_APPEND:
+      if (filler(buf, capacity, bytes) == NULL) {
+        error = NOTES_ERR_MEMORY;
+      } else if (op == OP_ADD) {
+        error = notes_add(worker->handle, *buf, bytes, &id);
+        if (!error) {
+          note_added(shared, id);
+        }
+      } else {
+        error = notes_append(worker->handle, id, *buf, bytes);
+      }
+      break;
+    case OP_READ:
+      error = notes_read_into(worker->handle, id, *buf, *capacity, &len);
+      if (error == NOTES_ERR_TOO_SMALL) {
+        // Grow once and read again, as a program would.
+        error = filler(buf, capacity, len) == NULL ? NOTES_ERR_MEMORY
+            : notes_read_into(worker->handle, id, *buf, *capacity, &len);
+      }
+      bytes = len;
+      break;
+    case OP_LIST: {
+      struct notes_iter iter;
+      error = notes_list(worker->handle, &iter);
+      if (!error) {
+        unsigned long listed;
+        while (notes_next(&iter, &listed)) {
+          ++bytes;
+        }
+        notes_list_end(&iter);
+      }
+      break;
+    }
+    case OP_DELETE:
+      error = notes_delete(worker->handle, id);
+      break;
+    default:
+      break;
+  }
+  double end = now_us();
+
+  // Picking a deleted note is part of the workload, not a failure.
+  int failed = error && error != NOTES_ERR_NOT_FOUND;
+  unsigned long long latency = end - start;
+  record_latency(&shared->interval[op], latency, failed);
+  record_latency(&shared->total[op], latency, failed);
+
+  if (worker->config->trace_fd >= 0) {
+    // One write per line, so lines from many workers don't mix.
+    char line[128];
+    int line_len = snprintf(line, sizeof(line), "%.0f %u %s %lu %zu %llu %d\n", start - start_us, worker->index,
+        op_names[op], id, bytes, latency, error);
+    if (write(worker->config->trace_fd, line, line_len) != line_len) {
+      perror("trace");
+    }
+  }
+}
+
+// Thread entry point for a worker.
+//
+// `arg`: the worker
+void* run_worker(void *arg) {
+  struct worker *worker = arg;
+  const struct load_config *config = worker->config;
+  unsigned char *buf = NULL;
+  size_t capacity = 0;
+
+  if (worker->generate) {
+    // Fill the notebook before the run.
+    for (unsigned long i = 0; i < worker->generate; ++i) {
+      size_t bytes = pick_size(&config->size, &worker->seed);
+      unsigned long id = 0;
+      if (filler(&buf, &capacity, bytes) == NULL || notes_add(worker->handle, buf, bytes, &id)) {
+        fprintf(stderr, "Generating notes failed\n");
+        break;
+      }
+      note_added(worker->shared, id);
+    }
+  } else if (config->replay) {
+    const struct trace_worker *trace = &config->replay[worker->index];
+    for (size_t i = 0; i < trace->count && !__atomic_load_n(&worker->shared->stop, __ATOMIC_RELAXED); ++i) {
+      const struct trace_op *op = &trace->ops[i];
+      run_op(worker, op->op, op->op == OP_ADD ? 0 : op->id, op->op == OP_READ ? 0 : op->bytes, &buf, &capacity);
+    }
+  } else {
+    for (unsigned long i = 0; (!config->ops || i < config->ops)
+        && !__atomic_load_n(&worker->shared->stop, __ATOMIC_RELAXED); ++i) {
+      enum load_op op = pick_op(config, &worker->seed);
+      size_t bytes = op == OP_ADD ? pick_size(&config->size, &worker->seed)
+          : op == OP_APPEND ? 1 + next_random(&worker->seed) % 256 : 0;
+      run_op(worker, op, 0, bytes, &buf, &capacity);
+    }
+  }
+
+  free(buf);
+  return NULL;
+}
+
+// Run workers on threads and wait for them.
+// Returns `0` on success or `-1` on error.
+//
+// `config`: settings for the run
+// `shared`: shared state
+// `first`: index of the first worker
+// `count`: the number of workers
+// `generate`: notes for each worker to generate, or `0` to run the workload
+int run_threads(const struct load_config *config, struct load_shared *shared, unsigned int first, unsigned int count,
+    unsigned long generate) {
+  // Each process logs in on its own, as separate programs would.
+  struct notes *handle = config->memory;
+  int error = handle ? NOTES_OK : notes_open(config->dir, LOAD_PASSWORD, &handle);
+  if (error) {
+    fprintf(stderr, "%s: %s\n", config->dir, notes_strerror(error));
+    return -1;
+  }
+
+  pthread_t *threads = calloc(count, sizeof(pthread_t));
+  struct worker *workers = calloc(count, sizeof(struct worker));
+  if (threads == NULL || workers == NULL) {
+    perror("workers");
+    free(threads);
+    free(workers);
+    if (handle != config->memory) {
+      notes_close(handle);
+    }
+    return -1;
+  }
+
+  unsigned int started = 0;
+  for (; started < count; ++started) {
+    struct worker *worker = &workers[started];
+    worker->config = config;
+    worker->shared = shared;
+    worker->handle = handle;
+    worker->index = first + started;
+    worker->seed = (config->seed + 1) * 0x9e3779b97f4a7c15ULL + worker->index + 1;
+    worker->generate = generate;
+    if ((error = pthread_create(&threads[started], NULL, run_worker, worker))) {
+      errno = error;
+      perror("worker");
+      break;
+    }
+  }
+  for (unsigned int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  free(workers);
+  if (handle != config->memory) {
+    notes_close(handle);
+  }
+  return started == count ? 0 : -1;
+}
+
+// Generate the notes asked for before a run, spread over threads.
+// Returns `0` on success or `-1` on error.
+//
+// `config`: settings for the run
+// `shared`: shared state
+// `generators`: the number of threads
+int generate_notes(const struct load_config *config, struct load_shared *shared, unsigned int generators) {
+  int failed = run_threads(config, shared, 0, generators, config->notes / generators)
+      || (config->notes % generators && run_threads(config, shared, 0, 1, config->notes % generators));
+  return failed ? -1 : 0;
+}
+
+// Leave a worker process. Its trace is written first, as `_exit` skips exit handlers.
+//
+// `failed`: nonzero if the worker failed
+void exit_worker(int failed) {
+  trace_write();
+  _exit(failed ? 1 : 0);
+}
+
+// Print a line of throughput and latency.
+//
+// `label`: what the line is for
+// `hist`: the latencies
+// `seconds`: the time the latencies were collected over
+void print_stats(const char *label, const struct histogram *hist, double seconds) {
+  unsigned long long count = histogram_count(hist);
+  printf("%-8s %10llu %10.1f %9llu %9llu %9llu %9llu %9llu %8llu\n", label, count, seconds > 0 ? count / seconds : 0,
+      histogram_percentile(hist, 50), histogram_percentile(hist, 95), histogram_percentile(hist, 99),
+      histogram_percentile(hist, 99.9), hist->max, hist->errors);
+}
+
+// Print the header for `print_stats` lines.
+void print_stats_header(const char *label) {
+  printf("%-8s %10s %10s %9s %9s %9s %9s %9s %8s\n", label, "ops", "ops/s", "p50 us", "p95 us", "p99 us",
+      "p99.9 us", "max us", "errors");
+}
+
+// Run the workload, reporting every interval.
+// Returns `0` on success or `-1` on error.
+//
+// `config`: settings for the run
+// `shared`: shared state
+int run_load(const struct load_config *config, struct load_shared *shared) {
+  unsigned int procs = config->replay ? 1 : config->procs;
+  unsigned int threads = config->replay ? config->replay_workers : config->threads;
+
+  // Workers in other processes share the histograms through the mapping.
+  start_us = now_us();
+  pid_t pids[MAX_WORKERS];
+  unsigned int forked = 0;
+  for (; forked + 1 < procs; ++forked) {
+    pids[forked] = fork();
+    if (pids[forked] < 0) {
+      perror("fork");
+      break;
+    }
+    if (pids[forked] == 0) {
+      exit_worker(run_threads(config, shared, (forked + 1) * threads, threads, 0));
+    }
+  }
+
+  // The first set of workers runs in a child too, so this process only reports.
+  pid_t local = fork();
+  if (local == 0) {
+    exit_worker(run_threads(config, shared, 0, threads, 0));
+  }
+
+  print_stats_header("time s");
+  double last = start_us;
+  int running = local > 0;
+  while (running) {
+    // Sleep until the next report, or check often for workers finishing.
+    double next = last + config->interval * 1e6;
+    while (now_us() < next && running) {
+      usleep(10000);
+      running = waitpid(local, NULL, WNOHANG) == 0;
+      if (config->duration > 0 && now_us() - start_us >= config->duration * 1e6) {
+        __atomic_store_n(&shared->stop, 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    double now = now_us();
+    struct histogram interval = {0};
+    for (int op = 0; op < OP_COUNT; ++op) {
+      merge_histogram(&interval, &shared->interval[op], 1);
+    }
+    char label[32];
+    snprintf(label, sizeof(label), "%.1f", (now - start_us) / 1e6);
+    print_stats(label, &interval, (now - last) / 1e6);
+    fflush(stdout);
+    last = now;
+  }
+
+  int status = 0;
+  __atomic_store_n(&shared->stop, 1, __ATOMIC_RELAXED);
+  for (unsigned int i = 0; i < forked; ++i) {
+    int child_status = 0;
+    if (waitpid(pids[i], &child_status, 0) < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status)) {
+      status = -1;
+    }
+  }
+  if (local < 0) {
+    perror("fork");
+    status = -1;
+  }
+  double seconds = (now_us() - start_us) / 1e6;
+
+  // Summary of the whole run, by operation.
+  printf("\n");
+  print_stats_header("op");
+  struct histogram all = {0};
+  for (int op = 0; op < OP_COUNT; ++op) {
+    if (histogram_count(&shared->total[op])) {
+      print_stats(op_names[op], &shared->total[op], seconds);
+      merge_histogram(&all, &shared->total[op], 0);
+    }
+  }
+  print_stats("all", &all, seconds);
+  printf("%u processes x %u threads, %.2f s\n", procs, threads, seconds);
+  return status;
+}
+
+// Parse an operation name.
+// Returns the operation or `OP_COUNT` if the name is unknown.
+enum load_op parse_op(const char *name, size_t len) {
+  for (int op = 0; op < OP_COUNT; ++op) {
+    if (strlen(op_names[op]) == len && !strncmp(op_names[op], name, len)) {
+      return op;
+    }
+  }
+  return OP_COUNT;
+}
+
+// Parse operation weights, i.e. `add=20,read=70,delete=10`. Operations not named get `0`.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+int parse_mix(const char *arg, unsigned int weights[OP_COUNT]) {
+  memset(weights, 0, OP_COUNT * sizeof(unsigned int));
+  unsigned int total = 0;
+  const char *pos = arg;
+  while (*pos) {
+    const char *equals = strchr(pos, '=');
+    enum load_op op = equals ? parse_op(pos, equals - pos) : OP_COUNT;
+    char *end = NULL;
+    unsigned long weight = op == OP_COUNT ? 0 : strtoul(equals + 1, &end, 10);
+    if (op == OP_COUNT || end == equals + 1 || (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "Invalid value for --mix: %s\n", arg);
+      return -1;
+    }
+    weights[op] = weight;
+    total += weight;
+    pos = *end ? end + 1 : end;
+  }
+  if (total == 0) {
+    fprintf(stderr, "Invalid value for --mix: %s\n", arg);
+    return -1;
+  }
+  return 0;
+}
+
+// Parse a size distribution: `N` for a fixed size, `MIN-MAX` for sizes spread evenly,
+// or `exp:MEAN[-MAX]` for mostly small notes with a few large ones.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+int parse_size(const char *arg, struct size_dist *dist) {
+  char *end = NULL;
+  int exp = !strncmp(arg, "exp:", 4);
+  const char *pos = exp ? arg + 4 : arg;
+  dist->min = strtoul(pos, &end, 10);
+  dist->max = exp ? NOTE_CHUNK_SIZE * 64 : dist->min;
+  if (end != pos && *end == '-') {
+    pos = end + 1;
+    dist->max = strtoul(pos, &end, 10);
+  }
+  if (end == pos || *end != '\0' || dist->max < dist->min || arg[0] == '-') {
+    fprintf(stderr, "Invalid value for --size: %s\n", arg);
+    return -1;
+  }
+  dist->kind = exp ? SIZE_EXP : dist->max > dist->min ? SIZE_UNIFORM : SIZE_FIXED;
+  return 0;
+}
+
+// Read a trace to replay, splitting operations by worker.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+int read_trace(const char *path, struct load_config *config) {
+  FILE *trace = fopen(path, "r");
+  if (trace == NULL) {
+    perror(path);
+    return -1;
+  }
+  config->replay = calloc(MAX_WORKERS, sizeof(struct trace_worker));
+  if (config->replay == NULL) {
+    perror(path);
+    fclose(trace);
+    return -1;
+  }
+
+  char line[256];
+  unsigned long line_number = 0;
+  int status = 0;
+  while (!status && fgets(line, sizeof(line), trace)) {
+    ++line_number;
+    double start;
+    unsigned int worker;
+    char name[16];
+    struct trace_op op;
+    if (sscanf(line, "%lf %u %15s %lu %zu", &start, &worker, name, &op.id, &op.bytes) != 5
+        || (op.op = parse_op(name, strlen(name))) == OP_COUNT || worker >= MAX_WORKERS) {
+      fprintf(stderr, "%s:%lu: not a trace line\n", path, line_number);
+      status = -1;
+      break;
+    }
+
+    struct trace_worker *ops = &config->replay[worker];
+    if (ops->count == ops->capacity) {
+      size_t capacity = ops->capacity ? ops->capacity * 2 : 256;
+      struct trace_op *grown = realloc(ops->ops, capacity * sizeof(struct trace_op));
+      if (grown == NULL) {
+        perror(path);
+        status = -1;
+        break;
+      }
+      ops->ops = grown;
+      ops->capacity = capacity;
+    }
+    ops->ops[ops->count++] = op;
+    if (worker >= config->replay_workers) {
+      config->replay_workers = worker + 1;
+    }
+  }
+  fclose(trace);
+  return status;
+}
+
+// Set up a notebook for the load, with the password used by the generator.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+int create_notebook(const char *dir) {
+  char login_path[PATH_MAX];
+  snprintf(login_path, PATH_MAX, "%s/%s", dir, LOGIN_FILE);
+  if (!access(login_path, F_OK)) {
+    // Already set up, i.e. by an earlier run.
+    return 0;
+  }
+
+  struct login_details details;
+  generate_salt(details.salt);
+  unsigned char *hash = calculate_hash(LOAD_PASSWORD, details.salt);
+  if (hash == NULL) {
+    return -1;
+  }
+  memcpy(details.hash, hash, sizeof(details.hash));
+  free(hash);
+
+  if (write_login_file(login_path, &details)) {
+    perror(login_path);
+    return -1;
+  }
+  return 0;
+}
+
+// Remove a file or directory while cleaning up the scratch notebook.
+int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  return remove(path);
+}
+
+// Print usage.
+void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [options]\n"
+      "  --dir DIR           notebook to use, set up if needed (default: a scratch notebook)\n"
+      "  --notes N           notes to generate before the run (default: 1000)\n"
+      "  --size SPEC         note sizes: N, MIN-MAX or exp:MEAN[-MAX] bytes (default: exp:1024)\n"
+      "  --threads N         worker threads in each process (default: 4)\n"
+      "  --procs N           worker processes (default: 1)\n"
+      "  --mix OP=W,...      weights of add, read, list, delete and append (default: add=20,read=60,list=5,delete=15)\n"
+      "  --ops N             operations for each worker (default: until --duration)\n"
+      "  --duration S        seconds to run (default: 10, unless --ops is given)\n"
+      "  --interval S        seconds between reports (default: 1)\n"
+      "  --seed N            seed for the workload (default: 1)\n"
+      "  --record FILE       write every operation to a trace\n"
+      "  --replay FILE       run the operations in a trace, one worker per traced worker\n"
+      "  --memory            keep notes in memory instead of in a notebook (one process only)\n", program);
+}
+
+// Entry point. Generates a notebook, then runs the workload and reports on it.
+//
+// `argc`: The number of arguments used when running the executable
+// `argv`: The arguments used when running the executable
+int main(int argc, char *argv[]) {
+  static const struct option long_options[] = {
+    {"dir", required_argument, NULL, 'd'},
+    {"notes", required_argument, NULL, 'n'},
+    {"size", required_argument, NULL, 's'},
+    {"threads", required_argument, NULL, 't'},
+    {"procs", required_argument, NULL, 'P'},
+    {"mix", required_argument, NULL, 'm'},
+    {"ops", required_argument, NULL, 'o'},
+    {"duration", required_argument, NULL, 'D'},
+    {"interval", required_argument, NULL, 'i'},
+    {"seed", required_argument, NULL, 'S'},
+    {"record", required_argument, NULL, 'r'},
+    {"replay", required_argument, NULL, 'R'},
+    {"memory", no_argument, NULL, 'M'},
+    {NULL, 0, NULL, 0},
+  };
+
+  struct load_config config = {0};
+  config.notes = 1000;
+  config.size.kind = SIZE_EXP;
+  config.size.min = 1024;
+  config.size.max = NOTE_CHUNK_SIZE * 64;
+  config.threads = 4;
+  config.procs = 1;
+  config.weights[OP_ADD] = 20;
+  config.weights[OP_READ] = 60;
+  config.weights[OP_LIST] = 5;
+  config.weights[OP_DELETE] = 15;
+  config.interval = 1;
+  config.seed = 1;
+  config.trace_fd = -1;
+  const char *record = NULL;
+  const char *replay = NULL;
+  int memory = 0;
+
+  int opt = 0;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'd':
+        config.dir = optarg;
+        break;
+      case 'n':
+        config.notes = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        if (parse_size(optarg, &config.size)) {
+          return 2;
+        }
+        break;
+      case 't':
+        config.threads = atoi(optarg);
+        break;
+      case 'P':
+        config.procs = atoi(optarg);
+        break;
+      case 'm':
+        if (parse_mix(optarg, config.weights)) {
+          return 2;
+        }
+        break;
+      case 'o':
+        config.ops = strtoul(optarg, NULL, 10);
+        break;
+      case 'D':
+        config.duration = atof(optarg);
+        break;
+      case 'i':
+        config.interval = atof(optarg);
+        break;
+      case 'S':
+        config.seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        record = optarg;
+        break;
+      case 'R':
+        replay = optarg;
+        break;
+      case 'M':
+        memory = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+  if (config.threads < 1 || config.procs < 1 || config.threads * config.procs > MAX_WORKERS || config.interval <= 0
+      || (memory && (config.procs > 1 || config.dir))) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (!config.ops && config.duration <= 0 && !replay) {
+    config.duration = 10;
+  }
+  if (replay && read_trace(replay, &config)) {
+    return 2;
+  }
+  if (record) {
+    config.trace_fd = open(record, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (config.trace_fd < 0) {
+      perror(record);
+      return 2;
+    }
+  }
+
+  // Without a notebook given, work in a scratch one, so real notes are never touched.
+  char scratch[] = "/tmp/notes-load-XXXXXX";
+  if (config.dir == NULL && !memory) {
+    if (mkdtemp(scratch) == NULL) {
+      perror(scratch);
+      return 2;
+    }
+    config.dir = scratch;
+  }
+
+  struct load_shared *shared = mmap(NULL, sizeof(struct load_shared), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  int status = 2;
+  int ready = 0;
+  if (shared == MAP_FAILED) {
+    perror("shared state");
+  } else if (memory) {
+    // Workers fork from this process, so they start with the same notes.
+    int error = notes_open_memory(LOAD_PASSWORD, &config.memory);
+    if (error) {
+      fprintf(stderr, "memory: %s\n", notes_strerror(error));
+    }
+    ready = !error;
+  } else if (!create_notebook(config.dir)) {
+    // Notes from earlier runs count as generated.
+    struct notes *handle = NULL;
+    struct notes_iter iter;
+    if (!notes_open(config.dir, LOAD_PASSWORD, &handle) && !notes_list(handle, &iter)) {
+      if (iter.count) {
+        shared->max_id = iter.ids[iter.count - 1];
+      }
+      config.notes = iter.count < config.notes ? config.notes - iter.count : 0;
+      notes_list_end(&iter);
+    }
+    notes_close(handle);
+    ready = 1;
+  }
+
+  if (ready) {
+    double generate_start = now_us();
+    unsigned int generators = config.threads < config.notes ? config.threads : 1;
+    int failed = 0;
+    if (config.memory && config.notes) {
+      // Notes added in a child would stay there, so they are added here. The threads are
+      // joined before the workers fork.
+      failed = generate_notes(&config, shared, generators);
+    } else if (config.notes) {
+      // Generate in a child, so no threads are running when the workers fork.
+      pid_t pid = fork();
+      if (pid == 0) {
+        exit_worker(generate_notes(&config, shared, generators));
+      }
+      int child_status = 0;
+      failed = pid < 0 || waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status)
+          || WEXITSTATUS(child_status);
+    }
+    if (config.notes && !failed) {
+      double seconds = (now_us() - generate_start) / 1e6;
+      printf("Generated %lu notes in %.2f s (%.0f notes/s), highest ID %lu\n", config.notes, seconds,
+          config.notes / seconds, shared->max_id);
+    }
+    if (failed) {
+      fprintf(stderr, "Generating notes failed\n");
+    } else {
+      status = run_load(&config, shared) ? 1 : 0;
+    }
+  }
+
+  if (config.trace_fd >= 0) {
+    close(config.trace_fd);
+  }
+  notes_close(config.memory);
+  if (config.dir == scratch) {
+    nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+  return status;
+}
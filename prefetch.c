@@ -0,0 +1,115 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "data.h"
+#include "prefetch.h"
+
+// Thread entry point for decrypting hinted notes into the cache.
+//
+// `arg`: the prefetcher
+static void* prefetch_worker(void *arg) {
+  struct prefetcher *prefetcher = arg;
+  // Prefetching is a guess, so notes that can't be read are not worth mentioning.
+  print_errors(0);
+
+  pthread_mutex_lock(&prefetcher->lock);
+  while (!prefetcher->stopping) {
+    if (prefetcher->count == 0) {
+      pthread_cond_wait(&prefetcher->wake, &prefetcher->lock);
+      continue;
+    }
+
+    unsigned long id = prefetcher->queue[0];
+    --prefetcher->count;
+    memmove(prefetcher->queue, prefetcher->queue + 1, prefetcher->count * sizeof(unsigned long));
+    prefetcher->busy = id;
+    pthread_mutex_unlock(&prefetcher->lock);
+
+    // Notes already cached cost a stat, and notes too large to cache are not read.
+    char note_name[MAXNAMLEN];
+    sprintf(note_name, ".%lu", id);
+    load_note(prefetcher->key, prefetcher->folder_name, note_name, prefetcher->cache, NULL, NULL);
+
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->busy = 0;
+    pthread_cond_broadcast(&prefetcher->done);
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+  return NULL;
+}
+
+// Start prefetching notes into a cache.
+// Returns `0` on success or `-1` on error.
+//
+// `prefetcher`: the prefetcher to start
+// `key`: the key to use for decryption, which must outlive the prefetcher
+// `folder_name`: path of directory containing note files
+// `cache`: the cache to decrypt notes into
+int prefetch_start(struct prefetcher *prefetcher, const unsigned char *key, const char *folder_name,
+    struct note_cache *cache) {
+  memset(prefetcher, 0, sizeof(struct prefetcher));
+  prefetcher->key = key;
+  prefetcher->folder_name = folder_name;
+  prefetcher->cache = cache;
+  if (pthread_mutex_init(&prefetcher->lock, NULL) || pthread_cond_init(&prefetcher->wake, NULL)
+      || pthread_cond_init(&prefetcher->done, NULL)) {
+    return -1;
+  }
+
+  int error = pthread_create(&prefetcher->thread, NULL, prefetch_worker, prefetcher);
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+// Ask for notes to be decrypted in the background, in place of any not yet started.
+//
+// `prefetcher`: the prefetcher
+// `ids`: the note IDs, most likely to be viewed first
+// `count`: the number of IDs
+void prefetch_hint(struct prefetcher *prefetcher, const unsigned long *ids, size_t count) {
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->count = 0;
+  for (size_t i = 0; i < count && prefetcher->count < PREFETCH_QUEUE_SIZE; ++i) {
+    if (ids[i]) {
+      prefetcher->queue[prefetcher->count++] = ids[i];
+    }
+  }
+  pthread_cond_signal(&prefetcher->wake);
+  pthread_mutex_unlock(&prefetcher->lock);
+}
+
+// Stop prefetching before a note is read in the foreground.
+// Notes not yet started are dropped. If the note is being decrypted already, this waits
+// for it, so it is read from the cache rather than decrypted twice.
+//
+// `prefetcher`: the prefetcher
+// `id`: the note about to be read
+void prefetch_claim(struct prefetcher *prefetcher, unsigned long id) {
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->count = 0;
+  while (id && prefetcher->busy == id) {
+    pthread_cond_wait(&prefetcher->done, &prefetcher->lock);
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+}
+
+// Stop the prefetcher and wait for its thread to finish.
+//
+// `prefetcher`: the prefetcher
+void prefetch_stop(struct prefetcher *prefetcher) {
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->stopping = 1;
+  prefetcher->count = 0;
+  pthread_cond_signal(&prefetcher->wake);
+  pthread_mutex_unlock(&prefetcher->lock);
+  pthread_join(prefetcher->thread, NULL);
+
+  pthread_cond_destroy(&prefetcher->done);
+  pthread_cond_destroy(&prefetcher->wake);
+  pthread_mutex_destroy(&prefetcher->lock);
+}
@@ -0,0 +1,61 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+#include "cache.h"
+
+// Most notes waiting to be prefetched at once. Older hints are dropped first.
+#define PREFETCH_QUEUE_SIZE 8
+
+// A background thread that decrypts notes into a cache before they are asked for.
+// It works while the menu waits for input, so the next note viewed is already decrypted.
+struct prefetcher {
+  pthread_mutex_t lock;
+  // Wakes the thread when there is work or it is time to stop.
+  pthread_cond_t wake;
+  // Signalled when the thread finishes a note.
+  pthread_cond_t done;
+  pthread_t thread;
+  int stopping;
+  const unsigned char *key;
+  const char *folder_name;
+  struct note_cache *cache;
+  // Notes to decrypt, most likely to be viewed first.
+  unsigned long queue[PREFETCH_QUEUE_SIZE];
+  size_t count;
+  // The note being decrypted, or `0`.
+  unsigned long busy;
+};
+
+// Start prefetching notes into a cache.
+// Returns `0` on success or `-1` on error.
+//
+// `prefetcher`: the prefetcher to start
+// `key`: the key to use for decryption, which must outlive the prefetcher
+// `folder_name`: path of directory containing note files
+// `cache`: the cache to decrypt notes into
+int prefetch_start(struct prefetcher *prefetcher, const unsigned char *key, const char *folder_name,
+    struct note_cache *cache);
+
+// Ask for notes to be decrypted in the background, in place of any not yet started.
+//
+// `prefetcher`: the prefetcher
+// `ids`: the note IDs, most likely to be viewed first
+// `count`: the number of IDs
+void prefetch_hint(struct prefetcher *prefetcher, const unsigned long *ids, size_t count);
+
+// Stop prefetching before a note is read in the foreground.
+// Notes not yet started are dropped. If the note is being decrypted already, this waits
+// for it, so it is read from the cache rather than decrypted twice.
+//
+// `prefetcher`: the prefetcher
+// `id`: the note about to be read
+void prefetch_claim(struct prefetcher *prefetcher, unsigned long id);
+
+// Stop the prefetcher and wait for its thread to finish.
+//
+// `prefetcher`: the prefetcher
+void prefetch_stop(struct prefetcher *prefetcher);
+
+#endif
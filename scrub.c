@@ -0,0 +1,770 @@
+// Resources used:
+// https://www.json.org/json-en.html
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include "security.h"
+#include "data.h"
+#include "notefile.h"
+#include "dedup.h"
+#include "mirror.h"
+#include "scrub.h"
+#include "throttle.h"
+
+// Size of each read while checking a note.
+#define SCRUB_READ_SIZE (1 << 20)
+
+// Outcome of checking an entry.
+enum scrub_status {
+  SCRUB_PENDING,
+  SCRUB_OK,
+  SCRUB_BAD,
+  SCRUB_TRUNCATED,
+  SCRUB_ORPHANED,
+  SCRUB_DUPLICATE,
+  SCRUB_MISCOUNTED,
+};
+
+// Names of outcomes for reports, in `enum scrub_status` order.
+static const char *status_names[] = {"pending", "ok", "bad", "truncated", "orphaned", "duplicate", "miscounted"};
+
+// An entry in the notes directory.
+struct scrub_entry {
+  char *path;
+  // The note ID, or `0` if the entry is not a note.
+  unsigned long id;
+  enum scrub_status status;
+  const char *detail;
+  // For a stored chunk whose count is wrong, the count it holds and the references found.
+  unsigned long long stored;
+  unsigned long long references;
+};
+
+// Entries found in the notes directory.
+struct scrub_list {
+  struct scrub_entry *entries;
+  size_t count;
+  size_t capacity;
+};
+
+// State shared by threads checking notes.
+struct scrub_job {
+  const unsigned char *key;
+  struct scrub_list *list;
+  // Index of the next entry to check.
+  size_t next;
+  // Total bytes read.
+  unsigned long long bytes;
+  struct throttle throttle;
+  // Path of the chunk store, so deduplicated notes are checked with their chunks.
+  char store[PATH_MAX];
+  // IDs of stored chunks, once for each reference a checked note holds.
+  pthread_mutex_t references_lock;
+  unsigned char *references;
+  size_t reference_count;
+  size_t reference_capacity;
+  // Set if a note's references could not be counted, so stored counts can't be checked.
+  int references_failed;
+};
+
+// Check whether a file a change to a note leaves beside it outlived the change.
+// Changes hold the note's lock until they are done with the file, so it is checked for
+// under a shared lock, when no change can be running.
+// Returns 1 if the file is left over, or 0 if it is in use or gone.
+//
+// `note_path`: path of the note file
+// `path`: path of the file beside it
+static int left_behind(const char *note_path, const char *path) {
+  int fd = open(note_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd >= 0 && try_lock_file(fd, 0)) {
+    close(fd);
+    return 0;
+  }
+  int exists = !access(path, F_OK);
+  if (fd >= 0) {
+    close(fd);
+  }
+  return exists;
+}
+
+// Add an entry to a list.
+// Returns `0` on success or `-1` if memory could not be allocated.
+static int add_entry(struct scrub_list *list, const char *path, unsigned long id, enum scrub_status status, const char *detail) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 256;
+    struct scrub_entry *entries = realloc(list->entries, capacity * sizeof(struct scrub_entry));
+    if (entries == NULL) {
+      return -1;
+    }
+    list->entries = entries;
+    list->capacity = capacity;
+  }
+
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    return -1;
+  }
+
+  struct scrub_entry *entry = &list->entries[list->count++];
+  entry->path = copy;
+  entry->id = id;
+  entry->status = status;
+  entry->detail = detail;
+  entry->stored = 0;
+  entry->references = 0;
+  return 0;
+}
+
+// Free memory used by a list of entries.
+static void free_entries(struct scrub_list *list) {
+  for (size_t i = 0; i < list->count; ++i) {
+    free(list->entries[i].path);
+  }
+  free(list->entries);
+}
+
+// Check if a file name is a note's name followed by a suffix, i.e. its journal.
+// Returns 1 if it is, placing the note's name, or 0 if not.
+//
+// `file_name`: the name to check
+// `suffix`: the suffix, i.e. `JOURNAL_SUFFIX`
+// `note_name`: A pointer to where the note's name is to be placed, at least `MAXNAMLEN + 1` long
+static int is_note_file_name(const char *file_name, const char *suffix, char *note_name) {
+  size_t len = strlen(file_name);
+  size_t suffix_len = strlen(suffix);
+  if (len <= suffix_len || strcmp(file_name + len - suffix_len, suffix)) {
+    return 0;
+  }
+  memcpy(note_name, file_name, len - suffix_len);
+  note_name[len - suffix_len] = '\0';
+  return parse_note_id(note_name) != 0;
+}
+
+// Collect entries in a directory and the shard directories below it.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `folder_name`: path of directory containing note files
+// `path`: path of the directory to collect from
+// `level`: the number of shard directory levels above the directory
+// `list`: the list to add entries to
+static int collect_entries(const char *folder_name, const char *path, int level, struct scrub_list *list) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    // A missing notebook has nothing to check.
+    if (errno == ENOENT && level == 0) {
+      return 0;
+    }
+    perror(path);
+    return -1;
+  }
+
+  int result = 0;
+  struct dirent *entry;
+  char entry_path[PATH_MAX];
+  char expected_path[PATH_MAX];
+  char note_name[MAXNAMLEN + 1];
+  while (!result && (entry = readdir(dir))) {
+    const char *name = entry->d_name;
+    // A mirror's manifest is skipped, so mirrors can be checked too. Stored chunks are
+    // checked once every note using them has been read.
+    if (!strcmp(name, ".") || !strcmp(name, "..") || (level == 0 && (!strcmp(name, CONFIG_FILE)
+        || !strcmp(name, MIRROR_MANIFEST) || !strcmp(name, CHUNK_STORE)))) {
+      continue;
+    }
+    if (checked_path(path, name, entry_path)) {
+      continue;
+    }
+
+    unsigned long id = parse_note_id(name);
+    if (id) {
+      // A note in the wrong shard can't be found by its ID.
+      int misplaced = note_path(folder_name, level, id, expected_path) || strcmp(entry_path, expected_path);
+      if (misplaced) {
+        result = add_entry(list, entry_path, id, SCRUB_ORPHANED, "not in the shard directory for its ID");
+      } else {
+        result = add_entry(list, entry_path, id, SCRUB_PENDING, NULL);
+      }
+    } else if (level < MAX_SHARD_DEPTH && is_shard_name(name)) {
+      result = collect_entries(folder_name, entry_path, level + 1, list);
+      continue;
+    } else if (level == 0 && is_note_file_name(name, JOURNAL_SUFFIX, note_name)) {
+      // An edit holds its note's lock until its journal is removed.
+      if (!note_file_path(folder_name, note_name, expected_path) && !left_behind(expected_path, entry_path)) {
+        continue;
+      }
+      result = add_entry(list, entry_path, 0, SCRUB_ORPHANED, "journal of an unfinished edit; finished when its note is read");
+    } else if (is_note_file_name(name, CONVERT_SUFFIX, note_name)) {
+      // A note is rewritten beside itself, under its lock.
+      if (!checked_path(path, note_name, expected_path) && !left_behind(expected_path, entry_path)) {
+        continue;
+      }
+      result = add_entry(list, entry_path, 0, SCRUB_ORPHANED, "rewrite of a note that was interrupted");
+    } else if (level == 0 && is_note_file_name(name, HISTORY_SUFFIX, note_name)) {
+      // Histories are checked as they are read, against their note's revision.
+      if (!note_file_path(folder_name, note_name, expected_path) && !access(expected_path, F_OK)) {
+        continue;
+      }
+      result = add_entry(list, entry_path, 0, SCRUB_ORPHANED, "history of a deleted note");
+    } else {
+      result = add_entry(list, entry_path, 0, SCRUB_ORPHANED, "not a note");
+    }
+
+    if (result) {
+      perror("scrub entries");
+    }
+  }
+
+  closedir(dir);
+  return result;
+}
+
+// Compare entries by note ID for qsort.
+static int compare_entries(const void *val1, const void *val2) {
+  const struct scrub_entry *entry1 = val1;
+  const struct scrub_entry *entry2 = val2;
+  return (entry1->id > entry2->id) - (entry1->id < entry2->id);
+}
+
+// Mark copies of a note other than the one that would be read as duplicates.
+//
+// `folder_name`: path of directory containing note files
+// `config`: the notebook configuration
+// `list`: the entries, sorted by ID
+static void mark_duplicates(const char *folder_name, const struct notebook_config *config, struct scrub_list *list) {
+  char found_path[PATH_MAX];
+  for (size_t i = 1; i < list->count; ++i) {
+    struct scrub_entry *entry = &list->entries[i];
+    if (!entry->id || entry->id != list->entries[i - 1].id) {
+      continue;
+    }
+
+    // Find the whole run of copies, then keep only the one a reader would find.
+    size_t first = i - 1;
+    size_t end = i;
+    while (end < list->count && list->entries[end].id == entry->id) {
+      ++end;
+    }
+    if (!find_note_path(folder_name, config, entry->id, found_path)) {
+      for (size_t j = first; j < end; ++j) {
+        if (strcmp(list->entries[j].path, found_path) && list->entries[j].status == SCRUB_PENDING) {
+          list->entries[j].status = SCRUB_DUPLICATE;
+          list->entries[j].detail = "another copy of this note is read instead";
+        }
+      }
+    }
+    i = end - 1;
+  }
+}
+
+// Discard decrypted note content.
+static int discard_content(void *arg, const unsigned char *content, size_t len) {
+  return 0;
+}
+
+// Count the references a deduplicated note holds to stored chunks.
+//
+// `job`: the shared job state
+// `fd`: the note file, locked for reading
+static void add_references(struct scrub_job *job, int fd) {
+  unsigned char *manifest;
+  size_t manifest_len;
+  if (read_dedup_manifest(fd, job->key, &manifest, &manifest_len)) {
+    __atomic_store_n(&job->references_failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (manifest == NULL) {
+    return;
+  }
+
+  size_t entries = manifest_len > DEDUP_MANIFEST_HEADER ? (manifest_len - DEDUP_MANIFEST_HEADER) / DEDUP_ENTRY_SIZE : 0;
+  pthread_mutex_lock(&job->references_lock);
+  if (job->reference_count + entries > job->reference_capacity) {
+    size_t capacity = job->reference_capacity ? job->reference_capacity : 1024;
+    while (capacity < job->reference_count + entries) {
+      capacity *= 2;
+    }
+    unsigned char *references = realloc(job->references, capacity * CHUNK_ID_SIZE);
+    if (references == NULL) {
+      job->references_failed = 1;
+      entries = 0;
+    } else {
+      job->references = references;
+      job->reference_capacity = capacity;
+    }
+  }
+  for (size_t i = 0; i < entries; ++i) {
+    memcpy(job->references + (job->reference_count++) * CHUNK_ID_SIZE,
+        manifest + DEDUP_MANIFEST_HEADER + i * DEDUP_ENTRY_SIZE, CHUNK_ID_SIZE);
+  }
+  pthread_mutex_unlock(&job->references_lock);
+  free(manifest);
+}
+
+// Check a single note's structure and content.
+//
+// `job`: the shared job state
+// `entry`: the entry to check
+// `in`: a buffer of at least `SCRUB_READ_SIZE` bytes
+// `out`: a buffer of at least `SCRUB_READ_SIZE + CIPHER_BLOCK_SIZE` bytes
+static void scrub_note(struct scrub_job *job, struct scrub_entry *entry, unsigned char *in, unsigned char *out) {
+  int fd = open(entry->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    // Deleted since the directory was read.
+    entry->status = errno == ENOENT ? SCRUB_OK : SCRUB_BAD;
+    entry->detail = errno == ENOENT ? NULL : "cannot be opened";
+    return;
+  }
+
+  // Notes being written or edited are locked until they are whole again, so a live
+  // notebook's notes are checked as they are between changes.
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    entry->status = SCRUB_BAD;
+    entry->detail = "not a regular file";
+    close(fd);
+    return;
+  }
+  if (lock_file(fd, 0) || fstat(fd, &st)) {
+    entry->status = SCRUB_BAD;
+    entry->detail = "cannot be locked for reading";
+    close(fd);
+    return;
+  }
+  if (st.st_nlink == 0) {
+    // Deleted or replaced while waiting for the lock, e.g. a new note that could not be
+    // written. A replacement holds chunk references of its own, so it is checked instead.
+    close(fd);
+    if (!access(entry->path, F_OK)) {
+      scrub_note(job, entry, in, out);
+    } else {
+      entry->status = SCRUB_OK;
+    }
+    return;
+  }
+
+  // A claimed note stays locked until it is written, so one that is still empty once
+  // the lock is free never will be.
+  unsigned long file_len = st.st_size;
+  if (file_len == 0) {
+    entry->status = SCRUB_ORPHANED;
+    entry->detail = "empty; claimed but never written";
+  } else if (is_chunked_note(fd)) {
+    // Chunked notes are authenticated, so a full read checks everything.
+    struct chunk_options chunk_options = {1, &job->throttle, job->store};
+    int error = read_chunked_note(fd, job->key, discard_content, NULL, &chunk_options);
+    if (!error) {
+      add_references(job, fd);
+    } else {
+      __atomic_store_n(&job->references_failed, 1, __ATOMIC_RELAXED);
+    }
+    entry->status = !error ? SCRUB_OK : error == NOTE_ERR_TRUNCATED ? SCRUB_TRUNCATED : SCRUB_BAD;
+    entry->detail = error ? note_error_string(error) : NULL;
+    __atomic_add_fetch(&job->bytes, file_len, __ATOMIC_RELAXED);
+  } else if (file_len < IV_SIZE * 2) {
+    entry->status = SCRUB_TRUNCATED;
+    entry->detail = "too short to contain an IV and content";
+  } else if ((file_len - IV_SIZE) % CIPHER_BLOCK_SIZE) {
+    entry->status = SCRUB_TRUNCATED;
+    entry->detail = "content is not a whole number of cipher blocks";
+  }
+  if (entry->status != SCRUB_PENDING) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return;
+  }
+
+  // Read IV.
+  unsigned char iv[IV_SIZE];
+  throttle_wait(&job->throttle, IV_SIZE);
+  if (read(fd, iv, IV_SIZE) != IV_SIZE) {
+    entry->status = SCRUB_TRUNCATED;
+    entry->detail = "IV could not be read";
+    close(fd);
+    return;
+  }
+
+  EVP_CIPHER_CTX *context = cipher_start(job->key, iv, 0);
+  if (context == NULL) {
+    entry->status = SCRUB_BAD;
+    entry->detail = "cipher could not be set up";
+    close(fd);
+    return;
+  }
+
+  // Decrypt everything, discarding the output. Only the padding at the end shows
+  // whether the content decrypted correctly.
+  unsigned long remaining = file_len - IV_SIZE;
+  int out_len = 0;
+  int failed = 0;
+  while (remaining > 0) {
+    size_t len = remaining < SCRUB_READ_SIZE ? remaining : SCRUB_READ_SIZE;
+    throttle_wait(&job->throttle, len);
+    ssize_t bytes_read = read(fd, in, len);
+    if (bytes_read <= 0) {
+      break;
+    }
+    __atomic_add_fetch(&job->bytes, bytes_read, __ATOMIC_RELAXED);
+    if (!cipher_update(context, in, bytes_read, out, &out_len)) {
+      failed = 1;
+      break;
+    }
+    remaining -= bytes_read;
+  }
+
+  if (failed) {
+    entry->status = SCRUB_BAD;
+    entry->detail = "decryption failed partway through the content";
+    EVP_CIPHER_CTX_free(context);
+  } else if (remaining > 0) {
+    entry->status = SCRUB_TRUNCATED;
+    entry->detail = "file shrank while being read";
+    EVP_CIPHER_CTX_free(context);
+  } else if (!cipher_finish(context, out, &out_len)) {
+    entry->status = SCRUB_BAD;
+    entry->detail = "decryption failed; content is corrupted or was written with another key";
+  } else {
+    entry->status = SCRUB_OK;
+  }
+
+  // Bad notes are expected here, so don't let their errors pile up.
+  ERR_clear_error();
+
+  // Checked notes are unlikely to be read again soon, so don't crowd out the page cache.
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Thread entry point for checking notes.
+// Takes entries from the shared list until none are left.
+//
+// `arg`: the shared job state
+static void* scrub_worker(void *arg) {
+  struct scrub_job *job = arg;
+
+  unsigned char *in = malloc(SCRUB_READ_SIZE);
+  unsigned char *out = malloc(SCRUB_READ_SIZE + CIPHER_BLOCK_SIZE);
+  if (in == NULL || out == NULL) {
+    perror("scrub buffers");
+    free(in);
+    free(out);
+    return NULL;
+  }
+
+  size_t index;
+  while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->list->count) {
+    struct scrub_entry *entry = &job->list->entries[index];
+    if (entry->status == SCRUB_PENDING) {
+      scrub_note(job, entry, in, out);
+    }
+  }
+
+  free(in);
+  free(out);
+  return NULL;
+}
+
+// Compare chunk IDs for qsort and bsearch.
+static int compare_chunk_ids(const void *val1, const void *val2) {
+  return memcmp(val1, val2, CHUNK_ID_SIZE);
+}
+
+// Count the references checked notes hold to a stored chunk.
+//
+// `job`: the shared job state, with its references sorted
+// `id`: the chunk ID
+static unsigned long long count_references(const struct scrub_job *job, const unsigned char *id) {
+  // Find the first reference to the chunk, then count the run.
+  size_t low = 0;
+  size_t high = job->reference_count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (memcmp(job->references + middle * CHUNK_ID_SIZE, id, CHUNK_ID_SIZE) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  unsigned long long count = 0;
+  while (low + count < job->reference_count && !memcmp(job->references + (low + count) * CHUNK_ID_SIZE, id, CHUNK_ID_SIZE)) {
+    ++count;
+  }
+  return count;
+}
+
+// Check whether a file changed since a time, i.e. since a scrub started.
+//
+// `st`: the file's status
+// `since`: the time
+static int changed_since(const struct stat *st, const struct timespec *since) {
+  return st->st_ctim.tv_sec > since->tv_sec
+      || (st->st_ctim.tv_sec == since->tv_sec && st->st_ctim.tv_nsec >= since->tv_nsec);
+}
+
+// Check a stored chunk's count of the notes using it against the references found.
+// A crash between counting a reference and writing the note leaves a reference no note
+// holds, so the chunk is never removed. Chunks changed since the scrub started are
+// skipped, as the notes that changed them may not have been checked.
+// Returns `0` on success or `-1` if memory could not be allocated.
+//
+// `job`: the shared job state, with its references sorted
+// `path`: path of the chunk
+// `name`: the chunk's file name
+// `since`: when the scrub started
+// `list`: the list to add problems to
+static int check_chunk(const struct scrub_job *job, const char *path, const char *name,
+    const struct timespec *since, struct scrub_list *list) {
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    // Released since the directory was read.
+    return errno == ENOENT ? 0 : add_entry(list, path, 0, SCRUB_BAD, "stored chunk cannot be opened");
+  }
+  // The count is read before the status, so a count changed while being read is skipped.
+  unsigned char buf[CHUNK_HEADER_SIZE];
+  struct stat st;
+  int error = read_at(fd, buf, sizeof(buf), 0);
+  int changed = fstat(fd, &st) || changed_since(&st, since);
+  close(fd);
+  if (error || memcmp(buf, CHUNK_MAGIC, 8)) {
+    return changed ? 0 : add_entry(list, path, 0, error == NOTE_ERR_TRUNCATED ? SCRUB_TRUNCATED : SCRUB_BAD,
+        "not a stored chunk");
+  }
+  if (changed) {
+    return 0;
+  }
+
+  unsigned char id[CHUNK_ID_SIZE];
+  for (int i = 0; i < CHUNK_ID_SIZE; ++i) {
+    sscanf(name + 2 * i, "%2hhx", &id[i]);
+  }
+  unsigned long long stored = get_le(buf + 8, 8);
+  unsigned long long references = count_references(job, id);
+  // Without every note's references, only counts too low to cover those found are certain.
+  if (stored == references || (job->references_failed && stored > references)) {
+    return 0;
+  }
+  int result = references ? add_entry(list, path, 0, SCRUB_MISCOUNTED, stored > references
+      ? "counts notes that don't use it; it is never removed"
+      : "counts fewer notes than use it; it is removed while still in use")
+      : add_entry(list, path, 0, SCRUB_ORPHANED, "stored chunk no note uses; it is never removed");
+  if (!result) {
+    list->entries[list->count - 1].stored = stored;
+    list->entries[list->count - 1].references = references;
+  }
+  return result;
+}
+
+// Check the stored chunks of deduplicated notes against the references found in them,
+// and look for files left in the chunk store by writers that stopped.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+//
+// `job`: the shared job state, with its references sorted
+// `since`: when the scrub started
+// `list`: the list to add problems to
+static int check_chunk_store(const struct scrub_job *job, const struct timespec *since, struct scrub_list *list) {
+  DIR *store = opendir(job->store);
+  if (store == NULL) {
+    // A notebook that never deduplicated a note has no store.
+    if (errno == ENOENT) {
+      return 0;
+    }
+    perror(job->store);
+    return -1;
+  }
+
+  int result = 0;
+  struct dirent *shard;
+  char shard_path[PATH_MAX];
+  char path[PATH_MAX];
+  while (!result && (shard = readdir(store))) {
+    if (!strcmp(shard->d_name, ".") || !strcmp(shard->d_name, "..") || checked_path(job->store, shard->d_name, shard_path)) {
+      continue;
+    }
+    DIR *dir = is_shard_name(shard->d_name) ? opendir(shard_path) : NULL;
+    if (dir == NULL) {
+      result = add_entry(list, shard_path, 0, SCRUB_ORPHANED, "not a chunk directory");
+      continue;
+    }
+
+    struct dirent *entry;
+    int empty = 1;
+    while (!result && (entry = readdir(dir))) {
+      const char *name = entry->d_name;
+      if (!strcmp(name, ".") || !strcmp(name, "..") || checked_path(shard_path, name, path)) {
+        continue;
+      }
+      empty = 0;
+      int pid;
+      int tid;
+      if (is_chunk_name(name)) {
+        result = check_chunk(job, path, name, since, list);
+      } else if (strlen(name) > CHUNK_ID_SIZE * 2 && sscanf(name + CHUNK_ID_SIZE * 2, ".%d.%d.tmp", &pid, &tid) == 2) {
+        // A chunk is written beside its final path by a writer that names itself.
+        if (kill(pid, 0) && errno == ESRCH) {
+          result = add_entry(list, path, 0, SCRUB_ORPHANED, "chunk being stored when its writer stopped");
+        }
+      } else {
+        result = add_entry(list, path, 0, SCRUB_ORPHANED, "not a stored chunk");
+      }
+    }
+    closedir(dir);
+
+    // Directories are left when their last chunk is removed, as a writer may be about to
+    // store a chunk in them.
+    struct stat st;
+    if (!result && empty && !stat(shard_path, &st) && !changed_since(&st, since)) {
+      result = add_entry(list, shard_path, 0, SCRUB_ORPHANED, "empty chunk directory");
+    }
+  }
+  if (result) {
+    perror("scrub chunks");
+  }
+
+  closedir(store);
+  return result;
+}
+
+// Write a string as a JSON string literal.
+//
+// `out`: where to write
+// `value`: the string to write
+static void print_json_string(FILE *out, const char *value) {
+  fputc('"', out);
+  for (const unsigned char *c = (const unsigned char *) value; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(out, "\\%c", *c);
+    } else if (*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// Check the integrity of every note in a folder.
+// Each note is checked for a valid structure and decrypted with the key. Entries in the
+// folder that are not reachable notes are reported as orphaned. Stored chunks are checked
+// against the references deduplicated notes hold, so counts left wrong by a crash show up.
+// The report has one JSON object per line for each problem found, then a summary object.
+// Returns the number of problems found or `-1` on error, printing issues.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `options`: concurrency, rate and output options
+long scrub_notes(const unsigned char *key, const char *folder_name, const struct scrub_options *options) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  // File times come from the coarse clock, so this is never later than a change made after it.
+  struct timespec since;
+  clock_gettime(CLOCK_REALTIME_COARSE, &since);
+
+  struct notebook_config config;
+  if (read_config(folder_name, &config)) {
+    return -1;
+  }
+
+  struct scrub_list list = {0};
+  if (collect_entries(folder_name, folder_name, 0, &list)) {
+    free_entries(&list);
+    return -1;
+  }
+
+  qsort(list.entries, list.count, sizeof(struct scrub_entry), compare_entries);
+  mark_duplicates(folder_name, &config, &list);
+
+  struct scrub_job job = {0};
+  job.key = key;
+  job.list = &list;
+  if (checked_path(folder_name, CHUNK_STORE, job.store)) {
+    free_entries(&list);
+    return -1;
+  }
+  throttle_init(&job.throttle, options->rate);
+  pthread_mutex_init(&job.references_lock, NULL);
+
+  // Use every processor unless told otherwise. There's no point in more threads than notes.
+  long jobs = options->jobs ? (long) options->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1) {
+    jobs = 1;
+  }
+  if ((size_t) jobs > list.count) {
+    jobs = list.count ? list.count : 1;
+  }
+
+  pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+  long started = 0;
+  if (threads != NULL) {
+    while (started < jobs && !pthread_create(&threads[started], NULL, scrub_worker, &job)) {
+      ++started;
+    }
+  }
+  // If no threads could be started, check everything here.
+  if (started == 0) {
+    scrub_worker(&job);
+  }
+  for (long i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  throttle_destroy(&job.throttle);
+  pthread_mutex_destroy(&job.references_lock);
+
+  // Every note has been checked, so the chunks they use can be counted.
+  qsort(job.references, job.reference_count, CHUNK_ID_SIZE, compare_chunk_ids);
+  int chunks_failed = check_chunk_store(&job, &since, &list);
+  free(job.references);
+  if (chunks_failed) {
+    free_entries(&list);
+    return -1;
+  }
+
+  // Report problems.
+  unsigned long counts[SCRUB_MISCOUNTED + 1] = {0};
+  long problems = 0;
+  for (size_t i = 0; i < list.count; ++i) {
+    struct scrub_entry *entry = &list.entries[i];
+    ++counts[entry->status];
+    if (entry->status == SCRUB_OK) {
+      continue;
+    }
+    ++problems;
+    fprintf(options->report, "{\"status\":\"%s\",", status_names[entry->status]);
+    if (entry->id) {
+      fprintf(options->report, "\"note\":%lu,", entry->id);
+    }
+    fprintf(options->report, "\"path\":");
+    print_json_string(options->report, entry->path);
+    if (entry->detail) {
+      fprintf(options->report, ",\"detail\":");
+      print_json_string(options->report, entry->detail);
+    }
+    if (entry->stored || entry->references) {
+      fprintf(options->report, ",\"stored\":%llu,\"references\":%llu", entry->stored, entry->references);
+    }
+    fprintf(options->report, "}\n");
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(options->report,
+      "{\"summary\":{\"entries\":%zu,\"ok\":%lu,\"bad\":%lu,\"truncated\":%lu,\"orphaned\":%lu,"
+      "\"duplicate\":%lu,\"miscounted\":%lu,\"bytes\":%llu,\"seconds\":%.3f,\"jobs\":%ld}}\n",
+      list.count, counts[SCRUB_OK], counts[SCRUB_BAD], counts[SCRUB_TRUNCATED], counts[SCRUB_ORPHANED],
+      counts[SCRUB_DUPLICATE], counts[SCRUB_MISCOUNTED], job.bytes, seconds, started ? started : 1);
+  fflush(options->report);
+
+  free_entries(&list);
+
+  return problems;
+}
@@ -0,0 +1,28 @@
+#ifndef SCRUB_H
+#define SCRUB_H 1
+
+#include <stdio.h>
+
+// Options for checking notes.
+struct scrub_options {
+  // Number of notes to check at once, or `0` for one per processor.
+  unsigned int jobs;
+  // Maximum bytes read per second across all jobs, or `0` for no limit.
+  unsigned long rate;
+  // Where to write the report.
+  FILE *report;
+};
+
+// Check the integrity of every note in a folder.
+// Each note is checked for a valid structure and decrypted with the key. Entries in the
+// folder that are not reachable notes are reported as orphaned. Stored chunks are checked
+// against the references deduplicated notes hold, so counts left wrong by a crash show up.
+// The report has one JSON object per line for each problem found, then a summary object.
+// Returns the number of problems found or `-1` on error, printing issues.
+//
+// `key`: the key to use for decryption
+// `folder_name`: path of directory containing note files
+// `options`: concurrency, rate and output options
+long scrub_notes(const unsigned char *key, const char *folder_name, const struct scrub_options *options);
+
+#endif
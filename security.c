@@ -3,15 +3,67 @@
 // https://man.openbsd.org/cgi-bin/man.cgi/OpenBSD-current/man3/arc4random.3
 // https://github.com/falk-werner/openssl-example/blob/main/doc/sha256.md
 // https://stackoverflow.com/a/24899425
+// https://www.openssl.org/docs/man3.0/man7/crypto.html (Performance)
 
 #include "security.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
+#include "trace.h"
+
+// Algorithms fetched once by `crypto_init`.
+static pthread_once_t crypto_once = PTHREAD_ONCE_INIT;
+static EVP_CIPHER *aes_256_cbc;
+static EVP_CIPHER *aes_256_gcm;
+static EVP_MD *sha256;
+
+// Set up OpenSSL and fetch the algorithms used by notes.
+// Called once, by whichever crypto operation comes first.
+static void crypto_setup() {
+  // The system OpenSSL configuration is only loaded when one is named explicitly, as
+  // reading and applying it is most of OpenSSL's startup time and notes needs none of it.
+  uint64_t options = getenv("OPENSSL_CONF") ? OPENSSL_INIT_LOAD_CONFIG : OPENSSL_INIT_NO_LOAD_CONFIG;
+  if (!OPENSSL_init_crypto(options, NULL)) {
+    ERR_print_errors_fp(stderr);
+    return;
+  }
+
+  // Fetching explicitly looks each algorithm up once, rather than on every use.
+  aes_256_cbc = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+  aes_256_gcm = EVP_CIPHER_fetch(NULL, "AES-256-GCM", NULL);
+  sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+  if (aes_256_cbc == NULL || aes_256_gcm == NULL || sha256 == NULL) {
+    ERR_print_errors_fp(stderr);
+  }
+}
+
+// Set up OpenSSL and fetch the algorithms used by notes, if not done already.
+// OpenSSL is not touched until a crypto operation needs it, so commands without any
+// start quickly. This may be called early on another thread to hide the setup time.
+// Returns 1 on success, 0 otherwise.
+int crypto_init() {
+  pthread_once(&crypto_once, crypto_setup);
+  return aes_256_cbc != NULL && aes_256_gcm != NULL && sha256 != NULL;
+}
+
+// Get the SHA-256 digest, setting up OpenSSL if needed.
+// Returns the digest or `NULL` on error, printing issues.
+const EVP_MD* sha256_digest() {
+  crypto_init();
+  return sha256;
+}
 
 // Generate a new random salt.
 //
@@ -19,6 +71,7 @@
 // Author: Alex, Adam (merged implementations)
 void generate_salt(unsigned char buf[SALT_SIZE]) {
   // Prefer OpenSSL random.
+  crypto_init();
   if (RAND_bytes(buf, SALT_SIZE) != 1) {
     ERR_print_errors_fp(stderr);
     // Fall back to arc4rand if OpenSSL fails.
@@ -32,6 +85,7 @@ void generate_salt(unsigned char buf[SALT_SIZE]) {
 // Author: Alex, Adam (merged implementations)
 void generate_iv(unsigned char buf[IV_SIZE]) {
   // Prefer OpenSSL random.
+  crypto_init();
   if (RAND_bytes(buf, IV_SIZE) != 1) {
     ERR_print_errors_fp(stderr);
     // Fall back to arc4rand if OpenSSL fails.
@@ -39,6 +93,19 @@ void generate_iv(unsigned char buf[IV_SIZE]) {
   }
 }
 
+// Generate a new random nonce.
+//
+// `buf`: buffer in which to place the new nonce
+void generate_nonce(unsigned char buf[NONCE_SIZE]) {
+  // Prefer OpenSSL random.
+  crypto_init();
+  if (RAND_bytes(buf, NONCE_SIZE) != 1) {
+    ERR_print_errors_fp(stderr);
+    // Fall back to arc4rand if OpenSSL fails.
+    arc4random_buf(buf, NONCE_SIZE);
+  }
+}
+
 // Calculate a SHA-256 hash of the given input.
 // Returns a hash of the input with the salt appended.
 // Note: This allocates memory to contain the resulting hash!
@@ -55,7 +122,7 @@ unsigned char* calculate_hash(const char *input, const unsigned char salt[SALT_S
   }
 
   // Initialize message digest context.
-  if (!EVP_DigestInit_ex2(context, EVP_sha256(), NULL)) {
+  if (!EVP_DigestInit_ex2(context, sha256_digest(), NULL)) {
     EVP_MD_CTX_free(context);
     ERR_print_errors_fp(stderr);
     return NULL;
@@ -123,15 +190,9 @@ unsigned char* calculate_hash(const char *input, const unsigned char salt[SALT_S
   return ptr;
 }
 
-// Authenticate using a password.
-// Returns a secret for use as a key in encryption and decryption.
-// Note: This allocates memory to store the resulting secret!
-//
-// `password`: The user password
-// `salt`: The salt to append to the password
-// `hash`: The expected hash
-// Author: Adam
-unsigned char* log_in(const char *password, const unsigned char salt[SALT_SIZE], const unsigned char hash[SHA256_DIGEST_LENGTH]) {
+// Check a password against its hash and derive the secret from it, as `log_in` does.
+static unsigned char* check_password(const char *password, const unsigned char salt[SALT_SIZE],
+    const unsigned char hash[SHA256_DIGEST_LENGTH]) {
   unsigned char *calculated = calculate_hash(password, salt);
 
   // If hash is not available, deny attempt.
@@ -141,6 +202,8 @@ unsigned char* log_in(const char *password, const unsigned char salt[SALT_SIZE],
 
   for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
     if (calculated[i] != hash[i]) {
+      // Callers embedding the library may retry many times, so don't leak on failure.
+      free(calculated);
       return NULL;
     }
   }
@@ -155,7 +218,7 @@ unsigned char* log_in(const char *password, const unsigned char salt[SALT_SIZE],
     return NULL;
   }
 
-  if (!EVP_DigestInit_ex2(context, EVP_sha256(), NULL)
+  if (!EVP_DigestInit_ex2(context, sha256_digest(), NULL)
     || !EVP_DigestUpdate(context, password, strlen(password))) {
     EVP_MD_CTX_free(context);
     ERR_print_errors_fp(stderr);
@@ -184,41 +247,193 @@ unsigned char* log_in(const char *password, const unsigned char salt[SALT_SIZE],
   return result;
 }
 
-// Encrypt or decrypt using the AES-256 algorithm.
-// Returns 1 on success, 0 otherwise.
+// Authenticate using a password.
+// Returns a secret for use as a key in encryption and decryption.
+// Note: This allocates memory to store the resulting secret!
+//
+// `password`: The user password
+// `salt`: The salt to append to the password
+// `hash`: The expected hash
+// Author: Adam
+unsigned char* log_in(const char *password, const unsigned char salt[SALT_SIZE], const unsigned char hash[SHA256_DIGEST_LENGTH]) {
+  unsigned long long span = trace_begin();
+  unsigned char *secret = check_password(password, salt, hash);
+  trace_end("log_in", span);
+  return secret;
+}
+
+// Read a login file, in the current format or the one from before versioned login files.
+// Returns `0` on success or `-1` with `errno` set, i.e. to `EBADMSG` if the file is
+// damaged or `ENOTSUP` if it was written by a newer version.
+//
+// `path`: path of the login file
+// `details`: A pointer to where the salt and hash are to be placed
+// `legacy`: A pointer to where `1` is to be placed if the file is in the old format, `0` otherwise
+int read_login_file(const char *path, struct login_details *details, int *legacy) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  // Read one byte more than expected, to tell a longer file apart.
+  unsigned char buf[LOGIN_FILE_SIZE + 1];
+  ssize_t len = read(fd, buf, sizeof(buf));
+  close(fd);
+  if (len < 0) {
+    return -1;
+  }
+
+  // Old login files are the bare struct, which never starts with the magic number by
+  // more than chance.
+  *legacy = len == sizeof(*details) && memcmp(buf, LOGIN_MAGIC, LOGIN_MAGIC_SIZE);
+  if (*legacy) {
+    memcpy(details, buf, sizeof(*details));
+    return 0;
+  }
+
+  if (len < LOGIN_MAGIC_SIZE + 2 || memcmp(buf, LOGIN_MAGIC, LOGIN_MAGIC_SIZE)) {
+    errno = EBADMSG;
+    return -1;
+  }
+  static const unsigned char zero[6];
+  if (buf[8] != LOGIN_FORMAT_VERSION || buf[9] != LOGIN_SCHEME_SHA256 || (len >= 16 && memcmp(buf + 10, zero, 6))) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  if (len != LOGIN_FILE_SIZE) {
+    errno = EBADMSG;
+    return -1;
+  }
+  memcpy(details->salt, buf + 16, SALT_SIZE);
+  memcpy(details->hash, buf + 24, SHA256_DIGEST_LENGTH);
+  return 0;
+}
+
+// Write a login file in the current format, replacing any file there atomically.
+// Returns `0` on success or `-1` with `errno` set.
+//
+// `path`: path of the login file
+// `details`: the salt and hash to save
+int write_login_file(const char *path, const struct login_details *details) {
+  unsigned char buf[LOGIN_FILE_SIZE] = {0};
+  memcpy(buf, LOGIN_MAGIC, LOGIN_MAGIC_SIZE);
+  buf[8] = LOGIN_FORMAT_VERSION;
+  buf[9] = LOGIN_SCHEME_SHA256;
+  memcpy(buf + 16, details->salt, SALT_SIZE);
+  memcpy(buf + 24, details->hash, SHA256_DIGEST_LENGTH);
+
+  // Write beside the file and rename over it, so a crash leaves the old or new file.
+  char temp_path[PATH_MAX];
+  if (snprintf(temp_path, PATH_MAX, "%s.new", path) >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = open(temp_path, O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return -1;
+  }
+  errno = 0;
+  if (write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd)) {
+    int saved = errno ? errno : EIO;
+    close(fd);
+    unlink(temp_path);
+    errno = saved;
+    return -1;
+  }
+  if (close(fd) || rename(temp_path, path)) {
+    int saved = errno;
+    unlink(temp_path);
+    errno = saved;
+    return -1;
+  }
+  return 0;
+}
+
+// Start encrypting or decrypting a stream using the AES-256 algorithm.
+// Returns a new cipher context or `NULL` on error, printing issues.
+// Note: The context must be released with `cipher_finish`!
 //
-// `in`: The content to encrypt or decrypt
-// `len`: The input length
-// `out`: The `FILE` to write to
 // `key`: The AES-256 key
 // `iv`: The IV used for CBC mode AES-256
-// Author: Alex
-int cipher(const unsigned char *in, const int len, FILE *out, const unsigned char key[KEY_SIZE], const unsigned char iv[IV_SIZE], int enc) {
+// `enc`: `1` to encrypt, `0` to decrypt
+EVP_CIPHER_CTX* cipher_start(const unsigned char key[KEY_SIZE], const unsigned char iv[IV_SIZE], int enc) {
+  if (!crypto_init()) {
+    return NULL;
+  }
+
   // Create new cipher context.
   EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
   if (!context) {
     ERR_print_errors_fp(stderr);
-    return 0;
+    return NULL;
   }
 
   // Initialize cipher context.
-  if (!EVP_CipherInit_ex(context, EVP_aes_256_cbc(), NULL, key, iv, enc)) {
+  if (!EVP_CipherInit_ex2(context, aes_256_cbc, key, iv, enc, NULL)) {
     ERR_print_errors_fp(stderr);
     EVP_CIPHER_CTX_free(context);
+    return NULL;
+  }
+
+  return context;
+}
+
+// Encrypt or decrypt the next part of a stream.
+// Returns 1 on success, 0 otherwise.
+//
+// `context`: The cipher context from `cipher_start`
+// `in`: The content to encrypt or decrypt
+// `len`: The input length
+// `out`: The output buffer, at least `len + CIPHER_BLOCK_SIZE` long
+// `out_len`: A pointer to where the output length is to be placed
+int cipher_update(EVP_CIPHER_CTX *context, const unsigned char *in, const int len, unsigned char *out, int *out_len) {
+  unsigned long long span = trace_begin();
+  int result = EVP_CipherUpdate(context, out, out_len, in, len);
+  trace_end("cipher_update", span);
+  return result;
+}
+
+// Finish encrypting or decrypting a stream and release the cipher context.
+// When decrypting, this fails if the padding is invalid, i.e. the content is corrupted
+// or the key is wrong. Errors are left on the OpenSSL error queue for the caller.
+// Returns 1 on success, 0 otherwise.
+//
+// `context`: The cipher context from `cipher_start`
+// `out`: The output buffer, at least `CIPHER_BLOCK_SIZE` long
+// `out_len`: A pointer to where the output length is to be placed
+int cipher_finish(EVP_CIPHER_CTX *context, unsigned char *out, int *out_len) {
+  unsigned long long span = trace_begin();
+  int result = EVP_CipherFinal_ex(context, out, out_len);
+  EVP_CIPHER_CTX_free(context);
+  trace_end("cipher_final", span);
+  return result;
+}
+
+// Encrypt or decrypt using the AES-256 algorithm.
+// Returns 1 on success, 0 otherwise.
+//
+// `in`: The content to encrypt or decrypt
+// `len`: The input length
+// `out`: The `FILE` to write to
+// `key`: The AES-256 key
+// `iv`: The IV used for CBC mode AES-256
+// Author: Alex
+int cipher(const unsigned char *in, const int len, FILE *out, const unsigned char key[KEY_SIZE], const unsigned char iv[IV_SIZE], int enc) {
+  EVP_CIPHER_CTX *context = cipher_start(key, iv, enc);
+  if (!context) {
     return 0;
   }
 
   // Allocate memory for result.
   int out_len;
-  unsigned char *result = malloc(len + EVP_CIPHER_block_size(EVP_aes_256_cbc()));
+  unsigned char *result = malloc(len + CIPHER_BLOCK_SIZE);
   if (result == NULL) {
-    ERR_print_errors_fp(stderr);
+    perror("cipher");
     EVP_CIPHER_CTX_free(context);
     return 0;
   }
 
   // Update cipher with content.
-  if (!EVP_CipherUpdate(context, result, &out_len, in, len)) {
+  if (!cipher_update(context, in, len, result, &out_len)) {
     ERR_print_errors_fp(stderr);
     free(result);
     EVP_CIPHER_CTX_free(context);
@@ -230,10 +445,9 @@ int cipher(const unsigned char *in, const int len, FILE *out, const unsigned cha
 
   // Finalize cipher.
   int final_len;
-  if (!EVP_CipherFinal_ex(context, result, &final_len)) {
+  if (!cipher_finish(context, result, &final_len)) {
     ERR_print_errors_fp(stderr);
     free(result);
-    EVP_CIPHER_CTX_free(context);
     return 0;
   }
 
@@ -242,7 +456,128 @@ int cipher(const unsigned char *in, const int len, FILE *out, const unsigned cha
 
   // Free up memory.
   free(result);
-  EVP_CIPHER_CTX_free(context);
 
   return 1; // success
 }
+
+// Create a context for authenticated encryption or decryption using AES-256 in GCM mode.
+// The key is set up once, so the context can be reused for many messages.
+// Returns a new cipher context or `NULL` on error, printing issues.
+// Note: The context must be released with `EVP_CIPHER_CTX_free`!
+//
+// `key`: The AES-256 key
+// `enc`: `1` to encrypt, `0` to decrypt
+EVP_CIPHER_CTX* aead_context(const unsigned char key[KEY_SIZE], int enc) {
+  if (!crypto_init()) {
+    return NULL;
+  }
+
+  EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+  if (!context) {
+    ERR_print_errors_fp(stderr);
+    return NULL;
+  }
+
+  // Set the key now. Each message only needs its nonce set.
+  if (!EVP_CipherInit_ex2(context, aes_256_gcm, key, NULL, enc, NULL)
+      || !EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_SET_IVLEN, NONCE_SIZE, NULL)) {
+    ERR_print_errors_fp(stderr);
+    EVP_CIPHER_CTX_free(context);
+    return NULL;
+  }
+
+  return context;
+}
+
+// Encrypt and authenticate a message.
+// Returns 1 on success, 0 otherwise.
+//
+// `context`: The encryption context from `aead_context`
+// `nonce`: A nonce never used before with this key
+// `aad`: Additional data that is authenticated but not encrypted
+// `aad_len`: The additional data length
+// `in`: The content to encrypt
+// `len`: The input length
+// `out`: The output buffer, at least `len` long
+// `tag`: A pointer to where the authentication tag is to be placed
+int aead_seal(EVP_CIPHER_CTX *context, const unsigned char nonce[NONCE_SIZE], const unsigned char *aad, int aad_len,
+    const unsigned char *in, int len, unsigned char *out, unsigned char tag[TAG_SIZE]) {
+  unsigned long long span = trace_begin();
+  int out_len;
+  int final_len;
+  // GCM is a stream mode, so there is never any output from finalizing.
+  int result = EVP_CipherInit_ex(context, NULL, NULL, NULL, nonce, 1)
+      && (aad_len == 0 || EVP_CipherUpdate(context, NULL, &out_len, aad, aad_len))
+      && (len == 0 || EVP_CipherUpdate(context, out, &out_len, in, len))
+      && EVP_CipherFinal_ex(context, out + len, &final_len)
+      && EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, tag);
+  trace_end("aead_seal", span);
+  return result;
+}
+
+// Decrypt and verify a message.
+// Returns 1 on success, 0 if the message could not be authenticated or on error.
+//
+// `context`: The decryption context from `aead_context`
+// `nonce`: The nonce the message was encrypted with
+// `aad`: Additional data that was authenticated with the message
+// `aad_len`: The additional data length
+// `in`: The content to decrypt
+// `len`: The input length
+// `out`: The output buffer, at least `len` long
+// `tag`: The authentication tag
+int aead_open(EVP_CIPHER_CTX *context, const unsigned char nonce[NONCE_SIZE], const unsigned char *aad, int aad_len,
+    const unsigned char *in, int len, unsigned char *out, const unsigned char tag[TAG_SIZE]) {
+  unsigned long long span = trace_begin();
+  int out_len;
+  int final_len;
+  // The tag is checked when finalizing.
+  int result = EVP_CipherInit_ex(context, NULL, NULL, NULL, nonce, 0)
+      && (aad_len == 0 || EVP_CipherUpdate(context, NULL, &out_len, aad, aad_len))
+      && (len == 0 || EVP_CipherUpdate(context, out, &out_len, in, len))
+      && EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, (void *) tag)
+      && EVP_CipherFinal_ex(context, out + len, &final_len);
+  trace_end("aead_open", span);
+  return result;
+}
+
+// Allocate memory for plaintext that is kept out of swap and core dumps.
+// Memory comes from its own pages, which are locked into RAM and excluded from dumps.
+// Returns the zeroed memory, or `NULL` if it cannot be allocated or locked, i.e. when
+// over the `RLIMIT_MEMLOCK` limit.
+// Note: The memory must be released with `secure_free`!
+//
+// `len`: the number of bytes needed
+void* secure_alloc(size_t len) {
+  if (len == 0) {
+    len = 1;
+  }
+  void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return NULL;
+  }
+
+  // Plaintext that can't be kept out of swap isn't kept at all.
+  if (mlock(ptr, len)) {
+    munmap(ptr, len);
+    return NULL;
+  }
+  madvise(ptr, len, MADV_DONTDUMP);
+  return ptr;
+}
+
+// Wipe and release memory from `secure_alloc`.
+//
+// `ptr`: the memory, or `NULL`
+// `len`: the number of bytes allocated
+void secure_free(void *ptr, size_t len) {
+  if (ptr == NULL) {
+    return;
+  }
+  if (len == 0) {
+    len = 1;
+  }
+  OPENSSL_cleanse(ptr, len);
+  munlock(ptr, len);
+  munmap(ptr, len);
+}
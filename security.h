@@ -14,6 +14,51 @@
 #define KEY_SIZE 32
 // 128-bit CBC mode AES-256 IV in bytes.
 #define IV_SIZE 16
+// AES block size in bytes. Ciphertext is always a multiple of this.
+#define CIPHER_BLOCK_SIZE 16
+// 96-bit GCM mode AES-256 nonce in bytes.
+#define NONCE_SIZE 12
+// 128-bit GCM mode authentication tag in bytes.
+#define TAG_SIZE 16
+
+// Struct for storing salted and hashed password and salt.
+// Login files from before versioned login files are this struct and nothing else.
+struct login_details {
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  unsigned char salt[SALT_SIZE];
+};
+
+// Login files start with this magic number.
+#define LOGIN_MAGIC "\x89NLGN\r\n\x1a"
+#define LOGIN_MAGIC_SIZE 8
+
+// Current login file format version.
+#define LOGIN_FORMAT_VERSION 1
+
+// Password scheme: SHA-256 of the password and salt is checked, and SHA-256 of the
+// password is the key.
+#define LOGIN_SCHEME_SHA256 1
+
+// Size of a login file in bytes.
+// On disk:
+// 0   magic (8)
+// 8   format version (1)
+// 9   password scheme (1)
+// 10  flags, zero (2)
+// 12  reserved, zero (4)
+// 16  salt (8)
+// 24  hash (32)
+#define LOGIN_FILE_SIZE 56
+
+// Set up OpenSSL and fetch the algorithms used by notes, if not done already.
+// OpenSSL is not touched until a crypto operation needs it, so commands without any
+// start quickly. This may be called early on another thread to hide the setup time.
+// Returns 1 on success, 0 otherwise.
+int crypto_init();
+
+// Get the SHA-256 digest, setting up OpenSSL if needed.
+// Returns the digest or `NULL` on error, printing issues.
+const EVP_MD* sha256_digest();
 
 // Generate a new random salt.
 //
@@ -25,6 +70,11 @@ void generate_salt(unsigned char buf[SALT_SIZE]);
 // `buf`: buffer in which to place the new IV
 void generate_iv(unsigned char buf[IV_SIZE]);
 
+// Generate a new random nonce.
+//
+// `buf`: buffer in which to place the new nonce
+void generate_nonce(unsigned char buf[NONCE_SIZE]);
+
 // Calculate a SHA-256 hash of the given input.
 //
 // `input`: The input value
@@ -38,6 +88,49 @@ unsigned char* calculate_hash(const char *input, const unsigned char salt[SALT_S
 // `hash`: The expected hash
 unsigned char* log_in(const char *password, const unsigned char salt[SALT_SIZE], const unsigned char hash[SHA256_DIGEST_LENGTH]);
 
+// Read a login file, in the current format or the one from before versioned login files.
+// Returns `0` on success or `-1` with `errno` set, i.e. to `EBADMSG` if the file is
+// damaged or `ENOTSUP` if it was written by a newer version.
+//
+// `path`: path of the login file
+// `details`: A pointer to where the salt and hash are to be placed
+// `legacy`: A pointer to where `1` is to be placed if the file is in the old format, `0` otherwise
+int read_login_file(const char *path, struct login_details *details, int *legacy);
+
+// Write a login file in the current format, replacing any file there atomically.
+// Returns `0` on success or `-1` with `errno` set.
+//
+// `path`: path of the login file
+// `details`: the salt and hash to save
+int write_login_file(const char *path, const struct login_details *details);
+
+// Start encrypting or decrypting a stream using the AES-256 algorithm.
+// Returns a new cipher context or `NULL` on error, printing issues.
+// Note: The context must be released with `cipher_finish`!
+//
+// `key`: The AES-256 key
+// `iv`: The IV used for CBC mode AES-256
+// `enc`: `1` to encrypt, `0` to decrypt
+EVP_CIPHER_CTX* cipher_start(const unsigned char key[KEY_SIZE], const unsigned char iv[IV_SIZE], int enc);
+
+// Encrypt or decrypt the next part of a stream.
+// Returns 1 on success, 0 otherwise.
+//
+// `context`: The cipher context from `cipher_start`
+// `in`: The content to encrypt or decrypt
+// `len`: The input length
+// `out`: The output buffer, at least `len + CIPHER_BLOCK_SIZE` long
+// `out_len`: A pointer to where the output length is to be placed
+int cipher_update(EVP_CIPHER_CTX *context, const unsigned char *in, const int len, unsigned char *out, int *out_len);
+
+// Finish encrypting or decrypting a stream and release the cipher context.
+// Returns 1 on success, 0 otherwise, i.e. if decrypted padding is invalid.
+//
+// `context`: The cipher context from `cipher_start`
+// `out`: The output buffer, at least `CIPHER_BLOCK_SIZE` long
+// `out_len`: A pointer to where the output length is to be placed
+int cipher_finish(EVP_CIPHER_CTX *context, unsigned char *out, int *out_len);
+
 // Encrypt or decrypt using the AES-256 algorithm.
 //
 // `in`: The content to encrypt or decrypt
@@ -47,4 +140,56 @@ unsigned char* log_in(const char *password, const unsigned char salt[SALT_SIZE],
 // `iv`: The IV used for CBC mode AES-256
 int cipher(const unsigned char *in, const int len, FILE *out, const unsigned char key[KEY_SIZE], const unsigned char iv[IV_SIZE], int enc);
 
+// Create a context for authenticated encryption or decryption using AES-256 in GCM mode.
+// The key is set up once, so the context can be reused for many messages.
+// Returns a new cipher context or `NULL` on error, printing issues.
+// Note: The context must be released with `EVP_CIPHER_CTX_free`!
+//
+// `key`: The AES-256 key
+// `enc`: `1` to encrypt, `0` to decrypt
+EVP_CIPHER_CTX* aead_context(const unsigned char key[KEY_SIZE], int enc);
+
+// Encrypt and authenticate a message.
+// Returns 1 on success, 0 otherwise.
+//
+// `context`: The encryption context from `aead_context`
+// `nonce`: A nonce never used before with this key
+// `aad`: Additional data that is authenticated but not encrypted
+// `aad_len`: The additional data length
+// `in`: The content to encrypt
+// `len`: The input length
+// `out`: The output buffer, at least `len` long
+// `tag`: A pointer to where the authentication tag is to be placed
+int aead_seal(EVP_CIPHER_CTX *context, const unsigned char nonce[NONCE_SIZE], const unsigned char *aad, int aad_len,
+    const unsigned char *in, int len, unsigned char *out, unsigned char tag[TAG_SIZE]);
+
+// Decrypt and verify a message.
+// Returns 1 on success, 0 if the message could not be authenticated or on error.
+//
+// `context`: The decryption context from `aead_context`
+// `nonce`: The nonce the message was encrypted with
+// `aad`: Additional data that was authenticated with the message
+// `aad_len`: The additional data length
+// `in`: The content to decrypt
+// `len`: The input length
+// `out`: The output buffer, at least `len` long
+// `tag`: The authentication tag
+int aead_open(EVP_CIPHER_CTX *context, const unsigned char nonce[NONCE_SIZE], const unsigned char *aad, int aad_len,
+    const unsigned char *in, int len, unsigned char *out, const unsigned char tag[TAG_SIZE]);
+
+// Allocate memory for plaintext that is kept out of swap and core dumps.
+// Memory comes from its own pages, which are locked into RAM and excluded from dumps.
+// Returns the zeroed memory, or `NULL` if it cannot be allocated or locked, i.e. when
+// over the `RLIMIT_MEMLOCK` limit.
+// Note: The memory must be released with `secure_free`!
+//
+// `len`: the number of bytes needed
+void* secure_alloc(size_t len);
+
+// Wipe and release memory from `secure_alloc`.
+//
+// `ptr`: the memory, or `NULL`
+// `len`: the number of bytes allocated
+void secure_free(void *ptr, size_t len);
+
 #endif
@@ -0,0 +1,82 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man2/posix_fadvise.2.html
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include "security.h"
+#include "data.h"
+#include "startup.h"
+
+// Thread entry point for startup work.
+// Nothing here needs the key, and everything is redone when needed if it fails.
+//
+// `arg`: the startup work
+static void* startup_worker(void *arg) {
+  struct startup *startup = arg;
+  print_errors(0);
+
+  // Loading providers and fetching ciphers is the slowest part of starting OpenSSL.
+  crypto_init();
+
+  struct notebook_config config;
+  if (read_config(startup->folder_name, &config)) {
+    return NULL;
+  }
+
+  // The scan is shared, so the first listing only checks that the notes directory is unchanged.
+  struct note_ids notes = {0};
+  if (load_note_ids(startup->folder_name, &notes) > 0) {
+    // The newest notes are the likeliest to be viewed, so start reading them from disk.
+    while (startup->newest_count < STARTUP_WARM_NOTES && startup->newest_count < notes.count) {
+      unsigned long id = notes.ids[notes.count - startup->newest_count - 1];
+      startup->newest[startup->newest_count++] = id;
+
+      char file_path[PATH_MAX];
+      if (find_note_path(startup->folder_name, &config, id, file_path)) {
+        continue;
+      }
+      int fd = open(file_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+      if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+      }
+    }
+  }
+  free_note_ids(&notes);
+  return NULL;
+}
+
+// Start setting up OpenSSL, scanning the notes directory and reading the newest notes
+// into the page cache, on a background thread.
+// Returns `0` on success or `-1` if the thread could not be started, in which case the
+// work is left to be done when needed.
+//
+// `startup`: the startup work to begin
+// `folder_name`: path of directory containing note files
+int startup_begin(struct startup *startup, const char *folder_name) {
+  memset(startup, 0, sizeof(struct startup));
+  startup->folder_name = folder_name;
+  int error = pthread_create(&startup->thread, NULL, startup_worker, startup);
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  startup->running = 1;
+  return 0;
+}
+
+// Wait for startup work to finish.
+// Returns the number of newest notes found.
+//
+// `startup`: the startup work from `startup_begin`
+size_t startup_finish(struct startup *startup) {
+  if (startup->running) {
+    pthread_join(startup->thread, NULL);
+    startup->running = 0;
+  }
+  return startup->newest_count;
+}
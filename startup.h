@@ -0,0 +1,36 @@
+#ifndef STARTUP_H
+#define STARTUP_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Notes whose files are read ahead at startup, newest first.
+#define STARTUP_WARM_NOTES 8
+
+// Work done at startup that doesn't need the password, so it can run while the
+// password is typed and the key is derived.
+struct startup {
+  pthread_t thread;
+  int running;
+  const char *folder_name;
+  // The newest notes found, newest first, once finished.
+  unsigned long newest[STARTUP_WARM_NOTES];
+  size_t newest_count;
+};
+
+// Start setting up OpenSSL, scanning the notes directory and reading the newest notes
+// into the page cache, on a background thread.
+// Returns `0` on success or `-1` if the thread could not be started, in which case the
+// work is left to be done when needed.
+//
+// `startup`: the startup work to begin
+// `folder_name`: path of directory containing note files
+int startup_begin(struct startup *startup, const char *folder_name);
+
+// Wait for startup work to finish.
+// Returns the number of newest notes found.
+//
+// `startup`: the startup work from `startup_begin`
+size_t startup_finish(struct startup *startup);
+
+#endif
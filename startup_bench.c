@@ -0,0 +1,251 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man3/mkdtemp.3.html
+// https://man7.org/linux/man-pages/man3/ftw.3.html
+
+// Measures how long notes takes to start, and fails if it is over budget.
+// Each run starts the program in a scratch notebook:
+//   time to prompt: until the main menu is shown, with the password given by -p
+//   time to first note: until a note has been decrypted and printed with --read
+
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Password for the scratch notebook.
+#define BENCH_PASSWORD "startup benchmark password"
+// Text shown once the main menu is ready for input.
+#define MENU_PROMPT "Please choose an option"
+// Default budgets in milliseconds, for the median of all runs.
+#define DEFAULT_PROMPT_BUDGET 20.0
+#define DEFAULT_NOTE_BUDGET 20.0
+
+// Get the current time in milliseconds.
+double now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+// Run notes once, feeding it input and timing it.
+// Returns the milliseconds until `until` was printed, or until exit if `until` is `NULL`,
+// or `-1` if the program failed.
+//
+// `notes`: path of the notes executable
+// `args`: arguments after the program name, ending with `NULL`
+// `input`: written to standard input at start
+// `until`: text to wait for, or `NULL` to wait for exit
+// `then`: written to standard input once `until` is seen
+double run_notes(const char *notes, char *const args[], const char *input, const char *until, const char *then) {
+  int in_pipe[2];
+  int out_pipe[2];
+  if (pipe(in_pipe) || pipe(out_pipe)) {
+    perror("pipe");
+    return -1;
+  }
+
+  char *argv[16] = {(char *) notes};
+  for (int i = 0; args[i] && i < 14; ++i) {
+    argv[i + 1] = args[i];
+  }
+
+  double start = now_ms();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(in_pipe[0], STDIN_FILENO);
+    dup2(out_pipe[1], STDOUT_FILENO);
+    close(in_pipe[0]);
+    close(in_pipe[1]);
+    close(out_pipe[0]);
+    close(out_pipe[1]);
+    execv(notes, argv);
+    perror(notes);
+    _exit(127);
+  }
+  close(in_pipe[0]);
+  close(out_pipe[1]);
+
+  if (input && write(in_pipe[1], input, strlen(input)) < 0) {
+    perror("input");
+  }
+
+  // Keep the tail of the output, so text split across reads is still found.
+  char seen[4096] = "";
+  size_t seen_len = 0;
+  double elapsed = -1;
+  char buf[4096];
+  ssize_t bytes_read;
+  while ((bytes_read = read(out_pipe[0], buf, sizeof(buf))) != 0) {
+    if (bytes_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (until == NULL || elapsed >= 0) {
+      continue;
+    }
+    if (seen_len + bytes_read >= sizeof(seen)) {
+      size_t keep = strlen(until);
+      memmove(seen, seen + seen_len - keep, keep);
+      seen_len = keep;
+    }
+    size_t take = (size_t) bytes_read < sizeof(seen) - seen_len - 1 ? (size_t) bytes_read : sizeof(seen) - seen_len - 1;
+    memcpy(seen + seen_len, buf, take);
+    seen_len += take;
+    seen[seen_len] = '\0';
+    if (strstr(seen, until)) {
+      elapsed = now_ms() - start;
+      if (then && write(in_pipe[1], then, strlen(then)) < 0) {
+        perror("input");
+      }
+      close(in_pipe[1]);
+      in_pipe[1] = -1;
+    }
+  }
+  if (until == NULL) {
+    elapsed = now_ms() - start;
+  }
+  if (in_pipe[1] >= 0) {
+    close(in_pipe[1]);
+  }
+  close(out_pipe[0]);
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    // Keep waiting through signals.
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "%s exited with status %d\n", notes, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return -1;
+  }
+  return elapsed;
+}
+
+// Compare times for qsort.
+int compare_times(const void *val1, const void *val2) {
+  double time1 = *(const double *) val1;
+  double time2 = *(const double *) val2;
+  return (time1 > time2) - (time1 < time2);
+}
+
+// Print the distribution of a set of times and check it against a budget.
+// Returns 0 if the median is within budget, 1 otherwise.
+//
+// `name`: what was measured
+// `times`: the times in milliseconds, sorted in place
+// `count`: the number of times
+// `budget`: the allowed median in milliseconds
+int report(const char *name, double *times, int count, double budget) {
+  qsort(times, count, sizeof(double), compare_times);
+  double median = times[count / 2];
+  double p95 = times[(count * 95 + 99) / 100 - 1];
+  int over = median > budget;
+  printf("%-20s min %7.2f ms  median %7.2f ms  p95 %7.2f ms  max %7.2f ms  budget %6.1f ms  %s\n",
+      name, times[0], median, p95, times[count - 1], budget, over ? "OVER BUDGET" : "ok");
+  return over;
+}
+
+// Remove a file or directory while cleaning up the scratch notebook.
+int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  return remove(path);
+}
+
+// Entry point. Usage: startup_bench [--runs N] [--prompt-budget MS] [--note-budget MS] [NOTES]
+//
+// `argc`: The number of arguments used when running the executable
+// `argv`: The arguments used when running the executable
+int main(int argc, char *argv[]) {
+  static const struct option long_options[] = {
+    {"runs", required_argument, NULL, 'n'},
+    {"prompt-budget", required_argument, NULL, 'p'},
+    {"note-budget", required_argument, NULL, 'r'},
+    {NULL, 0, NULL, 0},
+  };
+
+  int runs = 20;
+  double prompt_budget = DEFAULT_PROMPT_BUDGET;
+  double note_budget = DEFAULT_NOTE_BUDGET;
+  int opt = 0;
+  while ((opt = getopt_long(argc, argv, "n:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'n':
+        runs = atoi(optarg);
+        break;
+      case 'p':
+        prompt_budget = atof(optarg);
+        break;
+      case 'r':
+        note_budget = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [--runs N] [--prompt-budget MS] [--note-budget MS] [NOTES]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (runs < 1) {
+    runs = 1;
+  }
+
+  char notes[PATH_MAX];
+  if (realpath(optind < argc ? argv[optind] : "./notes", notes) == NULL) {
+    perror(optind < argc ? argv[optind] : "./notes");
+    return 2;
+  }
+
+  // Work in a scratch notebook, so real notes are never touched.
+  char scratch[] = "/tmp/notes-bench-XXXXXX";
+  if (mkdtemp(scratch) == NULL || chdir(scratch)) {
+    perror(scratch);
+    return 2;
+  }
+
+  // Set up the login and a note to read. The menu waits for a key after adding.
+  char *setup_args[] = {"-p", BENCH_PASSWORD, NULL};
+  int status = 2;
+  double *prompt_times = calloc(runs, sizeof(double));
+  double *note_times = calloc(runs, sizeof(double));
+  if (prompt_times == NULL || note_times == NULL) {
+    perror("times");
+  } else if (run_notes(notes, setup_args, "2Startup benchmark note\nx4", NULL, NULL) >= 0) {
+    char *prompt_args[] = {"-p", BENCH_PASSWORD, NULL};
+    char *note_args[] = {"-p", BENCH_PASSWORD, "--read", "1", NULL};
+    status = 0;
+
+    // One untimed run of each warms the page cache, as for any program run twice.
+    run_notes(notes, prompt_args, NULL, MENU_PROMPT, "4");
+    run_notes(notes, note_args, NULL, NULL, NULL);
+    for (int i = 0; i < runs && !status; ++i) {
+      prompt_times[i] = run_notes(notes, prompt_args, NULL, MENU_PROMPT, "4");
+      note_times[i] = run_notes(notes, note_args, NULL, NULL, NULL);
+      if (prompt_times[i] < 0 || note_times[i] < 0) {
+        status = 2;
+      }
+    }
+
+    if (!status) {
+      printf("%s, %d runs\n", notes, runs);
+      status |= report("time to prompt", prompt_times, runs, prompt_budget);
+      status |= report("time to first note", note_times, runs, note_budget);
+    }
+  }
+
+  free(prompt_times);
+  free(note_times);
+  if (chdir("/")) {
+    perror("/");
+  }
+  nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return status;
+}
@@ -0,0 +1,375 @@
+// Resources used:
+// https://man7.org/linux/man-pages/man2/memfd_create.2.html
+// https://man7.org/linux/man-pages/man2/syncfs.2.html
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "data.h"
+#include "notefile.h"
+#include "dedup.h"
+#include "storage.h"
+
+// Read a note's length, then decrypt it into a sink if it fits.
+// Returns `0` on success or a `NOTE_ERR_*` value.
+//
+// `fd`: the open note file
+// `key`: the key the note was written with
+// `limit`: the longest note to decrypt
+// `length`: A pointer to where the note's length is to be placed
+// `sink`: where to send decrypted content, or `NULL` to only read the length
+// `arg`: passed to the sink
+// `store`: path of the chunk store, or `NULL` for none
+static int read_note_fd(int fd, const unsigned char *key, unsigned long long limit, unsigned long long *length,
+    note_sink sink, void *arg, const char *store) {
+  // Check the length first, so nothing is decrypted that won't be used.
+  int error = read_note_length(fd, key, length);
+  if (error || sink == NULL) {
+    return error;
+  }
+  if (*length > limit) {
+    return NOTE_ERR_SINK;
+  }
+
+  // Callers read many notes at once, so each read stays on its own thread.
+  struct chunk_options options = {1, NULL, store};
+  return read_note_content(fd, key, 0, 0, sink, arg, &options);
+}
+
+// The notes directory as a storage backend.
+struct file_storage {
+  struct note_storage base;
+  char folder[PATH_MAX];
+};
+
+// Collect the IDs of every note in the notes directory.
+static int file_enumerate(struct note_storage *storage, struct note_ids *ids) {
+  struct file_storage *files = (struct file_storage *) storage;
+  return load_note_ids(files->folder, ids) < 0 ? NOTE_ERR_IO : 0;
+}
+
+// Encrypt and save a new note file at the next free ID.
+static int file_create(struct note_storage *storage, const unsigned char *key, const unsigned char *content, size_t len,
+    unsigned long *id) {
+  struct file_storage *files = (struct file_storage *) storage;
+  return create_note(key, files->folder, content, len, id);
+}
+
+// Decrypt a note file, finishing any edit to it that was interrupted first.
+static int file_read(struct note_storage *storage, const unsigned char *key, unsigned long id, unsigned long long limit,
+    unsigned long long *length, note_sink sink, void *arg) {
+  struct file_storage *files = (struct file_storage *) storage;
+  char note_name[32];
+  char file_path[PATH_MAX];
+  char store[PATH_MAX];
+  sprintf(note_name, ".%lu", id);
+  *length = 0;
+  if (checked_path(files->folder, CHUNK_STORE, store) || recover_note(key, files->folder, note_name)) {
+    return NOTE_ERR_IO;
+  }
+  int fd = open_current_note(key, files->folder, note_name, file_path);
+  if (fd < 0) {
+    return NOTE_ERR_IO;
+  }
+  int error = read_note_fd(fd, key, limit, length, sink, arg, store);
+  close(fd);
+  return error;
+}
+
+// Change a note file through its journal, keeping its history.
+static int file_write(struct note_storage *storage, const unsigned char *key, unsigned long id, int append,
+    long long offset, const unsigned char *content, size_t len) {
+  struct file_storage *files = (struct file_storage *) storage;
+  char note_name[32];
+  sprintf(note_name, ".%lu", id);
+  return edit_note(key, files->folder, note_name, append, offset, content, len);
+}
+
+// Delete a note file, its journal and its history, releasing any chunks it held.
+static int file_remove(struct note_storage *storage, const unsigned char *key, unsigned long id) {
+  struct file_storage *files = (struct file_storage *) storage;
+  char note_name[32];
+  sprintf(note_name, ".%lu", id);
+  return delete_note(key, files->folder, note_name) ? NOTE_ERR_IO : 0;
+}
+
+// Flush the filesystem holding the notes directory, including notes in shard directories.
+static int file_sync(struct note_storage *storage) {
+  struct file_storage *files = (struct file_storage *) storage;
+  int dir_fd = open(files->folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    return NOTE_ERR_IO;
+  }
+  int result = syncfs(dir_fd);
+  int saved_errno = errno;
+  close(dir_fd);
+  errno = saved_errno;
+  return result ? NOTE_ERR_IO : 0;
+}
+
+// Release the notes directory backend.
+static void file_destroy(struct note_storage *storage) {
+  free(storage);
+}
+
+static const struct storage_ops file_ops = {
+  file_enumerate, file_create, file_read, file_write, file_remove, file_sync, file_destroy,
+};
+
+// Open the notes directory as a storage backend.
+// Notes are files laid out as the notes program keeps them, with journals and history.
+// Returns the backend, or `NULL` with `errno` set.
+//
+// `folder_name`: path of directory containing note files
+struct note_storage* file_storage(const char *folder_name) {
+  if (strlen(folder_name) >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  struct file_storage *files = calloc(1, sizeof(struct file_storage));
+  if (files == NULL) {
+    return NULL;
+  }
+  files->base.ops = &file_ops;
+  strcpy(files->folder, folder_name);
+  return &files->base;
+}
+
+// A note held in memory.
+struct memory_note {
+  unsigned long id;
+  // An anonymous in-memory file holding the note as it would be on disk.
+  int fd;
+};
+
+// Notes held in memory as a storage backend.
+struct memory_storage {
+  struct note_storage base;
+  // Guards the table. Notes are read and written outside it.
+  pthread_mutex_t lock;
+  // Notes by ascending ID.
+  struct memory_note *notes;
+  size_t count;
+  size_t capacity;
+};
+
+// Find where a note is or would go in the table.
+// Returns the index of the first note with an ID at least as high.
+//
+// `memory`: the backend, locked
+// `id`: the note ID
+static size_t find_memory_note(const struct memory_storage *memory, unsigned long id) {
+  size_t low = 0;
+  size_t high = memory->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (memory->notes[mid].id < id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Get a file descriptor of its own for a note in memory.
+// Returns a file descriptor, or `-1` with `errno` set.
+//
+// `memory`: the backend
+// `id`: the note ID
+static int open_memory_note(struct memory_storage *memory, unsigned long id) {
+  pthread_mutex_lock(&memory->lock);
+  size_t index = find_memory_note(memory, id);
+  int fd = -1;
+  if (index < memory->count && memory->notes[index].id == id) {
+    fd = dup(memory->notes[index].fd);
+  } else {
+    errno = ENOENT;
+  }
+  pthread_mutex_unlock(&memory->lock);
+  return fd;
+}
+
+// Copy the IDs of every note in memory.
+static int memory_enumerate(struct note_storage *storage, struct note_ids *ids) {
+  struct memory_storage *memory = (struct memory_storage *) storage;
+  int error = 0;
+  pthread_mutex_lock(&memory->lock);
+  for (size_t i = 0; !error && i < memory->count; ++i) {
+    error = add_note_id(ids, memory->notes[i].id) ? NOTE_ERR_IO : 0;
+  }
+  pthread_mutex_unlock(&memory->lock);
+  return error;
+}
+
+// Encrypt a new note into memory at the lowest free ID.
+static int memory_create(struct note_storage *storage, const unsigned char *key, const unsigned char *content, size_t len,
+    unsigned long *id) {
+  struct memory_storage *memory = (struct memory_storage *) storage;
+  int fd = memfd_create("note", MFD_CLOEXEC);
+  if (fd < 0) {
+    return NOTE_ERR_IO;
+  }
+  // Encrypting takes the longest, so it is done before the note is added to the table.
+  int error = write_chunked_note(fd, key, content, len, NULL);
+  if (error) {
+    close(fd);
+    return error;
+  }
+
+  pthread_mutex_lock(&memory->lock);
+  // The lowest free ID is the first gap in the table. IDs are unique and ascending, so
+  // every note before the gap has its index plus one as its ID.
+  size_t index = 0;
+  size_t high = memory->count;
+  while (index < high) {
+    size_t mid = index + (high - index) / 2;
+    if (memory->notes[mid].id == mid + 1) {
+      index = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (index + 1 > MAX_NOTES) {
+    errno = ENOSPC;
+    error = NOTE_ERR_IO;
+  } else if (memory->count == memory->capacity) {
+    size_t capacity = memory->capacity ? memory->capacity * 2 : 64;
+    struct memory_note *grown = realloc(memory->notes, capacity * sizeof(struct memory_note));
+    if (grown == NULL) {
+      error = NOTE_ERR_MEMORY;
+    } else {
+      memory->notes = grown;
+      memory->capacity = capacity;
+    }
+  }
+  if (!error) {
+    memmove(memory->notes + index + 1, memory->notes + index, (memory->count - index) * sizeof(struct memory_note));
+    memory->notes[index].id = index + 1;
+    memory->notes[index].fd = fd;
+    ++memory->count;
+    *id = index + 1;
+  }
+  pthread_mutex_unlock(&memory->lock);
+
+  if (error) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+  }
+  return error;
+}
+
+// Decrypt a note in memory.
+static int memory_read(struct note_storage *storage, const unsigned char *key, unsigned long id, unsigned long long limit,
+    unsigned long long *length, note_sink sink, void *arg) {
+  *length = 0;
+  int fd = open_memory_note((struct memory_storage *) storage, id);
+  if (fd < 0) {
+    return NOTE_ERR_IO;
+  }
+  int error = read_note_fd(fd, key, limit, length, sink, arg, NULL);
+  close(fd);
+  return error;
+}
+
+// Change a note in memory, through a journal in memory.
+// Nothing in memory survives a crash, so the journal is only there for the note format.
+static int memory_write(struct note_storage *storage, const unsigned char *key, unsigned long id, int append,
+    long long offset, const unsigned char *content, size_t len) {
+  int fd = open_memory_note((struct memory_storage *) storage, id);
+  if (fd < 0) {
+    return NOTE_ERR_IO;
+  }
+  int journal_fd = memfd_create("journal", MFD_CLOEXEC);
+  if (journal_fd < 0) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return NOTE_ERR_IO;
+  }
+
+  int error;
+  if (append) {
+    error = append_chunked_note(fd, journal_fd, key, content, len);
+  } else {
+    error = write_chunked_range(fd, journal_fd, key, offset, content, len);
+  }
+  if (error) {
+    // Leave the note as it was, or as it was meant to be if the change was committed.
+    replay_note_journal(fd, journal_fd, key);
+  }
+  close(journal_fd);
+  close(fd);
+  return error;
+}
+
+// Delete a note from memory.
+static int memory_remove(struct note_storage *storage, const unsigned char *key, unsigned long id) {
+  struct memory_storage *memory = (struct memory_storage *) storage;
+  int error = 0;
+  pthread_mutex_lock(&memory->lock);
+  size_t index = find_memory_note(memory, id);
+  if (index < memory->count && memory->notes[index].id == id) {
+    // Readers holding their own descriptor finish with the old content.
+    close(memory->notes[index].fd);
+    --memory->count;
+    memmove(memory->notes + index, memory->notes + index + 1, (memory->count - index) * sizeof(struct memory_note));
+  } else {
+    errno = ENOENT;
+    error = NOTE_ERR_IO;
+  }
+  pthread_mutex_unlock(&memory->lock);
+  return error;
+}
+
+// Notes in memory never survive a crash, so there is nothing to flush.
+static int memory_sync(struct note_storage *storage) {
+  return 0;
+}
+
+// Release every note in memory.
+static void memory_destroy(struct note_storage *storage) {
+  struct memory_storage *memory = (struct memory_storage *) storage;
+  for (size_t i = 0; i < memory->count; ++i) {
+    close(memory->notes[i].fd);
+  }
+  pthread_mutex_destroy(&memory->lock);
+  free(memory->notes);
+  free(memory);
+}
+
+static const struct storage_ops memory_ops = {
+  memory_enumerate, memory_create, memory_read, memory_write, memory_remove, memory_sync, memory_destroy,
+};
+
+// Create an empty storage backend held in memory.
+// Each note is an anonymous in-memory file in the same format as on disk, so the cost of
+// encryption can be measured without the cost of I/O. Notes are lost when it is destroyed.
+// Each note holds a file descriptor, so the open file limit is raised as far as it goes.
+// Returns the backend, or `NULL` with `errno` set.
+struct note_storage* memory_storage() {
+  struct memory_storage *memory = calloc(1, sizeof(struct memory_storage));
+  if (memory == NULL) {
+    return NULL;
+  }
+  memory->base.ops = &memory_ops;
+  pthread_mutex_init(&memory->lock, NULL);
+
+  // Every note holds a file descriptor, so allow as many as the system will.
+  struct rlimit limit;
+  if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  return &memory->base;
+}
@@ -0,0 +1,55 @@
+#ifndef STORAGE_H
+#define STORAGE_H 1
+
+#include <stddef.h>
+#include "data.h"
+#include "notefile.h"
+
+struct note_storage;
+
+// Operations of a storage backend: where a notebook keeps its encrypted notes.
+// Each returns `0` on success or a `NOTE_ERR_*` value, where `NOTE_ERR_IO` means `errno`
+// has the cause, i.e. `ENOENT` for a note that doesn't exist. None of them print.
+// Any number of threads may use a backend at once, as long as changes to existing notes
+// are not made alongside other operations on them.
+struct storage_ops {
+  // Collect the IDs of every note, in no particular order.
+  int (*enumerate)(struct note_storage *storage, struct note_ids *ids);
+  // Encrypt and save a new note at the next free ID.
+  int (*create)(struct note_storage *storage, const unsigned char *key, const unsigned char *content, size_t len,
+      unsigned long *id);
+  // Get a note's length, then decrypt it into a sink if it is no longer than `limit`
+  // (`NOTE_ERR_SINK` otherwise). With a `NULL` sink, only the length is read.
+  int (*read)(struct note_storage *storage, const unsigned char *key, unsigned long id, unsigned long long limit,
+      unsigned long long *length, note_sink sink, void *arg);
+  // Change part of a note or, with `append`, add to its end, as `edit_note` does.
+  int (*write)(struct note_storage *storage, const unsigned char *key, unsigned long id, int append,
+      long long offset, const unsigned char *content, size_t len);
+  // Delete a note. The key is needed to release what a deduplicated note held.
+  int (*remove)(struct note_storage *storage, const unsigned char *key, unsigned long id);
+  // Make every change so far survive a crash.
+  int (*sync)(struct note_storage *storage);
+  // Release the backend. Notes in memory are lost.
+  void (*destroy)(struct note_storage *storage);
+};
+
+// A storage backend. Backends start with this, followed by their own state.
+struct note_storage {
+  const struct storage_ops *ops;
+};
+
+// Open the notes directory as a storage backend.
+// Notes are files laid out as the notes program keeps them, with journals and history.
+// Returns the backend, or `NULL` with `errno` set.
+//
+// `folder_name`: path of directory containing note files
+struct note_storage* file_storage(const char *folder_name);
+
+// Create an empty storage backend held in memory.
+// Each note is an anonymous in-memory file in the same format as on disk, so the cost of
+// encryption can be measured without the cost of I/O. Notes are lost when it is destroyed.
+// Each note holds a file descriptor, so the open file limit is raised as far as it goes.
+// Returns the backend, or `NULL` with `errno` set.
+struct note_storage* memory_storage();
+
+#endif
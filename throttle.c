@@ -0,0 +1,67 @@
+// Resources used:
+// https://en.wikipedia.org/wiki/Token_bucket
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "throttle.h"
+
+// Set up a rate limit.
+//
+// `throttle`: the rate limit to set up
+// `rate`: allowed bytes per second, or `0` for no limit
+void throttle_init(struct throttle *throttle, unsigned long rate) {
+  pthread_mutex_init(&throttle->lock, NULL);
+  throttle->rate = rate;
+  throttle->allowance = 0;
+  clock_gettime(CLOCK_MONOTONIC, &throttle->updated);
+}
+
+// Wait until an amount of I/O is allowed by a rate limit.
+// Each caller takes its bytes from the allowance immediately and then sleeps off any
+// debt, so concurrent callers queue fairly instead of polling.
+//
+// `throttle`: the rate limit
+// `bytes`: the number of bytes about to be read or written
+void throttle_wait(struct throttle *throttle, size_t bytes) {
+  if (!throttle->rate) {
+    return;
+  }
+
+  pthread_mutex_lock(&throttle->lock);
+
+  // Refill the allowance for time passed, up to one second of burst.
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - throttle->updated.tv_sec) + (now.tv_nsec - throttle->updated.tv_nsec) / 1e9;
+  throttle->updated = now;
+  throttle->allowance += elapsed * throttle->rate;
+  if (throttle->allowance > throttle->rate) {
+    throttle->allowance = throttle->rate;
+  }
+
+  throttle->allowance -= bytes;
+  double debt = -throttle->allowance;
+
+  pthread_mutex_unlock(&throttle->lock);
+
+  if (debt <= 0) {
+    return;
+  }
+
+  // Sleep until the debt is paid off.
+  double seconds = debt / throttle->rate;
+  struct timespec delay;
+  delay.tv_sec = (time_t) seconds;
+  delay.tv_nsec = (long) ((seconds - delay.tv_sec) * 1e9);
+  while (nanosleep(&delay, &delay) && errno == EINTR) {
+    // Keep sleeping through signals.
+  }
+}
+
+// Release resources used by a rate limit.
+//
+// `throttle`: the rate limit
+void throttle_destroy(struct throttle *throttle) {
+  pthread_mutex_destroy(&throttle->lock);
+}
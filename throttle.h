@@ -0,0 +1,37 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+// Shared I/O rate limit for background work.
+// Safe to use from multiple threads at once.
+struct throttle {
+  pthread_mutex_t lock;
+  // Allowed bytes per second, or `0` for no limit.
+  unsigned long rate;
+  // Bytes that may be used before waiting. Negative when in debt.
+  double allowance;
+  // When the allowance was last updated.
+  struct timespec updated;
+};
+
+// Set up a rate limit.
+//
+// `throttle`: the rate limit to set up
+// `rate`: allowed bytes per second, or `0` for no limit
+void throttle_init(struct throttle *throttle, unsigned long rate);
+
+// Wait until an amount of I/O is allowed by a rate limit.
+//
+// `throttle`: the rate limit
+// `bytes`: the number of bytes about to be read or written
+void throttle_wait(struct throttle *throttle, size_t bytes);
+
+// Release resources used by a rate limit.
+//
+// `throttle`: the rate limit
+void throttle_destroy(struct throttle *throttle);
+
+#endif
@@ -0,0 +1,224 @@
+// Resources used:
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU (Trace Event Format)
+// https://sourceware.org/systemtap/wiki/AddingUserSpaceProbingToApps
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef NOTES_USDT
+#include <sys/sdt.h>
+#endif
+#include "trace.h"
+
+// Spans recorded by one thread. Only that thread writes to it.
+struct trace_ring {
+  struct trace_event events[TRACE_RING_SIZE];
+  // Number of spans recorded. The newest is at `(head - 1) % TRACE_RING_SIZE`.
+  unsigned long long head;
+  pid_t tid;
+  struct trace_ring *next;
+  // The next ring whose thread has exited, while this one is free.
+  struct trace_ring *next_free;
+};
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+// Whether spans are timed, and whether they are kept to be written out.
+static int trace_timing;
+static int trace_recording;
+static char trace_path[PATH_MAX];
+// When tracing started, so the trace starts near zero.
+static unsigned long long trace_epoch;
+// Every ring, newest first. Rings are only added, and live until exit.
+static struct trace_ring *trace_rings;
+static __thread struct trace_ring *thread_ring;
+// Rings whose threads have exited, to be reused by new threads. Programs that start a
+// thread for every large note then only have as many rings as threads at once.
+static pthread_mutex_t trace_free_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_free_rings;
+// Hands a thread's ring back when it exits.
+static pthread_key_t trace_key;
+
+// Get the time on the monotonic clock in nanoseconds.
+static unsigned long long trace_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Write the trace at exit.
+static void trace_exit() {
+  trace_write();
+}
+
+// Free a ring for reuse once its thread exits. Its spans stay until they are overwritten.
+//
+// `arg`: the thread's ring
+static void trace_thread_exit(void *arg) {
+  struct trace_ring *ring = arg;
+  pthread_mutex_lock(&trace_free_lock);
+  ring->next_free = trace_free_rings;
+  trace_free_rings = ring;
+  pthread_mutex_unlock(&trace_free_lock);
+}
+
+// Turn tracing on if asked to by the environment.
+// Called once, by whichever span comes first.
+static void trace_setup() {
+  const char *path = getenv(TRACE_ENV);
+  if (path != NULL && *path && strlen(path) < sizeof(trace_path)) {
+    strcpy(trace_path, path);
+    trace_recording = !pthread_key_create(&trace_key, trace_thread_exit);
+    if (trace_recording) {
+      atexit(trace_exit);
+    }
+  }
+#ifdef NOTES_USDT
+  // Probes are cheap until something attaches, but need a duration either way.
+  trace_timing = 1;
+#else
+  trace_timing = trace_recording;
+#endif
+  trace_epoch = trace_now();
+}
+
+// Start timing a span.
+// This is a single check when tracing is off.
+// Returns the start time to pass to `trace_end`, or `0` if tracing is off.
+unsigned long long trace_begin() {
+  pthread_once(&trace_once, trace_setup);
+  return trace_timing ? trace_now() : 0;
+}
+
+// Get the calling thread's ring, setting one up the first time.
+// A ring left by a thread that has exited is taken over if there is one.
+// Returns the ring or `NULL` if there is no memory for one.
+static struct trace_ring* trace_thread_ring() {
+  if (thread_ring != NULL) {
+    return thread_ring;
+  }
+
+  pthread_mutex_lock(&trace_free_lock);
+  struct trace_ring *ring = trace_free_rings;
+  if (ring != NULL) {
+    trace_free_rings = ring->next_free;
+  }
+  pthread_mutex_unlock(&trace_free_lock);
+
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+      return NULL;
+    }
+    // Add to the list without a lock. Rings are never removed, so there is no ABA problem.
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      // `ring->next` now holds the current head; try again.
+    }
+  }
+  ring->tid = gettid();
+  pthread_setspecific(trace_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+// Record a span started with `trace_begin`.
+// Spans go to a buffer of the calling thread's own, so recording never waits on a lock.
+// In builds with `NOTES_USDT`, a `notes:span` probe fires too.
+//
+// `name`: the name of the span, which must live as long as the program, i.e. a literal
+// `start`: the time from `trace_begin`; nothing is recorded for `0`
+void trace_end(const char *name, unsigned long long start) {
+  if (!start) {
+    return;
+  }
+  unsigned long long duration = trace_now() - start;
+#ifdef NOTES_USDT
+  DTRACE_PROBE3(notes, span, name, start, duration);
+#endif
+  if (!trace_recording) {
+    return;
+  }
+
+  struct trace_ring *ring = trace_thread_ring();
+  if (ring == NULL) {
+    return;
+  }
+  unsigned long long head = ring->head;
+  struct trace_event *event = &ring->events[head % TRACE_RING_SIZE];
+  event->name = name;
+  event->start = start;
+  event->duration = duration;
+  event->tid = ring->tid;
+  // Publish the span only once it is complete.
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Write a time in nanoseconds as microseconds, the unit of Chrome traces.
+//
+// `out`: where to write
+// `ns`: the time
+static void write_micros(FILE *out, unsigned long long ns) {
+  fprintf(out, "%llu.%03llu", ns / 1000, ns % 1000);
+}
+
+// Write the spans recorded so far as a Chrome trace, which trace viewers such as
+// Perfetto and chrome://tracing can load. This is done at exit when tracing is on.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+int trace_write() {
+  pthread_once(&trace_once, trace_setup);
+  if (!trace_recording) {
+    return 0;
+  }
+
+  // Fill in the process ID, so processes sharing a setting don't write over each other.
+  char path[PATH_MAX + 16];
+  const char *pid_mark = strstr(trace_path, "%p");
+  if (pid_mark != NULL) {
+    snprintf(path, sizeof(path), "%.*s%d%s", (int) (pid_mark - trace_path), trace_path, (int) getpid(),
+        pid_mark + 2);
+  } else {
+    strcpy(path, trace_path);
+  }
+
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  pid_t pid = getpid();
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"notes\"}}", pid,
+      pid);
+  for (struct trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long long first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (unsigned long long i = first; i < head; ++i) {
+      // Names are literals from this program, so they need no escaping.
+      const struct trace_event *event = &ring->events[i % TRACE_RING_SIZE];
+      fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":", event->name, pid, event->tid);
+      write_micros(out, event->start - trace_epoch);
+      fprintf(out, ",\"dur\":");
+      write_micros(out, event->duration);
+      fprintf(out, "}");
+    }
+    if (first) {
+      fprintf(out, ",\n{\"name\":\"spans dropped\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":0,"
+          "\"args\":{\"count\":%llu}}", pid, ring->tid, first);
+    }
+  }
+  fprintf(out, "\n]}\n");
+
+  if (fclose(out)) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
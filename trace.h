@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+
+// Environment variable naming the file to write a trace to. Tracing is off without it.
+// A `%p` in the name is replaced with the process ID, for programs that fork.
+#define TRACE_ENV "NOTES_TRACE"
+
+// Spans kept for each thread. Once a thread records more, its oldest are overwritten.
+// A thread that exits hands its spans on to the next thread to start.
+#define TRACE_RING_SIZE 16384
+
+// A timed phase of an operation.
+struct trace_event {
+  // A string that lives as long as the program, i.e. a literal.
+  const char *name;
+  // Nanoseconds on the monotonic clock.
+  unsigned long long start;
+  unsigned long long duration;
+  // The thread that recorded it. Rings are reused once their thread exits.
+  int tid;
+};
+
+// Start timing a span.
+// This is a single check when tracing is off.
+// Returns the start time to pass to `trace_end`, or `0` if tracing is off.
+unsigned long long trace_begin();
+
+// Record a span started with `trace_begin`.
+// Spans go to a buffer of the calling thread's own, so recording never waits on a lock.
+// In builds with `NOTES_USDT`, a `notes:span` probe fires too.
+//
+// `name`: the name of the span, which must live as long as the program, i.e. a literal
+// `start`: the time from `trace_begin`; nothing is recorded for `0`
+void trace_end(const char *name, unsigned long long start);
+
+// Write the spans recorded so far as a Chrome trace, which trace viewers such as
+// Perfetto and chrome://tracing can load. This is done at exit when tracing is on.
+// Returns `0` on success, printing issues and returning `-1` otherwise.
+int trace_write();
+
+#endif
@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "security.h"
+#include "data.h"
+#include "trace.h"
+#include "writeback.h"
+
+// Thread entry point for writing queued notes, oldest first.
+// Waiting notes are written before the thread stops.
+//
+// `arg`: the queue
+static void* writeback_worker(void *arg) {
+  struct write_queue *writer = arg;
+
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    if (writer->count == 0) {
+      if (writer->stopping) {
+        break;
+      }
+      pthread_cond_wait(&writer->wake, &writer->lock);
+      continue;
+    }
+
+    // The note stays queued while it is written, so it can still be read from here.
+    struct pending_note note = writer->queue[0];
+    pthread_mutex_unlock(&writer->lock);
+
+    unsigned long long span = trace_begin();
+    int error = write_reserved_note(writer->key, writer->folder_name, note.fd, note.file_path, note.content,
+        note.len);
+    trace_end("write_behind", span);
+    if (error) {
+      fprintf(stderr, "\nNote %lu could not be saved: %s\n", note.id, note_error_string(error));
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    --writer->count;
+    memmove(writer->queue, writer->queue + 1, writer->count * sizeof(struct pending_note));
+    if (error) {
+      ++writer->failed;
+    }
+    pthread_cond_broadcast(&writer->done);
+    pthread_mutex_unlock(&writer->lock);
+
+    secure_free(note.content, note.len ? note.len : 1);
+    free(note.file_path);
+    pthread_mutex_lock(&writer->lock);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+// Start writing new notes in the background.
+// Returns `0` on success or `-1` on error.
+//
+// `writer`: the queue to start
+// `key`: the key to use for encryption, which must outlive the queue
+// `folder_name`: path of directory containing note files
+int writeback_start(struct write_queue *writer, const unsigned char *key, const char *folder_name) {
+  memset(writer, 0, sizeof(struct write_queue));
+  writer->key = key;
+  writer->folder_name = folder_name;
+  if (pthread_mutex_init(&writer->lock, NULL) || pthread_cond_init(&writer->wake, NULL)
+      || pthread_cond_init(&writer->done, NULL)) {
+    return -1;
+  }
+
+  int error = pthread_create(&writer->thread, NULL, writeback_worker, writer);
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+// Add a new note, claiming its ID now and writing it in the background.
+// The content is copied into locked memory, so it never reaches swap while it waits.
+// If there is no room for it there, the note is written before this returns instead.
+// Returns `0` on success, printing issues and returning a `NOTE_ERR_*` value otherwise.
+// For `NOTE_ERR_IO`, `errno` is `ENOSPC` if every ID is taken.
+//
+// `writer`: the queue
+// `content`: the plaintext note content
+// `len`: the content's length
+// `id`: A pointer to where the new note's ID is to be placed
+int writeback_add(struct write_queue *writer, const unsigned char *content, size_t len, unsigned long *id) {
+  char file_path[PATH_MAX];
+  int fd = reserve_note(writer->folder_name, id, file_path);
+  if (fd < 0) {
+    return NOTE_ERR_IO;
+  }
+
+  struct pending_note note = {*id, fd, strdup(file_path), secure_alloc(len ? len : 1), len};
+  if (note.file_path == NULL || note.content == NULL) {
+    free(note.file_path);
+    secure_free(note.content, len ? len : 1);
+    return write_reserved_note(writer->key, writer->folder_name, fd, file_path, content, len);
+  }
+  memcpy(note.content, content, len);
+
+  pthread_mutex_lock(&writer->lock);
+  while (writer->count == WRITEBACK_QUEUE_SIZE) {
+    pthread_cond_wait(&writer->done, &writer->lock);
+  }
+  writer->queue[writer->count++] = note;
+  pthread_cond_signal(&writer->wake);
+  pthread_mutex_unlock(&writer->lock);
+  return 0;
+}
+
+// Pass the content of a note still waiting to be written to a sink.
+// Returns `1` if the note is waiting and was passed on, `0` if it is not waiting, or
+// `-1` if the sink failed.
+//
+// `writer`: the queue
+// `id`: the note ID
+// `sink`: where to send the content
+// `arg`: passed to the sink
+int writeback_read(struct write_queue *writer, unsigned long id, note_sink sink, void *arg) {
+  int result = 0;
+  pthread_mutex_lock(&writer->lock);
+  for (size_t i = 0; i < writer->count; ++i) {
+    if (writer->queue[i].id == id) {
+      // The content is only freed by the thread once the lock is released.
+      result = sink(arg, writer->queue[i].content, writer->queue[i].len) ? -1 : 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return result;
+}
+
+// Check whether a note is still waiting to be written.
+// Returns `1` if it is waiting, `0` otherwise.
+//
+// `writer`: the queue
+// `id`: the note ID
+int writeback_waiting(struct write_queue *writer, unsigned long id) {
+  int result = 0;
+  pthread_mutex_lock(&writer->lock);
+  for (size_t i = 0; i < writer->count && !result; ++i) {
+    result = writer->queue[i].id == id;
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return result;
+}
+
+// Wait for every note added so far to be written.
+// Returns the number of notes that could not be written since the last flush.
+//
+// `writer`: the queue
+unsigned long writeback_flush(struct write_queue *writer) {
+  pthread_mutex_lock(&writer->lock);
+  while (writer->count) {
+    pthread_cond_wait(&writer->done, &writer->lock);
+  }
+  unsigned long failed = writer->failed;
+  writer->failed = 0;
+  pthread_mutex_unlock(&writer->lock);
+  return failed;
+}
+
+// Write every waiting note, then stop the queue and wait for its thread to finish.
+// Returns the number of notes that could not be written since the last flush.
+//
+// `writer`: the queue
+unsigned long writeback_stop(struct write_queue *writer) {
+  pthread_mutex_lock(&writer->lock);
+  writer->stopping = 1;
+  pthread_cond_signal(&writer->wake);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+  unsigned long failed = writer->failed;
+
+  pthread_cond_destroy(&writer->done);
+  pthread_cond_destroy(&writer->wake);
+  pthread_mutex_destroy(&writer->lock);
+  return failed;
+}
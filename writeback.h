@@ -0,0 +1,92 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+#include "notefile.h"
+
+// Most new notes waiting to be written at once. Adding another waits for room.
+#define WRITEBACK_QUEUE_SIZE 64
+
+// A new note whose ID is claimed, waiting to be encrypted and written.
+struct pending_note {
+  unsigned long id;
+  // The claimed note file, empty and locked for writing until the note is written.
+  int fd;
+  char *file_path;
+  // Plaintext in memory from `secure_alloc`.
+  unsigned char *content;
+  size_t len;
+};
+
+// A background thread that encrypts and writes new notes, so adding a note only waits
+// for its ID to be claimed. Notes are written in the order they were added.
+struct write_queue {
+  pthread_mutex_t lock;
+  // Wakes the thread when there is work or it is time to stop.
+  pthread_cond_t wake;
+  // Signalled when the thread finishes a note.
+  pthread_cond_t done;
+  pthread_t thread;
+  int stopping;
+  const unsigned char *key;
+  const char *folder_name;
+  // Notes waiting to be written, oldest first. The first may be being written.
+  struct pending_note queue[WRITEBACK_QUEUE_SIZE];
+  size_t count;
+  // Notes that could not be written, and were removed, since the last flush or stop.
+  unsigned long failed;
+};
+
+// Start writing new notes in the background.
+// Returns `0` on success or `-1` on error.
+//
+// `writer`: the queue to start
+// `key`: the key to use for encryption, which must outlive the queue
+// `folder_name`: path of directory containing note files
+int writeback_start(struct write_queue *writer, const unsigned char *key, const char *folder_name);
+
+// Add a new note, claiming its ID now and writing it in the background.
+// The content is copied into locked memory. If there is no room for it there, the note
+// is written before this returns instead.
+// Returns `0` on success, printing issues and returning a `NOTE_ERR_*` value otherwise.
+// For `NOTE_ERR_IO`, `errno` is `ENOSPC` if every ID is taken.
+//
+// `writer`: the queue
+// `content`: the plaintext note content
+// `len`: the content's length
+// `id`: A pointer to where the new note's ID is to be placed
+int writeback_add(struct write_queue *writer, const unsigned char *content, size_t len, unsigned long *id);
+
+// Pass the content of a note still waiting to be written to a sink.
+// Reading a note's file waits until it is written, so notes still waiting are read from
+// here instead.
+// Returns `1` if the note is waiting and was passed on, `0` if it is not waiting, or
+// `-1` if the sink failed.
+//
+// `writer`: the queue
+// `id`: the note ID
+// `sink`: where to send the content
+// `arg`: passed to the sink
+int writeback_read(struct write_queue *writer, unsigned long id, note_sink sink, void *arg);
+
+// Check whether a note is still waiting to be written.
+// Returns `1` if it is waiting, `0` otherwise.
+//
+// `writer`: the queue
+// `id`: the note ID
+int writeback_waiting(struct write_queue *writer, unsigned long id);
+
+// Wait for every note added so far to be written.
+// Returns the number of notes that could not be written since the last flush.
+//
+// `writer`: the queue
+unsigned long writeback_flush(struct write_queue *writer);
+
+// Write every waiting note, then stop the queue and wait for its thread to finish.
+// Returns the number of notes that could not be written since the last flush.
+//
+// `writer`: the queue
+unsigned long writeback_stop(struct write_queue *writer);
+
+#endif